@@ -74,6 +74,7 @@ struct_mediocre_functor = _c.FunctorBlob
 
 import numpy as _np
 import os
+import sys as _sys
 
 try:
     range = xrange
@@ -92,9 +93,9 @@ class Functor(object):
     make_functor_factory, or from one of the many Functor factory functions
     supplied by default by this library (e.g. ClippedMedian).
     """
-    __slots__ = ["_struct"]
+    __slots__ = ["_struct", "_skip_nan"]
     
-    def __init__(self, blob=None):
+    def __init__(self, blob=None, skip_nan=False):
         """Users should not be constructing Functor objects manually.
         
         Constructor used by factory function made by make_functor_factory.
@@ -107,7 +108,11 @@ class Functor(object):
         Checks whether the MediocreFunctor is good before managing it. If
         not, destroy the bad Functor (nonzero_error != 0) and
         throw an exception.
+        
+        skip_nan: true for NaN-aware functors, which combine masked arrays
+        with the masked out entries loaded as NaN (and so left out).
         """
+        self._skip_nan = bool(skip_nan)
         if blob is None:
             self._struct = None
         elif type(blob) is struct_mediocre_functor:
@@ -133,7 +138,8 @@ class Functor(object):
         return self._struct is not None
     
     def __call__(
-        self, arrays, masks=None, nonzero_means_bad=True, thread_count=7
+        self, arrays, masks=None, nonzero_means_bad=True, thread_count=0,
+        scale=None, offset=None, bad_pixels=None
     ):
         """Run this combine algorithm on a sequence of input arrays.
         
@@ -151,13 +157,35 @@ class Functor(object):
         data arrays apply to the mask arrays, including the requirement
         that the masks have the same shape as the data arrays.
         
-        If supplied, there must be one mask for each array in arrays.
+        If supplied, there must be one mask for each array in arrays, or
+        masks can be a single 2D array, the mask of every array (as for a
+        stack of frames from one detector), which is scanned only once.
+        Boolean masks are packed to one bit per entry (np.packbits) before
+        the combine, which makes them quicker to scan.
         
         nonzero_means_bad: If truthy, a nonzero value in a mask array
         indicates a value in the corresponding data array to be masked out.
         If falsey, the opposite is true.
         
-        thread_count: a reasonable integer not less than one.
+        thread_count: number of threads used to run the combine, not
+        counting the thread that loads the input. 0 (the default) lets the
+        library choose, based on the CPUs available to the process and on
+        how fast the input can be loaded compared to how fast it can be
+        combined.
+        
+        scale, offset: optional sequences with one number per array. If
+        given, arrays[I] is combined as if it were
+        arrays[I] * scale[I] + offset[I] (computed in float32 as the arrays
+        are loaded, so it's nearly free and the arrays aren't modified).
+        Not supported together with masks.
+        
+        bad_pixels: instead of masks, the bad entries of 2D arrays, as
+        integer numpy arrays of flat offsets (row * columns + column) or of
+        (row, column) pairs (as np.argwhere gives): a sequence with one for
+        each array, or a single one shared by all arrays. Bad entries are
+        replaced as with masks, but finding them takes time in proportion
+        to their number instead of the size of the arrays, which is much
+        quicker for the usual detector masks with few bad pixels.
         
         return value: a 1 or 2 dimensional numpy array of float32 holding
         the result of combining the [masked] input arrays.
@@ -191,10 +219,45 @@ class Functor(object):
         
         expected_shape = arrays[0].shape
         combine_count = len(arrays)
+        scale_array = _float_array(scale, combine_count, "scale")
+        offset_array = _float_array(offset, combine_count, "offset")
+        scaled = scale_array is not None or offset_array is not None
         
         # All of this below is just to construct the wrapped MediocreInput
         # instance input_obj.
-        if masks is None:
+        if bad_pixels is not None:
+            if masks is not None or scaled:
+                raise ValueError(
+                    "bad_pixels can't be used with masks, scale or offset")
+            if len(expected_shape) != 2:
+                raise TypeError("Masking can only be done for 2D arrays")
+            
+            # One shared list, or one per array. The offset arrays made
+            # here are borrowed by the input, so keep them until the end.
+            if isinstance(bad_pixels, _np.ndarray):
+                bad_lists = [bad_pixels]
+            else:
+                bad_lists = list(bad_pixels)
+                if len(bad_lists) != combine_count:
+                    raise IndexError("Need 1 or %i bad pixel lists, have %i"
+                        % (combine_count, len(bad_lists)))
+            offset_arrays = [_c.bad_pixel_offsets(bad, expected_shape)
+                for bad in bad_lists]
+            bad_pixel_array = (_c.BadPixels * len(offset_arrays))()
+            for i, offsets in enumerate(offset_arrays):
+                bad_pixel_array[i] = _c.BadPixels(offsets)
+            
+            mediocre_array = (_c.Mediocre2D * combine_count)()
+            for i, arr in enumerate(arrays):
+                if arr.shape != expected_shape:
+                    raise IndexError("All arrays must have the same shape.")
+                mediocre_array[i] = _c.Mediocre2D(arr)
+            
+            make_input = (_c.nan_bad_pixel_2D_input if self._skip_nan
+                else _c.bad_pixel_2D_input)
+            input_obj = make_input(mediocre_array, combine_count,
+                bad_pixel_array, len(offset_arrays))
+        elif masks is None:
             # Build an array of Mediocre2D structs that point to data in the
             # numpy arrays. The constructor for Mediocre2D in _c.py does
             # most of this work for us. Check that they all have the same
@@ -220,11 +283,30 @@ class Functor(object):
             # now. I feel like implementing this but I sure as hell don't feel
             # like testing it today, so I'll just leave this note for now.
             can_use_1d_input = all(
-                arr.dtype == first_dtype and arr.flags["C_CONTIGUOUS"]
-                for arr in arrays
+                arr.flags["C_CONTIGUOUS"] for arr in arrays
             )
-            if not can_use_1d_input:
+            # Stacks that mix data types, or that have arrays in the wrong
+            # byte order, use the 1D input that takes a type per array.
+            homogeneous = first_dtype.isnative and all(
+                arr.dtype == first_dtype for arr in arrays
+            )
+            if not can_use_1d_input and scaled:
+                input_obj = _c.scaled_2D_input(
+                    mediocre_array, combine_count, scale_array, offset_array
+                )
+            elif not can_use_1d_input:
                 input_obj = _c.mediocre_2D_input(mediocre_array, combine_count)
+            elif not homogeneous:
+                pointer_array = (_c.c_void_p * combine_count)()
+                code_array = (_c.c_size_t * combine_count)()
+                for i, arr in enumerate(arrays):
+                    pointer_array[i] = arr.ctypes.data
+                    code_array[i] = _c.dtype_type_code(arr.dtype)
+                input_obj = _c.mixed_1D_input(
+                    pointer_array, code_array,
+                    Dimension(combine_count, arrays[0].size),
+                    scale_array, offset_array
+                )
             else:
                 # Use faster 1D homogeneous input functions if able.
                 # Lookup the input_factory for the input arrays' data type
@@ -239,8 +321,39 @@ class Functor(object):
                     width *= expected_shape[1]
                 
                 dim = Dimension(combine_count, width)
-                input_obj = input_factory(pointer_array, dim)
+                if scaled:
+                    input_obj = _c.scaled_1D_input(
+                        _c.cast(pointer_array, _c.POINTER(_c.c_void_p)),
+                        _c.dtype_type_code(first_dtype), dim,
+                        scale_array, offset_array
+                    )
+                else:
+                    input_obj = input_factory(pointer_array, dim)
                 
+        elif scaled:
+            raise ValueError("scale and offset can't be used with masks")
+        elif isinstance(masks, _np.ndarray) and masks.ndim == 2:
+            # One mask shared by all the arrays.
+            if len(expected_shape) != 2:
+                raise TypeError("Masking can only be done for 2D arrays")
+            if masks.shape != expected_shape:
+                raise IndexError("Mask must have same shape as data array.")
+            mediocre_array = (_c.Mediocre2D * combine_count)()
+            for i, arr in enumerate(arrays):
+                if arr.shape != expected_shape:
+                    raise IndexError("All arrays must have the same shape.")
+                mediocre_array[i] = _c.Mediocre2D(arr)
+            if masks.dtype == _np.bool_:
+                packed_mask, mask_2D = _c.packed_mask_2D(masks)
+            else:
+                mask_2D = _c.Mediocre2D(masks)
+            
+            nonzero_means_bad = bool(nonzero_means_bad)
+            make_input = (_c.nan_shared_mask_2D_input if self._skip_nan
+                else _c.shared_mask_2D_input)
+            input_obj = make_input(
+                mediocre_array, combine_count, mask_2D, nonzero_means_bad
+            )
         else:       # We have masks
             if len(expected_shape) != 2:
                 raise TypeError("Masking can only be done for 2D arrays")
@@ -254,7 +367,10 @@ class Functor(object):
             
             # Construct an array of MediocreMasked2D structures and then
             # use the MediocreMasked2D input type as the input_obj.
+            # Boolean masks are packed 8 entries to a byte, which we keep
+            # alive until the combine is done.
             mediocre_masked_array = (_c.Masked2D * combine_count)()
+            packed_masks = []
             for i in range(combine_count):
                 arr = arrays[i]
                 mask = masks[i]
@@ -263,16 +379,161 @@ class Functor(object):
                 if mask.shape != expected_shape:
                     raise IndexError("Mask must have same shape as data array.")
                 mediocre_masked_array[i].data_2D = _c.Mediocre2D(arr)
-                mediocre_masked_array[i].mask_2D = _c.Mediocre2D(mask)
+                if mask.dtype == _np.bool_:
+                    packed, mask_2D = _c.packed_mask_2D(mask)
+                    packed_masks.append(packed)
+                    mediocre_masked_array[i].mask_2D = mask_2D
+                else:
+                    mediocre_masked_array[i].mask_2D = _c.Mediocre2D(mask)
             
             nonzero_means_bad = bool(nonzero_means_bad)
-            input_obj = _c.masked_2D_input(
+            make_input = (_c.nan_masked_2D_input if self._skip_nan
+                else _c.masked_2D_input)
+            input_obj = make_input(
                 mediocre_masked_array, combine_count, nonzero_means_bad
             )
         
+        return self._combine_input(input_obj, expected_shape, thread_count)
+    
+    def combine_raw_files(
+        self, paths, dtype, shape, header_offsets=0, thread_count=0,
+        io_threads=0, direct=False
+    ):
+        """Run this combine algorithm on a stack of raw binary files.
+        
+        paths: a sequence of paths to files that each hold one array of the
+        given shape (1D or 2D, C order) and numpy dtype (as written by
+        numpy's tofile method, for example). Big-endian ('>') dtypes work.
+        
+        header_offsets: number of bytes to skip at the start of each file,
+        either one number for all files or a sequence with one per file.
+        
+        The files are mapped into memory and loaded as the combine goes,
+        instead of being read into numpy arrays first, so the stack can be
+        larger than memory. Other arguments and the return value are as for
+        calling the Functor.
+        
+        io_threads, direct: if io_threads is nonzero or direct is true, the
+        files are instead read ahead of the combine by io_threads I/O
+        threads (a few if 0) into staging buffers, bypassing the page cache
+        with O_DIRECT if direct is true, so that the combine never waits
+        on page faults.
+        """
+        if type(self._struct) is not _c.FunctorBlob:
+            raise Exception("Functor not initialized.")
+        
+        combine_count = len(paths)
+        if combine_count == 0:
+            raise ValueError("Must have at least one file to combine")
+        
+        type_code = _c.dtype_type_code(dtype)
+        
+        shape = tuple(shape)
+        if len(shape) == 1:
+            rows, columns = 1, shape[0]
+        elif len(shape) == 2:
+            rows, columns = shape
+        else:
+            raise TypeError("Shape must be 1D or 2D. shape=%r" % (shape,))
+        
+        try:
+            offsets = list(header_offsets)
+        except TypeError:
+            offsets = [header_offsets] * combine_count
+        if len(offsets) != combine_count:
+            raise IndexError("Need %i header offsets, have %i" %
+                (combine_count, len(offsets)))
+        
+        path_array = _path_array(paths)
+        offset_array = (_c.c_size_t * combine_count)(*offsets)
+        
+        if io_threads != 0 or direct:
+            input_obj = _c.async_file_input(
+                path_array, combine_count, type_code, offset_array,
+                rows, columns, io_threads, int(bool(direct))
+            )
+        else:
+            input_obj = _c.raw_file_input(
+                path_array, combine_count, type_code, offset_array, rows, columns
+            )
+        return self._combine_input(input_obj, shape, thread_count)
+    
+    def combine_fits(self, paths, hdu=0, thread_count=0):
+        """Run this combine algorithm on the images in a stack of FITS files.
+        
+        paths: a sequence of paths to FITS files. The image to combine is
+        read from HDU number hdu of each file (0 for the primary HDU, 1 for
+        the first extension, ...). The images must all have the same shape
+        and BITPIX 8, 16, 32, -32 or -64.
+        
+        Each image is scaled by its BSCALE and BZERO as it's loaded, so the
+        result is what combining the images as opened by astropy would give
+        (rounded to float32), except that BLANK is ignored: blank pixels of
+        integer images are combined as BZERO + BSCALE * BLANK, not as NaN.
+        The files are mapped into memory and streamed through it, instead
+        of being decoded into full arrays first. Other arguments and the
+        return value are as for calling the Functor.
+        """
+        if type(self._struct) is not _c.FunctorBlob:
+            raise Exception("Functor not initialized.")
+        
+        combine_count = len(paths)
+        if combine_count == 0:
+            raise ValueError("Must have at least one file to combine")
+        
+        path_array = _path_array(paths)
+        rows = _c.c_size_t()
+        columns = _c.c_size_t()
+        status = _c.fits_image_shape(path_array[0], hdu, rows, columns)
+        if status != 0:
+            raise IOError(status, os.strerror(status), paths[0])
+        
+        input_obj = _c.fits_input(path_array, combine_count, hdu)
+        return self._combine_input(
+            input_obj, (rows.value, columns.value), thread_count
+        )
+    
+    def combine_rice_fits(
+        self, paths, hdu=1, thread_count=0, decoder_threads=0
+    ):
+        """Run this combine algorithm on the Rice tile-compressed images
+        (as written by fpack) in a stack of FITS files.
+        
+        paths: a sequence of paths to FITS files. The compressed image is
+        read from HDU number hdu of each file (1, the first extension, for
+        fpack's files). The images must all have the same shape and
+        ZBITPIX 8, 16 or 32.
+        
+        The result is what combine_fits would give for the uncompressed
+        files, but the images are never decompressed in full: the tiles are
+        decoded by decoder_threads threads (a few if 0) as the combine goes.
+        Other arguments and the return value are as for calling the Functor.
+        """
+        if type(self._struct) is not _c.FunctorBlob:
+            raise Exception("Functor not initialized.")
+        
+        combine_count = len(paths)
+        if combine_count == 0:
+            raise ValueError("Must have at least one file to combine")
+        
+        path_array = _path_array(paths)
+        rows = _c.c_size_t()
+        columns = _c.c_size_t()
+        status = _c.fits_image_shape(path_array[0], hdu, rows, columns)
+        if status != 0:
+            raise IOError(status, os.strerror(status), paths[0])
+        
+        input_obj = _c.rice_fits_input(
+            path_array, combine_count, hdu, decoder_threads
+        )
+        return self._combine_input(
+            input_obj, (rows.value, columns.value), thread_count
+        )
+    
+    def _combine_input(self, input_obj, shape, thread_count):
         # Now that we have the MediocreInput-manager object input_obj,
         # allocate the output floats and call the C combine function.
-        output = _np.empty(shape=expected_shape, dtype=_np.float32)
+        output = _np.empty(shape=shape, dtype=_np.float32)
         
         status = _c.combine(
             output.ctypes.data_as(_c.float_ptr),
@@ -287,7 +548,30 @@ class Functor(object):
         return output
  
 
-def make_functor_factory(c_function, doc=None, no_argtypes=False):
+def _path_array(paths):
+    """Convert a sequence of paths to a ctypes array of char pointers."""
+    path_array = (_c.c_char_p * len(paths))()
+    for i, path in enumerate(paths):
+        if not isinstance(path, bytes):
+            path = path.encode(_sys.getfilesystemencoding())
+        path_array[i] = path
+    return path_array
+
+
+def _float_array(numbers, count, name):
+    """Convert an optional sequence of count numbers to a ctypes array of
+    floats (None stays None)."""
+    if numbers is None:
+        return None
+    if len(numbers) != count:
+        raise IndexError("Need %i %s numbers, have %i" %
+            (count, name, len(numbers)))
+    return (_c.c_float * count)(*[float(x) for x in numbers])
+
+
+def make_functor_factory(
+    c_function, doc=None, no_argtypes=False, skip_nan=False
+):
     """Function for wrapping a C MediocreFunctor factory function as a
 Python-programmer-friendly Functor object factory function.
     
@@ -304,6 +588,8 @@ Python-programmer-friendly Functor object factory function.
     to set c_function's argtypes attribute. You still have to set the
     restype attribute to struct_mediocre_functor no matter what.
     
+    skip_nan: True if the C factory makes NaN-aware functors (see Functor).
+    
     return value: a Python function that takes arguments that are
     passed to the C factory function and returns a Functor object that
     wraps the kind of MediocreFunctor instance made by the C factory.
@@ -315,7 +601,7 @@ Python-programmer-friendly Functor object factory function.
     
     def functor_factory(*args):
         structure = c_function(*args)
-        return Functor(structure)
+        return Functor(structure, skip_nan)
     
     functor_factory.__doc__ = doc
     return functor_factory
@@ -340,9 +626,31 @@ ClippedMedian.__doc__ = _docs.cmedi
 
 clipped_median = ClippedMedian()
 
+nan_mean = Functor(_c._nan_mean_functor(), True)
+
+NanClippedMean2 = make_functor_factory(
+    _c._nan_clipped_mean_functor2, _docs.nancmean2, skip_nan=True)
+
+def NanClippedMean(sigma=3.0, max_iter=8):
+    return NanClippedMean2(sigma, sigma, max_iter)
+NanClippedMean.__doc__ = _docs.nancmean2
+
+nan_clipped_mean = NanClippedMean()
+
+nan_median = Functor(_c._nan_median_functor(), True)
+
+NanClippedMedian2 = make_functor_factory(
+    _c._nan_clipped_median_functor2, _docs.nancmedi2, skip_nan=True)
+
+def NanClippedMedian(sigma=3.0, max_iter=8):
+    return NanClippedMedian2(sigma, sigma, max_iter)
+NanClippedMedian.__doc__ = _docs.nancmedi2
+
+nan_clipped_median = NanClippedMedian()
+
 def scaled_mean(
-    scale_factors, arrays, masks=None, nonzero_means_bad=True, thread_count=7,
-    sigma=3.0, sigma_lower=None, sigma_upper=None, max_iter=8
+    scale_factors, arrays, masks=None, nonzero_means_bad=True, thread_count=0,
+    sigma=3.0, sigma_lower=None, sigma_upper=None, max_iter=8, skip_nan=False
 ):
     scale_factors = _np.array(scale_factors, _np.float32)
     if len(scale_factors) != len(arrays):
@@ -351,13 +659,15 @@ def scaled_mean(
     if sigma_upper is None: sigma_upper = sigma
     if sigma_lower is None: sigma_lower = sigma
     
-    functor = Functor(_c._scaled_mean_functor2(
+    factory = (_c._nan_scaled_mean_functor2 if skip_nan
+        else _c._scaled_mean_functor2)
+    functor = Functor(factory(
         scale_factors.ctypes.data_as(_c.float_ptr),
         len(scale_factors),
         sigma_lower,
         sigma_upper,
         max_iter
-    ))
+    ), skip_nan)
     
     return functor(arrays, masks, nonzero_means_bad, thread_count)
 scaled_mean.__doc__ = _docs.smean
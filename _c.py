@@ -26,7 +26,7 @@ structure that could leak resources if an exception is thrown.
 """
 
 import os
-from ctypes import CFUNCTYPE, POINTER, Structure, byref, cdll, c_size_t, c_int, c_void_p, c_int8, c_int16, c_int32, c_int64, c_uint8, c_uint16, c_uint32, c_uint64, c_float, c_double
+from ctypes import CFUNCTYPE, POINTER, Structure, byref, cast, cdll, c_char_p, c_size_t, c_int, c_void_p, c_int8, c_int16, c_int32, c_int64, c_uint8, c_uint16, c_uint32, c_uint64, c_float, c_double
 
 import numpy as np
 
@@ -177,18 +177,16 @@ class Mediocre2D(Structure):
     def __init__(self, arr):
         """Wrap 1 or 2 dimensional numpy array as Mediocre2D structure.
         The numpy array must have an 8/16/32/64 bit signed/unsigned integer
-        data type, or 32/64 bit floating point data type. Mediocre2D works okay
-        with arrays with unusual strides, but the array should otherwise not be
-        weird (bad alignment, incorrect endianness, etc.) Remember that this
-        object DOESN'T keep the numpy array alive.
+        data type, or 16/32/64 bit or bfloat16 floating point data type.
+        Mediocre2D works okay with arrays with unusual strides, but the array
+        should otherwise not be weird (bad alignment, etc.) Big-endian ('>')
+        data types are loaded with the big-endian type codes. Remember that
+        this object DOESN'T keep the numpy array alive.
         """
         if type(arr) is not np.ndarray:
             raise TypeError("Can only work with exact numpy ndarray instances.")
         
-        try:
-            type_code, ignored, ignored2 = np_type_dict[arr.dtype.name]
-        except KeyError:
-            raise TypeError("Unknown numpy array dtype %r" % (arr.dtype.name,))
+        type_code = dtype_type_code(arr.dtype)
         
         shape = arr.shape
         strides = arr.strides
@@ -220,6 +218,20 @@ class Masked2D(Structure):
         ("mask_2D", Mediocre2D),
     ]
 
+
+class BadPixels(Structure):
+    """Corresponds to MediocreBadPixels structure. Borrows the numpy array
+    of np.uintp offsets it's made from, which must be kept alive.
+    """
+    _fields_ = [
+        ("offsets", c_void_p),
+        ("count", c_size_t),        # Actually uintptr_t.
+    ]
+    
+    def __init__(self, offsets):
+        self.offsets = offsets.ctypes.data_as(c_void_p)
+        self.count = len(offsets)
+
 # Declare the all-important mediocre_combine function. (Just `combine` here).
 combine = lib.mediocre_combine
 combine.restype = c_int
@@ -247,6 +259,28 @@ _clipped_median_functor2 = lib.mediocre_clipped_median_functor2
 _clipped_median_functor2.restype = FunctorBlob
 _clipped_median_functor2.argtypes = (c_double, c_double, c_size_t)
 
+# NaN-aware versions, which leave NaN (e.g. masked out data) out.
+_nan_mean_functor = lib.mediocre_nan_mean_functor
+_nan_mean_functor.restype = FunctorBlob
+_nan_mean_functor.argtypes = ()
+
+_nan_clipped_mean_functor2 = lib.mediocre_nan_clipped_mean_functor2
+_nan_clipped_mean_functor2.restype = FunctorBlob
+_nan_clipped_mean_functor2.argtypes = (c_double, c_double, c_size_t)
+
+_nan_scaled_mean_functor2 = lib.mediocre_nan_scaled_mean_functor2
+_nan_scaled_mean_functor2.restype = FunctorBlob
+_nan_scaled_mean_functor2.argtypes = (
+    float_ptr, c_size_t, c_double, c_double, c_size_t
+)
+_nan_median_functor = lib.mediocre_nan_median_functor
+_nan_median_functor.restype = FunctorBlob
+_nan_median_functor.argtypes = ()
+
+_nan_clipped_median_functor2 = lib.mediocre_nan_clipped_median_functor2
+_nan_clipped_median_functor2.restype = FunctorBlob
+_nan_clipped_median_functor2.argtypes = (c_double, c_double, c_size_t)
+
 # Declare a bunch of MediocreInput factories for 1D homogeneous data.(English!!)
 # Also make lambdas that return that MediocreInput wrapped in an Input object.
 ptr2ptr = lambda c_type: POINTER(POINTER(c_type))
@@ -301,6 +335,17 @@ _double_input.restype = InputBlob
 _double_input.argtypes = (ptr2ptr(c_double), Dimension)
 double_input = lambda ptrs, dim: Input(_double_input(ptrs, dim))
 
+# Half precision and bfloat16 arrays are passed as arrays of their bits.
+_f16_input = lib.mediocre_f16_input
+_f16_input.restype = InputBlob
+_f16_input.argtypes = (ptr2ptr(c_uint16), Dimension)
+f16_input = lambda ptrs, dim: Input(_f16_input(ptrs, dim))
+
+_bf16_input = lib.mediocre_bf16_input
+_bf16_input.restype = InputBlob
+_bf16_input.argtypes = (ptr2ptr(c_uint16), Dimension)
+bf16_input = lambda ptrs, dim: Input(_bf16_input(ptrs, dim))
+
 # Declare the MediocreInput factories for 2D input (masked & unmasked).
 # Same as before, we also include lambdas returning Input objects.
 _masked_2D_input = lib.mediocre_masked_2D_input
@@ -308,11 +353,123 @@ _masked_2D_input.restype = InputBlob
 _masked_2D_input.argtypes = (POINTER(Masked2D), c_size_t, c_int)
 masked_2D_input = lambda ptr, ct, nz: Input(_masked_2D_input(ptr, ct, nz))
 
+_nan_masked_2D_input = lib.mediocre_nan_masked_2D_input
+_nan_masked_2D_input.restype = InputBlob
+_nan_masked_2D_input.argtypes = (POINTER(Masked2D), c_size_t, c_int)
+nan_masked_2D_input = lambda ptr, ct, nz: Input(
+    _nan_masked_2D_input(ptr, ct, nz)
+)
+
+# Unmasked 2D arrays plus sorted lists of their bad entries' flat offsets.
+_bad_pixel_2D_input = lib.mediocre_bad_pixel_2D_input
+_bad_pixel_2D_input.restype = InputBlob
+_bad_pixel_2D_input.argtypes = (
+    POINTER(Mediocre2D), c_size_t, POINTER(BadPixels), c_size_t
+)
+bad_pixel_2D_input = lambda ptr, ct, bad, bad_ct: Input(
+    _bad_pixel_2D_input(ptr, ct, bad, bad_ct)
+)
+
+_nan_bad_pixel_2D_input = lib.mediocre_nan_bad_pixel_2D_input
+_nan_bad_pixel_2D_input.restype = InputBlob
+_nan_bad_pixel_2D_input.argtypes = (
+    POINTER(Mediocre2D), c_size_t, POINTER(BadPixels), c_size_t
+)
+nan_bad_pixel_2D_input = lambda ptr, ct, bad, bad_ct: Input(
+    _nan_bad_pixel_2D_input(ptr, ct, bad, bad_ct)
+)
+
+# Unmasked 2D arrays that all share one mask, scanned once for all of them.
+_shared_mask_2D_input = lib.mediocre_shared_mask_2D_input
+_shared_mask_2D_input.restype = InputBlob
+_shared_mask_2D_input.argtypes = (
+    POINTER(Mediocre2D), c_size_t, Mediocre2D, c_int
+)
+shared_mask_2D_input = lambda ptr, ct, mask, nz: Input(
+    _shared_mask_2D_input(ptr, ct, mask, nz)
+)
+
+_nan_shared_mask_2D_input = lib.mediocre_nan_shared_mask_2D_input
+_nan_shared_mask_2D_input.restype = InputBlob
+_nan_shared_mask_2D_input.argtypes = (
+    POINTER(Mediocre2D), c_size_t, Mediocre2D, c_int
+)
+nan_shared_mask_2D_input = lambda ptr, ct, mask, nz: Input(
+    _nan_shared_mask_2D_input(ptr, ct, mask, nz)
+)
+
 _mediocre_2D_input = lib.mediocre_2D_input
 _mediocre_2D_input.restype = InputBlob
 _mediocre_2D_input.argtypes = (POINTER(Mediocre2D), c_size_t)
 mediocre_2D_input = lambda ptr, count: Input(_mediocre_2D_input(ptr, count))
 
+# Factories applying a per-array scale * x + offset while loading. scale and
+# offset are arrays of c_float, or None.
+_scaled_1D_input = lib.mediocre_scaled_1D_input
+_scaled_1D_input.restype = InputBlob
+_scaled_1D_input.argtypes = (
+    POINTER(c_void_p), c_size_t, Dimension, float_ptr, float_ptr
+)
+scaled_1D_input = lambda ptrs, code, dim, scale, offset: Input(
+    _scaled_1D_input(ptrs, code, dim, scale, offset))
+
+_mixed_1D_input = lib.mediocre_mixed_1D_input
+_mixed_1D_input.restype = InputBlob
+_mixed_1D_input.argtypes = (
+    POINTER(c_void_p), POINTER(c_size_t), Dimension, float_ptr, float_ptr
+)
+mixed_1D_input = lambda ptrs, codes, dim, scale, offset: Input(
+    _mixed_1D_input(ptrs, codes, dim, scale, offset))
+
+_scaled_2D_input = lib.mediocre_scaled_2D_input
+_scaled_2D_input.restype = InputBlob
+_scaled_2D_input.argtypes = (
+    POINTER(Mediocre2D), c_size_t, float_ptr, float_ptr
+)
+scaled_2D_input = lambda ptr, count, scale, offset: Input(
+    _scaled_2D_input(ptr, count, scale, offset))
+
+# MediocreInput factory for stacks of raw binary files, loaded by mapping them.
+_raw_file_input = lib.mediocre_raw_file_input
+_raw_file_input.restype = InputBlob
+_raw_file_input.argtypes = (
+    POINTER(c_char_p), c_size_t, c_size_t, POINTER(c_size_t), c_size_t, c_size_t
+)
+raw_file_input = lambda paths, ct, tc, offsets, rows, cols: Input(
+    _raw_file_input(paths, ct, tc, offsets, rows, cols)
+)
+
+# Same files, read ahead by I/O threads (optionally with O_DIRECT) instead.
+_async_file_input = lib.mediocre_async_file_input
+_async_file_input.restype = InputBlob
+_async_file_input.argtypes = (
+    POINTER(c_char_p), c_size_t, c_size_t, POINTER(c_size_t), c_size_t, c_size_t,
+    c_size_t, c_int
+)
+async_file_input = lambda paths, ct, tc, offsets, rows, cols, io, direct: Input(
+    _async_file_input(paths, ct, tc, offsets, rows, cols, io, direct)
+)
+
+# MediocreInput factory for FITS images, and the function to find their shape.
+_fits_input = lib.mediocre_fits_input
+_fits_input.restype = InputBlob
+_fits_input.argtypes = (POINTER(c_char_p), c_size_t, c_size_t)
+fits_input = lambda paths, count, hdu: Input(_fits_input(paths, count, hdu))
+
+# Rice tile-compressed FITS images, decoded by a thread pool as they load.
+_rice_fits_input = lib.mediocre_rice_fits_input
+_rice_fits_input.restype = InputBlob
+_rice_fits_input.argtypes = (POINTER(c_char_p), c_size_t, c_size_t, c_size_t)
+rice_fits_input = lambda paths, count, hdu, decoders: Input(
+    _rice_fits_input(paths, count, hdu, decoders)
+)
+
+fits_image_shape = lib.mediocre_fits_image_shape
+fits_image_shape.restype = c_int
+fits_image_shape.argtypes = (
+    c_char_p, c_size_t, POINTER(c_size_t), POINTER(c_size_t)
+)
+
 # Dictionary mapping numpy names for C types to type codes used in the
 # mediocre library, MediocreInput factories, and ctypes pointer classes
 # corresponding to that C type.
@@ -327,5 +484,52 @@ np_type_dict = {
     "uint64" : (164, u64_input, POINTER(c_uint64)),
     "float32": (0xF, float_input, POINTER(c_float)),
     "float64": (0xD, double_input, POINTER(c_double)),
+    "float16": (0xF16, f16_input, POINTER(c_uint16)),
+    "bfloat16": (0xBF16, bf16_input, POINTER(c_uint16)), # From ml_dtypes.
 }
 
+# Type code for packed bit masks: one bit per entry, rows starting on bytes.
+bit_code = 1
+
+def packed_mask_2D(mask):
+    """Pack a 2D boolean numpy mask with np.packbits and wrap the result as
+    a Mediocre2D with the bit mask type code. Returns (packed, mediocre_2D);
+    packed must be kept alive for as long as mediocre_2D is used.
+    """
+    rows, columns = mask.shape
+    packed = np.packbits(mask, axis=1)
+    mediocre_2D = Mediocre2D(packed)
+    mediocre_2D.type_code = bit_code
+    mediocre_2D.minor_width = columns
+    mediocre_2D.minor_stride = 0
+    return packed, mediocre_2D
+
+def bad_pixel_offsets(bad, shape):
+    """Convert a numpy array of bad entries of 2D arrays of the given shape,
+    either flat offsets or (row, column) pairs, to the sorted, duplicate
+    free np.uintp offsets that MediocreBadPixels needs.
+    """
+    bad = np.asarray(bad)
+    if bad.ndim == 2:
+        bad = np.ravel_multi_index((bad[:, 0], bad[:, 1]), shape)
+    return np.unique(bad).astype(np.uintp)
+
+# Type codes for numbers stored big-endian are the native type code + 1000.
+big_endian_code_offset = 1000
+
+def dtype_type_code(dtype):
+    """Return the mediocre type code for the given numpy dtype, using the
+    big-endian type codes for '>' dtypes. Raise TypeError if there is none.
+    """
+    dtype = np.dtype(dtype)
+    try:
+        type_code = np_type_dict[dtype.name][0]
+    except KeyError:
+        raise TypeError("Unknown numpy array dtype %r" % (dtype.name,))
+    
+    if dtype.byteorder == '>':
+        return type_code + big_endian_code_offset
+    elif not dtype.isnative:
+        raise TypeError("Unsupported byte order in dtype %r" % (dtype,))
+    return type_code
+
@@ -81,5 +81,22 @@ sigma, sigma_lower, sigma_upper, max_iter:
     sigma_lower, sigma_upper: float-like
     sigma: float-like, default value for sigma_lower, sigma_upper
     max_iter: integer-like
+
+skip_nan: if true, use the NaN-aware scaled mean (see NanClippedMean2).
+"""
+
+nancmean2 = """\
+NaN-aware versions of ClippedMean2 and ClippedMean (and nan_mean,
+nan_clipped_mean of mean, clipped_mean). NaN entries are left out of
+each column, as if clipped out; a column of only NaN combines to NaN.
+
+When these functors combine masked arrays, masked out entries are
+loaded as NaN, so they are left out of the combine entirely instead of
+being replaced by the median of their neighbors.
+"""
+
+nancmedi2 = """\
+NaN-aware versions of ClippedMedian2 and ClippedMedian (and nan_median,
+nan_clipped_median of median, clipped_median). See NanClippedMean2.
 """
 
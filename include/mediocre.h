@@ -146,17 +146,21 @@ static inline float* mediocre_output_alloc(MediocreInput input) {
     }
 }
 
-/*  Runs the specified combine functor on the  specified  input.  The  input
- *  argument  contains  the  dimension  of the input arrays (array width and
- *  array count [combine_count]). The output pointer must point  to  a  flat
- *  array  of  floats  that  is large enough to hold [input.dimension.width]
- *  floats. thread_count is the number of threads used by  the  function  to
- *  run  the  combine function; thread_count must be positive, and the total
- *  number of threads used by the function is  one  more  than  thread_count
- *  (because the calling thread is used to run the input function). errno is
- *  set to the return value of the function, which is zero if no errors were
- *  reported  by  either  the  input  function  or  the combine functor, and
- *  nonzero if there were errors.
+/*  Runs  the  specified combine functor on the specified input.  The  input
+ *  argument  contains  the dimension of the input arrays (array  width  and
+ *  array  count [combine_count]). The output pointer must point to  a  flat
+ *  array  of  floats that is large enough to  hold  [input.dimension.width]
+ *  floats.  thread_count is the number of threads used by the  function  to
+ *  run  the  combine  function; the total number of  threads  used  by  the
+ *  function  is one more than thread_count (because the calling  thread  is
+ *  used  to run the input function). thread_count may be 0, in  which  case
+ *  the function launches one thread per CPU that the calling thread may run
+ *  on  (less one for the input), times the input and functor loops  on  the
+ *  first  few commands, and only keeps as many functor threads busy as  the
+ *  input  function  can  keep fed; the rest are parked  until  the  combine
+ *  finishes.  errno  is set to the return value of the function,  which  is
+ *  zero  if  no errors were reported by either the input  function  or  the
+ *  combine functor, and nonzero if there were errors.
  */
 int mediocre_combine(
     float* output,
@@ -178,6 +182,46 @@ int mediocre_combine_destroy(
     int thread_count
 );
 
+/*  Checkpointed variant of mediocre_combine intended for combines that  run
+ *  for hours and might be killed partway through (e.g. preempted by a batch
+ *  scheduler).  Rather than writing to a caller-supplied float  array,  the
+ *  output  is  written  to the file at output_path,  which  is  created  if
+ *  needed,  resized  to hold input.dimension.width floats,  and  mmap'd.  A
+ *  small  journal file at journal_path records the offset below  which  the
+ *  output  file is known to be completely written; the journal  is  updated
+ *  (after  syncing  the output written so far) as the functor threads finish
+ *  their work, but no more than once every mediocre_checkpoint_seconds.
+ *  
+ *  If  the journal already exists and was written for an input of the  same
+ *  dimension,  the combine resumes from the offset recorded in the  journal
+ *  instead of starting over, so only the work done since the last journal
+ *  update is lost when a combine is killed and restarted with the same
+ *  arguments. The input and functor must of course be equivalent to those
+ *  of the interrupted run. A journal that does not match the input's
+ *  dimension is ignored (with a warning) and the combine starts from the
+ *  beginning.
+ *  
+ *  The  return value and errno are as in mediocre_combine. On success,  the
+ *  journal records the full width of the input, so running the same combine
+ *  again does no work.
+ */
+int mediocre_combine_checkpoint(
+    char const* output_path,
+    char const* journal_path,
+    MediocreInput input,
+    MediocreFunctor functor,
+    int thread_count
+);
+
+/*  Least number of seconds (default 5) between the journal updates of
+ *  mediocre_combine_checkpoint, each of which waits for the output written
+ *  since the last one to reach the disk. At most this much work (plus a
+ *  round of commands) is lost to a kill. 0 updates the journal as often as
+ *  the functor threads finish a round of commands. Read when the combine
+ *  starts.
+ */
+extern int mediocre_checkpoint_seconds;
+
 /*  Inline function wrapper for mediocre_combine that allows the  caller  to
  *  pass flags that specify which, if any, of the input or functor arguments
  *  that should  be  automatically  destroyed  after  the  combine  finishes
@@ -218,6 +262,18 @@ for (command = mediocre_input_control_get(control); \
     !command._exit; \
     command = mediocre_input_control_get(control))
 
+/*  Input loops whose data is already in chunk format for the command's range
+ *  may  call  this  instead  of  writing  to  command.output_chunks:  the
+ *  functor is then handed chunks (which must be 32 byte aligned and hold
+ *  the  command's  (width  +  7)  /  8  chunks)  in place of the library's
+ *  buffer, without copying. This applies to the command most recently  got
+ *  from  mediocre_input_control_get.  The  memory  is  never  written  (see
+ *  mediocre_functor_control_get_read_only), and must stay valid until  the
+ *  combine returns. Returns 0, or EINVAL if chunks is misaligned or there is
+ *  no command to lend it to.
+ */
+int mediocre_input_control_lend(MediocreInputControl*, __m256 const* chunks);
+
 typedef struct mediocre_functor_command {
     size_t _exit;
     MediocreDimension dimension;
@@ -239,6 +295,20 @@ for (command = mediocre_functor_control_get(control); \
     !command._exit; \
     command = mediocre_functor_control_get(control))
 
+/*  Same as mediocre_functor_control_get, for functor loops that only  read
+ *  command.input_chunks. Their input_chunks may point straight at chunks
+ *  lent by the input (see mediocre_input_control_lend), which must NOT  be
+ *  written  to;  mediocre_functor_control_get  instead  copies  lent chunks
+ *  into the functor's own buffer, so that it may overwrite them as usual.
+ */
+MediocreFunctorCommand
+mediocre_functor_control_get_read_only(MediocreFunctorControl*);
+
+#define MEDIOCRE_READ_ONLY_FUNCTOR_LOOP(command, control) \
+for (command = mediocre_functor_control_get_read_only(control); \
+    !command._exit; \
+    command = mediocre_functor_control_get_read_only(control))
+
 /*  The output pointer provided in a command to a combine  functor  loop  is
  *  just a pointer to a portion of the float array provided by the caller of
  *  mediocre_combine. As such, the pointer may not be  that  convenient  for
@@ -269,7 +339,8 @@ for (command = mediocre_functor_control_get(control); \
  *  Implementors   may   call   mediocre_functor_write_temp   in  this  case
  *  regardless; they do not need to check for this condition.
  *  
- *  You DON'T have to free the memory returned.
+ *  You DON'T have to free the memory returned  (it  comes  from  the  same
+ *  per-thread arena as mediocre_functor_scratch).
  */
 __m256* mediocre_functor_aligned_temp(
     MediocreFunctorCommand, MediocreFunctorControl*
@@ -287,6 +358,69 @@ static inline void mediocre_functor_write_temp(
     }
 }
 
+/*  Stores  the  8  floats  in  value to output[8  *  chunk_index  ...  8  *
+ *  chunk_index + 7], where output points to a flat array of [width]  floats
+ *  of    any   alignment   (such   as   command.output,   with   width    =
+ *  command.dimension.width).  Only  the lanes that fall  within  the  first
+ *  [width]  floats are written, so the last chunk of a command whose  width
+ *  is not a multiple of 8 can be stored without writing past the end of the
+ *  output.  This lets combine functors write each chunk's  result  straight
+ *  into     the    output    instead    of    collecting     results     in
+ *  mediocre_functor_aligned_temp      and      copying      them       with
+ *  mediocre_functor_write_temp.  Unaligned stores are cheap on current  x86
+ *  processors,  whereas the copy is an extra pass over the output, and  the
+ *  caller's  output  is  often  not 32  byte  aligned  (numpy  arrays,  for
+ *  instance).
+ */
+static inline void mediocre_store_chunk(
+    float* output, size_t width, size_t chunk_index, __m256 value
+) {
+    // Loading 8 ints starting at tail_mask + 8 - n gives a mask whose
+    // first n lanes are set.
+    static const int32_t tail_mask[16] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+    const size_t offset = 8 * chunk_index;
+    const size_t remaining = width - offset;
+    
+    if (remaining >= 8) {
+        _mm256_storeu_ps(output + offset, value);
+    } else {
+        const __m256i mask = _mm256_loadu_si256(
+            (__m256i const*)(tail_mask + 8 - remaining));
+        _mm256_maskstore_ps(output + offset, mask, value);
+    }
+}
+
+/*  Returns a pointer to at least [bytes] bytes of scratch memory aligned to
+ *  [alignment]  bytes (which must be a power of 2), for the private use  of
+ *  the  functor  thread  that  owns the  control  structure.  Functor  loop
+ *  functions  should  get any scratch space they need this way  instead  of
+ *  allocating it themselves: the memory comes from a per-thread arena owned
+ *  by  the library, which is kept (and reused by later combines) after  the
+ *  combine  finishes,  so that repeated combines do not  have  to  allocate
+ *  scratch space over and over. The memory stays valid until the  functor's
+ *  loop_function  returns;  don't free it. The function returns  NULL  (and
+ *  sets errno) if there is an error.
+ *  
+ *  If a loop function asks for more scratch than the arena has, the library
+ *  allocates more and then merges it into one larger block once the combine
+ *  is done, so the next combine is served from a single block.
+ */
+void* mediocre_functor_scratch(
+    MediocreFunctorControl*, size_t bytes, size_t alignment
+);
+
+/*  Returns  the total number of bytes of scratch memory currently  held  by
+ *  the library (in use by running combines or kept for future combines).
+ */
+size_t mediocre_scratch_bytes(void);
+
+/*  Frees the scratch memory kept by the library for future combines. Memory
+ *  in use by combines that are still running is not affected.
+ */
+void mediocre_scratch_release(void);
+
 /*  Function to help humans deal with the chunk format. The chunk format  is
  *  designed the way that it is for a reason: algorithms using this function
  *  may not be the most optimal functions for working  with  data  in  chunk
@@ -414,6 +548,57 @@ static inline MediocreFunctor mediocre_clipped_median_functor(
     return mediocre_clipped_median_functor2(sigma, sigma, max_iter);
 }
 
+/*  NaN-aware versions of the mean, clipped mean, scaled mean,  median,  and
+ *  clipped  median  functors  above.  NaN  numbers  (such as the bad pixels
+ *  written by mediocre_nan_masked_2D_input) are left out of each  column's
+ *  combine,  as if they had been clipped out, so each column is combined
+ *  from only the numbers it has. Columns with no numbers besides  NaN  are
+ *  combined  to  NaN.  (The  plain  functors let NaN spread to the result,
+ *  which is faster when there's no NaN to worry about.)
+ */
+MediocreFunctor mediocre_nan_mean_functor();
+
+MediocreFunctor mediocre_nan_clipped_mean_functor2(
+    double sigma_lower, double sigma_upper, size_t max_iter
+);
+
+static inline MediocreFunctor mediocre_nan_clipped_mean_functor(
+    double sigma, size_t max_iter
+) {
+    return mediocre_nan_clipped_mean_functor2(sigma, sigma, max_iter);
+}
+
+MediocreFunctor mediocre_nan_scaled_mean_functor2(
+    float const* scale_factors,
+    size_t scale_count,
+    double sigma_lower,
+    double sigma_upper,
+    size_t max_iter
+);
+
+static inline MediocreFunctor mediocre_nan_scaled_mean_functor(
+    float const* scale_factors,
+    size_t scale_count,
+    double sigma,
+    size_t max_iter
+) {
+    return mediocre_nan_scaled_mean_functor2(
+        scale_factors, scale_count, sigma, sigma, max_iter
+    );
+}
+
+MediocreFunctor mediocre_nan_median_functor();
+
+MediocreFunctor mediocre_nan_clipped_median_functor2(
+    double sigma_lower, double sigma_upper, size_t max_iter
+);
+
+static inline MediocreFunctor mediocre_nan_clipped_median_functor(
+    double sigma, size_t max_iter
+) {
+    return mediocre_nan_clipped_median_functor2(sigma, sigma, max_iter);
+}
+
 /*  Functions for creating MediocreInput instances that load  data  from  1D
  *  arrays.  There  are  MediocreDimension.combine_count  arrays,  each with
  *  MediocreDimension.width entries. The functions all take a pointer to  an
@@ -439,6 +624,51 @@ MediocreInput mediocre_u64_input(uint64_t const* const*, MediocreDimension);
 MediocreInput mediocre_float_input(float const* const*, MediocreDimension);
 MediocreInput mediocre_double_input(double const* const*, MediocreDimension);
 
+/*  As above, for arrays of IEEE half precision (float16) or bfloat16 numbers.
+ *  C has no type for these, so the arrays are passed as arrays of their
+ *  16-bit patterns.
+ */
+MediocreInput mediocre_f16_input(uint16_t const* const*, MediocreDimension);
+MediocreInput mediocre_bf16_input(uint16_t const* const*, MediocreDimension);
+
+/*  As above, for arrays of the type with the given type code (see below),
+ *  but  array  i is loaded as scale[i] * x + offset[i] instead of x. The
+ *  transform is applied to each vector of 8 numbers as it is converted to
+ *  floats, so it costs (nearly) nothing compared with loading. scale and
+ *  offset  each  hold  one  number  per  array  and  are  copied;  either
+ *  may be NULL, meaning 1 or 0 for every array.
+ */
+MediocreInput mediocre_scaled_1D_input(
+    void const* const* pointers,
+    uintptr_t type_code,
+    MediocreDimension dim,
+    float const* scale,
+    float const* offset
+);
+
+/*  As mediocre_scaled_1D_input, but the arrays needn't all have the same
+ *  type:  array  i  has  type  code  type_codes[i],  and  is loaded with the
+ *  vectorized loader for that type, so a stack that mixes (say) uint16  and
+ *  float64 arrays loads as fast as the 1D inputs above instead of needing a
+ *  2D input. type_codes is copied, like pointers.
+ */
+MediocreInput mediocre_mixed_1D_input(
+    void const* const* pointers,
+    uintptr_t const* type_codes,
+    MediocreDimension dim,
+    float const* scale,
+    float const* offset
+);
+
+/*  Create a MediocreInput instance for data that's already in chunk format:
+ *  the  (dim.width + 7) / 8 chunks of dim.combine_count vectors each, laid
+ *  out  as  for  mediocre_chunk_ptr,  starting  at  the  32  byte  aligned
+ *  chunks.  Nothing  is loaded or copied; each command's chunks are lent to
+ *  the functor (see mediocre_input_control_lend), so the chunks  must  stay
+ *  valid until the combine returns. They are never written to.
+ */
+MediocreInput mediocre_chunk_input(__m256 const* chunks, MediocreDimension dim);
+
 // Workaround for stupid C rules about T const* const* to T* const* conversions.
 static inline MediocreInput
 mediocre_mi8_input(int8_t* const* ptr, MediocreDimension dim) {
@@ -480,6 +710,14 @@ static inline MediocreInput
 mediocre_mdouble_input(double* const* ptr, MediocreDimension dim) {
     return mediocre_double_input((double const* const*)ptr, dim);
 }
+static inline MediocreInput
+mediocre_mf16_input(uint16_t* const* ptr, MediocreDimension dim) {
+    return mediocre_f16_input((uint16_t const* const*)ptr, dim);
+}
+static inline MediocreInput
+mediocre_mbf16_input(uint16_t* const* ptr, MediocreDimension dim) {
+    return mediocre_bf16_input((uint16_t const* const*)ptr, dim);
+}
 
 // Type codes (see below). These shouldn't ever change.
 static const int
@@ -492,7 +730,35 @@ static const int
     mediocre_u32_code = 132,
     mediocre_u64_code = 164,
     mediocre_float_code = 0xF,   // 15
-    mediocre_double_code = 0xD ; // 13
+    mediocre_double_code = 0xD,  // 13
+    mediocre_f16_code = 0xF16,   // 3862, IEEE half precision.
+    mediocre_bf16_code = 0xBF16; // 48918
+
+/*  Type code for packed bit masks, which can only be used as the mask_2D
+ *  of a MediocreMasked2D: one bit per entry, packed most significant bit
+ *  first into bytes (as numpy's packbits does), with each row starting on
+ *  a new byte. major_stride is the distance in bytes between rows, and
+ *  minor_stride is not used. Masks take 1/8 the memory of byte masks, and
+ *  are scanned 64 entries at a time.
+ */
+static const int mediocre_bit_code = 1;
+
+/*  Type codes for Mediocre2D arrays of numbers stored in big-endian  byte
+ *  order  (as  in  FITS  files and numpy's '>' dtypes): the native code plus
+ *  1000. The bytes are swapped while loading, so the array itself is never
+ *  modified or copied. Single bytes have no byte order; use the codes above.
+ */
+static const int
+    mediocre_i16be_code = 1016,
+    mediocre_i32be_code = 1032,
+    mediocre_i64be_code = 1064,
+    mediocre_u16be_code = 1116,
+    mediocre_u32be_code = 1132,
+    mediocre_u64be_code = 1164,
+    mediocre_floatbe_code = 1015,
+    mediocre_doublebe_code = 1013,
+    mediocre_f16be_code = 4862,
+    mediocre_bf16be_code = 49918;
 
 /*  Structure intended for  holding  a  borrowed  pointer  to  a  2D  array.
  *  (Borrowed  in  the  sense that the structure does not manage/free the 2D
@@ -519,7 +785,8 @@ typedef struct mediocre_2D {
  *  data  array  is  good or bad. The user will. specify elsewhere whether a
  *  zero mask entry or a nonzero mask entry indicates a bad data entry.  The
  *  data and mask arrays should have the same major and minor width, but may
- *  have different strides and type codes.
+ *  have different strides and type codes. The mask may be a packed bit mask
+ *  (mediocre_bit_code).
  */
 typedef struct mediocre_masked_2D {
     Mediocre2D data_2D, mask_2D;
@@ -547,6 +814,77 @@ MediocreInput mediocre_masked_2D_input(
     int nonzero_means_bad
 );
 
+/*  Same as mediocre_masked_2D_input, except that bad entries are loaded as
+ *  NaN instead of being replaced by the median of the good entries  around
+ *  them. Combine with the NaN-aware functors (mediocre_nan_mean_functor and
+ *  so on) to leave the bad entries out of the combine entirely.
+ */
+MediocreInput mediocre_nan_masked_2D_input(
+    MediocreMasked2D const* masked_arrays,
+    size_t count,
+    int nonzero_means_bad
+);
+
+/*  mediocre_masked_2D_input for [count] Mediocre2D arrays that all share the
+ *  one  mask (as a stack of frames from a single detector does). The mask
+ *  is scanned once per command for all the arrays, instead of once for each
+ *  array. (mediocre_masked_2D_input does the same when it notices that all
+ *  of its MediocreMasked2D instances have the same mask_2D.)
+ */
+MediocreInput mediocre_shared_mask_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    Mediocre2D mask,
+    int nonzero_means_bad
+);
+
+/*  Same as mediocre_shared_mask_2D_input, except that bad entries are loaded
+ *  as NaN (see mediocre_nan_masked_2D_input).
+ */
+MediocreInput mediocre_nan_shared_mask_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    Mediocre2D mask,
+    int nonzero_means_bad
+);
+
+/*  Borrowed list of the bad entries of 2D arrays, as flat offsets  (major *
+ *  minor_width  + minor), sorted in increasing order without duplicates.
+ *  For masks with few bad entries, this is much smaller than a full-size
+ *  mask array and much quicker to apply.
+ */
+typedef struct mediocre_bad_pixels {
+    uintptr_t const* offsets;
+    uintptr_t count;
+} MediocreBadPixels;
+
+/*  Create a MediocreInput instance that loads [count] Mediocre2D arrays (as
+ *  mediocre_2D_input does) and replaces their bad entries  with  the  median
+ *  of  the  good  entries  around them (as mediocre_masked_2D_input does).
+ *  bad_pixels_count is 1, for one list of bad entries shared by all arrays,
+ *  or count, for one list per array. Each command finds its bad entries with
+ *  a binary search, so masking takes time in proportion to the number of
+ *  bad entries, not the size of the arrays. The arrays and lists are NOT
+ *  copied and must outlive the returned MediocreInput instance, but the
+ *  arrays of Mediocre2D and MediocreBadPixels themselves are copied.
+ */
+MediocreInput mediocre_bad_pixel_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    MediocreBadPixels const* bad_pixels,
+    size_t bad_pixels_count
+);
+
+/*  Same as mediocre_bad_pixel_2D_input, except that bad entries are loaded
+ *  as NaN (see mediocre_nan_masked_2D_input).
+ */
+MediocreInput mediocre_nan_bad_pixel_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    MediocreBadPixels const* bad_pixels,
+    size_t bad_pixels_count
+);
+
 /*  Create a MediocreInput instance that loads data from an array of [count]
  *  Mediocre2D  instances.  The  array  of  Mediocre2D will be copied to the
  *  MediocreInput instance's internal storage; the array passed may be freed
@@ -560,6 +898,142 @@ MediocreInput mediocre_masked_2D_input(
  */
 MediocreInput mediocre_2D_input(Mediocre2D const* arrays, size_t count);
 
+/*  mediocre_2D_input, but arrays[i] is loaded as scale[i] * x + offset[i]
+ *  (see mediocre_scaled_1D_input).
+ */
+MediocreInput mediocre_scaled_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    float const* scale,
+    float const* offset
+);
+
+/*  Nonzero (the default) lets the 2D inputs load 32-bit arrays with unusual
+ *  minor  strides  using  AVX2  gathers,  on CPUs that have AVX2. Set it to 0
+ *  before creating an input to have it always use the scalar loads instead
+ *  (mostly useful for benchmarking the two against each other).
+ */
+extern int mediocre_gather_enabled;
+
+/*  How many numbers ahead of themselves the 2D inputs (and the inputs built
+ *  on  them)  prefetch  each  array  they  load  directly,  so  that the next
+ *  row, and the start of the next command, are in cache when they get there.
+ *  0 turns prefetching off. Like mediocre_gather_enabled, this is read when
+ *  loading, and is mostly useful for benchmarking.
+ */
+extern int mediocre_prefetch_distance;
+
+/*  Most memory, in megabytes, that a combine of a 2D input may use to stage
+ *  the rows of arrays stored in Fortran order (default 256). Those arrays
+ *  are loaded a few rows at a time into C order, 8 to 64 rows depending on
+ *  type. A deep enough stack of wide enough arrays gets fewer rows per array,
+ *  down to 8; if even 8 rows don't fit, the arrays are loaded by walking
+ *  their columns instead (much slower). 0 turns staging off. Read when an
+ *  input is made.
+ */
+extern int mediocre_stage_megabytes;
+
+/*  Create a MediocreInput instance that loads a stack of [count] raw binary
+ *  files  (as  written  by  numpy's  tofile,  for  example).  File  paths[i]
+ *  holds a [rows] x [columns] C order array of numbers of the type with the
+ *  given  type  code  (which  may  be  one  of  the big-endian codes),
+ *  starting header_offsets[i] bytes into the file. header_offsets  may  be
+ *  NULL if there are no headers.
+ *  
+ *  The files are mapped into memory (not read) when the input is  created
+ *  and  stay  mapped  until it is destroyed. During a combine the kernel is
+ *  told to read ahead of the part of the files being loaded and to drop the
+ *  part already loaded, so the files can be much larger than memory. The
+ *  files should not be modified while the input exists, and the input
+ *  should not be used by two combines at once.
+ */
+MediocreInput mediocre_raw_file_input(
+    char const* const* paths,
+    size_t count,
+    uintptr_t type_code,
+    size_t const* header_offsets,
+    size_t rows,
+    size_t columns
+);
+
+/*  Create a MediocreInput instance that loads the same files as
+ *  mediocre_raw_file_input, but instead of mapping them, reads them ahead
+ *  of the combine with io_thread_count I/O threads (a few if 0). Each I/O
+ *  thread preads the exact part of a file that one of the next few
+ *  commands needs into a staging buffer, and the combine only loads
+ *  commands whose reads have finished, so it never waits on page faults.
+ *  If direct is nonzero the files are opened with O_DIRECT (where the file
+ *  system supports it) so that they don't pass through the page cache;
+ *  otherwise the pages read are dropped from the cache after they're read.
+ *  Staging takes 4 * count * (maximum request width) * (number size) bytes
+ *  during a combine. The input should not be used by two combines at once.
+ */
+MediocreInput mediocre_async_file_input(
+    char const* const* paths,
+    size_t count,
+    uintptr_t type_code,
+    size_t const* header_offsets,
+    size_t rows,
+    size_t columns,
+    size_t io_thread_count,
+    int direct
+);
+
+/*  Create a MediocreInput instance that loads the images in HDU number  hdu
+ *  (0  for the primary HDU, 1 for the first extension, and so on) of [count]
+ *  FITS files. Each HDU must be the primary HDU or an IMAGE extension  with
+ *  BITPIX 8, 16, 32, -32 or -64, and all the images must have the same shape
+ *  (NAXIS2 rows of NAXIS1 columns, or one row for 1D images). The output is
+ *  in C order, like numpy / astropy arrays of the images, and holds
+ *  
+ *      float(double(stored) * BSCALE + BZERO)
+ *  
+ *  for each stored number. The scaling is applied while the numbers are
+ *  loaded, so there is no separate pass over the data. As with the raw file
+ *  input,  the files are mapped into memory and streamed through it during
+ *  the combine, and the input should not be used by two combines at once.
+ *  BLANK (integer null values) is not handled.
+ */
+MediocreInput mediocre_fits_input(
+    char const* const* paths,
+    size_t count,
+    size_t hdu
+);
+
+/*  Create a MediocreInput instance that loads the Rice tile-compressed
+ *  images (ZCMPTYPE = 'RICE_1', as written by fpack) in HDU number hdu of
+ *  [count] FITS files, usually HDU 1. The images must have ZBITPIX 8, 16 or
+ *  32 and all be the same shape; the tiles may be any shape. The output is
+ *  what mediocre_fits_input would load from the uncompressed images.
+ *  
+ *  The images are never decompressed in full. During a combine a pool of
+ *  decoder_thread_count threads (a few if 0) decodes the tiles that the
+ *  next few commands need into staging buffers, taking 16 * count *
+ *  (maximum request width) bytes, and the combine converts each
+ *  command as its tiles are done. Tiles that fall into two commands are
+ *  decoded twice, so tiles of whole rows (fpack's default) work best. The
+ *  files are mapped into memory, and the input should not be used by two
+ *  combines at once.
+ */
+MediocreInput mediocre_rice_fits_input(
+    char const* const* paths,
+    size_t count,
+    size_t hdu,
+    size_t decoder_thread_count
+);
+
+/*  Find the shape of the image that mediocre_fits_input (or, for a tile-
+ *  compressed image, mediocre_rice_fits_input) would load from HDU number
+ *  hdu of the FITS file at path, writing it to *rows and *columns. Returns
+ *  0 on success or an errno value.
+ */
+int mediocre_fits_image_shape(
+    char const* path,
+    size_t hdu,
+    size_t* rows,
+    size_t* columns
+);
+
 /*  Functions for wrapping  arrays  of  different  shapes  (row-major  2D  C
  *  arrays:  c2d,  colmun-major  2D  Fortran arrays: f2d, and 1D arrays) and
  *  different types (i8 int8_t, u64 uint64_t, etc.) as Mediocre2D instances.
@@ -18,20 +18,30 @@
  *  along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+// Needed for sched_getaffinity and CPU_COUNT.
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <immintrin.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "mediocre.h"
 
 int mediocre_combine_verbose = 0;
+int mediocre_checkpoint_seconds = 5;
 
 // Define the control structs declared to the user in mediocre.h
 // The convenience typedefs MediocreInputControl and MediocreFunctorControl
@@ -51,6 +61,20 @@ struct functor_buffer {
     
     int nonzero_error;
     
+    // Nanoseconds the functor thread spent on the command that was in this
+    // buffer, or 0 if not measured. Passed back the same way nonzero_error
+    // is, and only written when the combine is choosing its thread count.
+    uint64_t functor_ns;
+    
+    // Copy of the input control's calibrating flag when the command was
+    // issued: the functor thread times the command only if it's set, so the
+    // timing stops with the calibration.
+    int time_command;
+    
+    // Chunks the input lent for this command in place of chunk_data (see
+    // mediocre_input_control_lend), or NULL if it loaded into chunk_data.
+    __m256 const* lent_chunks;
+    
     // The compiler better align this array properly or I WILL FSCKING KILL
     // EVERYONE!!!!1!1!!!!!11!!!!1!1!!!!11!!1!!!!one!
     // This array needs to be big enough to store
@@ -117,12 +141,15 @@ struct mediocre_functor_control {
     struct functor_buffer* even_input_buffer;
     
     // Temporary aligned storage needed by mediocre_functor_aligned_temp.
-    // Initially set to NULL and will be freed by mediocre_combine
-    // even though it is allocated in a different thread by a combine functor. 
-    // This is ugly for the maintainer (ME) but pretty for the user / extender 
-    // of the library.
+    // Initially set to NULL; carved out of the scratch arena below the first
+    // time it is needed.
     __m256* aligned_temp;
     
+    // Scratch arena checked out of the library's pool the first time this
+    // functor thread asks for scratch memory (NULL until then). Given back
+    // to the pool by mediocre_combine once it joins the functor thread.
+    struct scratch_arena* arena;
+    
     // Used to pass data through the pthread start function.
     // (maximum_request also used to allocate aligned_temp).
     int (*functor_loop_function)(
@@ -132,6 +159,15 @@ struct mediocre_functor_control {
     );
     void const* user_data;
     MediocreDimension maximum_request;
+    
+    // Offset of the command that this functor thread is currently working
+    // on, or SIZE_MAX if it has no unfinished command. Only touched by the
+    // input thread; used to figure out how much of the output is finished.
+    size_t in_flight_offset;
+    
+    // When the command the functor thread is running began, or 0 if it
+    // isn't being timed (see functor_buffer.time_command).
+    uint64_t command_begin_ns;
 };
 
 /*  Helper functions for the double buffer scheme in MediocreFunctorControl.
@@ -159,6 +195,7 @@ static inline struct functor_buffer* functor_buffer(MediocreFunctorControl* c) {
  */
 struct mediocre_input_control {
     size_t thread_count;
+    size_t active_thread_count; // Threads past this index are parked.
     MediocreDimension input_dimension;
     MediocreDimension maximum_request;
     MediocreFunctorControl* previous_iteration_thread; // Starts as null.
@@ -166,6 +203,20 @@ struct mediocre_input_control {
     size_t current_thread_index;
     size_t current_offset;
     
+    // Non-null only for mediocre_combine_checkpoint; see below.
+    struct checkpoint_journal* journal;
+    
+    // Throughput measurements used to choose active_thread_count when the
+    // caller passed thread_count = 0. calibrating is cleared once the choice
+    // is made. input_ns is time spent in the user's input loop between
+    // commands; functor_ns is reported back by the functor threads.
+    int calibrating;
+    uint64_t last_command_ns;
+    uint64_t input_ns;
+    uint64_t functor_ns;
+    size_t input_commands;
+    size_t functor_commands;
+    
     // Initially false: set to true once we issue an exit command to the
     // user's input loop function. After we get control back from the user's
     // function, we check this to see if the user returned successfully
@@ -194,6 +245,181 @@ struct mediocre_input_control {
 static const MediocreInputCommand input_exit = { 1, 0, { 0, 0 }, NULL };
 static const MediocreFunctorCommand functor_exit = { 1, { 0, 0 }, NULL, NULL };
 
+/*  State of a checkpointed combine (mediocre_combine_checkpoint). The output
+ *  is an mmap'd file and fd is the journal file, which holds a single struct
+ *  journal_record  at  offset  0.  journaled_offset  is  the  offset  most
+ *  recently written to the journal: every output float below it  has  been
+ *  synced  to  the  output file. The journal is rewritten whenever at least
+ *  checkpoint_interval more floats of the output have been completed and
+ *  at least sync_period_ns have passed since journaled_ns, the time it was
+ *  last written: each write syncs the output on the input thread, so doing
+ *  it every round of commands makes the combine wait on the disk.
+ */
+struct checkpoint_journal {
+    int fd;
+    char* output_map;
+    size_t page_size;
+    size_t journaled_offset;
+    size_t checkpoint_interval;
+    uint64_t journaled_ns;
+    uint64_t sync_period_ns;
+    MediocreDimension dimension;
+    int reported_error;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+struct journal_record {
+    char magic[8];
+    uint64_t combine_count;
+    uint64_t width;
+    uint64_t completed_offset;
+};
+
+/*  Syncs the output written in [journaled_offset, completed_offset) to  the
+ *  output  file,  then records completed_offset in the journal. The output
+ *  must reach the disk before the journal does, or a crash  between  the  two
+ *  could  leave  a  journal  claiming  output that was never written. Returns
+ *  nonzero and sets errno on failure.
+ */
+static int write_journal(
+    struct checkpoint_journal* journal, size_t completed_offset
+) {
+    const size_t begin_byte = journal->journaled_offset * sizeof(float)
+                            & ~(journal->page_size - 1);
+    const size_t end_byte = completed_offset * sizeof(float);
+    
+    if (end_byte > begin_byte) {
+        if (msync(journal->output_map + begin_byte,
+                  end_byte - begin_byte, MS_SYNC) != 0) {
+            return -1;
+        }
+    }
+    
+    struct journal_record record;
+    memcpy(record.magic, "MEDIOCRE", sizeof record.magic);
+    record.combine_count = journal->dimension.combine_count;
+    record.width = journal->dimension.width;
+    record.completed_offset = completed_offset;
+    
+    const ssize_t written = pwrite(journal->fd, &record, sizeof record, 0);
+    if (written != (ssize_t)sizeof record) {
+        if (written >= 0) errno = EIO;
+        return -1;
+    }
+    if (fdatasync(journal->fd) != 0) return -1;
+    
+    journal->journaled_offset = completed_offset;
+    journal->journaled_ns = now_ns();
+    return 0;
+}
+
+/*  Called by the input thread each time it learns that  a  functor  thread
+ *  finished  a command. Commands are issued in increasing offset order, so
+ *  every command below the smallest offset still in flight  (or  not  yet
+ *  issued) is finished, and that offset is safe to record in the journal.
+ */
+static void update_checkpoint(MediocreInputControl* control) {
+    struct checkpoint_journal* journal = control->journal;
+    size_t completed_offset = control->current_offset;
+    
+    for (size_t i = 0; i < control->thread_count; ++i) {
+        const size_t offset = control->functor_threads[i].in_flight_offset;
+        if (offset < completed_offset) completed_offset = offset;
+    }
+    if (completed_offset > journal->dimension.width) {
+        completed_offset = journal->dimension.width;
+    }
+    
+    if (completed_offset - journal->journaled_offset
+        < journal->checkpoint_interval) {
+        return;
+    }
+    if (now_ns() - journal->journaled_ns < journal->sync_period_ns) return;
+    
+    if (write_journal(journal, completed_offset) != 0
+        && !journal->reported_error) {
+        perror("mediocre_combine_checkpoint could not update journal");
+        journal->reported_error = 1;
+    }
+}
+
+/*  Number of functor threads to launch when the caller passes thread_count
+ *  =  0:  one  fewer than the number of CPUs we are allowed to run on (the
+ *  calling thread runs the input loop), but at least one.
+ */
+static int auto_thread_count(void) {
+    int cpus = 0;
+    cpu_set_t cpu_set;
+    
+    if (sched_getaffinity(0, sizeof cpu_set, &cpu_set) == 0) {
+        cpus = CPU_COUNT(&cpu_set);
+    } else {
+        cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return cpus > 2 ? cpus - 1 : 1;
+}
+
+/*  Once we have timed a few commands on both sides, decide how many functor
+ *  threads  are  worth keeping busy. The input thread can issue one command
+ *  per input_ns / input_commands nanoseconds, so if a functor thread  takes
+ *  F  nanoseconds  per command we only need about F / L threads to keep up;
+ *  any more just sit waiting for the input and compete  with  it  for  the
+ *  memory bus. Threads at indices past the chosen count are parked: we wait
+ *  for  their  current command to finish and then never issue them another,
+ *  so they stay blocked on command_ready_sem until the exit command. Returns
+ *  nonzero if a parked thread reported an error.
+ */
+static int choose_active_thread_count(MediocreInputControl* control) {
+    control->calibrating = 0;
+    
+    const size_t thread_count = control->thread_count;
+    size_t active = thread_count;
+    if (control->input_ns != 0) {
+        const double load_ns =
+            (double)control->input_ns / control->input_commands;
+        const double functor_ns =
+            (double)control->functor_ns / control->functor_commands;
+        const double needed = functor_ns / load_ns;
+        if (needed < (double)thread_count) {
+            active = needed < 1.0 ? 1 : (size_t)needed;
+            if ((double)active < needed) ++active;
+        }
+    }
+    control->active_thread_count = active;
+    
+    if (mediocre_combine_verbose) {
+        printf("mediocre_combine: using %zi of %zi functor threads.\n",
+            active, thread_count);
+    }
+    
+    int error = 0;
+    for (size_t i = active; i < thread_count; ++i) {
+        MediocreFunctorControl* thr = &control->functor_threads[i];
+        if (thr->in_flight_offset == SIZE_MAX) continue;
+        
+        int status;
+        verbose_functor_sem_wait(thr);
+        do {
+            status = sem_wait(&thr->functor_ready_sem);
+        } while (status != 0 && errno == EINTR);
+        CHECK_STATUS_VARIABLE("sem_wait");
+        
+        thr->in_flight_offset = SIZE_MAX;
+        error |= thr->odd_input_buffer->nonzero_error;
+        error |= thr->even_input_buffer->nonzero_error;
+    }
+    
+    if (control->current_thread_index >= active) {
+        control->current_thread_index = 0;
+    }
+    return error;
+}
+
 /*  The implementor of a MediocreInput instance was instructed  to  write  a
  *  loop function that calls this mediocre_input_control_get function to get
  *  a command each iteration. We will use the loop that the user  wrote  and
@@ -247,6 +473,11 @@ MediocreInputCommand
 mediocre_input_control_get(MediocreInputControl* control) {
     int status;
     
+    if (control->calibrating && control->last_command_ns != 0) {
+        control->input_ns += now_ns() - control->last_command_ns;
+        ++control->input_commands;
+    }
+    
     // Wait for the previous iteration's thread, if any, to finish working and
     // command it to work on the new data loaded in the last iteration. To do
     // this, we post the semaphore that the functor thread is waiting on and
@@ -255,6 +486,8 @@ mediocre_input_control_get(MediocreInputControl* control) {
     MediocreFunctorControl* const prev_thr = control->previous_iteration_thread;
     if (prev_thr != NULL) {
         const size_t odd_flag = prev_thr->input_odd_flag;
+        const size_t posted_offset = (size_t)(
+            input_buffer(prev_thr)->command_output - control->combine_output);
         
         verbose_command_sem_post(prev_thr);
         status = sem_post(&prev_thr->command_ready_sem);
@@ -267,6 +500,7 @@ mediocre_input_control_get(MediocreInputControl* control) {
         CHECK_STATUS_VARIABLE("sem_wait");
         
         prev_thr->input_odd_flag = !odd_flag;
+        prev_thr->in_flight_offset = posted_offset;
         
         // Check for any errors reported by the combine functor thread.
         // This code was reported through the functor thread's buffer, which
@@ -280,12 +514,33 @@ mediocre_input_control_get(MediocreInputControl* control) {
             verbose_input_command(control, input_exit);
             return input_exit;
         }
+        
+        // prev_thr's previous command is finished now; see if that lets us
+        // advance the checkpoint.
+        if (control->journal != NULL) update_checkpoint(control);
+        
+        if (control->calibrating) {
+            struct functor_buffer* finished = input_buffer(prev_thr);
+            if (finished->functor_ns != 0) {
+                control->functor_ns += finished->functor_ns;
+                ++control->functor_commands;
+                finished->functor_ns = 0;
+            }
+            if (control->functor_commands >= control->thread_count
+             && control->input_commands >= control->thread_count
+             && choose_active_thread_count(control) != 0) {
+                control->received_exit_command = 1;
+                verbose_input_command(control, input_exit);
+                return input_exit;
+            }
+        }
     }
     // Get the current index of the thread that should have data written to
     // it in this iteration, then increment that index inside the control
     // structure, or restart at 0 if needed.
     const size_t i = control->current_thread_index;
-    control->current_thread_index = i+1 == control->thread_count ? 0 : i+1;
+    control->current_thread_index =
+        i+1 == control->active_thread_count ? 0 : i+1;
     
     // This is the next thread in the sequence. We want to get data into it.
     // Also store its address so that it will be commanded to run the next
@@ -333,26 +588,62 @@ mediocre_input_control_get(MediocreInputControl* control) {
     // with whatever portion of data we gave to the functor thread.
     buffer->command_dimension = request_dim;
     buffer->command_output = control->combine_output + offset;
+    buffer->lent_chunks = NULL;
+    buffer->time_command = control->calibrating;
     
     // Now we are finally ready to give the input thread a new command.
     MediocreInputCommand command = {
         0, offset, request_dim, buffer->chunk_data
     };
     verbose_input_command(control, command);
+    if (control->calibrating) control->last_command_ns = now_ns();
     return command;
 }
 
+/*  Lend chunks to the functor thread that the command most recently issued
+ *  by mediocre_input_control_get was for. The pointer travels with the rest
+ *  of the command when the buffers are swapped, and functor_control_get
+ *  hands it to the functor in place of the buffer's chunk_data.
+ */
+int mediocre_input_control_lend(
+    MediocreInputControl* control, __m256 const* chunks
+) {
+    MediocreFunctorControl* const thr = control->previous_iteration_thread;
+    if (thr == NULL || control->received_exit_command) {
+        fprintf(stderr, "mediocre_input_control_lend: No current command.\n");
+        return EINVAL;
+    }
+    if ((uintptr_t)chunks % sizeof(__m256) != 0) {
+        fprintf(stderr, "mediocre_input_control_lend: "
+            "Chunks at %p are not 32 byte aligned.\n", (void*)chunks);
+        return EINVAL;
+    }
+    input_buffer(thr)->lent_chunks = chunks;
+    return 0;
+}
+
 /*  Function that the implementor of a combine functor loop is  expected  to
  *  call each iteration to get a command. Cooperates with
  *  mediocre_input_control_get to signal its completion of its command,  and
  *  to ensure that the correct buffer in the double buffer is written to.
+ *  If the input lent chunks for the command, read_only functors are given
+ *  them as they are; the others get a copy in their own buffer, since they
+ *  are allowed to overwrite their input.
  */
-MediocreFunctorCommand
-mediocre_functor_control_get(MediocreFunctorControl* control) {
+static MediocreFunctorCommand functor_control_get(
+    MediocreFunctorControl* control, int read_only
+) {
     int status;
     
     const size_t odd_flag = control->functor_odd_flag;
     
+    // Report how long the command we just finished took (if we had one).
+    if (control->command_begin_ns != 0) {
+        functor_buffer(control)->functor_ns =
+            now_ns() - control->command_begin_ns;
+        control->command_begin_ns = 0;
+    }
+    
     verbose_functor_sem_post(control);
     status = sem_post(&control->functor_ready_sem);
     CHECK_STATUS_VARIABLE("sem_post");
@@ -372,10 +663,24 @@ mediocre_functor_control_get(MediocreFunctorControl* control) {
         verbose_functor_command(control, functor_exit);
         return functor_exit;
     } else {
+        if (functor_thread_buffer->time_command) {
+            control->command_begin_ns = now_ns();
+        }
+        
+        const MediocreDimension dim = functor_thread_buffer->command_dimension;
+        __m256 const* lent = functor_thread_buffer->lent_chunks;
+        __m256* chunks = functor_thread_buffer->chunk_data;
+        if (lent != NULL && read_only) {
+            chunks = (__m256*)lent;
+        } else if (lent != NULL) {
+            memcpy(chunks, lent,
+                (dim.width + 7) / 8 * dim.combine_count * sizeof(__m256));
+        }
+        
         MediocreFunctorCommand command = {
             0,
-            functor_thread_buffer->command_dimension,
-            functor_thread_buffer->chunk_data,
+            dim,
+            chunks,
             functor_thread_buffer->command_output
         };
         verbose_functor_command(control, command);
@@ -383,6 +688,16 @@ mediocre_functor_control_get(MediocreFunctorControl* control) {
     }
 }
 
+MediocreFunctorCommand
+mediocre_functor_control_get(MediocreFunctorControl* control) {
+    return functor_control_get(control, 0);
+}
+
+MediocreFunctorCommand
+mediocre_functor_control_get_read_only(MediocreFunctorControl* control) {
+    return functor_control_get(control, 1);
+}
+
 static MediocreDimension get_maximum_request(MediocreDimension input_dim) {
     MediocreDimension result = input_dim;
     const size_t n = 160000 / input_dim.combine_count;
@@ -441,6 +756,154 @@ static void* functor_start_function(void* functor_control_pv) {
     return NULL;
 }
 
+/*  Scratch arenas. Each is a list of blocks (newest first) that scratch is
+ *  bump-allocated  from.  A  functor thread checks an arena out of the pool
+ *  the first time it asks for scratch, and mediocre_combine gives it  back
+ *  after  joining  the thread. If the thread needed more than one block, the
+ *  blocks are replaced with a single block big enough for everything it
+ *  asked for, so a repeat of the same combine never allocates.  The  pool
+ *  and  the  byte  count  are  protected  by  scratch_mutex;  a  checked-out
+ *  arena is only touched by the thread that owns it.
+ */
+struct scratch_block {
+    struct scratch_block* next;
+    size_t capacity;
+    size_t used;
+    char* data;
+};
+
+struct scratch_arena {
+    struct scratch_arena* next_free;
+    struct scratch_block* blocks;
+    size_t requested; // Upper bound on bytes needed, including alignment.
+};
+
+static pthread_mutex_t scratch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct scratch_arena* scratch_pool = NULL;
+static size_t scratch_bytes_held = 0;
+
+static void add_scratch_bytes(size_t bytes, int sign) {
+    pthread_mutex_lock(&scratch_mutex);
+    if (sign > 0) scratch_bytes_held += bytes;
+    else scratch_bytes_held -= bytes;
+    pthread_mutex_unlock(&scratch_mutex);
+}
+
+// Block header and data come from one allocation, with the data starting
+// on a cache line.
+static const size_t scratch_header_size =
+    (sizeof(struct scratch_block) + 63) & ~(size_t)63;
+
+static struct scratch_block* new_scratch_block(size_t capacity) {
+    void* ptr;
+    capacity = (capacity + 4095) & ~(size_t)4095;
+    int status = posix_memalign(&ptr, 64, scratch_header_size + capacity);
+    if (status != 0) {
+        errno = status;
+        return NULL;
+    }
+    struct scratch_block* block = (struct scratch_block*)ptr;
+    block->next = NULL;
+    block->capacity = capacity;
+    block->used = 0;
+    block->data = (char*)ptr + scratch_header_size;
+    add_scratch_bytes(capacity, 1);
+    return block;
+}
+
+static void free_scratch_blocks(struct scratch_block* block) {
+    while (block != NULL) {
+        struct scratch_block* next = block->next;
+        add_scratch_bytes(block->capacity, -1);
+        free(block);
+        block = next;
+    }
+}
+
+void* mediocre_functor_scratch(
+    MediocreFunctorControl* control, size_t bytes, size_t alignment
+) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return (errno = EINVAL, NULL);
+    }
+    
+    struct scratch_arena* arena = control->arena;
+    if (arena == NULL) {
+        pthread_mutex_lock(&scratch_mutex);
+        arena = scratch_pool;
+        if (arena != NULL) scratch_pool = arena->next_free;
+        pthread_mutex_unlock(&scratch_mutex);
+        
+        if (arena == NULL) {
+            arena = (struct scratch_arena*)calloc(1, sizeof *arena);
+            if (arena == NULL) return (errno = ENOMEM, NULL);
+        }
+        control->arena = arena;
+    }
+    
+    const size_t needed = bytes + alignment - 1;
+    arena->requested += needed;
+    
+    struct scratch_block* block = arena->blocks;
+    if (block == NULL || block->capacity - block->used < needed) {
+        const size_t capacity = block != NULL && 2 * block->capacity > needed
+                              ? 2 * block->capacity : needed;
+        struct scratch_block* new_block = new_scratch_block(capacity);
+        if (new_block == NULL) return NULL;
+        new_block->next = block;
+        arena->blocks = block = new_block;
+    }
+    
+    const uintptr_t begin = (uintptr_t)(block->data + block->used);
+    const uintptr_t aligned = (begin + alignment - 1) & ~(alignment - 1);
+    block->used += (aligned - begin) + bytes;
+    return (void*)aligned;
+}
+
+/*  Called by mediocre_combine after the functor thread that owned the arena
+ *  has  been joined. Resets the arena and puts it back in the pool, merging
+ *  its blocks into one if the thread outgrew the first block.
+ */
+static void return_scratch_arena(struct scratch_arena* arena) {
+    if (arena == NULL) return;
+    
+    struct scratch_block* block = arena->blocks;
+    if (block != NULL && block->next != NULL) {
+        free_scratch_blocks(block);
+        // If this fails the arena just starts empty next time.
+        block = new_scratch_block(arena->requested);
+    }
+    if (block != NULL) block->used = 0;
+    arena->blocks = block;
+    arena->requested = 0;
+    
+    pthread_mutex_lock(&scratch_mutex);
+    arena->next_free = scratch_pool;
+    scratch_pool = arena;
+    pthread_mutex_unlock(&scratch_mutex);
+}
+
+size_t mediocre_scratch_bytes(void) {
+    pthread_mutex_lock(&scratch_mutex);
+    const size_t bytes = scratch_bytes_held;
+    pthread_mutex_unlock(&scratch_mutex);
+    return bytes;
+}
+
+void mediocre_scratch_release(void) {
+    pthread_mutex_lock(&scratch_mutex);
+    struct scratch_arena* arena = scratch_pool;
+    scratch_pool = NULL;
+    pthread_mutex_unlock(&scratch_mutex);
+    
+    while (arena != NULL) {
+        struct scratch_arena* next = arena->next_free;
+        free_scratch_blocks(arena->blocks);
+        free(arena);
+        arena = next;
+    }
+}
+
 /*  Function  that  prepares  the  environment  expected  by   the   command
  *  functions,   launches   the  functor  threads,  and  passes  control  to
  *  input.loop_function.  The  function  then  cleans  up  the   environment
@@ -449,16 +912,16 @@ static void* functor_start_function(void* functor_control_pv) {
  *  conditions.  Zero  return  indicates  no  errors, nonzero indicates that
  *  there was an error. The errno variable will be set to the return value.
  *  
- *  To users of the library, this is the function that allows  them  to  run
- *  any  combine  functor  implementation  on  any  specified  input,  while
- *  specifying the number of threads to be used and the  destination  buffer
- *  as a flat C array of floats.
+ *  If journal is not NULL, the combine starts at journal->journaled_offset
+ *  instead  of  0,  and  the  journal  is  updated  as  the  combine  makes
+ *  progress. Otherwise the whole input is combined.
  */
-int mediocre_combine(
+static int combine_impl(
     float* output,
     MediocreInput input,
     MediocreFunctor functor,
-    int thread_count
+    int thread_count,
+    struct checkpoint_journal* journal
 ) {
     int status;
     
@@ -485,11 +948,15 @@ int mediocre_combine(
         return functor.nonzero_error;
     }
     
-    if (thread_count < 1) {
-        fprintf(stderr, "mediocre_combine: needed positive thread_count.\n");
+    if (thread_count < 0) {
+        fprintf(stderr, "mediocre_combine: needed non-negative "
+            "thread_count.\n");
         return (errno = ERANGE);
     }
     
+    const int choose_thread_count = thread_count == 0;
+    if (choose_thread_count) thread_count = auto_thread_count();
+    
     MediocreDimension maximum_request = get_maximum_request(input.dimension);
     
     assert(maximum_request.width % 8 == 0 && maximum_request.width > 0);
@@ -499,8 +966,9 @@ int mediocre_combine(
     // struct functor_buffer instances for each MediocreFunctorControl. We
     // will allocate memory only once in this function using posix_memalign and
     // divide it up. (Note that the aligned_temp buffers inside a functor
-    // control struct are not allocated by us since it's up to the implementor
-    // whether that temporary storage is needed, but it is freed by us).
+    // control struct are not allocated here since it's up to the implementor
+    // whether that temporary storage is needed; they come from the scratch
+    // arenas).
     
     // The actual size of each structure we need to allocate is variable
     // because of the flexible array member at the end. Calculate the
@@ -543,12 +1011,21 @@ int mediocre_combine(
         (char*)allocated + functor_buffer_size * 2u * thread_count);
     
     input_control->thread_count = (size_t)thread_count;
+    input_control->active_thread_count = (size_t)thread_count;
     input_control->input_dimension = input.dimension;
     input_control->maximum_request = maximum_request;
     input_control->previous_iteration_thread = NULL;
     input_control->combine_output = output;
     input_control->current_thread_index = 0;
-    input_control->current_offset = 0;
+    input_control->current_offset =
+        journal != NULL ? journal->journaled_offset : 0;
+    input_control->journal = journal;
+    input_control->calibrating = choose_thread_count;
+    input_control->last_command_ns = 0;
+    input_control->input_ns = 0;
+    input_control->functor_ns = 0;
+    input_control->input_commands = 0;
+    input_control->functor_commands = 0;
     input_control->received_exit_command = 0;
     
     // Now initialize the array of MediocreFunctorControl.
@@ -577,14 +1054,23 @@ int mediocre_combine(
             ((char*)functor_buffers + (2*i) * functor_buffer_size);
         
         functor_control->odd_input_buffer->nonzero_error = 0;
+        functor_control->odd_input_buffer->functor_ns = 0;
+        functor_control->odd_input_buffer->lent_chunks = NULL;
+        functor_control->odd_input_buffer->time_command = 0;
         
         functor_control->even_input_buffer =
             (struct functor_buffer*)
             ((char*)functor_buffers + (2*i + 1) * functor_buffer_size);
         
         functor_control->even_input_buffer->nonzero_error = 0;
+        functor_control->even_input_buffer->functor_ns = 0;
+        functor_control->even_input_buffer->lent_chunks = NULL;
+        functor_control->even_input_buffer->time_command = 0;
         
         functor_control->aligned_temp = NULL;
+        functor_control->arena = NULL;
+        functor_control->in_flight_offset = SIZE_MAX;
+        functor_control->command_begin_ns = 0;
         
         // Now we can finally launch the thread since the semaphores are ready.
         functor_control->functor_loop_function = functor.loop_function;
@@ -618,6 +1104,7 @@ int mediocre_combine(
             } else {
                 thread_count = i;
                 input_control->thread_count = thread_count;
+                input_control->active_thread_count = thread_count;
                 static const char format[] =
                     "mediocre_combine: could only start %i threads";
                 char str[sizeof format + 20];
@@ -672,9 +1159,8 @@ int mediocre_combine(
         
         // Memory for input_thread_buffer and functor_thread_buffer will be
         // freed when the memory we allocated for everything is freed.
-        // We do however have to free aligned_temp; its memory did not come
-        // from the large buffer we allocated.
-        free(control->aligned_temp);
+        // Scratch memory (including aligned_temp) goes back to the pool.
+        return_scratch_arena(control->arena);
         
         // user_data will be freed by the user-supplied destructor, not us.
         
@@ -716,6 +1202,151 @@ int mediocre_combine(
     return (errno = error_code);
 }
 
+/*  To users of the library, this is the function that allows  them  to  run
+ *  any  combine  functor  implementation  on  any  specified  input,  while
+ *  specifying the number of threads to be used and the  destination  buffer
+ *  as a flat C array of floats.
+ */
+int mediocre_combine(
+    float* output,
+    MediocreInput input,
+    MediocreFunctor functor,
+    int thread_count
+) {
+    return combine_impl(output, input, functor, thread_count, NULL);
+}
+
+/*  Reads the journal record and decides where to resume the combine.  We
+ *  only  trust the journal if it was written for an input of the same shape
+ *  and the output file was already big enough  to  hold  the  output  (if
+ *  someone truncated or deleted the output, the journal is stale).
+ */
+static size_t read_journal(
+    int fd, MediocreDimension dimension, int output_was_complete
+) {
+    struct journal_record record;
+    const ssize_t bytes = pread(fd, &record, sizeof record, 0);
+    
+    if (bytes == 0) return 0; // New journal.
+    
+    if (bytes != sizeof record
+        || memcmp(record.magic, "MEDIOCRE", sizeof record.magic) != 0
+        || record.combine_count != dimension.combine_count
+        || record.width != dimension.width
+        || record.completed_offset > dimension.width
+        || !output_was_complete) {
+        fprintf(stderr, "mediocre_combine_checkpoint: journal does not match "
+            "the input or output; starting from the beginning.\n");
+        return 0;
+    }
+    
+    // Commands must start at multiples of 8. A completed combine records
+    // the full width, which might not be one; rounding it up still makes
+    // the input loop exit straight away.
+    return ((size_t)record.completed_offset + 7) & ~(size_t)7;
+}
+
+int mediocre_combine_checkpoint(
+    char const* output_path,
+    char const* journal_path,
+    MediocreInput input,
+    MediocreFunctor functor,
+    int thread_count
+) {
+    if (output_path == NULL || journal_path == NULL) {
+        fprintf(stderr, "mediocre_combine_checkpoint: cannot have null "
+            "output_path or journal_path.\n");
+        return (errno = EFAULT);
+    }
+    
+    if (input.nonzero_error != 0) {
+        errno = input.nonzero_error;
+        perror("mediocre_combine_checkpoint input not constructed");
+        return input.nonzero_error;
+    }
+    
+    if (input.dimension.combine_count == 0) {
+        fprintf(stderr, "mediocre_combine_checkpoint: "
+            "input.dimension.combine_count must not be 0.\n");
+        return (errno = EINVAL);
+    }
+    
+    const MediocreDimension dimension = input.dimension;
+    const size_t output_bytes = dimension.width * sizeof(float);
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    int error_code = 0;
+    
+    const int output_fd = open(output_path, O_RDWR | O_CREAT, 0644);
+    if (output_fd < 0) {
+        error_code = errno;
+        perror("mediocre_combine_checkpoint could not open output");
+        return (errno = error_code);
+    }
+    
+    const int journal_fd = open(journal_path, O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0) {
+        error_code = errno;
+        perror("mediocre_combine_checkpoint could not open journal");
+        close(output_fd);
+        return (errno = error_code);
+    }
+    
+    struct stat output_stat;
+    if (fstat(output_fd, &output_stat) != 0
+        || ftruncate(output_fd, (off_t)output_bytes) != 0) {
+        error_code = errno;
+        perror("mediocre_combine_checkpoint could not resize output");
+        close(journal_fd);
+        close(output_fd);
+        return (errno = error_code);
+    }
+    
+    // Map at least one page so that mmap doesn't reject a 0 width input.
+    const size_t map_bytes = output_bytes == 0 ? page_size : output_bytes;
+    void* map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     output_fd, 0);
+    if (map == MAP_FAILED) {
+        error_code = errno;
+        perror("mediocre_combine_checkpoint could not mmap output");
+        close(journal_fd);
+        close(output_fd);
+        return (errno = error_code);
+    }
+    
+    struct checkpoint_journal journal;
+    journal.fd = journal_fd;
+    journal.output_map = (char*)map;
+    journal.page_size = page_size;
+    journal.journaled_offset = read_journal(
+        journal_fd, dimension, (size_t)output_stat.st_size >= output_bytes);
+    journal.dimension = dimension;
+    journal.reported_error = 0;
+    journal.journaled_ns = now_ns();
+    journal.sync_period_ns = mediocre_checkpoint_seconds > 0
+        ? (uint64_t)mediocre_checkpoint_seconds * 1000000000u : 0;
+    
+    // Checkpoint about once per round of commands issued to the functor
+    // threads; syncing more often than that just makes the threads wait.
+    const MediocreDimension maximum_request = get_maximum_request(dimension);
+    journal.checkpoint_interval = maximum_request.width * (size_t)(
+        thread_count > 0 ? thread_count : auto_thread_count());
+    
+    error_code =
+        combine_impl((float*)map, input, functor, thread_count, &journal);
+    
+    // Every functor thread has been joined, so if the combine succeeded the
+    // whole output is finished.
+    if (error_code == 0 && write_journal(&journal, dimension.width) != 0) {
+        error_code = errno;
+        perror("mediocre_combine_checkpoint could not update journal");
+    }
+    
+    munmap(map, map_bytes);
+    close(journal_fd);
+    close(output_fd);
+    return (errno = error_code);
+}
+
 /*  Similar to mediocre_combine, except that the destructor  for  the  input
  *  and  functor  arguments  is  automatically run afterwards (regardless of
  *  whether the function succeeds or fails). The user need not and must  not
@@ -749,14 +1380,14 @@ int mediocre_combine_destroy(
  *  in  the first place. Otherwise, the function checks for a cached aligned
  *  buffer inside the control structure (the structure is exclusively  owned
  *  by  this running functor thread) and returns it to the user. If it isn't
- *  there, we allocate it (with the allocation being wide  enough  to  store
+ *  there, we take it from the thread's scratch arena (wide enough to  store
  *  maximum_request.width  floats, where maximum_request.width is guaranteed
  *  to be divisible by 8). This might be much more memory than  we  promised
  *  the  caller  but  should  never  be less, since the command passed as an
  *  argument should have been created by the control structure passed, which
  *  will  never  create  a  command  with  a  dimension  field  greater than
- *  control->maximum_request. This buffer will be freed by  mediocre_combine
- *  when it joins all the functor threads.
+ *  control->maximum_request. The arena is given back to the library's pool
+ *  when mediocre_combine joins the functor threads.
  */
 __m256* mediocre_functor_aligned_temp(
     MediocreFunctorCommand command, MediocreFunctorControl* control
@@ -773,17 +1404,10 @@ __m256* mediocre_functor_aligned_temp(
     assert(dim.combine_count <= control->maximum_request.combine_count);
     
     if (control->aligned_temp == NULL) {
-        void* ptr;
         const size_t bytes = sizeof(float) * control->maximum_request.width;
         assert(bytes % sizeof(__m256) == 0);
-        int status = posix_memalign(&ptr, sizeof(__m256), bytes);
-        
-        if (status != 0) {
-            errno = status;
-            return NULL;
-        }
-        
-        return (control->aligned_temp = (__m256*)ptr);
+        control->aligned_temp = (__m256*)
+            mediocre_functor_scratch(control, bytes, sizeof(__m256));
     }
     return control->aligned_temp;
 }
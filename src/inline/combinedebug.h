@@ -111,6 +111,9 @@ static inline void print_functor_buffer(
     } else if (functor_control->even_input_buffer->chunk_data == buf) {
         print_thread(functor_control);
         printf("\x1b[36m even buffer [%p]\x1b[0m", buf);
+    } else if (functor_buffer(functor_control)->lent_chunks == buf) {
+        print_thread(functor_control);
+        printf("\x1b[32m lent chunks [%p]\x1b[0m", buf);
     } else {
         printf("\x1b[1m\x1b[41mUnknown buffer [%p]\x1b[0m", buf);
     }
@@ -0,0 +1,429 @@
+/*  An aggresively average SIMD combine library.
+ *  Copyright (C) 2017 David Akeley
+ *  
+ *  Vectorized loaders that convert 8 consecutive numbers of one of the
+ *  supported input types to a vector of 8 floats (input.cc).
+ *  
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MediocrePy_INLINE_CONVERT_H_
+#define MediocrePy_INLINE_CONVERT_H_
+
+#include <immintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*  Each load8 overload reads p[0] ... p[7] (p need not be aligned) and
+ *  returns  the vector whose lane i is float(p[i]), rounded exactly as the
+ *  scalar conversion would round it, so results don't depend  on  whether
+ *  the  vectorized  or  scalar  path loaded a number. We only have AVX (no
+ *  AVX2), so the integer widening is done with  the  SSE4.1  pmovsx/pmovzx
+ *  instructions on each 128-bit half.
+ */
+namespace mediocre_convert {
+
+static inline __m256 combine_halves_epi32(__m128i lo, __m128i hi) {
+    return _mm256_cvtepi32_ps(
+        _mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1)
+    );
+}
+
+static inline __m256 load8(float const* p) {
+    return _mm256_loadu_ps(p);
+}
+
+static inline __m256 load8(double const* p) {
+    const __m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(p));
+    const __m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(p + 4));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+static inline __m256 load8(int8_t const* p) {
+    const __m128i bytes = _mm_loadl_epi64((__m128i const*)p);
+    return combine_halves_epi32(
+        _mm_cvtepi8_epi32(bytes), _mm_cvtepi8_epi32(_mm_srli_si128(bytes, 4))
+    );
+}
+
+static inline __m256 load8(uint8_t const* p) {
+    const __m128i bytes = _mm_loadl_epi64((__m128i const*)p);
+    return combine_halves_epi32(
+        _mm_cvtepu8_epi32(bytes), _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4))
+    );
+}
+
+static inline __m256 from_epi16(__m128i words) {
+    return combine_halves_epi32(
+        _mm_cvtepi16_epi32(words), _mm_cvtepi16_epi32(_mm_srli_si128(words, 8))
+    );
+}
+
+static inline __m256 from_epu16(__m128i words) {
+    return combine_halves_epi32(
+        _mm_cvtepu16_epi32(words), _mm_cvtepu16_epi32(_mm_srli_si128(words, 8))
+    );
+}
+
+static inline __m256 load8(int16_t const* p) {
+    return from_epi16(_mm_loadu_si128((__m128i const*)p));
+}
+
+static inline __m256 load8(uint16_t const* p) {
+    return from_epu16(_mm_loadu_si128((__m128i const*)p));
+}
+
+static inline __m256 load8(int32_t const* p) {
+    return _mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i const*)p));
+}
+
+/*  There's no unsigned conversion before AVX-512, so split each number into
+ *  its  high and low 16 bits, which both convert exactly, and compute hi *
+ *  65536 + lo. hi * 65536 is exact too, so the only rounding  is  in  the
+ *  final addition, which makes the result match float(x). a and b hold the
+ *  low and high 4 numbers.
+ */
+static inline __m256 unsigned_halves_to_ps(__m128i a, __m128i b) {
+    const __m128i lo_mask = _mm_set1_epi32(0xFFFF);
+    
+    const __m256 hi = combine_halves_epi32(
+        _mm_srli_epi32(a, 16), _mm_srli_epi32(b, 16));
+    const __m256 lo = combine_halves_epi32(
+        _mm_and_si128(a, lo_mask), _mm_and_si128(b, lo_mask));
+    
+    return _mm256_add_ps(_mm256_mul_ps(hi, _mm256_set1_ps(65536.0f)), lo);
+}
+
+static inline __m256 load8(uint32_t const* p) {
+    return unsigned_halves_to_ps(
+        _mm_loadu_si128((__m128i const*)p),
+        _mm_loadu_si128((__m128i const*)(p + 4))
+    );
+}
+
+// No packed 64-bit integer conversions without AVX-512; stay scalar.
+static inline __m256 load8(int64_t const* p) {
+    return _mm256_set_ps(
+        float(p[7]), float(p[6]), float(p[5]), float(p[4]),
+        float(p[3]), float(p[2]), float(p[1]), float(p[0])
+    );
+}
+
+static inline __m256 load8(uint64_t const* p) {
+    return _mm256_set_ps(
+        float(p[7]), float(p[6]), float(p[5]), float(p[4]),
+        float(p[3]), float(p[2]), float(p[1]), float(p[0])
+    );
+}
+
+/*  IEEE half precision (float16) and bfloat16 numbers, held as their bits
+ *  since C has no type for them. As with BigEndian below, wrapping the bits
+ *  gives the loaders in input.cc a distinct type to be templated on.
+ *  
+ *  A half's exponent and mantissa shifted up 13 bits are the bits of  the
+ *  float  2^-112 times as large (subnormal halves become subnormal floats),
+ *  so multiplying by 2^112 converts every finite half exactly; infinities
+ *  and NaNs just need the exponent set to all ones afterwards (and NaNs the
+ *  quiet bit, as vcvtph2ps sets it).
+ */
+static const float half_exponent_adjust = 5.192296858534828e+33f; // 2^112
+
+struct Half {
+    uint16_t bits;
+    
+    operator float() const {
+        const uint32_t magnitude = uint32_t(bits & 0x7FFF) << 13;
+        float f;
+        memcpy(&f, &magnitude, sizeof f);
+        f *= half_exponent_adjust;
+        
+        uint32_t result;
+        memcpy(&result, &f, sizeof result);
+        if (magnitude >= 0x0F800000) result |= 0x7F800000;
+        if (magnitude > 0x0F800000) result |= 0x00400000; // Quiet NaNs.
+        result |= uint32_t(bits & 0x8000) << 16;
+        memcpy(&f, &result, sizeof f);
+        return f;
+    }
+};
+
+// bfloat16 is just the upper half of a float.
+struct BFloat16 {
+    uint16_t bits;
+    
+    operator float() const {
+        const uint32_t widened = uint32_t(bits) << 16;
+        float f;
+        memcpy(&f, &widened, sizeof f);
+        return f;
+    }
+};
+
+/*  Convert 8 half bits to floats. F16C isn't part of AVX (Sandy Bridge has
+ *  AVX  but  not  F16C),  so  use  vcvtph2ps  if  the  CPU  has  it and the
+ *  Half::operator float method 4 lanes at a time if not.
+ */
+static inline bool cpu_has_f16c() {
+    static const bool has_f16c = (__builtin_cpu_init(),
+        __builtin_cpu_supports("f16c") != 0);
+    return has_f16c;
+}
+
+__attribute__((target("f16c")))
+static inline __m256 f16c_cvtph_ps(__m128i bits) {
+    return _mm256_cvtph_ps(bits);
+}
+
+static inline __m128 half_bits_to_ps(__m128i widened) {
+    const __m128i magnitude = _mm_slli_epi32(
+        _mm_and_si128(widened, _mm_set1_epi32(0x7FFF)), 13);
+    const __m128i sign = _mm_slli_epi32(
+        _mm_and_si128(widened, _mm_set1_epi32(0x8000)), 16);
+    const __m128i inf_nan = _mm_or_si128(
+        _mm_and_si128(
+            _mm_cmpgt_epi32(magnitude, _mm_set1_epi32(0x0F7FFFFF)),
+            _mm_set1_epi32(0x7F800000)),
+        _mm_and_si128(
+            _mm_cmpgt_epi32(magnitude, _mm_set1_epi32(0x0F800000)),
+            _mm_set1_epi32(0x00400000)));
+    
+    const __m128 scaled = _mm_mul_ps(
+        _mm_castsi128_ps(magnitude), _mm_set1_ps(half_exponent_adjust));
+    return _mm_castsi128_ps(_mm_or_si128(
+        _mm_or_si128(_mm_castps_si128(scaled), inf_nan), sign));
+}
+
+static inline __m256 cvtph_ps(__m128i bits) {
+    if (cpu_has_f16c()) return f16c_cvtph_ps(bits);
+    
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 lo = half_bits_to_ps(_mm_unpacklo_epi16(bits, zero));
+    const __m128 hi = half_bits_to_ps(_mm_unpackhi_epi16(bits, zero));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+// Interleaving zeros below each bfloat16 shifts it into place.
+static inline __m256 cvtbf16_ps(__m128i bits) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_unpacklo_epi16(zero, bits);
+    const __m128i hi = _mm_unpackhi_epi16(zero, bits);
+    return _mm256_castsi256_ps(
+        _mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+}
+
+static inline __m256 load8(Half const* p) {
+    return cvtph_ps(_mm_loadu_si128((__m128i const*)p));
+}
+
+static inline __m256 load8(BFloat16 const* p) {
+    return cvtbf16_ps(_mm_loadu_si128((__m128i const*)p));
+}
+
+/*  Reverse the bytes within each 16, 32 or 64-bit lane, converting between
+ *  big-endian  (FITS  files,  for example) and our native little-endian byte
+ *  order. pshufb is SSSE3, so these are fine with plain AVX.
+ */
+static inline __m128i bswap16(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+}
+
+static inline __m128i bswap32(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+}
+
+static inline __m128i bswap64(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+}
+
+/*  Scalar counterpart: read one big-endian number. */
+template <typename T>
+static inline T load_big(T const* p) {
+    unsigned char bytes[sizeof(T)];
+    unsigned char swapped[sizeof(T)];
+    memcpy(bytes, p, sizeof(T));
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        swapped[i] = bytes[sizeof(T) - 1 - i];
+    }
+    T result;
+    memcpy(&result, swapped, sizeof(T));
+    return result;
+}
+
+/*  A number of type T stored big-endian (the *be type codes in mediocre.h).
+ *  The  loaders in input.cc are templated on the stored type, so wrapping T
+ *  gives them a distinct type of the same size whose  conversion  to  float
+ *  swaps  the  bytes  first; the load8 overloads below swap 8 numbers at a
+ *  time instead.
+ */
+template <typename T>
+struct BigEndian {
+    T stored;
+    
+    operator float() const {
+        return float(load_big(&stored));
+    }
+};
+
+static inline __m256 load8(BigEndian<int16_t> const* p) {
+    return from_epi16(bswap16(_mm_loadu_si128((__m128i const*)p)));
+}
+
+static inline __m256 load8(BigEndian<uint16_t> const* p) {
+    return from_epu16(bswap16(_mm_loadu_si128((__m128i const*)p)));
+}
+
+static inline __m256 load8(BigEndian<int32_t> const* p) {
+    return combine_halves_epi32(
+        bswap32(_mm_loadu_si128((__m128i const*)p)),
+        bswap32(_mm_loadu_si128((__m128i const*)(p + 4)))
+    );
+}
+
+static inline __m256 load8(BigEndian<uint32_t> const* p) {
+    return unsigned_halves_to_ps(
+        bswap32(_mm_loadu_si128((__m128i const*)p)),
+        bswap32(_mm_loadu_si128((__m128i const*)(p + 4)))
+    );
+}
+
+static inline __m256 load8(BigEndian<float> const* p) {
+    const __m128i lo = bswap32(_mm_loadu_si128((__m128i const*)p));
+    const __m128i hi = bswap32(_mm_loadu_si128((__m128i const*)(p + 4)));
+    return _mm256_castsi256_ps(
+        _mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+}
+
+// Swap the doubles as 4 pairs, then convert them as load8(double const*).
+static inline __m256 load8(BigEndian<double> const* p) {
+    __m128i pairs[4];
+    for (int j = 0; j < 4; ++j) {
+        pairs[j] = bswap64(_mm_loadu_si128((__m128i const*)(p + 2*j)));
+    }
+    const __m128 lo = _mm256_cvtpd_ps(_mm256_castsi256_pd(
+        _mm256_insertf128_si256(_mm256_castsi128_si256(pairs[0]), pairs[1], 1)
+    ));
+    const __m128 hi = _mm256_cvtpd_ps(_mm256_castsi256_pd(
+        _mm256_insertf128_si256(_mm256_castsi128_si256(pairs[2]), pairs[3], 1)
+    ));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+static inline __m256 load8(BigEndian<Half> const* p) {
+    return cvtph_ps(bswap16(_mm_loadu_si128((__m128i const*)p)));
+}
+
+static inline __m256 load8(BigEndian<BFloat16> const* p) {
+    return cvtbf16_ps(bswap16(_mm_loadu_si128((__m128i const*)p)));
+}
+
+static inline __m256 load8(BigEndian<int64_t> const* p) {
+    return _mm256_set_ps(
+        float(p[7]), float(p[6]), float(p[5]), float(p[4]),
+        float(p[3]), float(p[2]), float(p[1]), float(p[0])
+    );
+}
+
+static inline __m256 load8(BigEndian<uint64_t> const* p) {
+    return _mm256_set_ps(
+        float(p[7]), float(p[6]), float(p[5]), float(p[4]),
+        float(p[3]), float(p[2]), float(p[1]), float(p[0])
+    );
+}
+
+/*  Transpose the 8x8 matrix whose rows are r[0] ... r[7] in place, so that
+ *  afterwards  lane  j of r[i] holds what was lane i of r[j]. Standard AVX
+ *  sequence:  unpack  pairs  of  rows,  shuffle  pairs  of  pairs,  then
+ *  exchange 128-bit halves.
+ */
+static inline void transpose8x8(__m256* r) {
+    const __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    const __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    const __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    const __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    const __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    const __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    const __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    const __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    
+    const __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    
+    r[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+    r[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+    r[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+    r[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+    r[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+    r[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+    r[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+    r[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+/*  Convert 8 raw 32-bit numbers collected by an AVX2 gather (input.cc) to
+ *  floats,  rounding  exactly as load8 does. These are the only functions in
+ *  this file that need AVX2; only call them after checking that the CPU has
+ *  it.
+ */
+__attribute__((target("avx2")))
+static inline __m256 from_gathered(float const*, __m256i raw) {
+    return _mm256_castsi256_ps(raw);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 from_gathered(int32_t const*, __m256i raw) {
+    return _mm256_cvtepi32_ps(raw);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 from_gathered(uint32_t const*, __m256i raw) {
+    const __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(raw, 16));
+    const __m256 lo = _mm256_cvtepi32_ps(
+        _mm256_and_si256(raw, _mm256_set1_epi32(0xFFFF)));
+    return _mm256_add_ps(_mm256_mul_ps(hi, _mm256_set1_ps(65536.0f)), lo);
+}
+
+// Big-endian lanes are swapped with one 256-bit pshufb first.
+template <typename T>
+__attribute__((target("avx2")))
+static inline __m256 from_gathered(BigEndian<T> const*, __m256i raw) {
+    const __m256i swap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    return from_gathered(
+        static_cast<T const*>(nullptr), _mm256_shuffle_epi8(raw, swap));
+}
+
+/*  Load the last count < 8 numbers of an array, filling the upper lanes with
+ *  0.  We  can't  use  load8 here since it could read past the end of the
+ *  array (and off the end of a page).
+ */
+template <typename T>
+static inline __m256 load_partial(T const* p, size_t count) {
+    float f[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    for (size_t i = 0; i < count; ++i) f[i] = float(p[i]);
+    return _mm256_loadu_ps(f);
+}
+
+} // end namespace mediocre_convert.
+
+#endif // end include guard.
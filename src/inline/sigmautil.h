@@ -40,6 +40,20 @@ static inline __m256 sigma_mask(__m256 arg, struct ClipBoundsM256 bounds) {
     return _mm256_or_ps(lower_mask, upper_mask);
 }
 
+/*  Same as sigma_mask, except that if skip_nan is true, NaN  counts  as  out
+ *  of  range  as  well  (the  unordered  comparisons  are  true  for  NaN).
+ *  skip_nan is the same throughout the loops calling this, so the  compiler
+ *  can move the test out of those loops.
+ */
+static inline __m256 sigma_mask_nan(
+    __m256 arg, struct ClipBoundsM256 bounds, int skip_nan
+) {
+    if (!skip_nan) return sigma_mask(arg, bounds);
+    __m256 const lower_mask = _mm256_cmp_ps(arg, bounds.lower, _CMP_NGE_UQ);
+    __m256 const upper_mask = _mm256_cmp_ps(arg, bounds.upper, _CMP_NLE_UQ);
+    return _mm256_or_ps(lower_mask, upper_mask);
+}
+
 /*  Given some data, current clipping bounds calculated by  sigma  clipping,
  *  and  some  parameters,  calculate the new clipping bounds that should be
  *  used  for  the  next  round  of  sigma  clipping.  This  is   calculated
@@ -68,6 +82,8 @@ static inline __m256 sigma_mask(__m256 arg, struct ClipBoundsM256 bounds) {
  *    vector of 4 identical positive doubles
  *      ** sigma_upper
  *    vector of 4 identical positive doubles
+ *      ** skip_nan
+ *    if true, NaN numbers are left out (as if outside the bounds)
  *  
  *  The new clipping range is defined as [center - sigma_lower * s, center +
  *  sigma_upper  *  s],  where  sd  is  calculated as the standard deviation
@@ -85,7 +101,8 @@ static inline struct ClipBoundsM256 get_new_clip_bounds(
     __m256 center,
     __m256 clipped_count,
     __m256d sigma_lower,
-    __m256d sigma_upper
+    __m256d sigma_upper,
+    int skip_nan
 ) {
     // To calculate the standard deviation, we need to first get the
     // sum of the squared deviations. We will do this in double rather
@@ -114,7 +131,7 @@ static inline struct ClipBoundsM256 get_new_clip_bounds(
         // I think that recalculating the mask is faster than storing
         // and reloading it from memory. Memory is slooooow.
         __m256 const vec = data[i];
-        __m256 const mask = sigma_mask(vec, bounds);
+        __m256 const mask = sigma_mask_nan(vec, bounds, skip_nan);
         
         __m256 const diffs = _mm256_blendv_ps(
             _mm256_sub_ps(vec, center), zero, mask
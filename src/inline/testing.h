@@ -64,6 +64,18 @@ void delete_random(struct Random* generator) noexcept;
 // Sort floats in an array of the specified size.
 void sort_floats(float* array, size_t size) noexcept;
 
+// Replace entries of the array_count arrays of bin_count numbers with the
+// missing value at random: in some bins all of them or all but one,
+// otherwise about one in rate.
+void punch_holes(
+    struct Random*,
+    uint16_t* const* arrays,
+    size_t array_count,
+    size_t bin_count,
+    uint32_t rate,
+    uint16_t missing
+) noexcept;
+
 // Return the difference between the current time and the timeb passed as an
 // argument (in milliseconds). Ignores the timezone and dstflag.
 static inline long ms_elapsed(struct timeb before) noexcept {
@@ -17,98 +17,460 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <immintrin.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <deque>
+#include <map>
 #include <new>
+#include <string>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "mediocre.h"
+#include "convert.h"
 
 namespace {
 
-/*  The data type of a Mediocre2D object is determined at run  time  through
- *  the  type_code  member,  but  these  templatized functions have the type
- *  they're designed to work  on  determined  at  compile  time.  Call  this
- *  function  within  a  templatized  function  to check that the Mediocre2D
- *  object has the correct runtime type for the chosen template function.
+using mediocre_convert::BigEndian;
+using mediocre_convert::Half;
+using mediocre_convert::BFloat16;
+
+/*  Size in bytes of one number of the type with the given  type  code,  or  0
+ *  for unknown type codes.
  */
-template <typename T>
-void check_type_code(Mediocre2D arg) {
-    bool is_okay;
-    switch (arg.type_code) {
-      default:
-        is_okay = false;
-      break; case 8:
-        is_okay = std::is_same<T, int8_t>::value;
-      break; case 16:
-        is_okay = std::is_same<T, int16_t>::value;
-      break; case 32:
-        is_okay = std::is_same<T, int32_t>::value;
-      break; case 64:
-        is_okay = std::is_same<T, int64_t>::value;
-      break; case 108:
-        is_okay = std::is_same<T, uint8_t>::value;
-      break; case 116:
-        is_okay = std::is_same<T, uint16_t>::value;
-      break; case 132:
-        is_okay = std::is_same<T, uint32_t>::value;
-      break; case 164:
-        is_okay = std::is_same<T, uint64_t>::value;
-      break; case 0xF:
-        is_okay = std::is_same<T, float>::value;
-      break; case 0xD:
-        is_okay = std::is_same<T, double>::value;
-    }
-    
-    assert(is_okay);
-}
-
-/*  Non-templatized, inefficient function for indexing a  Mediocre2D  array.
- *  coordinates  should  be  a pair of major and minor indices. The function
- *  should only be used in the mask functions for fetching data for  use  in
- *  median filtering; the most important functions for loading from the data
- *  array are templatized on the data array's type and should not  use  this
- *  function.  We  choose  to  handle  the data type of the input at runtime
- *  instead of compile time there because we expect that not so many  pixels
- *  will  be masked out (we only need to access the data array when the mask
- *  array indicates bad pixels), and to avoid having to write mask functions
- *  with  two  template parameters (data and mask type), which would require
- *  instantiating a huge number of template functions.
- */
-inline float get_data(
-    Mediocre2D data,
-    std::pair<size_t, size_t> coordinate
+inline size_t type_code_sizeof(size_t type_code) {
+    switch (type_code) {
+      default: return 0;
+      case 8:   case 108: return 1;
+      case 16:  case 116: case 1016: case 1116: return 2;
+      case 0xF16: case 0xBF16: case 4862: case 49918: return 2;
+      case 32:  case 132: case 0xF: case 1032: case 1132: case 1015: return 4;
+      case 64:  case 164: case 0xD: case 1064: case 1164: case 1013: return 8;
+    }
+}
+
+/*  Staging area used by load_data for arrays stored with the major axis
+ *  contiguous  (Fortran order, as made by as_mediocre_2D_*_f2d). For those
+ *  arrays the numbers in one chunk are minor_stride bytes apart, so walking
+ *  them touches a different cache line (and often page) per number. Instead
+ *  we convert [height] whole rows (major indices first_major ... first_major
+ *  +  height  -  1) at a time into rows, in C order, by loading 8 contiguous
+ *  majors per minor index and transposing 8x8 tiles in registers.  height
+ *  is  chosen  so  that  a  group  uses  a whole cache line of each column,
+ *  but  scaled  down  (to no less than 8) so that the stages of all the
+ *  input's  arrays  fit  in  mediocre_stage_megabytes;  if  even  8  rows
+ *  don't fit, the array uses the strided loaders instead. Commands proceed
+ *  through  the  array  in  order,  so  every number is loaded and transposed
+ *  only once. The input only works out the height; each combine's loop
+ *  function allocates the rows in its own copy of the plans (see
+ *  combine_plans), so no staged rows outlive a combine or are shared.
+ */
+struct TransposeStage {
+    std::vector<float> rows; // Allocated by combine_plans.
+    size_t height = 0; // 0 if this array doesn't use the stage.
+    size_t first_major = SIZE_MAX;
+    
+    // Only worth it (and only possible) if the majors are contiguous.
+    static bool wanted(Mediocre2D data) {
+        return data.major_stride == type_code_sizeof(data.type_code)
+            && data.minor_stride != data.major_stride
+            && data.major_width >= 8;
+    }
+    
+    TransposeStage(Mediocre2D data, size_t combine_count) {
+        if (!wanted(data) || mediocre_stage_megabytes <= 0) return;
+        const size_t budget =
+            size_t(mediocre_stage_megabytes) * (1 << 20) / sizeof(float);
+        const size_t share = budget / std::max(combine_count, size_t(1));
+        const size_t max_height = (share / data.minor_width) & ~size_t(7);
+        if (max_height == 0) return;
+        
+        height = std::max(size_t(8), 64 / type_code_sizeof(data.type_code));
+        height = std::min(height, max_height);
+        height = std::min(height, data.major_width & ~size_t(7));
+    }
+};
+
+/*  Per-array transform scale * x + offset applied to every  vector  right
+ *  after  it's  converted  to  floats  (mediocre_scaled_1D_input  and
+ *  mediocre_scaled_2D_input), so subtracting a pedestal or  applying  a
+ *  gain costs no extra pass over the data. The loaders copy it into an
+ *  AffineVector, which skips the arithmetic for the identity transform.
+ */
+struct Affine {
+    float scale = 1.0f;
+    float offset = 0.0f;
+};
+
+class AffineVector {
+    const bool enabled;
+    const __m256 scale, offset;
+  public:
+    explicit AffineVector(Affine affine) :
+        enabled(affine.scale != 1.0f || affine.offset != 0.0f),
+        scale(_mm256_set1_ps(affine.scale)),
+        offset(_mm256_set1_ps(affine.offset))
+    { }
+    
+    __m256 operator() (__m256 v) const {
+        return enabled ? _mm256_add_ps(_mm256_mul_ps(v, scale), offset) : v;
+    }
+};
+
+struct LoadPlan;
+
+/*  Signature of the functions that load one array's share of  a  command
+ *  (see load_data below).
+ */
+typedef void (*LoadFunction)(MediocreInputCommand, LoadPlan*, size_t);
+
+/*  Everything about loading one Mediocre2D array that  doesn't  change  from
+ *  command  to command, worked out once when the input is created (see
+ *  make_load_plan) instead of on every command: the loader specialized for
+ *  the array's type and layout, the array's TransposeStage (height 0 if the
+ *  loader  doesn't  use  it),  the  lane  offsets  used  by the gather
+ *  loader, and the array's Affine transform.
+ */
+struct LoadPlan {
+    Mediocre2D data;
+    LoadFunction load = nullptr;
+    TransposeStage stage;
+    int32_t lane_offsets[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    Affine affine;
+    
+    LoadPlan(Mediocre2D data_arg, size_t combine_count) :
+        data(data_arg), stage(data_arg, combine_count) {}
+};
+
+/*  Copy an input's load plans for one combine's loop function to load with,
+ *  allocating  the  copies'  stages.  The  input's own plans are never
+ *  written, so an input may be used by several combines at once. Throws
+ *  std::bad_alloc.
+ */
+inline std::vector<LoadPlan> combine_plans(std::vector<LoadPlan> const& plans) {
+    std::vector<LoadPlan> result(plans);
+    for (LoadPlan& plan : result) {
+        plan.stage.rows.resize(plan.stage.height * plan.data.minor_width);
+    }
+    return result;
+}
+
+/*  Cursor that walks an array's numbers ahead of a loader and prefetches the
+ *  cache  lines  they're  in.  The hardware prefetcher follows one stream at
+ *  a time well, but not the jump from the end of one row to the next  one
+ *  major_stride bytes away, nor the switch to the next of combine_count
+ *  arrays, so without this every row starts with a cold miss. The loaders
+ *  keep it mediocre_prefetch_distance numbers ahead of themselves, which
+ *  runs past the end of the command into the next command's first rows.
+ */
+class Prefetcher {
+    Mediocre2D data;
+    size_t major;
+    size_t minor;
+    
+  public:
+    Prefetcher(Mediocre2D data_arg, size_t offset) :
+        data(data_arg),
+        major(offset / data_arg.minor_width),
+        minor(offset % data_arg.minor_width)
+    { }
+    
+    // Prefetch the next count numbers (stopping at the end of the array)
+    // and move past them. Numbers sharing cache lines get one prefetch.
+    void advance(size_t count) {
+        const intptr_t stride = intptr_t(data.minor_stride);
+        while (count != 0 && major < data.major_width) {
+            const size_t n = std::min(count, data.minor_width - minor);
+            char const* first = static_cast<char const*>(data.data)
+                              + major * data.major_stride
+                              + intptr_t(minor) * stride;
+            if (stride >= -64 && stride <= 64) {
+                const intptr_t span = stride * intptr_t(n - 1);
+                const uintptr_t low =
+                    uintptr_t(first + std::min(span, intptr_t(0)));
+                const uintptr_t high =
+                    uintptr_t(first + std::max(span, intptr_t(0)));
+                for (uintptr_t line = low & ~uintptr_t(63); line <= high;
+                    line += 64
+                ) {
+                    _mm_prefetch(reinterpret_cast<char const*>(line),
+                        _MM_HINT_T0);
+                }
+            } else {
+                for (size_t k = 0; k < n; ++k) {
+                    _mm_prefetch(first + intptr_t(k) * stride, _MM_HINT_T0);
+                }
+            }
+            count -= n;
+            minor += n;
+            if (minor == data.minor_width) {
+                minor = 0;
+                ++major;
+            }
+        }
+    }
+};
+
+// How far ahead the loaders prefetch, in numbers (0 for not at all).
+inline size_t prefetch_distance() {
+    return mediocre_prefetch_distance > 0
+        ? size_t(mediocre_prefetch_distance) : 0;
+}
+
+/*  Fill the stage with rows [first_major, first_major + height). */
+template <typename DataType>
+void fill_stage(TransposeStage* stage, Mediocre2D data, size_t first_major) {
+    const size_t minor_width = data.minor_width;
+    const size_t height = stage->height;
+    char const* base = reinterpret_cast<char const*>(data.data)
+        + first_major * data.major_stride;
+    
+    size_t minor = 0;
+    for (; minor + 8 <= minor_width; minor += 8) {
+        for (size_t block = 0; block < height; block += 8) {
+            __m256 tile[8];
+            for (size_t j = 0; j < 8; ++j) {
+                tile[j] = mediocre_convert::load8(
+                    reinterpret_cast<DataType const*>(
+                        base + (minor + j) * data.minor_stride) + block);
+            }
+            mediocre_convert::transpose8x8(tile);
+            float* rows = stage->rows.data() + block * minor_width + minor;
+            for (size_t k = 0; k < 8; ++k) {
+                _mm256_storeu_ps(rows + k * minor_width, tile[k]);
+            }
+        }
+    }
+    for (; minor < minor_width; ++minor) {
+        DataType const* column = reinterpret_cast<DataType const*>(
+            base + minor * data.minor_stride);
+        for (size_t k = 0; k < height; ++k) {
+            stage->rows[k * minor_width + minor] = float(column[k]);
+        }
+    }
+    stage->first_major = first_major;
+}
+
+/*  Return the staged row for the given major index,  restaging  if  it  isn't
+ *  there.  Near  the  end  of  the  array  the  group  is moved back so that
+ *  it stays inside the array (height <= major_width).
+ */
+template <typename DataType>
+inline float const*
+staged_row(TransposeStage* stage, Mediocre2D data, size_t major) {
+    const size_t height = stage->height;
+    if (major < stage->first_major || major - stage->first_major >= height) {
+        fill_stage<DataType>(
+            stage, data, std::min(major, data.major_width - height));
+    }
+    return stage->rows.data() + (major - stage->first_major) * data.minor_width;
+}
+
+/*  load_data (below) for arrays with a stage. Whole chunks inside one  row
+ *  are  copied  out  of  the  staged  row with vector loads; chunks crossing
+ *  rows (and the tail) are gathered one number at a time.
+ */
+template <typename DataType>
+void load_data_transposed(
+    MediocreInputCommand command,
+    LoadPlan* plan,
+    size_t which_array
 ) {
-    void const* ptr =
-        static_cast<char const*>(data.data)
-      + data.major_stride * coordinate.first
-      + data.minor_stride * coordinate.second;
+    const Mediocre2D data = plan->data;
+    TransposeStage* stage = &plan->stage;
+    const AffineVector transform(plan->affine);
     
-    assert(coordinate.first < data.major_width);
-    assert(coordinate.second < data.minor_width);
+    __m256* current_chunk = command.output_chunks;
+    const size_t width = command.dimension.width;
+    size_t major = command.offset / data.minor_width;
+    size_t minor = command.offset % data.minor_width;
     
-    switch (data.type_code) {
-        default: assert(0); abort();
+    size_t i = 0;
+    while (i < width) {
+        const size_t run = std::min(data.minor_width - minor, width - i) / 8;
+        
+        if (run != 0) {
+            float const* row = staged_row<DataType>(stage, data, major);
+            for (size_t v = 0; v < run; ++v) {
+                current_chunk[which_array] =
+                    transform(_mm256_loadu_ps(row + minor));
+                current_chunk += command.dimension.combine_count;
+                minor += 8;
+            }
+            i += 8*run;
+        } else {
+            float f[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+            const size_t count = std::min(width - i, size_t(8));
+            for (size_t k = 0; k < count; ++k) {
+                f[k] = staged_row<DataType>(stage, data, major)[minor];
+                if (++minor == data.minor_width) {
+                    minor = 0;
+                    ++major;
+                }
+            }
+            current_chunk[which_array] = transform(_mm256_loadu_ps(f));
+            current_chunk += command.dimension.combine_count;
+            i += 8;
+        }
+        
+        if (minor == data.minor_width) {
+            minor = 0;
+            ++major;
+        }
+    }
+}
+
+/*  Arrays of 32-bit numbers with unusual minor strides (every other column,
+ *  reversed  rows,  and  so  on)  can  be  loaded  with AVX2 gathers instead of
+ *  eight scalar loads per chunk. The rest of the library only needs AVX,  so
+ *  this  is  only  done  if  the  CPU  turns out to have AVX2, and only while
+ *  mediocre_gather_enabled is nonzero.
+ */
+inline bool cpu_has_avx2() {
+    static const bool has_avx2 = (__builtin_cpu_init(),
+        __builtin_cpu_supports("avx2") != 0);
+    return has_avx2;
+}
+
+template <typename DataType>
+struct is_gatherable : std::integral_constant<bool,
+    std::is_same<DataType, int32_t>::value
+ || std::is_same<DataType, uint32_t>::value
+ || std::is_same<DataType, float>::value
+ || std::is_same<DataType, BigEndian<int32_t>>::value
+ || std::is_same<DataType, BigEndian<uint32_t>>::value
+ || std::is_same<DataType, BigEndian<float>>::value
+> { };
+
+/*  Whole chunks within one row are gathered using 32-bit offsets 0, s, 2s
+ *  ...  7s from the first number (s is the minor stride, which may be
+ *  negative), so 7s has to fit in an int32. Contiguous rows are left to the
+ *  plain vector loads in load_data.
+ */
+template <typename DataType>
+bool wants_gather(Mediocre2D data) {
+    const intptr_t stride = intptr_t(data.minor_stride);
+    const intptr_t limit = INT32_MAX / 7;
+    return is_gatherable<DataType>::value
+        && mediocre_gather_enabled != 0
+        && stride != intptr_t(sizeof(DataType))
+        && stride <= limit && stride >= -limit
+        && cpu_has_avx2();
+}
+
+/*  load_data (below) for arrays that wants_gather. The 32-bit offsets of the
+ *  8 lanes are computed once, in the load plan; a chunk that crosses the end
+ *  of  a  row  (or  is  the partial chunk at the end) is fixed up by walking
+ *  the lane pointers one at a time and gathering with 64-bit offsets instead,
+ *  which can reach the next row wherever it is. Lanes past the end of  the
+ *  command are masked off and load 0.
+ */
+template <typename DataType>
+__attribute__((target("avx2")))
+void load_data_gathered(
+    MediocreInputCommand command,
+    LoadPlan* plan,
+    size_t which_array
+) {
+    const Mediocre2D data = plan->data;
+    const AffineVector transform(plan->affine);
+    __m256* current_chunk = command.output_chunks;
+    const size_t width = command.dimension.width;
+    const intptr_t minor_stride = intptr_t(data.minor_stride);
+    const __m256i lane_offsets = _mm256_loadu_si256(
+        reinterpret_cast<__m256i const*>(plan->lane_offsets));
+    
+    size_t major = command.offset / data.minor_width;
+    size_t minor = command.offset % data.minor_width;
+    char const* row_pointer = reinterpret_cast<char const*>(data.data)
+        + major*data.major_stride;
+    char const* current_pointer = row_pointer + minor*data.minor_stride;
+    
+    const size_t distance = prefetch_distance();
+    Prefetcher prefetcher(data, command.offset + distance);
     
-        case 8:   return *static_cast<int8_t const*>(ptr);
-        case 16:  return *static_cast<int16_t const*>(ptr);
-        case 32:  return *static_cast<int32_t const*>(ptr);
-        case 64:  return *static_cast<int64_t const*>(ptr);
-        case 108: return *static_cast<uint8_t const*>(ptr);
-        case 116: return *static_cast<uint16_t const*>(ptr);
-        case 132: return *static_cast<uint32_t const*>(ptr);
-        case 164: return *static_cast<uint64_t const*>(ptr);
-        case 0xF: return *static_cast<float const*>(ptr);
-        case 0xD: return *static_cast<double const*>(ptr);
+    for (size_t i = 0; i < width; i += 8) {
+        __m256i raw;
+        
+        if (distance != 0) prefetcher.advance(8);
+        if (minor + 8 <= data.minor_width && width - i >= 8) {
+            raw = _mm256_i32gather_epi32(
+                reinterpret_cast<int const*>(current_pointer), lane_offsets, 1
+            );
+            minor += 8;
+            current_pointer += 8*minor_stride;
+            if (minor == data.minor_width) {
+                minor = 0;
+                row_pointer += data.major_stride;
+                current_pointer = row_pointer;
+            }
+        } else {
+            char const* base = current_pointer;
+            int64_t offsets[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+            int32_t lane_mask[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+            const size_t count = std::min(width - i, size_t(8));
+            
+            for (size_t k = 0; k < count; ++k) {
+                offsets[k] = current_pointer - base;
+                lane_mask[k] = -1;
+                
+                bool at_row_end = minor+1 >= data.minor_width;
+                minor = at_row_end ? 0 : minor+1;
+                row_pointer += at_row_end ? data.major_stride : 0;
+                current_pointer =
+                    at_row_end ? row_pointer : current_pointer + minor_stride;
+            }
+            
+            const __m128i lo = _mm256_mask_i64gather_epi32(
+                _mm_setzero_si128(),
+                reinterpret_cast<int const*>(base),
+                _mm256_loadu_si256(reinterpret_cast<__m256i const*>(offsets)),
+                _mm_loadu_si128(reinterpret_cast<__m128i const*>(lane_mask)),
+                1
+            );
+            const __m128i hi = _mm256_mask_i64gather_epi32(
+                _mm_setzero_si128(),
+                reinterpret_cast<int const*>(base),
+                _mm256_loadu_si256(
+                    reinterpret_cast<__m256i const*>(offsets + 4)),
+                _mm_loadu_si128(
+                    reinterpret_cast<__m128i const*>(lane_mask + 4)),
+                1
+            );
+            raw = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        }
+        
+        current_chunk[which_array] = transform(
+            mediocre_convert::from_gathered(
+                static_cast<DataType const*>(nullptr), raw)
+        );
+        current_chunk += command.dimension.combine_count;
     }
 }
 
+// Only instantiate the gather loader for types that it can load.
+template <typename DataType>
+LoadFunction gather_loader(std::false_type) {
+    return nullptr;
+}
+
+template <typename DataType>
+LoadFunction gather_loader(std::true_type) {
+    return load_data_gathered<DataType>;
+}
+
 /*  Index a mask 2D array with the given pair of (major, minor) indices  and
  *  return true if the mask array indicates that coordinate has a bad pixel.
  *  People don't seem to agree  whether  a  truthy  (nonzero)  value  should
@@ -133,67 +495,274 @@ inline bool mask_is_bad_coordinate(
     return (*static_cast<MaskType const*>(ptr) != 0) == nonzero_means_bad;
 }
 
-/*  Perform a 5 x 5 median filter on a coordinate given a pair of  data  and
- *  mask  2D  arrays. The arrays should have the same dimensions. We collect
- *  all numbers from the data array that are not  masked  out  by  the  mask
- *  array within a 5 x 5 box centered on the specified coordinate and return
- *  the median of those numbers. If the coordinate  specified  is  within  2
- *  pixels  of  the  edge  of the arrays, the box will be smaller than 5 x 5
- *  (edge pixels are not repeated in this implementation).  Returns  NAN  if
- *  all nearby pixels were masked out.
+/*  MaskType for packed bit masks (mediocre_bit_code): one bit per entry,
+ *  packed  most  significant  bit first into the bytes of each row (as numpy's
+ *  packbits does), with rows major_stride bytes apart. minor_stride is not
+ *  used.
  */
-template <typename MaskType>
-inline float median_filter(
-    MediocreMasked2D masked_2D,
+struct MaskBit { };
+
+template <>
+inline bool mask_is_bad_coordinate<MaskBit>(
+    Mediocre2D mask,
     std::pair<size_t, size_t> coordinate,
     bool nonzero_means_bad
 ) {
-    check_type_code<MaskType>(masked_2D.mask_2D);
+    uint8_t const* row = static_cast<uint8_t const*>(mask.data)
+                       + mask.major_stride * coordinate.first;
     
-    const size_t major_width = masked_2D.mask_2D.major_width;
-    const size_t minor_width = masked_2D.mask_2D.minor_width;
+    assert(coordinate.first < mask.major_width);
+    assert(coordinate.second < mask.minor_width);
     
-    const size_t coord_major = coordinate.first;
-    const size_t coord_minor = coordinate.second;
+    const int bit = row[coordinate.second / 8] >> (7 - coordinate.second % 8);
+    return (bit & 1) == int(nonzero_means_bad);
+}
+
+/*  Bad pixels waiting to be median filtered together by median_filter_batch,
+ *  up to 8 of them, one per lane of the vectors their neighborhoods are
+ *  sorted in. good[k] has bit 5*row + column set for each entry of pixel
+ *  k's 5 x 5 neighborhood that is inside the arrays and not masked out.
+ */
+struct FilterBatch {
+    static const size_t capacity = 8;
+    size_t count = 0;
+    size_t major[capacity];
+    size_t minor[capacity];
+    uint32_t good[capacity];
+    float* output[capacity];
+};
+
+/*  Find which entries of the 5 x 5 box centered on the given coordinate  of
+ *  the  mask  are  good  (see  FilterBatch::good).  If  the coordinate is
+ *  within 2 pixels of the edge of the arrays, the box is cut short  (edge
+ *  pixels are not repeated in this implementation).
+ */
+template <typename MaskType>
+inline uint32_t neighborhood_good_bits(
+    Mediocre2D mask,
+    std::pair<size_t, size_t> coordinate,
+    bool nonzero_means_bad
+) {
+    uint32_t good = 0;
+    for (size_t row = 0; row < 5; ++row) {
+        // Wraps around (and fails the test) for rows above row 0.
+        const size_t major = coordinate.first + row - 2;
+        if (major >= mask.major_width) continue;
+        for (size_t column = 0; column < 5; ++column) {
+            const size_t minor = coordinate.second + column - 2;
+            if (minor >= mask.minor_width) continue;
+            bool bad = mask_is_bad_coordinate<MaskType>(
+                mask, { major, minor }, nonzero_means_bad
+            );
+            if (!bad) good |= uint32_t(1) << (5*row + column);
+        }
+    }
+    return good;
+}
+
+/*  Like neighborhood_good_bits, but for the bad pixels of a bad pixel list
+ *  on arrays of the given widths, found with one binary search per row.
+ */
+inline uint32_t bad_pixel_list_good_bits(
+    MediocreBadPixels bad_pixels,
+    size_t major_width,
+    size_t minor_width,
+    std::pair<size_t, size_t> coordinate
+) {
+    uintptr_t const* list_end = bad_pixels.offsets + bad_pixels.count;
+    const size_t minor_first =
+        coordinate.second < 2 ? 0 : coordinate.second - 2;
+    const size_t minor_end = std::min(coordinate.second + 3, minor_width);
     
-    // Calculate the bounds of the box of numbers used for the median filter.
-    // Normally this is just [x-2, x+2], but we need to check for coordinates
-    // near the edge, and shrink the box if needed. We need to worry about
-    // underflow but not overflow (size_t is never that large for real data).
-    const size_t major_start = coord_major < 2 ? 0 : coord_major - 2;
-    const size_t minor_start = coord_minor < 2 ? 0 : coord_minor - 2;
+    uint32_t good = 0;
+    for (size_t row = 0; row < 5; ++row) {
+        const size_t major = coordinate.first + row - 2;
+        if (major >= major_width) continue;
+        const size_t row_offset = major * minor_width;
+        
+        for (size_t minor = minor_first; minor < minor_end; ++minor) {
+            good |= uint32_t(1) << (5*row + minor + 2 - coordinate.second);
+        }
+        uintptr_t const* bad = std::lower_bound(
+            bad_pixels.offsets, list_end, row_offset + minor_first);
+        for (; bad != list_end && *bad < row_offset + minor_end; ++bad) {
+            const size_t minor = *bad - row_offset;
+            good &= ~(uint32_t(1) << (5*row + minor + 2 - coordinate.second));
+        }
+    }
+    return good;
+}
+
+/*  Gather the numbers of the data array in the good entries of the batch's
+ *  neighborhoods into the lanes of 25 vectors of 8 floats: lane k of vector
+ *  j gets entry j (5*row + column) of pixel k's neighborhood. Lanes of other
+ *  entries are left alone. Templated on the data type so that the numbers
+ *  are loaded without checking the type code for each one.
+ */
+template <typename DataType>
+void gather_neighborhoods(
+    Mediocre2D data,
+    FilterBatch const& batch,
+    float* lanes
+) {
+    for (size_t k = 0; k < batch.count; ++k) {
+        char const* center = static_cast<char const*>(data.data)
+                           + data.major_stride * batch.major[k]
+                           + data.minor_stride * batch.minor[k];
+        uint32_t good = batch.good[k];
+        while (good != 0) {
+            const size_t j = size_t(__builtin_ctz(good));
+            good &= good - 1;
+            const ptrdiff_t row = ptrdiff_t(j / 5) - 2;
+            const ptrdiff_t column = ptrdiff_t(j % 5) - 2;
+            char const* ptr = center
+                + row * ptrdiff_t(data.major_stride)
+                + column * ptrdiff_t(data.minor_stride);
+            lanes[8*j + k] = float(*reinterpret_cast<DataType const*>(ptr));
+        }
+    }
+}
+
+typedef void (*GatherFunction)(Mediocre2D, FilterBatch const&, float*);
+
+/*  Sort the 8 lanes of the count vectors with Batcher's merge exchange sort
+ *  network (Knuth's algorithm 5.2.2M), which works for any count.
+ */
+inline void sort_network_m256(__m256* vectors, size_t count) {
+    size_t top = 1;
+    while (top < count) top *= 2;
+    top /= 2;
     
-    const size_t major_last = coord_major + 2 >= major_width
-        ? major_width - 1 : coord_major + 2;
+    for (size_t p = top; p > 0; p /= 2) {
+        size_t q = top, r = 0, d = p;
+        while (true) {
+            for (size_t i = 0; i + d < count; ++i) {
+                if ((i & p) != r) continue;
+                const __m256 a = vectors[i];
+                const __m256 b = vectors[i + d];
+                vectors[i] = _mm256_min_ps(a, b);
+                vectors[i + d] = _mm256_max_ps(a, b);
+            }
+            if (q == p) break;
+            d = q - p;
+            q /= 2;
+            r = p;
+        }
+    }
+}
+
+/*  Perform a 5 x 5 median filter on each pixel of the batch and write  the
+ *  results  to  their  outputs:  the median of the good numbers around the
+ *  pixel (see neighborhood_good_bits), or NAN if  there  are  none.  The
+ *  neighborhoods  are  sorted  8 at a time, with the missing and bad entries
+ *  sorted as +infinity to the top of each lane, above the good ones. Leaves
+ *  the batch empty.
+ */
+inline void median_filter_batch(
+    Mediocre2D data,
+    GatherFunction gather,
+    FilterBatch* batch
+) {
+    const __m256 infinity = _mm256_set1_ps(1.0f / 0.0f);
+    __m256 neighborhoods[25];
+    for (size_t j = 0; j < 25; ++j) neighborhoods[j] = infinity;
     
-    const size_t minor_last = coord_minor + 2 >= minor_width
-        ? minor_width - 1 : coord_minor + 2;
+    gather(data, *batch, reinterpret_cast<float*>(neighborhoods));
+    sort_network_m256(neighborhoods, 25);
     
-    // Collect the numbers.
-    float numbers[25];
-    size_t number_count = 0;
+    float const* sorted = reinterpret_cast<float const*>(neighborhoods);
+    for (size_t k = 0; k < batch->count; ++k) {
+        const size_t count = size_t(__builtin_popcount(batch->good[k]));
+        *batch->output[k] = count == 0 ? 0.0f / 0.0f : 0.5f * (
+            sorted[8*((count-1)/2) + k] + sorted[8*(count/2) + k]
+        );
+    }
+    batch->count = 0;
+}
+
+/*  A bad pixel of the arrays: its coordinate, its index within the command
+ *  it was found for, and which of its neighbors are good (FilterBatch::good).
+ *  The same bad pixels can be fixed in every array that shares the mask.
+ */
+struct BadPixel {
+    size_t major;
+    size_t minor;
+    size_t index;
+    uint32_t good;
+};
+
+/*  Follow-up function to load_data to be called if masking is  needed.  The
+ *  function  overwrites  only  those positions in the command.output_chunks
+ *  array whose data comes from the bad pixels (as found by find_bad_pixels
+ *  or  from a bad pixel list), with the median filter of the pixels around
+ *  them, or with NaN if bad_as_nan. As with load_data, the  [which_array]
+ *  argument specifies the offset within a single chunk of [combine_count]
+ *  __m256 vectors that corresponds to data from this array. The bad pixels
+ *  are median filtered 8 at a time (median_filter_batch), using gather to
+ *  read the data array.
+ */
+inline void fix_bad_pixels(
+    MediocreInputCommand command,
+    size_t which_array,
+    Mediocre2D data,
+    GatherFunction gather,
+    std::vector<BadPixel> const& bad_pixels,
+    bool bad_as_nan
+) {
+    FilterBatch batch;
     
-    for (size_t major = major_start; major <= major_last; ++major) {
-        for (size_t minor = minor_start; minor <= minor_last; ++minor) {
-            std::pair<size_t, size_t> current(major, minor);
-            bool bad = mask_is_bad_coordinate<MaskType>(
-                masked_2D.mask_2D, current, nonzero_means_bad
-            );
-            if (!bad) {
-                numbers[number_count++] = get_data(masked_2D.data_2D, current);
-            }
+    for (BadPixel const& bad : bad_pixels) {
+        float* value_to_mask = mediocre_chunk_ptr(
+            command.output_chunks,
+            command.dimension.combine_count,
+            which_array,
+            bad.index
+        );
+        if (bad_as_nan) {
+            *value_to_mask = 0.0f / 0.0f;
+            continue;
+        }
+        
+        const size_t k = batch.count++;
+        batch.major[k] = bad.major;
+        batch.minor[k] = bad.minor;
+        batch.good[k] = bad.good;
+        batch.output[k] = value_to_mask;
+        if (batch.count == FilterBatch::capacity) {
+            median_filter_batch(data, gather, &batch);
         }
     }
+    if (batch.count != 0) {
+        median_filter_batch(data, gather, &batch);
+    }
+}
+
+/*  Like find_bad_pixels, for a bad pixel list (MediocreBadPixels) on arrays
+ *  of  the given widths: binary search the list for the command's range of
+ *  offsets, so that only its bad pixels are touched.
+ */
+inline void list_bad_pixels(
+    MediocreInputCommand command,
+    MediocreBadPixels list,
+    size_t major_width,
+    size_t minor_width,
+    bool bad_as_nan,
+    std::vector<BadPixel>* bad_pixels
+) {
+    const size_t command_end = command.offset + command.dimension.width;
+    uintptr_t const* list_end = list.offsets + list.count;
+    uintptr_t const* bad = std::lower_bound(
+        list.offsets, list_end, command.offset);
     
-    // Sort the portion of the numbers array that hold valid data and
-    // calculate the median from that sorted portion.
-    assert(number_count <= 25);
-    
-    if (number_count == 0) {
-        return 0.0f / 0.0f;
-    } else {
-        std::sort(numbers, numbers + number_count);
-        return 0.5f * (numbers[(number_count-1)/2] + numbers[number_count/2]);
+    for (; bad != list_end && *bad < command_end; ++bad) {
+        const std::pair<size_t, size_t> coordinate(
+            *bad / minor_width, *bad % minor_width);
+        const uint32_t good = bad_as_nan ? 0 : bad_pixel_list_good_bits(
+            list, major_width, minor_width, coordinate
+        );
+        bad_pixels->push_back(BadPixel {
+            coordinate.first, coordinate.second, *bad - command.offset, good
+        });
     }
 }
 
@@ -216,18 +785,26 @@ inline float median_filter(
  *  vector  starting  from command.output_chunks + which_array, because each
  *  chunk is N vectors wide and the vector indexed by [which_array] within a
  *  single  chunk  is  the  position  corresponding to data from input array
- *  number [which_array].
+ *  number [which_array]. The array is plan->data.
+ *  
+ *  contiguous_rows should be true if neighbouring minor indices are
+ *  neighbours in memory (C order arrays, including cropped views with padded
+ *  rows). Then any 8 numbers that don't cross the end of a row are loaded
+ *  with one vector load instead of by walking 8 pointers. Arrays with a
+ *  TransposeStage and strided arrays that can be gathered use the loaders
+ *  above instead; make_load_plan picks one.
  */
-template <typename DataType>
+template <typename DataType, bool contiguous_rows>
 void load_data(
     MediocreInputCommand command,
-    Mediocre2D data,
+    LoadPlan* plan,
     size_t which_array
 ) {
-    check_type_code<DataType>(data);
+    const Mediocre2D data = plan->data;
+    const AffineVector transform(plan->affine);
     __m256* current_chunk = command.output_chunks;
     
-    const DataType zero = DataType(0);
+    const DataType zero = DataType();
     
     DataType const* ptr0 = &zero;
     DataType const* ptr1 = &zero;
@@ -269,10 +846,44 @@ void load_data(
     
     char const* current_pointer = row_pointer + minor*data.minor_stride;
     
-    // Calculate eight data pointers at once. The requested width may
-    // not be a multiple of 8: in that case, in the last iteration of
-    // this loop the extra pointers will be cleared to &zero by the switch.
-    for (size_t i = 0; i < command.dimension.width; i += 8) {
+    const size_t distance = prefetch_distance();
+    Prefetcher prefetcher(data, command.offset + distance);
+    
+    size_t i = 0;
+    while (i < command.dimension.width) {
+        if (contiguous_rows) {
+            const size_t run = std::min(
+                data.minor_width - minor, command.dimension.width - i
+            ) / 8;
+            
+            if (run != 0) {
+                DataType const* p =
+                    reinterpret_cast<DataType const*>(current_pointer);
+                for (size_t v = 0; v < run; ++v) {
+                    if (distance != 0) prefetcher.advance(8);
+                    current_chunk[which_array] =
+                        transform(mediocre_convert::load8(p + 8*v));
+                    current_chunk += command.dimension.combine_count;
+                }
+                
+                i += 8*run;
+                minor += 8*run;
+                if (minor == data.minor_width) {
+                    minor = 0;
+                    row_pointer += data.major_stride;
+                    current_pointer = row_pointer;
+                } else {
+                    current_pointer += 8*run*sizeof(DataType);
+                }
+                continue;
+            }
+        }
+        
+        // Otherwise calculate eight data pointers at once. The requested
+        // width may not be a multiple of 8: in that case, in the last
+        // iteration of this loop the extra pointers will be cleared to &zero
+        // by the switch.
+        if (distance != 0) prefetcher.advance(8);
         LOAD_DATA_INCREMENT_VARIABLES_GET_PTR(ptr0);
         LOAD_DATA_INCREMENT_VARIABLES_GET_PTR(ptr1);
         LOAD_DATA_INCREMENT_VARIABLES_GET_PTR(ptr2);
@@ -295,33 +906,214 @@ void load_data(
             }
         }
         
-        current_chunk[which_array] =_mm256_set_ps(
+        current_chunk[which_array] = transform(_mm256_set_ps(
             *ptr7, *ptr6, *ptr5, *ptr4, *ptr3, *ptr2, *ptr1, *ptr0
-        );
+        ));
         
         current_chunk += command.dimension.combine_count;
+        i += 8;
     }
 }
 
-/*  Follow-up function to load_data to be called if masking is  needed.  The
- *  function  overwrites  only  those positions in the command.output_chunks
- *  array whose data comes  from  pixels  that  were  masked  out.  As  with
- *  load_data,  the  [which_array]  argument  specifies  the offset within a
- *  single chunk of [combine_count] __m256 vectors that corresponds to  data
- *  from this array.
+/*  One bit for each of the 32 / sizeof(T) numbers of type T in the 32 bytes
+ *  at ptr, set if the number is zero, found with vector compares and
+ *  movemask. (AVX has no 256-bit integer compares, so the integers are
+ *  compared 16 bytes at a time.)
+ */
+template <typename T> struct ZeroScan;
+
+template <> struct ZeroScan<int8_t> {
+    static uint32_t bits(char const* ptr) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i low = _mm_loadu_si128((__m128i const*)ptr);
+        const __m128i high = _mm_loadu_si128((__m128i const*)(ptr + 16));
+        return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(low, zero)))
+            | uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(high, zero))) << 16;
+    }
+};
+
+template <> struct ZeroScan<int16_t> {
+    static uint32_t bits(char const* ptr) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i low = _mm_loadu_si128((__m128i const*)ptr);
+        const __m128i high = _mm_loadu_si128((__m128i const*)(ptr + 16));
+        return uint32_t(_mm_movemask_epi8(_mm_packs_epi16(
+            _mm_cmpeq_epi16(low, zero), _mm_cmpeq_epi16(high, zero))));
+    }
+};
+
+template <> struct ZeroScan<int32_t> {
+    static uint32_t bits(char const* ptr) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i low = _mm_loadu_si128((__m128i const*)ptr);
+        const __m128i high = _mm_loadu_si128((__m128i const*)(ptr + 16));
+        return uint32_t(_mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpeq_epi32(low, zero))))
+            | uint32_t(_mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpeq_epi32(high, zero)))) << 4;
+    }
+};
+
+template <> struct ZeroScan<int64_t> {
+    static uint32_t bits(char const* ptr) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i low = _mm_loadu_si128((__m128i const*)ptr);
+        const __m128i high = _mm_loadu_si128((__m128i const*)(ptr + 16));
+        return uint32_t(_mm_movemask_pd(_mm_castsi128_pd(
+                _mm_cmpeq_epi64(low, zero))))
+            | uint32_t(_mm_movemask_pd(_mm_castsi128_pd(
+                _mm_cmpeq_epi64(high, zero)))) << 2;
+    }
+};
+
+// Floats compare equal to zero as numbers (-0.0 is zero, NaN is not).
+template <> struct ZeroScan<float> {
+    static uint32_t bits(char const* ptr) {
+        const __m256 v = _mm256_loadu_ps((float const*)ptr);
+        return uint32_t(_mm256_movemask_ps(
+            _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_EQ_OQ)));
+    }
+};
+
+template <> struct ZeroScan<double> {
+    static uint32_t bits(char const* ptr) {
+        const __m256d v = _mm256_loadu_pd((double const*)ptr);
+        return uint32_t(_mm256_movemask_pd(
+            _mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_EQ_OQ)));
+    }
+};
+
+/*  The ZeroScan type that tests masks of MaskType for zeros: a signed
+ *  integer of the same size for integers (of either byte order, since
+ *  they're zero when all their bytes are), or the floating point type
+ *  itself. void for the mask types tested one at a time instead (16-bit
+ *  and big-endian floats).
+ */
+template <typename MaskType> struct ZeroScanType { typedef void type; };
+template <> struct ZeroScanType<int8_t> { typedef int8_t type; };
+template <> struct ZeroScanType<int16_t> { typedef int16_t type; };
+template <> struct ZeroScanType<int32_t> { typedef int32_t type; };
+template <> struct ZeroScanType<int64_t> { typedef int64_t type; };
+template <> struct ZeroScanType<uint8_t> { typedef int8_t type; };
+template <> struct ZeroScanType<uint16_t> { typedef int16_t type; };
+template <> struct ZeroScanType<uint32_t> { typedef int32_t type; };
+template <> struct ZeroScanType<uint64_t> { typedef int64_t type; };
+template <> struct ZeroScanType<float> { typedef float type; };
+template <> struct ZeroScanType<double> { typedef double type; };
+
+template <typename T>
+struct ZeroScanType<BigEndian<T>> {
+    typedef typename std::conditional<
+        std::is_integral<T>::value, typename ZeroScanType<T>::type, void
+    >::type type;
+};
+
+// Append the bad pixel at (major, minor), index within the command, to
+// bad_pixels for find_bad_pixels.
+template <typename MaskType>
+inline void push_bad_pixel(
+    Mediocre2D mask,
+    size_t major,
+    size_t minor,
+    size_t index,
+    bool nonzero_means_bad,
+    bool bad_as_nan,
+    std::vector<BadPixel>* bad_pixels
+) {
+    const uint32_t good = bad_as_nan ? 0
+        : neighborhood_good_bits<MaskType>(
+            mask, { major, minor }, nonzero_means_bad
+        );
+    bad_pixels->push_back(BadPixel { major, minor, index, good });
+}
+
+// find_bad_pixels_vector for mask types with no ZeroScan: can't do it.
+template <typename MaskType>
+inline bool find_bad_pixels_vector(
+    MediocreInputCommand, Mediocre2D, bool, bool, std::vector<BadPixel>*,
+    std::true_type // No ZeroScan.
+) {
+    return false;
+}
+
+/*  find_bad_pixels for masks whose rows are contiguous (minor_stride is
+ *  the size of MaskType): test 32 bytes of the mask at a time with ZeroScan
+ *  and follow only the bits of the bad entries, so that the groups of
+ *  entries with no bad ones, which are most of them for real masks, cost
+ *  one compare and movemask. Returns true.
  */
 template <typename MaskType>
-void mask_data(
+bool find_bad_pixels_vector(
     MediocreInputCommand command,
-    MediocreMasked2D masked_data,
-    size_t which_array,
-    bool nonzero_means_bad
+    Mediocre2D mask,
+    bool nonzero_means_bad,
+    bool bad_as_nan,
+    std::vector<BadPixel>* bad_pixels,
+    std::false_type // Has ZeroScan.
 ) {
-    Mediocre2D mask = masked_data.mask_2D;
-    check_type_code<MaskType>(mask);
+    typedef ZeroScan<typename ZeroScanType<MaskType>::type> Scan;
+    const size_t group = 32 / sizeof(MaskType);
+    const uint32_t all_bits = group == 32 ? ~uint32_t(0)
+                                          : (uint32_t(1) << group) - 1;
+    // Bad entries are the zeros, or all but the zeros.
+    const uint32_t flip = nonzero_means_bad ? all_bits : 0;
     
-    assert(masked_data.data_2D.minor_width == mask.minor_width);
-    assert(masked_data.data_2D.major_width == mask.major_width);
+    const size_t columns = mask.minor_width;
+    const size_t end = command.offset + command.dimension.width;
+    
+    for (size_t begin = command.offset; begin < end; ) {
+        const size_t major = begin / columns;
+        const size_t row_start = major * columns;
+        const size_t row_end = std::min(end, row_start + columns);
+        char const* row = static_cast<char const*>(mask.data)
+                        + major * mask.major_stride;
+        size_t minor = begin - row_start;
+        
+        for (; row_start + minor + group <= row_end; minor += group) {
+            uint32_t bad = Scan::bits(row + minor * sizeof(MaskType)) ^ flip;
+            while (bad != 0) {
+                const size_t bit = size_t(__builtin_ctz(bad));
+                bad &= bad - 1;
+                push_bad_pixel<MaskType>(mask, major, minor + bit,
+                    row_start + minor + bit - command.offset,
+                    nonzero_means_bad, bad_as_nan, bad_pixels);
+            }
+        }
+        for (; row_start + minor < row_end; ++minor) {
+            const MaskType value =
+                reinterpret_cast<MaskType const*>(row)[minor];
+            if ((value != 0) == nonzero_means_bad) {
+                push_bad_pixel<MaskType>(mask, major, minor,
+                    row_start + minor - command.offset,
+                    nonzero_means_bad, bad_as_nan, bad_pixels);
+            }
+        }
+        begin = row_end;
+    }
+    return true;
+}
+
+/*  Scan the mask for the entries of the command's range that are bad,  and
+ *  append  them  (see BadPixel) to bad_pixels, in order. Their good
+ *  neighbors are only needed for the median filter, so they're left 0 if
+ *  bad_as_nan. Contiguous rows are scanned with find_bad_pixels_vector when
+ *  it can; other masks are tested one entry at a time.
+ */
+template <typename MaskType>
+void find_bad_pixels(
+    MediocreInputCommand command,
+    Mediocre2D mask,
+    bool nonzero_means_bad,
+    bool bad_as_nan,
+    std::vector<BadPixel>* bad_pixels
+) {
+    typedef typename ZeroScanType<MaskType>::type ScanType;
+    if (mask.minor_stride == sizeof(MaskType) && find_bad_pixels_vector<
+        MaskType>(command, mask, nonzero_means_bad, bad_as_nan, bad_pixels,
+            std::is_void<ScanType>())
+    ) {
+        return;
+    }
     
     size_t major = command.offset / mask.minor_width;
     size_t minor = command.offset % mask.minor_width;
@@ -334,16 +1126,8 @@ void mask_data(
     for (size_t i = 0; i < command.dimension.width; ++i) {
         MaskType value = *reinterpret_cast<MaskType const*>(current_pointer);
         if ((value != 0) == nonzero_means_bad) {
-            float* value_to_mask = mediocre_chunk_ptr(
-                command.output_chunks,
-                command.dimension.combine_count,
-                which_array,
-                i
-            );
-            
-            *value_to_mask = median_filter<MaskType>(
-                masked_data, { major, minor }, nonzero_means_bad
-            );
+            push_bad_pixel<MaskType>(mask, major, minor, i,
+                nonzero_means_bad, bad_as_nan, bad_pixels);
         }
         
         bool at_row_end = minor+1 >= mask.minor_width;
@@ -356,15 +1140,87 @@ void mask_data(
     }
 }
 
+/*  find_bad_pixels for packed bit masks. Instead of testing the mask one
+ *  entry at a time, test 64 entries at a time, one word of a row's bits,
+ *  and skip the words with no bad entries (all zero bits, or all one bits
+ *  if zero means bad), which is most of them for real masks.
+ */
+template <>
+void find_bad_pixels<MaskBit>(
+    MediocreInputCommand command,
+    Mediocre2D mask,
+    bool nonzero_means_bad,
+    bool bad_as_nan,
+    std::vector<BadPixel>* bad_pixels
+) {
+    const size_t columns = mask.minor_width;
+    const size_t row_bytes = (columns + 7) / 8;
+    const size_t end = command.offset + command.dimension.width;
+    
+    for (size_t begin = command.offset; begin < end; ) {
+        const size_t major = begin / columns;
+        const size_t row_start = major * columns;
+        const size_t row_end = std::min(end, row_start + columns);
+        uint8_t const* row = static_cast<uint8_t const*>(mask.data)
+                           + major * mask.major_stride;
+        
+        // Words start on whole bytes; clear the bits before begin and from
+        // row_end on (the padding at the end of the row, or the next
+        // command's entries).
+        for (size_t minor = (begin - row_start) / 8 * 8;
+            row_start + minor < row_end;
+            minor += 64
+        ) {
+            uint64_t word = 0;
+            memcpy(&word, row + minor / 8,
+                std::min<size_t>(8, row_bytes - minor / 8));
+            word = __builtin_bswap64(word);
+            if (!nonzero_means_bad) word = ~word;
+            
+            const size_t first = row_start + minor;
+            if (first < begin) word &= ~uint64_t(0) >> (begin - first);
+            if (row_end - first < 64) {
+                word &= ~(~uint64_t(0) >> (row_end - first));
+            }
+            
+            while (word != 0) {
+                const size_t bit = size_t(__builtin_clzll(word));
+                word &= ~(uint64_t(1) << 63 >> bit);
+                
+                const uint32_t good = bad_as_nan ? 0
+                    : neighborhood_good_bits<MaskBit>(
+                        mask, { major, minor + bit }, nonzero_means_bad
+                    );
+                bad_pixels->push_back(BadPixel {
+                    major, minor + bit, first + bit - command.offset, good
+                });
+            }
+        }
+        begin = row_end;
+    }
+}
+
+// True if the two Mediocre2D instances describe the very same array.
+inline bool same_2D(Mediocre2D const& a, Mediocre2D const& b) {
+    return a.data == b.data && a.type_code == b.type_code
+        && a.major_width == b.major_width && a.major_stride == b.major_stride
+        && a.minor_width == b.minor_width && a.minor_stride == b.minor_stride;
+}
+
 /*  Function used to help check that Mediocre2D instances all have the  same
  *  size  and  a  valid type code. Returns false if the array's size doesn't
  *  match with the expected size, or if the type  code  is  not  recognized.
- *  Returns true otherwise.
+ *  Returns true otherwise. Mask arrays (is_mask) may also be packed bit
+ *  masks.
  */
 inline bool array_is_okay(
-    Mediocre2D array, size_t major_expected, size_t minor_expected
+    Mediocre2D array,
+    size_t major_expected,
+    size_t minor_expected,
+    bool is_mask = false
 ) {
-    switch (array.type_code) {
+    const bool packed_bits = is_mask && array.type_code == 1;
+    switch (packed_bits ? 108 : array.type_code) {
       default:
         fprintf(stderr, "Unknown type code %zi.\n", array.type_code);
         return false;
@@ -372,6 +1228,10 @@ inline bool array_is_okay(
       case 8:   case 16:  case 32:  case 64:
       case 108: case 116: case 132: case 164:
       case 0xF: case 0xD:
+      case 1016: case 1032: case 1064:
+      case 1116: case 1132: case 1164:
+      case 1015: case 1013:
+      case 0xF16: case 0xBF16: case 4862: case 49918:
        
         if (array.major_width == major_expected
             && array.minor_width == minor_expected
@@ -388,11 +1248,170 @@ inline bool array_is_okay(
     }
 }
 
+/*  Pick the loader for an array of the given type (see LoadPlan). */
+template <typename DataType>
+void choose_loader(LoadPlan* plan) {
+    const Mediocre2D data = plan->data;
+    
+    if (plan->stage.height != 0) {
+        plan->load = load_data_transposed<DataType>;
+    } else if (wants_gather<DataType>(data)) {
+        plan->load = gather_loader<DataType>(is_gatherable<DataType>());
+        for (int j = 0; j < 8; ++j) {
+            plan->lane_offsets[j] = int32_t(j * intptr_t(data.minor_stride));
+        }
+    } else if (data.minor_stride == sizeof(DataType)) {
+        plan->load = load_data<DataType, true>;
+    } else {
+        plan->load = load_data<DataType, false>;
+    }
+}
+
+/*  Make the load plan for the given array, one of combine_count  arrays
+ *  loaded by the same input. This is the only place that the array's type
+ *  code is looked at, so it must already have been checked with
+ *  array_is_okay.
+ */
+inline LoadPlan make_load_plan(Mediocre2D data, size_t combine_count) {
+    LoadPlan plan(data, combine_count);
+    
+    switch (data.type_code) {
+      default:
+        assert(0); abort();
+      break; case 8:   choose_loader<int8_t>(&plan);
+      break; case 16:  choose_loader<int16_t>(&plan);
+      break; case 32:  choose_loader<int32_t>(&plan);
+      break; case 64:  choose_loader<int64_t>(&plan);
+      break; case 108: choose_loader<uint8_t>(&plan);
+      break; case 116: choose_loader<uint16_t>(&plan);
+      break; case 132: choose_loader<uint32_t>(&plan);
+      break; case 164: choose_loader<uint64_t>(&plan);
+      break; case 0xF: choose_loader<float>(&plan);
+      break; case 0xD: choose_loader<double>(&plan);
+      break; case 1016: choose_loader<BigEndian<int16_t>>(&plan);
+      break; case 1032: choose_loader<BigEndian<int32_t>>(&plan);
+      break; case 1064: choose_loader<BigEndian<int64_t>>(&plan);
+      break; case 1116: choose_loader<BigEndian<uint16_t>>(&plan);
+      break; case 1132: choose_loader<BigEndian<uint32_t>>(&plan);
+      break; case 1164: choose_loader<BigEndian<uint64_t>>(&plan);
+      break; case 1015: choose_loader<BigEndian<float>>(&plan);
+      break; case 1013: choose_loader<BigEndian<double>>(&plan);
+      break; case 0xF16:  choose_loader<Half>(&plan);
+      break; case 0xBF16: choose_loader<BFloat16>(&plan);
+      break; case 4862:   choose_loader<BigEndian<Half>>(&plan);
+      break; case 49918:  choose_loader<BigEndian<BFloat16>>(&plan);
+    }
+    return plan;
+}
+
+typedef void (*MaskFunction)(
+    MediocreInputCommand, Mediocre2D, bool, bool, std::vector<BadPixel>*);
+
+/*  Like make_load_plan, but for the find_bad_pixels specialization to  use
+ *  for mask arrays of the given (already checked) type code.
+ */
+inline MaskFunction choose_mask_function(size_t type_code) {
+    switch (type_code) {
+      default:  assert(0); abort();
+      case 1:   return find_bad_pixels<MaskBit>;
+      case 8:   return find_bad_pixels<int8_t>;
+      case 16:  return find_bad_pixels<int16_t>;
+      case 32:  return find_bad_pixels<int32_t>;
+      case 64:  return find_bad_pixels<int64_t>;
+      case 108: return find_bad_pixels<uint8_t>;
+      case 116: return find_bad_pixels<uint16_t>;
+      case 132: return find_bad_pixels<uint32_t>;
+      case 164: return find_bad_pixels<uint64_t>;
+      case 0xF: return find_bad_pixels<float>;
+      case 0xD: return find_bad_pixels<double>;
+      case 1016: return find_bad_pixels<BigEndian<int16_t>>;
+      case 1032: return find_bad_pixels<BigEndian<int32_t>>;
+      case 1064: return find_bad_pixels<BigEndian<int64_t>>;
+      case 1116: return find_bad_pixels<BigEndian<uint16_t>>;
+      case 1132: return find_bad_pixels<BigEndian<uint32_t>>;
+      case 1164: return find_bad_pixels<BigEndian<uint64_t>>;
+      case 1015: return find_bad_pixels<BigEndian<float>>;
+      case 1013: return find_bad_pixels<BigEndian<double>>;
+      case 0xF16:  return find_bad_pixels<Half>;
+      case 0xBF16: return find_bad_pixels<BFloat16>;
+      case 4862:   return find_bad_pixels<BigEndian<Half>>;
+      case 49918:  return find_bad_pixels<BigEndian<BFloat16>>;
+    }
+}
+
+/*  Like choose_mask_function, for the gather_neighborhoods  specialization
+ *  that median filters data arrays of the given (already checked) type code.
+ */
+inline GatherFunction choose_gather_function(size_t type_code) {
+    switch (type_code) {
+      default:  assert(0); abort();
+      case 8:   return gather_neighborhoods<int8_t>;
+      case 16:  return gather_neighborhoods<int16_t>;
+      case 32:  return gather_neighborhoods<int32_t>;
+      case 64:  return gather_neighborhoods<int64_t>;
+      case 108: return gather_neighborhoods<uint8_t>;
+      case 116: return gather_neighborhoods<uint16_t>;
+      case 132: return gather_neighborhoods<uint32_t>;
+      case 164: return gather_neighborhoods<uint64_t>;
+      case 0xF: return gather_neighborhoods<float>;
+      case 0xD: return gather_neighborhoods<double>;
+      case 1016: return gather_neighborhoods<BigEndian<int16_t>>;
+      case 1032: return gather_neighborhoods<BigEndian<int32_t>>;
+      case 1064: return gather_neighborhoods<BigEndian<int64_t>>;
+      case 1116: return gather_neighborhoods<BigEndian<uint16_t>>;
+      case 1132: return gather_neighborhoods<BigEndian<uint32_t>>;
+      case 1164: return gather_neighborhoods<BigEndian<uint64_t>>;
+      case 1015: return gather_neighborhoods<BigEndian<float>>;
+      case 1013: return gather_neighborhoods<BigEndian<double>>;
+      case 0xF16:  return gather_neighborhoods<Half>;
+      case 0xBF16: return gather_neighborhoods<BFloat16>;
+      case 4862:   return gather_neighborhoods<BigEndian<Half>>;
+      case 49918:  return gather_neighborhoods<BigEndian<BFloat16>>;
+    }
+}
+
+/*  Load array #which_array's share of a command from the command.dimension
+ *  .width  consecutive numbers starting at subarray (used by the 1D inputs,
+ *  and by the asynchronous file input for its staging buffers).
+ */
+template <typename DataType>
+void load_contiguous(
+    MediocreInputCommand command,
+    DataType const* subarray,
+    size_t which_array,
+    AffineVector const& transform
+) {
+    const size_t whole_vector_count = command.dimension.width / 8;
+    const size_t remainder = command.dimension.width % 8;
+    __m256* current_chunk = command.output_chunks;
+    
+    // Load most of the numbers 8 at a time, converting them with the
+    // vectorized loader for this type.
+    for (size_t v = 0; v < whole_vector_count; ++v) {
+        current_chunk[which_array] =
+            transform(mediocre_convert::load8(subarray + 8*v));
+        current_chunk += command.dimension.combine_count;
+    }
+    
+    // Deal with up to 7 leftover numbers to load.
+    if (remainder != 0) {
+        current_chunk[which_array] = transform(mediocre_convert::load_partial(
+            subarray + 8*whole_vector_count, remainder
+        ));
+    }
+}
+
 template <typename DataType>
 MediocreInput
-mediocre_1D_input_impl(DataType const* const* pointers, MediocreDimension dim) {
+mediocre_1D_input_impl(
+    DataType const* const* pointers,
+    MediocreDimension dim,
+    float const* scale = nullptr,
+    float const* offset = nullptr
+) {
     struct UserData {
         std::vector<DataType const*> ptr_vec;
+        std::vector<Affine> affines;
         
         static int loop_function(
             MediocreInputControl* control,
@@ -401,49 +1420,20 @@ mediocre_1D_input_impl(DataType const* const* pointers, MediocreDimension dim) {
         ) {
             (void)maximum_request;
             MediocreInputCommand command;
-            DataType const* const* pointers =
-                static_cast<UserData const*>(user_data_pv)->ptr_vec.data();
+            UserData const* user_data =
+                static_cast<UserData const*>(user_data_pv);
+            DataType const* const* pointers = user_data->ptr_vec.data();
             
             MEDIOCRE_INPUT_LOOP(command, control) {
-                const size_t whole_vector_count = command.dimension.width / 8;
-                const size_t remainder = command.dimension.width % 8;
-                
                 for (size_t i = 0; i < command.dimension.combine_count; ++i) {
                     // The subsection of the array that we are to load data
                     // from. Array #i + the offset we are given.
-                    DataType const* subarray = pointers[i] + command.offset;
-                    
-                    __m256* current_chunk = command.output_chunks;
-                    
-                    // Load most of the numbers 8 at a time.
-                    for (size_t v = 0; v < whole_vector_count; ++v) {
-                        DataType const* p = subarray + 8*v;
-                        current_chunk[i] = _mm256_set_ps(
-                            float(p[7]), float(p[6]), float(p[5]), float(p[4]),
-                            float(p[3]), float(p[2]), float(p[1]), float(p[0])
-                        );
-                        
-                        current_chunk += command.dimension.combine_count;
-                    }
-                    
-                    // Deal with up to 7 leftover numbers to load.
-                    float f6 = 0, f5 = 0, f4 = 0, f3 = 0, f2 = 0, f1 = 0;
-                    DataType const* p = subarray + 8*whole_vector_count;
-                    switch (remainder) {
-                        case 7: f6 = float(p[6]);
-                        case 6: f5 = float(p[5]);
-                        case 5: f4 = float(p[4]);
-                        case 4: f3 = float(p[3]);
-                        case 3: f2 = float(p[2]);
-                        case 2: f1 = float(p[1]);
-                        case 1:
-                            current_chunk[i] = _mm256_set_ps(
-                                0.0, f6, f5, f4, f3, f2, f1, float(p[0])
-                            );
-                            break;
-                        case 0:
-                            break;
-                    }
+                    load_contiguous(
+                        command,
+                        pointers[i] + command.offset,
+                        i,
+                        AffineVector(user_data->affines[i])
+                    );
                 }
             }
             return 0;
@@ -463,8 +1453,13 @@ mediocre_1D_input_impl(DataType const* const* pointers, MediocreDimension dim) {
     
     try {
         UserData* user_data = new UserData {
-            std::vector<DataType const*>(pointers, pointers + dim.combine_count)
+            std::vector<DataType const*>(pointers, pointers + dim.combine_count),
+            std::vector<Affine>(dim.combine_count)
         };
+        for (size_t i = 0; i < dim.combine_count; ++i) {
+            if (scale != nullptr) user_data->affines[i].scale = scale[i];
+            if (offset != nullptr) user_data->affines[i].offset = offset[i];
+        }
         result.user_data = user_data;
     } catch (std::bad_alloc&) {
         result.nonzero_error = ENOMEM;
@@ -474,374 +1469,2846 @@ mediocre_1D_input_impl(DataType const* const* pointers, MediocreDimension dim) {
     return result;
 }
 
-} // end anonymous namespace.
-
-extern "C" {
-
-/*  Export functions to the user that  return  MediocreInput  instances  for
- *  loading 1D arrays.
+/*  mediocre_1D_input_impl for mediocre_scaled_1D_input, whose arrays are
+ *  typed by type code instead of by pointer type.
  */
-MediocreInput
-mediocre_i8_input(int8_t const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_i8_input: %s\n", strerror(result.nonzero_error));
-    return result;
-}
-MediocreInput
-mediocre_i16_input(int16_t const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_i16_input: %s\n", strerror(result.nonzero_error));
-    return result;
-}
-MediocreInput
-mediocre_i32_input(int32_t const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_i32_input: %s\n", strerror(result.nonzero_error));
-    return result;
-}
-MediocreInput
-mediocre_i64_input(int64_t const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_i64_input: %s\n", strerror(result.nonzero_error));
-    return result;
-}
-MediocreInput
-mediocre_u8_input(uint8_t const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_u8_input: %s\n", strerror(result.nonzero_error));
-    return result;
-}
-MediocreInput
-mediocre_u16_input(uint16_t const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_u16_input: %s\n", strerror(result.nonzero_error));
-    return result;
-}
-MediocreInput
-mediocre_u32_input(uint32_t const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_u32_input: %s\n", strerror(result.nonzero_error));
-    return result;
+template <typename DataType>
+MediocreInput scaled_1D_input(
+    void const* const* pointers,
+    MediocreDimension dim,
+    float const* scale,
+    float const* offset
+) {
+    return mediocre_1D_input_impl(
+        reinterpret_cast<DataType const* const*>(pointers), dim, scale, offset
+    );
 }
-MediocreInput
-mediocre_u64_input(uint64_t const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_u64_input: %s\n", strerror(result.nonzero_error));
-    return result;
+
+// Destructor for inputs that failed before allocating anything.
+void no_op(void*) {
+
 }
-MediocreInput
-mediocre_float_input(float const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_float_input: %s\n", strerror(result.nonzero_error));
-    return result;
+
+typedef MediocreInput (*Scaled1DFactory)(
+    void const* const*, MediocreDimension, float const*, float const*);
+
+/*  Like choose_mask_function, for mediocre_scaled_1D_input. Returns null for
+ *  unknown type codes.
+ */
+inline Scaled1DFactory choose_scaled_1D_input(size_t type_code) {
+    switch (type_code) {
+      default:     return nullptr;
+      case 8:      return scaled_1D_input<int8_t>;
+      case 16:     return scaled_1D_input<int16_t>;
+      case 32:     return scaled_1D_input<int32_t>;
+      case 64:     return scaled_1D_input<int64_t>;
+      case 108:    return scaled_1D_input<uint8_t>;
+      case 116:    return scaled_1D_input<uint16_t>;
+      case 132:    return scaled_1D_input<uint32_t>;
+      case 164:    return scaled_1D_input<uint64_t>;
+      case 0xF:    return scaled_1D_input<float>;
+      case 0xD:    return scaled_1D_input<double>;
+      case 0xF16:  return scaled_1D_input<Half>;
+      case 0xBF16: return scaled_1D_input<BFloat16>;
+      case 1016:   return scaled_1D_input<BigEndian<int16_t>>;
+      case 1032:   return scaled_1D_input<BigEndian<int32_t>>;
+      case 1064:   return scaled_1D_input<BigEndian<int64_t>>;
+      case 1116:   return scaled_1D_input<BigEndian<uint16_t>>;
+      case 1132:   return scaled_1D_input<BigEndian<uint32_t>>;
+      case 1164:   return scaled_1D_input<BigEndian<uint64_t>>;
+      case 1015:   return scaled_1D_input<BigEndian<float>>;
+      case 1013:   return scaled_1D_input<BigEndian<double>>;
+      case 4862:   return scaled_1D_input<BigEndian<Half>>;
+      case 49918:  return scaled_1D_input<BigEndian<BFloat16>>;
+    }
 }
-MediocreInput
-mediocre_double_input(double const* const* pointers, MediocreDimension dim) {
-    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
-    if (result.nonzero_error != 0) fprintf(stderr,
-        "mediocre_double_input: %s\n", strerror(result.nonzero_error));
-    return result;
+
+/*  load_contiguous for an array whose type is only known at runtime, as in
+ *  mediocre_mixed_1D_input: array points to the array's first number.
+ */
+template <typename DataType>
+void load_contiguous_typed(
+    MediocreInputCommand command,
+    void const* array,
+    size_t which_array,
+    AffineVector const& transform
+) {
+    load_contiguous(
+        command,
+        static_cast<DataType const*>(array) + command.offset,
+        which_array,
+        transform
+    );
 }
 
-/*  Implement the user_data structure, input loop, and destructor needed for
- *  MediocreInput instances that load stacks of masked 2D data arrays.
+typedef void (*ContiguousFunction)(
+    MediocreInputCommand, void const*, size_t, AffineVector const&);
+
+/*  Like choose_scaled_1D_input, for the load_contiguous_typed specialization
+ *  that loads arrays of the given type code. Returns null for unknown type
+ *  codes.
  */
+inline ContiguousFunction choose_contiguous_function(size_t type_code) {
+    switch (type_code) {
+      default:     return nullptr;
+      case 8:      return load_contiguous_typed<int8_t>;
+      case 16:     return load_contiguous_typed<int16_t>;
+      case 32:     return load_contiguous_typed<int32_t>;
+      case 64:     return load_contiguous_typed<int64_t>;
+      case 108:    return load_contiguous_typed<uint8_t>;
+      case 116:    return load_contiguous_typed<uint16_t>;
+      case 132:    return load_contiguous_typed<uint32_t>;
+      case 164:    return load_contiguous_typed<uint64_t>;
+      case 0xF:    return load_contiguous_typed<float>;
+      case 0xD:    return load_contiguous_typed<double>;
+      case 0xF16:  return load_contiguous_typed<Half>;
+      case 0xBF16: return load_contiguous_typed<BFloat16>;
+      case 1016:   return load_contiguous_typed<BigEndian<int16_t>>;
+      case 1032:   return load_contiguous_typed<BigEndian<int32_t>>;
+      case 1064:   return load_contiguous_typed<BigEndian<int64_t>>;
+      case 1116:   return load_contiguous_typed<BigEndian<uint16_t>>;
+      case 1132:   return load_contiguous_typed<BigEndian<uint32_t>>;
+      case 1164:   return load_contiguous_typed<BigEndian<uint64_t>>;
+      case 1015:   return load_contiguous_typed<BigEndian<float>>;
+      case 1013:   return load_contiguous_typed<BigEndian<double>>;
+      case 4862:   return load_contiguous_typed<BigEndian<Half>>;
+      case 49918:  return load_contiguous_typed<BigEndian<BFloat16>>;
+    }
+}
 
-struct MaskedUserData {
-    std::vector<MediocreMasked2D> arrays;
-    bool nonzero_means_bad;
+/*  The 1D input for stacks of arrays that needn't all have the same type:
+ *  each array keeps its own vectorized loader (chosen once, by type code,
+ *  when the input is created), so a stack of uint16 frames with one float64
+ *  frame in it loads as fast as the uint16 frames alone would.
+ */
+struct Mixed1DUserData {
+    std::vector<void const*> pointers;
+    std::vector<ContiguousFunction> loaders;
+    std::vector<Affine> affines;
+    
+    static int loop_function(
+        MediocreInputControl* control,
+        void const* user_data_pv,
+        MediocreDimension maximum_request
+    ) {
+        (void)maximum_request;
+        MediocreInputCommand command;
+        Mixed1DUserData const* user_data =
+            static_cast<Mixed1DUserData const*>(user_data_pv);
+        
+        MEDIOCRE_INPUT_LOOP(command, control) {
+            for (size_t i = 0; i < command.dimension.combine_count; ++i) {
+                user_data->loaders[i](
+                    command,
+                    user_data->pointers[i],
+                    i,
+                    AffineVector(user_data->affines[i])
+                );
+            }
+        }
+        return 0;
+    }
+    
+    static void destructor(void* user_data_pv) {
+        delete static_cast<Mixed1DUserData*>(user_data_pv);
+    }
 };
 
-static int masked_loop_function(
+/*  Loop function for mediocre_chunk_input: user_data is the chunks, and
+ *  each command's chunks are lent to the functor instead of being copied.
+ */
+int chunk_loop_function(
     MediocreInputControl* control,
-    void const* user_data_pv,
+    void const* user_data,
     MediocreDimension maximum_request
 ) {
     (void)maximum_request;
     MediocreInputCommand command;
-    
-    MaskedUserData const* user_data =
-        static_cast<MaskedUserData const*>(user_data_pv);
-    
-    MediocreMasked2D const* masked_2D_arrays = user_data->arrays.data();
-    const bool nonzero_means_bad = user_data->nonzero_means_bad;
+    __m256 const* chunks = static_cast<__m256 const*>(user_data);
     
     MEDIOCRE_INPUT_LOOP(command, control) {
-        for (size_t i = 0; i < command.dimension.combine_count; ++i) {
-            MediocreMasked2D masked_2D = masked_2D_arrays[i];
-            Mediocre2D data = masked_2D.data_2D;
-            
-            switch (data.type_code) {
-              default:
-                fprintf(stderr, "MediocreMasked2D input loop:\n"
-                    "Unknown data type_code %zi (array number [%zi]).\n",
-                    data.type_code, i
-                );
-                return EINVAL;
-              break; case 8:
-                load_data<int8_t>(command, data, i);
-              break; case 16:
-                load_data<int16_t>(command, data, i);
-              break; case 32:
-                load_data<int32_t>(command, data, i);
-              break; case 64:
-                load_data<int64_t>(command, data, i);
-              break; case 108:
-                load_data<uint8_t>(command, data, i);
-              break; case 116:
-                load_data<uint16_t>(command, data, i);
-              break; case 132:
-                load_data<uint32_t>(command, data, i);
-              break; case 164:
-                load_data<uint64_t>(command, data, i);
-              break; case 0xF:
-                load_data<float>(command, data, i);
-              break; case 0xD:
-                load_data<double>(command, data, i);
-            }
-            
-            switch (masked_2D.mask_2D.type_code) {
-              default:
-                fprintf(stderr, "MediocreMasked2D input loop:\n"
-                    "Unknown mask type_code %zi (array number [%zi]).\n",
-                    masked_2D.mask_2D.type_code, i
-                );
-                return EINVAL;
-              break; case 8:
-                mask_data<int8_t>(command, masked_2D, i, nonzero_means_bad);
-              break; case 16:
-                mask_data<int16_t>(command, masked_2D, i, nonzero_means_bad);
-              break; case 32:
-                mask_data<int32_t>(command, masked_2D, i, nonzero_means_bad);
-              break; case 64:
-                mask_data<int64_t>(command, masked_2D, i, nonzero_means_bad);
-              break; case 108:
-                mask_data<uint8_t>(command, masked_2D, i, nonzero_means_bad);
-              break; case 116:
-                mask_data<uint16_t>(command, masked_2D, i, nonzero_means_bad);
-              break; case 132:
-                mask_data<uint32_t>(command, masked_2D, i, nonzero_means_bad);
-              break; case 164:
-                mask_data<uint64_t>(command, masked_2D, i, nonzero_means_bad);
-              break; case 0xF:
-                mask_data<float>(command, masked_2D, i, nonzero_means_bad);
-              break; case 0xD:
-                mask_data<double>(command, masked_2D, i, nonzero_means_bad);
-            }
-        }
+        const size_t first_chunk = command.offset / 8;
+        const int error = mediocre_input_control_lend(
+            control, chunks + first_chunk * command.dimension.combine_count);
+        if (error != 0) return error;
     }
-    
     return 0;
 }
 
-static void masked_user_data_destructor(void* user_data_pv) {
-    delete static_cast<MaskedUserData*>(user_data_pv);
+/*  Loader for numbers of one type in a ReadPipeline staging buffer. */
+typedef void (*StagedLoadFunction)(MediocreInputCommand, void const*, size_t);
+
+template <typename DataType>
+void load_staged(
+    MediocreInputCommand command, void const* staged, size_t which_array
+) {
+    load_contiguous(command, static_cast<DataType const*>(staged),
+        which_array, AffineVector(Affine()));
 }
 
-/*  User-visible function that returns a MediocreInput instance intended for
- *  loading  masked  2D  arrays.  The 2D arrays are not copied into internal
- *  storage  and  must  remain  valid  for  the  lifetime  of  the  returned
- *  MediocreInput  instance.  However, the array of MediocreMasked2D objects
- *  itself will be copied into the MediocreInput's internal storage, so that
- *  array  can  be safely deleted after the function returns, as long as the
- *  data pointed to by those MediocreMasked2D objects remains valid.
+inline StagedLoadFunction choose_staged_loader(size_t type_code) {
+    switch (type_code) {
+      default:     return nullptr;
+      case 8:      return load_staged<int8_t>;
+      case 16:     return load_staged<int16_t>;
+      case 32:     return load_staged<int32_t>;
+      case 64:     return load_staged<int64_t>;
+      case 108:    return load_staged<uint8_t>;
+      case 116:    return load_staged<uint16_t>;
+      case 132:    return load_staged<uint32_t>;
+      case 164:    return load_staged<uint64_t>;
+      case 0xF:    return load_staged<float>;
+      case 0xD:    return load_staged<double>;
+      case 0xF16:  return load_staged<Half>;
+      case 0xBF16: return load_staged<BFloat16>;
+      case 1016:   return load_staged<BigEndian<int16_t>>;
+      case 1032:   return load_staged<BigEndian<int32_t>>;
+      case 1064:   return load_staged<BigEndian<int64_t>>;
+      case 1116:   return load_staged<BigEndian<uint16_t>>;
+      case 1132:   return load_staged<BigEndian<uint32_t>>;
+      case 1164:   return load_staged<BigEndian<uint64_t>>;
+      case 1015:   return load_staged<BigEndian<float>>;
+      case 1013:   return load_staged<BigEndian<double>>;
+      case 4862:   return load_staged<BigEndian<Half>>;
+      case 49918:  return load_staged<BigEndian<BFloat16>>;
+    }
+}
+
+/*  A file mapped read-only into memory. Used by the file inputs, which load
+ *  chunks straight out of the mapping.
  */
-MediocreInput mediocre_masked_2D_input(
-    MediocreMasked2D const* masked_arrays,
-    size_t count,
-    int nonzero_means_bad
-) {
-    MediocreInput result;
-    
-    result.loop_function = masked_loop_function;
-    result.destructor = masked_user_data_destructor;
-    result.user_data = nullptr; // Set later.
-    result.dimension.combine_count = count;
-    result.dimension.width = 0; // Set later.
-    result.nonzero_error = 0;
+struct MappedFile {
+    void* map = MAP_FAILED;
+    size_t length = 0;
     
-    MaskedUserData* masked_user_data = nullptr;
+    MappedFile() = default;
+    MappedFile(MappedFile const&) = delete;
+    MappedFile(MappedFile&& other) noexcept
+    : map(other.map), length(other.length) {
+        other.map = MAP_FAILED;
+        other.length = 0;
+    }
     
-    if (count == 0) {
-        fprintf(stderr, "mediocre_masked_2D_input:\n"
-            "count should not be zero (needs at least one input array).\n"
-        );
-        result.nonzero_error = EINVAL;
-        return result;
+    ~MappedFile() {
+        if (map != MAP_FAILED) munmap(map, length);
     }
     
-    size_t major_expected = masked_arrays[0].data_2D.major_width;
-    size_t minor_expected = masked_arrays[0].data_2D.minor_width;
-    result.dimension.width = major_expected * minor_expected;
+    char const* bytes() const {
+        return static_cast<char const*>(map);
+    }
     
-    for (size_t i = 0; i < count; ++i) {
-        MediocreMasked2D const& m = masked_arrays[i];
-        if (!array_is_okay(m.data_2D, major_expected, minor_expected)) {
-            result.nonzero_error = EINVAL;
-            return result;
+    // Map the whole file at path. Returns 0 or an errno value. An empty file
+    // is left unmapped (mmap refuses to map 0 bytes) with length 0.
+    int open(char const* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return errno;
+        
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            int error = errno;
+            close(fd);
+            return error;
         }
-        if (!array_is_okay(m.mask_2D, major_expected, minor_expected)) {
-            result.nonzero_error = EINVAL;
-            return result;
+        
+        length = size_t(file_stat.st_size);
+        if (length != 0) {
+            map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
         }
+        int error = length != 0 && map == MAP_FAILED ? errno : 0;
+        close(fd);
+        return error;
     }
     
-    try {
-        masked_user_data = new MaskedUserData;
-        masked_user_data->nonzero_means_bad = nonzero_means_bad != 0;
-        masked_user_data->arrays.reserve(count);
+    // madvise the pages holding bytes [begin, end) of the file. For anything
+    // but MADV_WILLNEED only whole pages are advised, so that we never throw
+    // away part of a page that we haven't finished with. Advice is only a
+    // hint, so errors are ignored.
+    void advise(size_t begin, size_t end, int advice) const {
+        static const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+        end = std::min(end, length);
         
-        for (size_t i = 0; i < count; ++i) {
-            masked_user_data->arrays.push_back(masked_arrays[i]);
+        if (advice == MADV_WILLNEED) {
+            begin -= begin % page_size;
+        } else {
+            begin += (page_size - begin % page_size) % page_size;
+            if (end != length) end -= end % page_size;
         }
         
-        // Don't write out the user_data pointer to the MediocreInput result
-        // (visible to the user) until we are sure that the user_data
-        // object was successfully, fully constructed.
-        result.user_data = masked_user_data;
+        if (begin < end) {
+            madvise(static_cast<char*>(map) + begin, end - begin, advice);
+        }
+    }
+};
+
+/*  Readahead for the file inputs. Before a command is loaded, ask the kernel
+ *  to  start  reading  the  next  readahead_commands  commands'  worth of each
+ *  file, and to drop the pages before the command, which we're done  with.
+ *  Commands  arrive  in  order;  going  backwards means a new combine started
+ *  and we start over. Offsets count numbers, not bytes, so that files with
+ *  different number sizes can share one Readahead.
+ */
+struct Readahead {
+    static const size_t readahead_commands = 4;
+    
+    // Numbers [0, dropped_offset) have been dropped and numbers up to
+    // advised_offset have been asked for.
+    size_t dropped_offset = 0;
+    size_t advised_offset = 0;
+    
+    // What to advise for the current command (set by start_command).
+    size_t advise_begin = 0;
+    size_t advise_end = 0;
+    size_t drop_end = 0;
+    
+    void start_command(MediocreInputCommand const& command) {
+        const size_t begin = command.offset;
+        const size_t end = begin + command.dimension.width;
+        
+        if (begin < dropped_offset) {
+            dropped_offset = 0;
+            advised_offset = 0;
+        }
+        advise_begin = std::max(end, advised_offset);
+        advise_end = end + readahead_commands * (end - begin);
+        drop_end = begin;
+    }
+    
+    // Advise one file whose numbers are item_size bytes each, starting
+    // header bytes into the file.
+    void advise(MappedFile const& file, size_t header, size_t item_size) const {
+        if (advise_begin < advise_end) {
+            file.advise(
+                header + advise_begin * item_size,
+                header + advise_end * item_size,
+                MADV_WILLNEED
+            );
+        }
+        if (dropped_offset < drop_end) {
+            file.advise(
+                header + dropped_offset * item_size,
+                header + drop_end * item_size,
+                MADV_DONTNEED
+            );
+        }
+    }
+    
+    void finish_command() {
+        advised_offset = std::max(advised_offset, advise_end);
+        dropped_offset = drop_end;
+    }
+};
+
+/*  Memory that a staging source fills with one array's share of a command;
+ *  the numbers start skip bytes in.
+ */
+struct StagingBuffer {
+    char* memory = nullptr;
+    size_t skip = 0;
+};
+
+/*  Staging for the inputs that prepare their data ahead of the combine on a
+ *  pool of worker threads (the asynchronous file input, which reads it, and
+ *  the Rice-compressed FITS input, which decodes it). The workers fill
+ *  staging buffers with what the next staging_commands commands will need
+ *  from each array, and the input loop only converts commands whose
+ *  buffers have all been filled. Commands arrive in order, each
+ *  maximum_request.width numbers wide except the last, so we know which
+ *  ranges come next; any other command (a new combine, or one resumed from a
+ *  checkpoint) drains the pipeline and starts it over at that command.
+ *  
+ *  The Source does the actual work. It must provide
+ *  
+ *      size_t count() const;  // Number of arrays.
+ *      size_t width() const;  // Numbers in each array.
+ *      size_t buffer_size(size_t width) const; // Bytes to fill width numbers.
+ *      int fill(size_t array, size_t offset, size_t width,
+ *          StagingBuffer* buffer) const;
+ *  
+ *  where fill stages numbers [offset, offset + width) of the array and
+ *  returns 0 or an errno value. fill is called from several workers at
+ *  once, for different commands and arrays.
+ */
+template <typename Source>
+class StagingPipeline {
+  public:
+    static const size_t staging_commands = 4;
+    static const size_t buffer_alignment = 4096;
+    
+    // Declared first so that it outlives the workers using it.
+    Source source;
+    
+  private:
+    // The command starting at [offset]; the slot is ready when fills_left
+    // is 0. error holds the first error, if any.
+    struct Slot {
+        size_t offset = SIZE_MAX;
+        size_t width = 0;
+        size_t fills_left = 0;
+        int error = 0;
+        std::vector<StagingBuffer> buffers;
+    };
+    
+    struct Job {
+        size_t slot;
+        size_t array;
+    };
+    
+    // Everything below is shared with the workers and guarded by mutex,
+    // except that a slot's buffers belong to the workers from when it is
+    // scheduled until its fills_left reaches 0.
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready;
+    pthread_cond_t fill_done;
+    std::vector<pthread_t> threads;
+    bool stopping = false;
+    std::deque<Job> jobs;
+    std::vector<Slot> slots;
+    size_t buffer_capacity = 0;
+    size_t command_width = 0;
+    size_t next_offset = 0; // First number not yet scheduled.
+    
+    static void* worker(void* pipeline_pv) {
+        static_cast<StagingPipeline*>(pipeline_pv)->run_worker();
+        return nullptr;
+    }
+    
+    void run_worker() {
+        pthread_mutex_lock(&mutex);
+        while (true) {
+            while (!stopping && jobs.empty()) {
+                pthread_cond_wait(&job_ready, &mutex);
+            }
+            if (stopping) break;
+            
+            const Job job = jobs.front();
+            jobs.pop_front();
+            Slot* slot = &slots[job.slot];
+            pthread_mutex_unlock(&mutex);
+            
+            int error = source.fill(job.array, slot->offset, slot->width,
+                &slot->buffers[job.array]);
+            
+            pthread_mutex_lock(&mutex);
+            if (slot->error == 0) slot->error = error;
+            if (--slot->fills_left == 0) pthread_cond_broadcast(&fill_done);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    // Queue the fills of the next command into the slot (mutex held).
+    void schedule(Slot* slot) {
+        slot->offset = next_offset;
+        slot->width = std::min(command_width, source.width() - next_offset);
+        slot->fills_left = source.count();
+        slot->error = 0;
+        next_offset += slot->width;
+        
+        for (size_t a = 0; a < source.count(); ++a) {
+            jobs.push_back(Job { size_t(slot - slots.data()), a });
+        }
+        pthread_cond_broadcast(&job_ready);
+    }
+    
+    // Cancel queued fills and wait for the rest to finish (mutex held).
+    void drain() {
+        for (Job const& job : jobs) --slots[job.slot].fills_left;
+        jobs.clear();
+        for (Slot& slot : slots) {
+            while (slot.fills_left != 0) {
+                pthread_cond_wait(&fill_done, &mutex);
+            }
+            slot.offset = SIZE_MAX;
+        }
+    }
+    
+  public:
+    StagingPipeline() {
+        pthread_mutex_init(&mutex, nullptr);
+        pthread_cond_init(&job_ready, nullptr);
+        pthread_cond_init(&fill_done, nullptr);
+    }
+    StagingPipeline(StagingPipeline const&) = delete;
+    
+    ~StagingPipeline() {
+        pthread_mutex_lock(&mutex);
+        drain();
+        stopping = true;
+        pthread_cond_broadcast(&job_ready);
+        pthread_mutex_unlock(&mutex);
+        
+        for (pthread_t thread : threads) pthread_join(thread, nullptr);
+        for (Slot& slot : slots) {
+            for (StagingBuffer& buffer : slot.buffers) free(buffer.memory);
+        }
+        
+        pthread_cond_destroy(&fill_done);
+        pthread_cond_destroy(&job_ready);
+        pthread_mutex_destroy(&mutex);
+    }
+    
+    // Start thread_count workers. Returns 0 or an errno value.
+    int start_threads(size_t thread_count) {
+        for (size_t t = 0; t < thread_count; ++t) {
+            pthread_t thread;
+            int error = pthread_create(&thread, nullptr, worker, this);
+            if (error != 0) return error;
+            threads.push_back(thread);
+        }
+        return 0;
+    }
+    
+    // Get ready for a combine whose commands are up to width numbers wide.
+    // Returns 0 or ENOMEM.
+    int start(size_t width) {
+        pthread_mutex_lock(&mutex);
+        drain();
+        command_width = width;
+        
+        const size_t capacity = source.buffer_size(width);
+        int error = 0;
+        if (capacity > buffer_capacity) {
+            slots.resize(staging_commands);
+            for (Slot& slot : slots) {
+                slot.buffers.resize(source.count());
+                for (StagingBuffer& buffer : slot.buffers) {
+                    free(buffer.memory);
+                    buffer.memory = nullptr;
+                    void* memory = nullptr;
+                    error = error != 0 ? error : posix_memalign(
+                        &memory, buffer_alignment, capacity);
+                    buffer.memory = static_cast<char*>(memory);
+                }
+            }
+            buffer_capacity = error == 0 ? capacity : 0;
+        }
+        pthread_mutex_unlock(&mutex);
+        return error;
+    }
+    
+    // Wait for the fills of the given command and return the slot holding
+    // them in *slot_index. Returns 0 or the errno value of a failed fill.
+    int wait(MediocreInputCommand const& command, size_t* slot_index) {
+        pthread_mutex_lock(&mutex);
+        
+        auto matches = [&command] (Slot const& slot) {
+            return slot.offset == command.offset
+                && slot.width == command.dimension.width;
+        };
+        auto slot = std::find_if(slots.begin(), slots.end(), matches);
+        if (slot == slots.end()) {
+            drain();
+            next_offset = command.offset;
+            for (Slot& s : slots) {
+                if (next_offset < source.width()) schedule(&s);
+            }
+            slot = std::find_if(slots.begin(), slots.end(), matches);
+        }
+        
+        int error = EINVAL; // Command doesn't fit our commands' pattern.
+        if (slot != slots.end()) {
+            while (slot->fills_left != 0) {
+                pthread_cond_wait(&fill_done, &mutex);
+            }
+            error = slot->error;
+            *slot_index = size_t(slot - slots.begin());
+        }
+        pthread_mutex_unlock(&mutex);
+        return error;
+    }
+    
+    // The numbers staged from the given array for the command in the slot.
+    void const* data(size_t slot_index, size_t array) const {
+        StagingBuffer const& buffer = slots[slot_index].buffers[array];
+        return buffer.memory + buffer.skip;
+    }
+    
+    // Done with the slot's command; reuse the slot for the next one.
+    void recycle(size_t slot_index) {
+        pthread_mutex_lock(&mutex);
+        if (next_offset < source.width()) {
+            schedule(&slots[slot_index]);
+        } else {
+            slots[slot_index].offset = SIZE_MAX;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+/*  StagingPipeline source for the asynchronous file input
+ *  (mediocre_async_file_input). Instead of mapping the files and stalling
+ *  on page faults whenever the kernel's readahead falls behind, the workers
+ *  pread the exact byte ranges that the coming commands need.
+ *  
+ *  With O_DIRECT the reads bypass the page cache, and have to start and
+ *  end on direct_alignment byte boundaries in aligned buffers, so we read a
+ *  little extra on each side and remember where the range starts. Without
+ *  it, the pages read are dropped from the cache afterwards, since we won't
+ *  read them again.
+ */
+class FileReader {
+  public:
+    static const size_t direct_alignment = 4096;
+    
+  private:
+    struct File {
+        int fd;
+        size_t header;
+        bool direct;
+    };
+    
+    std::vector<File> files;
+    size_t item_size = 0;
+    size_t total_width = 0;
+    
+  public:
+    FileReader() = default;
+    FileReader(FileReader const&) = delete;
+    
+    ~FileReader() {
+        for (File const& file : files) close(file.fd);
+    }
+    
+    void set_shape(size_t item_size_arg, size_t total_width_arg) {
+        item_size = item_size_arg;
+        total_width = total_width_arg;
+    }
+    
+    // Open the next file, whose [width] numbers of item_size bytes each
+    // start header bytes in. Returns 0 or an errno value. O_DIRECT is
+    // skipped for files (e.g. on tmpfs) that can't be opened with it.
+    int add_file(char const* path, size_t header, bool direct) {
+        int fd = -1;
+#ifdef O_DIRECT
+        if (direct) {
+            fd = ::open(path, O_RDONLY | O_DIRECT);
+            if (fd < 0 && errno != EINVAL) return errno;
+        }
+#endif
+        if (fd < 0) {
+            direct = false;
+            fd = ::open(path, O_RDONLY);
+            if (fd < 0) return errno;
+        }
+        files.push_back(File { fd, header, direct });
+        
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) return errno;
+        const size_t length = size_t(file_stat.st_size);
+        if (length < header || (length - header) / item_size < total_width) {
+            return EINVAL;
+        }
+        if (!direct) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return 0;
+    }
+    
+    size_t count() const {
+        return files.size();
+    }
+    
+    size_t width() const {
+        return total_width;
+    }
+    
+    size_t buffer_size(size_t width) const {
+        return width * item_size + 2 * direct_alignment;
+    }
+    
+    // Read numbers [offset, offset + width) of the file into the buffer.
+    int fill(
+        size_t file_index, size_t offset, size_t width, StagingBuffer* buffer
+    ) const {
+        File const& file = files[file_index];
+        const size_t begin = file.header + offset * item_size;
+        const size_t end = begin + width * item_size;
+        size_t read_begin = begin;
+        size_t read_end = end;
+        if (file.direct) {
+            read_begin -= begin % direct_alignment;
+            read_end += (direct_alignment - end % direct_alignment)
+                      % direct_alignment;
+        }
+        buffer->skip = begin - read_begin;
+        
+        size_t done = 0;
+        while (read_begin + done < end) {
+            ssize_t got = pread(file.fd, buffer->memory + done,
+                read_end - read_begin - done, off_t(read_begin + done));
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) return errno;
+            if (got == 0) return EIO; // File got shorter.
+            done += size_t(got);
+        }
+        if (!file.direct) {
+            posix_fadvise(file.fd, off_t(read_begin),
+                off_t(read_end - read_begin), POSIX_FADV_DONTNEED);
+        }
+        return 0;
+    }
+};
+
+typedef StagingPipeline<FileReader> ReadPipeline;
+
+/*  Where to find, and how to convert, the image in one HDU of a FITS file.
+ *  Only  what  we  need  to load the image is kept: the number type (BITPIX),
+ *  shape (NAXIS2 rows of NAXIS1 columns), the linear scaling  applied  to
+ *  the stored numbers (physical = BZERO + BSCALE * stored), and where the
+ *  data starts.
+ */
+struct FitsHeader {
+    long bitpix = 0;
+    size_t rows = 0;
+    size_t columns = 0;
+    double bscale = 1.0;
+    double bzero = 0.0;
+    size_t data_offset = 0;
+};
+
+// FITS files are made of blocks of 2880 bytes; headers of 80 byte cards.
+static const size_t fits_block_size = 2880;
+static const size_t fits_card_size = 80;
+
+inline size_t fits_round_up(size_t bytes) {
+    return (bytes + fits_block_size - 1) / fits_block_size * fits_block_size;
+}
+
+// Numeric value of a "KEYWORD = value / comment" card. FITS allows D as the
+// exponent letter for double precision values.
+inline double fits_number(char const* card) {
+    char value[fits_card_size - 9];
+    memcpy(value, card + 10, fits_card_size - 10);
+    value[fits_card_size - 10] = '\0';
+    for (char& c : value) {
+        if (c == 'D' || c == 'd') c = 'E';
+        if (c == '/') c = '\0';
+    }
+    return strtod(value, nullptr);
+}
+
+// String value of a card ('IMAGE   ' is IMAGE), without trailing spaces.
+inline std::string fits_string(char const* card) {
+    std::string value(card + 10, fits_card_size - 10);
+    const size_t open = value.find('\'');
+    const size_t close = value.find('\'', open + 1);
+    if (open == std::string::npos || close == std::string::npos) return "";
+    value = value.substr(open + 1, close - open - 1);
+    value.erase(value.find_last_not_of(' ') + 1);
+    return value;
+}
+
+// Value of a logical card (T or F).
+inline bool fits_logical(char const* card) {
+    for (size_t c = 10; c < fits_card_size; ++c) {
+        if (card[c] != ' ') return card[c] == 'T';
+    }
+    return false;
+}
+
+/*  The keyword cards of one HDU's header, and where its data starts. Each
+ *  keyword maps to its card (the first, if it appears more than once).
+ */
+struct FitsCards {
+    std::map<std::string, char const*> cards;
+    size_t data_offset = 0;
+    
+    char const* find(std::string const& key) const {
+        auto it = cards.find(key);
+        return it == cards.end() ? nullptr : it->second;
+    }
+    
+    double number(std::string const& key, double default_value) const {
+        char const* card = find(key);
+        return card ? fits_number(card) : default_value;
+    }
+    
+    std::string string(std::string const& key) const {
+        char const* card = find(key);
+        return card ? fits_string(card) : "";
+    }
+    
+    bool logical(std::string const& key) const {
+        char const* card = find(key);
+        return card ? fits_logical(card) : false;
+    }
+    
+    // The lengths of the axes counted by the keyword (NAXIS, or ZNAXIS
+    // for compressed images), missing axes counting as length 1.
+    std::vector<size_t> axes(std::string const& key) const {
+        std::vector<size_t> result(size_t(number(key, 0.0)));
+        for (size_t n = 0; n < result.size(); ++n) {
+            result[n] = size_t(number(key + std::to_string(n + 1), 1.0));
+        }
+        return result;
+    }
+};
+
+/*  Find HDU number hdu (0 for the primary HDU, 1 for the first extension,
+ *  and so on) of the mapped FITS file, skipping the HDUs before it, and
+ *  collect its header cards. Returns 0 or EINVAL, after saying what's
+ *  wrong.
+ */
+inline int find_fits_hdu(
+    MappedFile const& file,
+    char const* path,
+    size_t hdu,
+    FitsCards* out
+) {
+    size_t offset = 0;
+    
+    for (size_t h = 0; ; ++h) {
+        if (offset >= file.length) {
+            fprintf(stderr, "%s: FITS file has no HDU %zi.\n", path, hdu);
+            return EINVAL;
+        }
+        
+        FitsCards cards;
+        bool ended = false;
+        
+        size_t card_offset = offset;
+        for (; card_offset + fits_card_size <= file.length;
+            card_offset += fits_card_size
+        ) {
+            char const* card = file.bytes() + card_offset;
+            std::string key(card, 8);
+            key.erase(key.find_last_not_of(' ') + 1);
+            
+            if (card_offset == offset
+                && key != (h == 0 ? "SIMPLE" : "XTENSION")
+            ) {
+                if (h == 0) {
+                    fprintf(stderr, "%s: Not a FITS file.\n", path);
+                } else {
+                    fprintf(stderr, "%s: FITS file has no HDU %zi.\n",
+                        path, hdu);
+                }
+                return EINVAL;
+            }
+            if (key == "END") {
+                ended = true;
+                break;
+            }
+            if (card[8] == '=') cards.cards.emplace(key, card);
+        }
+        if (!ended) {
+            fprintf(stderr, "%s: FITS header %zi has no END.\n", path, h);
+            return EINVAL;
+        }
+        
+        cards.data_offset = fits_round_up(card_offset + fits_card_size);
+        if (h == hdu) {
+            *out = std::move(cards);
+            return 0;
+        }
+        
+        const std::vector<size_t> axes = cards.axes("NAXIS");
+        size_t item_count = axes.empty() ? 0 : 1;
+        for (size_t axis : axes) item_count *= axis;
+        const long bitpix = long(cards.number("BITPIX", 0.0));
+        const size_t item_size = size_t(bitpix < 0 ? -bitpix : bitpix) / 8;
+        const size_t pcount = size_t(cards.number("PCOUNT", 0.0));
+        const size_t gcount = size_t(cards.number("GCOUNT", 1.0));
+        offset = cards.data_offset
+            + fits_round_up(item_size * gcount * (pcount + item_count));
+    }
+}
+
+/*  Read the header of HDU number hdu of the mapped FITS file. The HDU has
+ *  to be the primary HDU or an IMAGE extension, with 1 or 2 axes (or more
+ *  with all but the first two of length 1) and data that's all in the
+ *  file. Returns 0 or EINVAL, after saying what's wrong.
+ */
+inline int read_fits_header(
+    MappedFile const& file,
+    char const* path,
+    size_t hdu,
+    FitsHeader* out
+) {
+    FitsCards cards;
+    int error = find_fits_hdu(file, path, hdu, &cards);
+    if (error != 0) return error;
+    
+    if (hdu != 0 && cards.string("XTENSION") != "IMAGE") {
+        if (cards.logical("ZIMAGE")) {
+            fprintf(stderr, "%s: HDU %zi is a tile-compressed image "
+                "(see mediocre_rice_fits_input).\n", path, hdu);
+        } else {
+            fprintf(stderr, "%s: HDU %zi is not an image.\n", path, hdu);
+        }
+        return EINVAL;
+    }
+    const long bitpix = long(cards.number("BITPIX", 0.0));
+    switch (bitpix) {
+      default:
+        fprintf(stderr, "%s: Unsupported BITPIX %li.\n", path, bitpix);
+        return EINVAL;
+      case 8: case 16: case 32: case -32: case -64:
+        break;
+    }
+    
+    const std::vector<size_t> axes = cards.axes("NAXIS");
+    size_t naxis = axes.size();
+    for (size_t n = 2; n < naxis; ++n) {
+        if (axes[n] != 1) naxis = 0;
+    }
+    if (naxis == 0) {
+        fprintf(stderr, "%s: HDU %zi has no 1D or 2D image.\n", path, hdu);
+        return EINVAL;
+    }
+    
+    size_t item_count = 1;
+    for (size_t axis : axes) item_count *= axis;
+    const size_t item_size = size_t(bitpix < 0 ? -bitpix : bitpix) / 8;
+    if (file.length < cards.data_offset
+        || (file.length - cards.data_offset) / item_size < item_count
+    ) {
+        fprintf(stderr, "%s: FITS file is truncated.\n", path);
+        return EINVAL;
+    }
+    
+    out->bitpix = bitpix;
+    out->columns = axes[0];
+    out->rows = naxis >= 2 ? axes[1] : 1;
+    out->bscale = cards.number("BSCALE", 1.0);
+    out->bzero = cards.number("BZERO", 0.0);
+    out->data_offset = cards.data_offset;
+    return 0;
+}
+
+/*  FITS data is big-endian, so it can't go through the load plans. Instead
+ *  each  BITPIX  has  its  own  loader that byte swaps and converts 8 numbers
+ *  at a time and applies BZERO and BSCALE in the same pass. Every loader
+ *  computes float(double(stored) * BSCALE + BZERO); two common cases get
+ *  shortcuts with the same results: no scaling at all, and the  BZERO  that
+ *  FITS  uses  to store unsigned 16 and 32-bit (and signed 8-bit) numbers,
+ *  which is the same as flipping the sign bit.
+ */
+enum FitsScaling { fits_identity, fits_sign_flip, fits_general };
+
+struct FitsPlan;
+
+typedef void (*FitsLoadFunction)(
+    MediocreInputCommand, FitsPlan const*, char const*, size_t);
+
+/*  data is the image's first number, or null for images that are staged
+ *  a command at a time (see RiceDecoder), which pass load the command's
+ *  first number instead of data + command.offset * item_size.
+ */
+struct FitsPlan {
+    char const* data;
+    size_t item_size;
+    size_t data_offset;
+    double bscale;
+    double bzero;
+    FitsLoadFunction load;
+};
+
+// float(lo * scale + zero) and the same for hi, as one vector.
+inline __m256 fits_scale_halves(
+    __m256d lo, __m256d hi, __m256d scale, __m256d zero
+) {
+    const __m128 a =
+        _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(lo, scale), zero));
+    const __m128 b =
+        _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(hi, scale), zero));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(a), b, 1);
+}
+
+inline __m256 fits_scale_epi32(
+    __m128i lo, __m128i hi, __m256d scale, __m256d zero
+) {
+    return fits_scale_halves(
+        _mm256_cvtepi32_pd(lo), _mm256_cvtepi32_pd(hi), scale, zero);
+}
+
+template <FitsScaling scaling>
+inline __m256 fits_load8(uint8_t const* p, __m256d scale, __m256d zero) {
+    using namespace mediocre_convert;
+    __m128i bytes = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p));
+    
+    if (scaling == fits_sign_flip) {
+        bytes = _mm_xor_si128(bytes, _mm_set1_epi8(char(0x80)));
+        return combine_halves_epi32(
+            _mm_cvtepi8_epi32(bytes),
+            _mm_cvtepi8_epi32(_mm_srli_si128(bytes, 4)));
+    }
+    const __m128i lo = _mm_cvtepu8_epi32(bytes);
+    const __m128i hi = _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4));
+    return scaling == fits_identity
+        ? combine_halves_epi32(lo, hi)
+        : fits_scale_epi32(lo, hi, scale, zero);
+}
+
+template <FitsScaling scaling>
+inline __m256 fits_load8(int16_t const* p, __m256d scale, __m256d zero) {
+    using namespace mediocre_convert;
+    __m128i words = bswap16(
+        _mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+    
+    if (scaling == fits_sign_flip) {
+        words = _mm_xor_si128(words, _mm_set1_epi16(short(0x8000)));
+        return combine_halves_epi32(
+            _mm_cvtepu16_epi32(words),
+            _mm_cvtepu16_epi32(_mm_srli_si128(words, 8)));
+    }
+    const __m128i lo = _mm_cvtepi16_epi32(words);
+    const __m128i hi = _mm_cvtepi16_epi32(_mm_srli_si128(words, 8));
+    return scaling == fits_identity
+        ? combine_halves_epi32(lo, hi)
+        : fits_scale_epi32(lo, hi, scale, zero);
+}
+
+template <FitsScaling scaling>
+inline __m256 fits_load8(int32_t const* p, __m256d scale, __m256d zero) {
+    using namespace mediocre_convert;
+    __m128i lo = bswap32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p)));
+    __m128i hi = bswap32(
+        _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 4)));
+    
+    if (scaling == fits_sign_flip) {
+        const __m128i sign = _mm_set1_epi32(int32_t(0x80000000u));
+        return unsigned_halves_to_ps(
+            _mm_xor_si128(lo, sign), _mm_xor_si128(hi, sign));
+    }
+    return scaling == fits_identity
+        ? combine_halves_epi32(lo, hi)
+        : fits_scale_epi32(lo, hi, scale, zero);
+}
+
+template <FitsScaling scaling>
+inline __m256 fits_load8(float const* p, __m256d scale, __m256d zero) {
+    using namespace mediocre_convert;
+    const __m128 lo = _mm_castsi128_ps(
+        bswap32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p))));
+    const __m128 hi = _mm_castsi128_ps(
+        bswap32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 4))));
+    
+    return scaling == fits_identity
+        ? _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1)
+        : fits_scale_halves(
+            _mm256_cvtps_pd(lo), _mm256_cvtps_pd(hi), scale, zero);
+}
+
+template <FitsScaling scaling>
+inline __m256 fits_load8(double const* p, __m256d scale, __m256d zero) {
+    using namespace mediocre_convert;
+    __m128d pairs[4];
+    for (int i = 0; i < 4; ++i) {
+        pairs[i] = _mm_castsi128_pd(bswap64(
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 2*i))));
+    }
+    const __m256d lo =
+        _mm256_insertf128_pd(_mm256_castpd128_pd256(pairs[0]), pairs[1], 1);
+    const __m256d hi =
+        _mm256_insertf128_pd(_mm256_castpd128_pd256(pairs[2]), pairs[3], 1);
+    
+    return scaling == fits_identity
+        ? _mm256_insertf128_ps(
+            _mm256_castps128_ps256(_mm256_cvtpd_ps(lo)), _mm256_cvtpd_ps(hi), 1)
+        : fits_scale_halves(lo, hi, scale, zero);
+}
+
+/*  Load this file's share of a command, whose numbers start at
+ *  command_data: the data is one contiguous C order array, so like the 1D
+ *  input, but with the FITS conversions above.
+ */
+template <typename Raw, FitsScaling scaling>
+void load_fits(
+    MediocreInputCommand command,
+    FitsPlan const* plan,
+    char const* command_data,
+    size_t which_array
+) {
+    Raw const* subarray = reinterpret_cast<Raw const*>(command_data);
+    const __m256d scale = _mm256_set1_pd(plan->bscale);
+    const __m256d zero = _mm256_set1_pd(plan->bzero);
+    const size_t whole_vector_count = command.dimension.width / 8;
+    const size_t remainder = command.dimension.width % 8;
+    
+    __m256* current_chunk = command.output_chunks;
+    for (size_t v = 0; v < whole_vector_count; ++v) {
+        current_chunk[which_array] =
+            fits_load8<scaling>(subarray + 8*v, scale, zero);
+        current_chunk += command.dimension.combine_count;
+    }
+    
+    if (remainder != 0) {
+        float f[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+        for (size_t k = 0; k < remainder; ++k) {
+            const Raw stored = mediocre_convert::load_big(
+                subarray + 8*whole_vector_count + k);
+            f[k] = float(double(stored) * plan->bscale + plan->bzero);
+        }
+        current_chunk[which_array] = _mm256_loadu_ps(f);
+    }
+}
+
+template <typename Raw>
+FitsLoadFunction choose_fits_scaling(FitsHeader const& header, double flip) {
+    if (header.bscale == 1.0 && header.bzero == 0.0) {
+        return load_fits<Raw, fits_identity>;
+    }
+    if (header.bscale == 1.0 && flip != 0.0 && header.bzero == flip) {
+        return load_fits<Raw, fits_sign_flip>;
+    }
+    return load_fits<Raw, fits_general>;
+}
+
+// BZERO values that mean "flip the sign bit" are 2^(BITPIX-1), except for
+// BITPIX 8, which is unsigned and uses -128 to store signed bytes.
+inline FitsPlan make_fits_plan(FitsHeader const& h, char const* data) {
+    FitsPlan plan;
+    plan.data = data;
+    plan.item_size = size_t(h.bitpix < 0 ? -h.bitpix : h.bitpix) / 8;
+    plan.data_offset = h.data_offset;
+    plan.bscale = h.bscale;
+    plan.bzero = h.bzero;
+    
+    switch (h.bitpix) {
+      default: assert(0); abort();
+      break; case 8:   plan.load = choose_fits_scaling<uint8_t>(h, -128.0);
+      break; case 16:  plan.load = choose_fits_scaling<int16_t>(h, 32768.0);
+      break; case 32:
+        plan.load = choose_fits_scaling<int32_t>(h, 2147483648.0);
+      break; case -32: plan.load = choose_fits_scaling<float>(h, 0.0);
+      break; case -64: plan.load = choose_fits_scaling<double>(h, 0.0);
+    }
+    return plan;
+}
+
+/*  Bits of a Rice-compressed tile, read most significant bit first. Reading
+ *  past the end gives zero bits and sets overrun.
+ */
+class RiceBits {
+    uint8_t const* next;
+    uint8_t const* end;
+    uint64_t buffer = 0; // The low [count] bits are still to be read.
+    unsigned count = 0;
+  public:
+    bool overrun = false;
+    
+    RiceBits(uint8_t const* begin, uint8_t const* end_arg)
+    : next(begin), end(end_arg) { }
+    
+    // Read n <= 32 bits as an unsigned number.
+    uint32_t read(unsigned n) {
+        while (count < n) {
+            uint8_t byte = 0;
+            if (next != end) byte = *next++;
+            else overrun = true;
+            buffer = buffer << 8 | byte;
+            count += 8;
+        }
+        count -= n;
+        return uint32_t(buffer >> count) & uint32_t((uint64_t(1) << n) - 1);
+    }
+    
+    // Count the zero bits before the next 1 bit, and skip past the 1.
+    uint32_t read_zeros() {
+        uint32_t zeros = 0;
+        while (true) {
+            if (count == 0) {
+                if (next == end) {
+                    overrun = true;
+                    return zeros;
+                }
+                buffer = *next++;
+                count = 8;
+            }
+            const uint64_t bits = buffer & ((uint64_t(1) << count) - 1);
+            if (bits == 0) {
+                zeros += count;
+                count = 0;
+                continue;
+            }
+            const unsigned top = 63 - unsigned(__builtin_clzll(bits));
+            zeros += count - 1 - top;
+            count = top;
+            return zeros;
+        }
+    }
+};
+
+/*  Decode one tile of count numbers compressed with the FITS Rice algorithm
+ *  (RICE_1), as written by fpack / cfitsio, for numbers of bytepix (1, 2
+ *  or 4) bytes. The tile starts with the first number, then holds blocks of
+ *  block_size differences between neighbouring numbers, each starting with
+ *  the block's fs + 1 in fs_bits bits: 0 means all the differences are 0,
+ *  fs_max + 1 means they're stored verbatim, and otherwise each difference
+ *  is its high bits as that many 0 bits and a 1, then its low fs bits.
+ *  Differences are mapped to unsigned (0, -1, 1, -2, ... to 0, 1, 2, 3, ...)
+ *  and wrap around at bytepix bytes. Writes the numbers, zero-extended, to
+ *  out. Returns false if the tile is too short.
+ */
+inline bool rice_decode(
+    uint8_t const* tile,
+    size_t length,
+    size_t bytepix,
+    size_t block_size,
+    uint32_t* out,
+    size_t count
+) {
+    const unsigned fs_bits = bytepix == 1 ? 3 : bytepix == 2 ? 4 : 5;
+    const int fs_max = bytepix == 1 ? 6 : bytepix == 2 ? 14 : 25;
+    const unsigned bbits = unsigned(8 * bytepix);
+    const uint32_t mask = uint32_t((uint64_t(1) << bbits) - 1);
+    
+    if (length < bytepix) return false;
+    uint32_t last = 0;
+    for (size_t b = 0; b < bytepix; ++b) last = last << 8 | tile[b];
+    
+    RiceBits bits(tile + bytepix, tile + length);
+    for (size_t i = 0; i < count; ) {
+        const size_t block_end = std::min(i + block_size, count);
+        const int fs = int(bits.read(fs_bits)) - 1;
+        
+        if (fs < 0) {
+            for (; i < block_end; ++i) out[i] = last;
+        } else if (fs == fs_max) {
+            for (; i < block_end; ++i) {
+                const uint32_t diff = bits.read(bbits);
+                last = (last + ((diff & 1) ? ~(diff >> 1) : diff >> 1)) & mask;
+                out[i] = last;
+            }
+        } else {
+            for (; i < block_end; ++i) {
+                uint32_t diff = bits.read_zeros() << fs;
+                if (fs != 0) diff |= bits.read(unsigned(fs));
+                last = (last + ((diff & 1) ? ~(diff >> 1) : diff >> 1)) & mask;
+                out[i] = last;
+            }
+        }
+        if (bits.overrun) return false;
+    }
+    return true;
+}
+
+struct RiceTile {
+    uint8_t const* bytes;
+    size_t length;
+};
+
+/*  A Rice tile-compressed image: a BINTABLE HDU (ZIMAGE = T) with one row
+ *  per tile, whose COMPRESSED_DATA column points into the heap at the
+ *  tile's bytes. Tiles are tile_rows x tile_columns (the last ones in each
+ *  direction may be cut short) and listed in C order. header describes the
+ *  image as it was before compression (BITPIX is ZBITPIX, and so on).
+ */
+struct RiceImage {
+    MappedFile file;
+    FitsHeader header;
+    size_t tile_rows = 1;
+    size_t tile_columns = 0;
+    size_t block_size = 32;
+    size_t bytepix = 4;
+    std::vector<RiceTile> tiles;
+};
+
+// Bytes in one table row taken up by a column with the given TFORM, or 0
+// if the TFORM isn't understood. Sets *descriptor if it's a P or Q array
+// descriptor (for which the repeat count is 0 or 1).
+inline size_t fits_column_size(std::string const& tform, char* descriptor) {
+    size_t letter = tform.find_first_not_of("0123456789");
+    if (letter == std::string::npos) return 0;
+    const size_t repeat = letter == 0 ? 1 : size_t(atol(tform.c_str()));
+    *descriptor = '\0';
+    
+    switch (tform[letter]) {
+      default: return 0;
+      case 'L': case 'B': case 'A': return repeat;
+      case 'X': return (repeat + 7) / 8;
+      case 'I': return 2 * repeat;
+      case 'J': case 'E': return 4 * repeat;
+      case 'K': case 'D': case 'C': return 8 * repeat;
+      case 'M': return 16 * repeat;
+      case 'P': *descriptor = 'P'; return 8 * repeat;
+      case 'Q': *descriptor = 'Q'; return 16 * repeat;
+    }
+}
+
+/*  Open the FITS file at path and read the Rice-compressed image in HDU
+ *  number hdu, with ZBITPIX 8, 16 or 32, 1 or 2 axes (or more with all but
+ *  the first two of length 1), and tiles that are all in the file. Returns
+ *  0 or an errno value, after saying what's wrong.
+ */
+inline int read_rice_image(char const* path, size_t hdu, RiceImage* out) {
+    MappedFile& file = out->file;
+    int error = file.open(path);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(error));
+        return error;
+    }
+    
+    FitsCards cards;
+    error = find_fits_hdu(file, path, hdu, &cards);
+    if (error != 0) return error;
+    
+    if (cards.string("XTENSION") != "BINTABLE" || !cards.logical("ZIMAGE")) {
+        fprintf(stderr, "%s: HDU %zi is not a tile-compressed image.\n",
+            path, hdu);
+        return EINVAL;
+    }
+    const std::string compression = cards.string("ZCMPTYPE");
+    if (compression != "RICE_1" && compression != "RICE_ONE") {
+        fprintf(stderr, "%s: HDU %zi is compressed with %s, not RICE_1.\n",
+            path, hdu, compression.c_str());
+        return EINVAL;
+    }
+    
+    FitsHeader& header = out->header;
+    header.bitpix = long(cards.number("ZBITPIX", 0.0));
+    if (header.bitpix != 8 && header.bitpix != 16 && header.bitpix != 32) {
+        fprintf(stderr, "%s: Unsupported ZBITPIX %li.\n",
+            path, header.bitpix);
+        return EINVAL;
+    }
+    
+    const std::vector<size_t> axes = cards.axes("ZNAXIS");
+    size_t naxis = axes.size();
+    for (size_t n = 2; n < naxis; ++n) {
+        if (axes[n] != 1) naxis = 0;
+    }
+    if (naxis == 0) {
+        fprintf(stderr, "%s: HDU %zi has no 1D or 2D image.\n", path, hdu);
+        return EINVAL;
+    }
+    header.columns = axes[0];
+    header.rows = naxis >= 2 ? axes[1] : 1;
+    header.bscale = cards.number("BSCALE", 1.0);
+    header.bzero = cards.number("BZERO", 0.0);
+    
+    out->tile_columns = size_t(cards.number("ZTILE1", double(header.columns)));
+    out->tile_rows = size_t(cards.number("ZTILE2", 1.0));
+    for (size_t n = 1; ; ++n) {
+        const std::string name = cards.string("ZNAME" + std::to_string(n));
+        if (name.empty()) break;
+        const double value = cards.number("ZVAL" + std::to_string(n), 0.0);
+        if (name == "BLOCKSIZE") out->block_size = size_t(value);
+        if (name == "BYTEPIX") out->bytepix = size_t(value);
+    }
+    if (out->tile_columns == 0 || out->tile_rows == 0 || out->block_size == 0
+        || (out->bytepix != 1 && out->bytepix != 2 && out->bytepix != 4)
+    ) {
+        fprintf(stderr, "%s: Bad tile size or Rice parameters.\n", path);
+        return EINVAL;
+    }
+    
+    // Find the COMPRESSED_DATA column's place in each row of the table.
+    size_t column_offset = 0;
+    char descriptor = '\0';
+    const size_t field_count = size_t(cards.number("TFIELDS", 0.0));
+    size_t field = 1;
+    for (; field <= field_count; ++field) {
+        const std::string n = std::to_string(field);
+        const size_t size = fits_column_size(
+            cards.string("TFORM" + n), &descriptor);
+        if (cards.string("TTYPE" + n) == "COMPRESSED_DATA") break;
+        column_offset += size;
+    }
+    const size_t row_size = size_t(cards.number("NAXIS1", 0.0));
+    const size_t row_count = size_t(cards.number("NAXIS2", 0.0));
+    const size_t descriptor_size = descriptor == 'Q' ? 16 : 8;
+    if (field > field_count || descriptor == '\0'
+        || column_offset + descriptor_size > row_size
+    ) {
+        fprintf(stderr, "%s: HDU %zi has no COMPRESSED_DATA column.\n",
+            path, hdu);
+        return EINVAL;
+    }
+    
+    const size_t tiles_across =
+        (header.columns + out->tile_columns - 1) / out->tile_columns;
+    const size_t tiles_down =
+        (header.rows + out->tile_rows - 1) / out->tile_rows;
+    if (row_count != tiles_across * tiles_down) {
+        fprintf(stderr, "%s: Expected %zi tiles, found %zi.\n",
+            path, tiles_across * tiles_down, row_count);
+        return EINVAL;
+    }
+    
+    const size_t table_size = row_size * row_count;
+    const size_t heap_offset = cards.data_offset
+        + size_t(cards.number("THEAP", double(table_size)));
+    const size_t data_end = cards.data_offset + table_size
+        + size_t(cards.number("PCOUNT", 0.0));
+    if (data_end > file.length || heap_offset > data_end) {
+        fprintf(stderr, "%s: FITS file is truncated.\n", path);
+        return EINVAL;
+    }
+    
+    out->tiles.resize(row_count);
+    for (size_t t = 0; t < row_count; ++t) {
+        char const* entry = file.bytes() + cards.data_offset
+                          + t * row_size + column_offset;
+        uint64_t length, offset;
+        if (descriptor == 'P') {
+            length = mediocre_convert::load_big(
+                reinterpret_cast<uint32_t const*>(entry));
+            offset = mediocre_convert::load_big(
+                reinterpret_cast<uint32_t const*>(entry + 4));
+        } else {
+            length = mediocre_convert::load_big(
+                reinterpret_cast<uint64_t const*>(entry));
+            offset = mediocre_convert::load_big(
+                reinterpret_cast<uint64_t const*>(entry + 8));
+        }
+        if (length == 0) {
+            // cfitsio stores tiles that Rice can't compress some other way.
+            fprintf(stderr, "%s: Tile %zi is not Rice-compressed.\n",
+                path, t);
+            return EINVAL;
+        }
+        if (offset > data_end - heap_offset
+            || length > data_end - heap_offset - offset
+        ) {
+            fprintf(stderr, "%s: Tile %zi is outside the heap.\n", path, t);
+            return EINVAL;
+        }
+        out->tiles[t] = RiceTile {
+            reinterpret_cast<uint8_t const*>(file.bytes() + heap_offset)
+                + offset,
+            size_t(length)
+        };
+    }
+    return 0;
+}
+
+/*  StagingPipeline source for the Rice-compressed FITS input
+ *  (mediocre_rice_fits_input). Each fill decodes the tiles overlapping the
+ *  command's part of an image and stages that part as big-endian numbers
+ *  of the image's ZBITPIX, exactly as the uncompressed image would store
+ *  them, so that they go through the same FITS loaders (and scaling) as
+ *  mediocre_fits_input. Tiles shared by two commands are decoded for each;
+ *  with fpack's default one row per tile, that's at most a row per command.
+ */
+class RiceDecoder {
+    std::vector<RiceImage> images;
+    size_t total_width = 0;
+    
+    // Write the tile's numbers in [offset, end) to staging (which starts
+    // at number offset), converting them to the image's ZBITPIX.
+    template <typename Stored>
+    static void stage_tile(
+        RiceImage const& image,
+        uint32_t const* values,
+        size_t first_row,
+        size_t first_column,
+        size_t tile_columns,
+        size_t tile_rows,
+        size_t offset,
+        size_t end,
+        char* staging
+    ) {
+        for (size_t r = 0; r < tile_rows; ++r) {
+            const size_t row_begin =
+                (first_row + r) * image.header.columns + first_column;
+            const size_t begin = std::max(row_begin, offset);
+            const size_t stop = std::min(row_begin + tile_columns, end);
+            uint32_t const* row = values + r * tile_columns;
+            
+            for (size_t x = begin; x < stop; ++x) {
+                uint32_t v = row[x - row_begin];
+                // 16-bit numbers are signed, bytes unsigned.
+                if (image.bytepix == 2) v = uint32_t(int32_t(int16_t(v)));
+                if (sizeof(Stored) == 2) v = __builtin_bswap16(uint16_t(v));
+                if (sizeof(Stored) == 4) v = __builtin_bswap32(v);
+                const Stored stored = Stored(v);
+                memcpy(staging + (x - offset) * sizeof(Stored),
+                    &stored, sizeof(Stored));
+            }
+        }
+    }
+    
+  public:
+    // Read the Rice-compressed image in HDU number hdu of the file at
+    // path. It has to be the same shape as the images before it. Returns
+    // 0 or an errno value, after saying what's wrong.
+    int add_image(char const* path, size_t hdu) {
+        images.emplace_back();
+        RiceImage& image = images.back();
+        int error = read_rice_image(path, hdu, &image);
+        if (error != 0) return error;
+        
+        RiceImage const& first = images.front();
+        if (image.header.rows != first.header.rows
+            || image.header.columns != first.header.columns
+        ) {
+            fprintf(stderr, "%s: Expected [%zi, %zi] image, found "
+                "[%zi, %zi].\n", path, first.header.rows,
+                first.header.columns, image.header.rows,
+                image.header.columns);
+            return EINVAL;
+        }
+        total_width = first.header.rows * first.header.columns;
+        return 0;
+    }
+    
+    RiceImage const& image(size_t index) const {
+        return images[index];
+    }
+    
+    size_t count() const {
+        return images.size();
+    }
+    
+    size_t width() const {
+        return total_width;
+    }
+    
+    size_t buffer_size(size_t width) const {
+        return width * sizeof(int32_t);
+    }
+    
+    // Decode numbers [offset, offset + width) of the image into the buffer.
+    int fill(
+        size_t image_index, size_t offset, size_t width, StagingBuffer* buffer
+    ) const {
+        RiceImage const& image = images[image_index];
+        const size_t columns = image.header.columns;
+        const size_t tiles_across =
+            (columns + image.tile_columns - 1) / image.tile_columns;
+        const size_t band_size = image.tile_rows * columns;
+        const size_t end = offset + width;
+        buffer->skip = 0;
+        
+        std::vector<uint32_t> values;
+        try {
+            values.resize(image.tile_rows * image.tile_columns);
+        } catch (std::bad_alloc&) {
+            return ENOMEM;
+        }
+        
+        for (size_t band = offset / band_size; band * band_size < end;
+            ++band
+        ) {
+            const size_t first_row = band * image.tile_rows;
+            const size_t rows =
+                std::min(image.tile_rows, image.header.rows - first_row);
+            
+            for (size_t across = 0; across < tiles_across; ++across) {
+                const size_t first_column = across * image.tile_columns;
+                const size_t tile_columns =
+                    std::min(image.tile_columns, columns - first_column);
+                const size_t first = first_row * columns + first_column;
+                const size_t last = first + (rows - 1) * columns
+                                  + tile_columns - 1;
+                if (last < offset || first >= end) continue;
+                
+                RiceTile const& tile =
+                    image.tiles[band * tiles_across + across];
+                if (!rice_decode(tile.bytes, tile.length, image.bytepix,
+                    image.block_size, values.data(), rows * tile_columns)
+                ) {
+                    return EILSEQ;
+                }
+                
+                switch (image.header.bitpix) {
+                  default: assert(0); abort();
+                  break; case 8: stage_tile<uint8_t>(image, values.data(),
+                    first_row, first_column, tile_columns, rows,
+                    offset, end, buffer->memory);
+                  break; case 16: stage_tile<uint16_t>(image, values.data(),
+                    first_row, first_column, tile_columns, rows,
+                    offset, end, buffer->memory);
+                  break; case 32: stage_tile<uint32_t>(image, values.data(),
+                    first_row, first_column, tile_columns, rows,
+                    offset, end, buffer->memory);
+                }
+            }
+        }
+        return 0;
+    }
+};
+
+typedef StagingPipeline<RiceDecoder> DecodePipeline;
+
+} // end anonymous namespace.
+
+extern "C" {
+
+int mediocre_gather_enabled = 1;
+int mediocre_prefetch_distance = 1024;
+int mediocre_stage_megabytes = 256;
+
+/*  Export functions to the user that  return  MediocreInput  instances  for
+ *  loading 1D arrays.
+ */
+MediocreInput
+mediocre_i8_input(int8_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_i8_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_i16_input(int16_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_i16_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_i32_input(int32_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_i32_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_i64_input(int64_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_i64_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_u8_input(uint8_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_u8_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_u16_input(uint16_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_u16_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_u32_input(uint32_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_u32_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_u64_input(uint64_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_u64_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_float_input(float const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_float_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_double_input(double const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(pointers, dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_double_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_f16_input(uint16_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(
+        reinterpret_cast<Half const* const*>(pointers), dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_f16_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+MediocreInput
+mediocre_bf16_input(uint16_t const* const* pointers, MediocreDimension dim) {
+    MediocreInput result = mediocre_1D_input_impl(
+        reinterpret_cast<BFloat16 const* const*>(pointers), dim);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_bf16_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+
+MediocreInput mediocre_scaled_1D_input(
+    void const* const* pointers,
+    uintptr_t type_code,
+    MediocreDimension dim,
+    float const* scale,
+    float const* offset
+) {
+    const Scaled1DFactory factory = choose_scaled_1D_input(type_code);
+    if (factory == nullptr) {
+        fprintf(stderr, "mediocre_scaled_1D_input: Unknown type code %zi.\n",
+            size_t(type_code));
+        MediocreInput result;
+        result.loop_function = nullptr;
+        result.destructor = no_op;
+        result.user_data = nullptr;
+        result.dimension = dim;
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    
+    MediocreInput result = factory(pointers, dim, scale, offset);
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_scaled_1D_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+
+MediocreInput mediocre_mixed_1D_input(
+    void const* const* pointers,
+    uintptr_t const* type_codes,
+    MediocreDimension dim,
+    float const* scale,
+    float const* offset
+) {
+    MediocreInput result;
+    result.loop_function = Mixed1DUserData::loop_function;
+    result.destructor = Mixed1DUserData::destructor;
+    result.user_data = nullptr;
+    result.dimension = dim;
+    result.nonzero_error = 0;
+    
+    for (size_t i = 0; i < dim.combine_count; ++i) {
+        if (choose_contiguous_function(type_codes[i]) == nullptr) {
+            fprintf(stderr, "mediocre_mixed_1D_input: Array %zi has unknown "
+                "type code %zi.\n", i, size_t(type_codes[i]));
+            result.loop_function = nullptr;
+            result.destructor = no_op;
+            result.nonzero_error = EINVAL;
+            return result;
+        }
+    }
+    
+    try {
+        Mixed1DUserData* user_data = new Mixed1DUserData {
+            std::vector<void const*>(pointers, pointers + dim.combine_count),
+            std::vector<ContiguousFunction>(dim.combine_count),
+            std::vector<Affine>(dim.combine_count)
+        };
+        for (size_t i = 0; i < dim.combine_count; ++i) {
+            user_data->loaders[i] = choose_contiguous_function(type_codes[i]);
+            if (scale != nullptr) user_data->affines[i].scale = scale[i];
+            if (offset != nullptr) user_data->affines[i].offset = offset[i];
+        }
+        result.user_data = user_data;
+    } catch (std::bad_alloc&) {
+        result.nonzero_error = ENOMEM;
+    } catch (...) {
+        result.nonzero_error = -1;
+    }
+    
+    if (result.nonzero_error != 0) fprintf(stderr,
+        "mediocre_mixed_1D_input: %s\n", strerror(result.nonzero_error));
+    return result;
+}
+
+MediocreInput
+mediocre_chunk_input(__m256 const* chunks, MediocreDimension dim) {
+    MediocreInput result;
+    result.loop_function = chunk_loop_function;
+    result.destructor = no_op;
+    result.user_data = chunks;
+    result.dimension = dim;
+    result.nonzero_error = 0;
+    
+    if (reinterpret_cast<uintptr_t>(chunks) % sizeof(__m256) != 0) {
+        fprintf(stderr, "mediocre_chunk_input: "
+            "Chunks at %p are not 32 byte aligned.\n",
+            static_cast<void const*>(chunks));
+        result.loop_function = nullptr;
+        result.nonzero_error = EINVAL;
+    }
+    return result;
+}
+
+/*  Implement the user_data structure, input loop, and destructor needed for
+ *  MediocreInput instances that load stacks of masked 2D data arrays.
+ */
+
+struct MaskedUserData {
+    std::vector<MediocreMasked2D> arrays;
+    std::vector<LoadPlan> plans;
+    std::vector<MaskFunction> mask_functions;
+    std::vector<GatherFunction> gather_functions;
+    bool nonzero_means_bad;
+    bool bad_as_nan;
+    bool shared_mask; // Every array has the same mask, scanned only once.
+};
+
+static int masked_loop_function(
+    MediocreInputControl* control,
+    void const* user_data_pv,
+    MediocreDimension maximum_request
+) {
+    (void)maximum_request;
+    MediocreInputCommand command;
+    
+    MaskedUserData const* user_data =
+        static_cast<MaskedUserData const*>(user_data_pv);
+    
+    MediocreMasked2D const* masked_2D_arrays = user_data->arrays.data();
+    MaskFunction const* mask_functions = user_data->mask_functions.data();
+    GatherFunction const* gather_functions =
+        user_data->gather_functions.data();
+    const bool nonzero_means_bad = user_data->nonzero_means_bad;
+    const bool bad_as_nan = user_data->bad_as_nan;
+    const bool shared_mask = user_data->shared_mask;
+    
+    try {
+        std::vector<LoadPlan> plans = combine_plans(user_data->plans);
+        std::vector<BadPixel> bad_pixels; // Of the last mask scanned.
+        MEDIOCRE_INPUT_LOOP(command, control) {
+            for (size_t i = 0; i < command.dimension.combine_count; ++i) {
+                plans[i].load(command, &plans[i], i);
+                if (i == 0 || !shared_mask) {
+                    bad_pixels.clear();
+                    mask_functions[i](command, masked_2D_arrays[i].mask_2D,
+                        nonzero_means_bad, bad_as_nan, &bad_pixels);
+                }
+                fix_bad_pixels(command, i, masked_2D_arrays[i].data_2D,
+                    gather_functions[i], bad_pixels, bad_as_nan);
+            }
+        }
+    } catch (std::bad_alloc&) {
+        fprintf(stderr,
+            "mediocre_masked_2D_input: Could not allocate memory.\n"
+        );
+        return ENOMEM;
+    }
+    
+    return 0;
+}
+
+static void masked_user_data_destructor(void* user_data_pv) {
+    delete static_cast<MaskedUserData*>(user_data_pv);
+}
+
+/*  User-visible function that returns a MediocreInput instance intended for
+ *  loading  masked  2D  arrays.  The 2D arrays are not copied into internal
+ *  storage  and  must  remain  valid  for  the  lifetime  of  the  returned
+ *  MediocreInput  instance.  However, the array of MediocreMasked2D objects
+ *  itself will be copied into the MediocreInput's internal storage, so that
+ *  array  can  be safely deleted after the function returns, as long as the
+ *  data pointed to by those MediocreMasked2D objects remains valid.  Bad
+ *  pixels are median filtered, or loaded as NaN if bad_as_nan. If all the
+ *  arrays have the same mask (as for a stack of frames from one detector),
+ *  the mask is scanned once per command for all of them.
+ */
+static MediocreInput masked_2D_input(
+    MediocreMasked2D const* masked_arrays,
+    size_t count,
+    int nonzero_means_bad,
+    bool bad_as_nan
+) {
+    MediocreInput result;
+    
+    result.loop_function = masked_loop_function;
+    result.destructor = masked_user_data_destructor;
+    result.user_data = nullptr; // Set later.
+    result.dimension.combine_count = count;
+    result.dimension.width = 0; // Set later.
+    result.nonzero_error = 0;
+    
+    MaskedUserData* masked_user_data = nullptr;
+    
+    if (count == 0) {
+        fprintf(stderr, "mediocre_masked_2D_input:\n"
+            "count should not be zero (needs at least one input array).\n"
+        );
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    
+    size_t major_expected = masked_arrays[0].data_2D.major_width;
+    size_t minor_expected = masked_arrays[0].data_2D.minor_width;
+    result.dimension.width = major_expected * minor_expected;
+    
+    for (size_t i = 0; i < count; ++i) {
+        MediocreMasked2D const& m = masked_arrays[i];
+        if (!array_is_okay(m.data_2D, major_expected, minor_expected)) {
+            result.nonzero_error = EINVAL;
+            return result;
+        }
+        if (!array_is_okay(m.mask_2D, major_expected, minor_expected, true)) {
+            result.nonzero_error = EINVAL;
+            return result;
+        }
+    }
+    
+    try {
+        masked_user_data = new MaskedUserData;
+        masked_user_data->nonzero_means_bad = nonzero_means_bad != 0;
+        masked_user_data->bad_as_nan = bad_as_nan;
+        masked_user_data->shared_mask = true;
+        masked_user_data->arrays.reserve(count);
+        masked_user_data->plans.reserve(count);
+        masked_user_data->mask_functions.reserve(count);
+        masked_user_data->gather_functions.reserve(count);
+        
+        for (size_t i = 0; i < count; ++i) {
+            MediocreMasked2D const& m = masked_arrays[i];
+            masked_user_data->arrays.push_back(m);
+            masked_user_data->shared_mask = masked_user_data->shared_mask
+                && same_2D(m.mask_2D, masked_arrays[0].mask_2D);
+            masked_user_data->plans.push_back(make_load_plan(m.data_2D, count));
+            masked_user_data->mask_functions.push_back(
+                choose_mask_function(m.mask_2D.type_code));
+            masked_user_data->gather_functions.push_back(
+                choose_gather_function(m.data_2D.type_code));
+        }
+        
+        // Don't write out the user_data pointer to the MediocreInput result
+        // (visible to the user) until we are sure that the user_data
+        // object was successfully, fully constructed.
+        result.user_data = masked_user_data;
+    } catch (std::bad_alloc&) {
+        fprintf(stderr,
+            "mediocre_masked_2D_input: Could not allocate memory.\n"
+        );
+        result.nonzero_error = ENOMEM;
+        delete masked_user_data;
+        return result;
+    } catch (...) {
+        fprintf(stderr, "mediocre_masked_2D_input: Unknown error.\n");
+        result.nonzero_error = -1;
+        delete masked_user_data;
+        return result;
+    }
+    
+    return result;
+}
+
+MediocreInput mediocre_masked_2D_input(
+    MediocreMasked2D const* masked_arrays,
+    size_t count,
+    int nonzero_means_bad
+) {
+    return masked_2D_input(masked_arrays, count, nonzero_means_bad, false);
+}
+
+MediocreInput mediocre_nan_masked_2D_input(
+    MediocreMasked2D const* masked_arrays,
+    size_t count,
+    int nonzero_means_bad
+) {
+    return masked_2D_input(masked_arrays, count, nonzero_means_bad, true);
+}
+
+/*  Pair each of the arrays with the shared mask for masked_2D_input, which
+ *  notices that they all have the same mask.
+ */
+static MediocreInput shared_mask_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    Mediocre2D mask,
+    int nonzero_means_bad,
+    bool bad_as_nan
+) {
+    std::vector<MediocreMasked2D> masked_arrays;
+    try {
+        masked_arrays.resize(count);
+    } catch (std::bad_alloc&) {
+        fprintf(stderr,
+            "mediocre_shared_mask_2D_input: Could not allocate memory.\n"
+        );
+        MediocreInput result;
+        result.loop_function = masked_loop_function;
+        result.destructor = masked_user_data_destructor;
+        result.user_data = nullptr;
+        result.dimension.combine_count = count;
+        result.dimension.width = 0;
+        result.nonzero_error = ENOMEM;
+        return result;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        masked_arrays[i].data_2D = arrays[i];
+        masked_arrays[i].mask_2D = mask;
+    }
+    return masked_2D_input(
+        masked_arrays.data(), count, nonzero_means_bad, bad_as_nan);
+}
+
+MediocreInput mediocre_shared_mask_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    Mediocre2D mask,
+    int nonzero_means_bad
+) {
+    return shared_mask_2D_input(arrays, count, mask, nonzero_means_bad, false);
+}
+
+MediocreInput mediocre_nan_shared_mask_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    Mediocre2D mask,
+    int nonzero_means_bad
+) {
+    return shared_mask_2D_input(arrays, count, mask, nonzero_means_bad, true);
+}
+
+/*  Implement the bad pixel list input: 2D arrays with their bad entries given
+ *  as sorted lists of flat offsets instead of as full-size masks. Each
+ *  command binary searches each list for the bad pixels in its range, so
+ *  masking costs time in proportion to the number of bad pixels instead of
+ *  the number of pixels.
+ */
+
+struct BadPixelUserData {
+    std::vector<Mediocre2D> arrays;
+    std::vector<MediocreBadPixels> bad_pixel_lists; // 1 (shared) or count.
+    std::vector<LoadPlan> plans;
+    std::vector<GatherFunction> gather_functions;
+    bool bad_as_nan;
+};
+
+static int bad_pixel_loop_function(
+    MediocreInputControl* control,
+    void const* user_data_pv,
+    MediocreDimension maximum_request
+) {
+    (void)maximum_request;
+    MediocreInputCommand command;
+    
+    BadPixelUserData const* user_data =
+        static_cast<BadPixelUserData const*>(user_data_pv);
+    const bool bad_as_nan = user_data->bad_as_nan;
+    
+    try {
+        std::vector<LoadPlan> plans = combine_plans(user_data->plans);
+        std::vector<BadPixel> bad_pixels; // Of the last list looked up.
+        MEDIOCRE_INPUT_LOOP(command, control) {
+            for (size_t i = 0; i < command.dimension.combine_count; ++i) {
+                plans[i].load(command, &plans[i], i);
+                Mediocre2D const& data = user_data->arrays[i];
+                
+                // Shared lists (there's only one) are looked up once.
+                if (i < user_data->bad_pixel_lists.size()) {
+                    bad_pixels.clear();
+                    list_bad_pixels(command, user_data->bad_pixel_lists[i],
+                        data.major_width, data.minor_width, bad_as_nan,
+                        &bad_pixels);
+                }
+                fix_bad_pixels(command, i, data,
+                    user_data->gather_functions[i], bad_pixels, bad_as_nan);
+            }
+        }
+    } catch (std::bad_alloc&) {
+        fprintf(stderr,
+            "mediocre_bad_pixel_2D_input: Could not allocate memory.\n"
+        );
+        return ENOMEM;
+    }
+    
+    return 0;
+}
+
+static void bad_pixel_user_data_destructor(void* user_data_pv) {
+    delete static_cast<BadPixelUserData*>(user_data_pv);
+}
+
+/*  Shared implementation of mediocre_bad_pixel_2D_input and
+ *  mediocre_nan_bad_pixel_2D_input: bad pixels are median filtered, or
+ *  loaded as NaN if bad_as_nan.
+ */
+static MediocreInput bad_pixel_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    MediocreBadPixels const* bad_pixels,
+    size_t bad_pixels_count,
+    bool bad_as_nan
+) {
+    MediocreInput result;
+    
+    result.loop_function = bad_pixel_loop_function;
+    result.destructor = bad_pixel_user_data_destructor;
+    result.user_data = nullptr; // Set later.
+    result.dimension.combine_count = count;
+    result.dimension.width = 0; // Set later.
+    result.nonzero_error = 0;
+    
+    BadPixelUserData* user_data = nullptr;
+    
+    if (count == 0) {
+        fprintf(stderr, "mediocre_bad_pixel_2D_input:\n"
+            "count should not be zero (needs at least one input array).\n"
+        );
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    if (bad_pixels_count != 1 && bad_pixels_count != count) {
+        fprintf(stderr, "mediocre_bad_pixel_2D_input:\n"
+            "Need 1 (shared) or %zi bad pixel lists, not %zi.\n",
+            count, bad_pixels_count
+        );
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    
+    size_t major_expected = arrays[0].major_width;
+    size_t minor_expected = arrays[0].minor_width;
+    const size_t width = major_expected * minor_expected;
+    result.dimension.width = width;
+    
+    for (size_t i = 0; i < count; ++i) {
+        if (!array_is_okay(arrays[i], major_expected, minor_expected)) {
+            result.nonzero_error = EINVAL;
+            return result;
+        }
+    }
+    for (size_t b = 0; b < bad_pixels_count; ++b) {
+        MediocreBadPixels const& list = bad_pixels[b];
+        for (size_t n = 0; n < list.count; ++n) {
+            if (list.offsets[n] >= width
+                || (n != 0 && list.offsets[n] <= list.offsets[n-1])
+            ) {
+                fprintf(stderr, "mediocre_bad_pixel_2D_input:\n"
+                    "Bad pixel list %zi is not sorted, has duplicates, "
+                    "or has offsets past the end of the arrays.\n", b
+                );
+                result.nonzero_error = EINVAL;
+                return result;
+            }
+        }
+    }
+    
+    try {
+        user_data = new BadPixelUserData;
+        user_data->bad_as_nan = bad_as_nan;
+        user_data->arrays.reserve(count);
+        user_data->bad_pixel_lists.assign(
+            bad_pixels, bad_pixels + bad_pixels_count);
+        user_data->plans.reserve(count);
+        user_data->gather_functions.reserve(count);
+        
+        for (size_t i = 0; i < count; ++i) {
+            user_data->arrays.push_back(arrays[i]);
+            user_data->plans.push_back(make_load_plan(arrays[i], count));
+            user_data->gather_functions.push_back(
+                choose_gather_function(arrays[i].type_code));
+        }
+        // Don't write out user_data to the returned structure until
+        // we are sure it was successfully, fully constructed.
+        result.user_data = user_data;
+    } catch (std::bad_alloc&) {
+        fprintf(stderr,
+            "mediocre_bad_pixel_2D_input: Could not allocate memory.\n"
+        );
+        result.nonzero_error = ENOMEM;
+        delete user_data;
+        return result;
+    } catch (...) {
+        fprintf(stderr, "mediocre_bad_pixel_2D_input: Unknown error.\n");
+        result.nonzero_error = -1;
+        delete user_data;
+        return result;
+    }
+    
+    return result;
+}
+
+MediocreInput mediocre_bad_pixel_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    MediocreBadPixels const* bad_pixels,
+    size_t bad_pixels_count
+) {
+    return bad_pixel_2D_input(
+        arrays, count, bad_pixels, bad_pixels_count, false);
+}
+
+MediocreInput mediocre_nan_bad_pixel_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    MediocreBadPixels const* bad_pixels,
+    size_t bad_pixels_count
+) {
+    return bad_pixel_2D_input(
+        arrays, count, bad_pixels, bad_pixels_count, true);
+}
+
+struct Mediocre2DUserData {
+    std::vector<LoadPlan> plans;
+};
+
+static int mediocre_2D_loop_function(
+    MediocreInputControl* control,
+    void const* user_data_pv,
+    MediocreDimension maximum_request
+) {
+    (void)maximum_request;
+    
+    Mediocre2DUserData const* user_data =
+        static_cast<Mediocre2DUserData const*>(user_data_pv);
+    
+    MediocreInputCommand command;
+    
+    try {
+        std::vector<LoadPlan> plans = combine_plans(user_data->plans);
+        MEDIOCRE_INPUT_LOOP(command, control) {
+            assert(command.dimension.combine_count == plans.size());
+            for (size_t i = 0; i < command.dimension.combine_count; ++i) {
+                plans[i].load(command, &plans[i], i);
+            }
+        }
+    } catch (std::bad_alloc&) {
+        fprintf(stderr, "mediocre_2D_input: Could not allocate memory.\n");
+        return ENOMEM;
+    }
+    
+    return 0;
+}
+
+static void mediocre_2D_user_data_destructor(void* user_data_pv) {
+    delete static_cast<Mediocre2DUserData*>(user_data_pv);
+}
+
+/*  User-visible function that returns a MediocreInput instance intended for
+ *  loading  2D  data  arrays.  The  2D  arrays are not copied into internal
+ *  storage  and  must  remain  valid  for  the  lifetime  of  the  returned
+ *  MediocreInput  instance. However, the array of Mediocre2D objects itself
+ *  will be copied into the MediocreInput's internal storage, so that  array
+ *  can  be  safely  deleted after the function returns, as long as the data
+ *  pointed to by those Mediocre2D objects remains valid.
+ */
+MediocreInput mediocre_2D_input(Mediocre2D const* arrays, size_t count) {
+    return mediocre_scaled_2D_input(arrays, count, nullptr, nullptr);
+}
+
+MediocreInput mediocre_scaled_2D_input(
+    Mediocre2D const* arrays,
+    size_t count,
+    float const* scale,
+    float const* offset
+) {
+    MediocreInput result;
+    
+    result.loop_function = mediocre_2D_loop_function;
+    result.destructor = mediocre_2D_user_data_destructor;
+    result.user_data = nullptr; // Set later.
+    result.dimension.combine_count = count;
+    result.dimension.width = 0; // Set later.
+    result.nonzero_error = 0;
+    
+    Mediocre2DUserData* user_data = nullptr;
+    
+    if (count == 0) {
+        fprintf(stderr, "mediocre_2D_input:\n"
+            "count should not be zero (needs at least one input array).\n"
+        );
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    
+    size_t major_expected = arrays[0].major_width;
+    size_t minor_expected = arrays[0].minor_width;
+    result.dimension.width = major_expected * minor_expected;
+    
+    for (size_t i = 0; i < count; ++i) {
+        if (!array_is_okay(arrays[i], major_expected, minor_expected)) {
+            result.nonzero_error = EINVAL;
+            return result;
+        }
+    }
+    
+    try {
+        user_data = new Mediocre2DUserData;
+        user_data->plans.reserve(count);
+        
+        for (size_t i = 0; i < count; ++i) {
+            user_data->plans.push_back(make_load_plan(arrays[i], count));
+            if (scale != nullptr) user_data->plans[i].affine.scale = scale[i];
+            if (offset != nullptr) {
+                user_data->plans[i].affine.offset = offset[i];
+            }
+        }
+        // Don't write out user_data to the returned structure until
+        // we are sure it was successfully, fully constructed.
+        result.user_data = user_data;
+    } catch (std::bad_alloc&) {
+        fprintf(stderr,
+            "mediocre_2D_input: Could not allocate memory.\n"
+        );
+        result.nonzero_error = ENOMEM;
+        delete user_data;
+        return result;
+    } catch (...) {
+        fprintf(stderr, "mediocre_2D_input: Unknown error.\n");
+        result.nonzero_error = -1;
+        delete user_data;
+        return result;
+    }
+    
+    return result;
+}
+
+/*  Implement the raw binary file stack input. The files are mapped and then
+ *  loaded  with the same load plans as the Mediocre2D input, while the
+ *  Readahead streams the files through memory, so that stacks larger than
+ *  memory can be combined in one pass.
+ */
+struct RawFileUserData {
+    std::vector<MappedFile> files;
+    std::vector<size_t> header_offsets;
+    std::vector<LoadPlan> plans;
+    size_t item_size;
+};
+
+static int raw_file_loop_function(
+    MediocreInputControl* control,
+    void const* user_data_pv,
+    MediocreDimension maximum_request
+) {
+    (void)maximum_request;
+    
+    RawFileUserData const* user_data =
+        static_cast<RawFileUserData const*>(user_data_pv);
+    Readahead readahead;
+    
+    MediocreInputCommand command;
+    
+    try {
+        std::vector<LoadPlan> plans = combine_plans(user_data->plans);
+        MEDIOCRE_INPUT_LOOP(command, control) {
+            readahead.start_command(command);
+            for (size_t i = 0; i < command.dimension.combine_count; ++i) {
+                readahead.advise(
+                    user_data->files[i],
+                    user_data->header_offsets[i],
+                    user_data->item_size
+                );
+                plans[i].load(command, &plans[i], i);
+            }
+            readahead.finish_command();
+        }
     } catch (std::bad_alloc&) {
         fprintf(stderr,
-            "mediocre_masked_2D_input: Could not allocate memory.\n"
+            "mediocre_raw_file_input: Could not allocate memory.\n");
+        return ENOMEM;
+    }
+    
+    return 0;
+}
+
+static void raw_file_user_data_destructor(void* user_data_pv) {
+    delete static_cast<RawFileUserData*>(user_data_pv);
+}
+
+/*  User-visible function that returns a MediocreInput instance that  loads
+ *  a  stack of raw binary files, each holding a [rows] x [columns] C order
+ *  array of numbers of the type with the given  type  code,  starting  at
+ *  header_offsets[i] bytes into file i (header_offsets may be NULL if all
+ *  are 0). The files are mapped until the MediocreInput is destroyed.
+ */
+MediocreInput mediocre_raw_file_input(
+    char const* const* paths,
+    size_t count,
+    uintptr_t type_code,
+    size_t const* header_offsets,
+    size_t rows,
+    size_t columns
+) {
+    MediocreInput result;
+    
+    result.loop_function = raw_file_loop_function;
+    result.destructor = raw_file_user_data_destructor;
+    result.user_data = nullptr; // Set later.
+    result.dimension.combine_count = count;
+    result.dimension.width = rows * columns;
+    result.nonzero_error = 0;
+    
+    RawFileUserData* user_data = nullptr;
+    const size_t item_size = type_code_sizeof(type_code);
+    
+    if (count == 0) {
+        fprintf(stderr, "mediocre_raw_file_input:\n"
+            "count should not be zero (needs at least one input file).\n"
+        );
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    if (item_size == 0) {
+        fprintf(stderr, "mediocre_raw_file_input: "
+            "Unknown type code %zi.\n", size_t(type_code));
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    
+    try {
+        user_data = new RawFileUserData;
+        user_data->item_size = item_size;
+        user_data->files.reserve(count);
+        user_data->header_offsets.reserve(count);
+        user_data->plans.reserve(count);
+        
+        for (size_t i = 0; i < count; ++i) {
+            const size_t header = header_offsets ? header_offsets[i] : 0;
+            user_data->files.emplace_back();
+            MappedFile& file = user_data->files.back();
+            
+            int error = file.open(paths[i]);
+            if (error != 0) {
+                fprintf(stderr, "mediocre_raw_file_input: %s: %s\n",
+                    paths[i], strerror(error));
+                result.nonzero_error = error;
+                delete user_data;
+                return result;
+            }
+            if (file.length < header || 
+                (file.length - header) / item_size < rows * columns
+            ) {
+                fprintf(stderr, "mediocre_raw_file_input: %s: "
+                    "File too small for [%zi, %zi] array after %zi byte "
+                    "header.\n", paths[i], rows, columns, header);
+                result.nonzero_error = EINVAL;
+                delete user_data;
+                return result;
+            }
+            
+            Mediocre2D array = {
+                file.bytes() + header, type_code,
+                rows, columns * item_size, columns, item_size
+            };
+            user_data->header_offsets.push_back(header);
+            user_data->plans.push_back(make_load_plan(array, count));
+        }
+        // Don't write out user_data to the returned structure until
+        // we are sure it was successfully, fully constructed.
+        result.user_data = user_data;
+    } catch (std::bad_alloc&) {
+        fprintf(stderr,
+            "mediocre_raw_file_input: Could not allocate memory.\n"
         );
         result.nonzero_error = ENOMEM;
-        delete masked_user_data;
+        delete user_data;
         return result;
     } catch (...) {
-        fprintf(stderr, "mediocre_masked_2D_input: Unknown error.\n");
+        fprintf(stderr, "mediocre_raw_file_input: Unknown error.\n");
         result.nonzero_error = -1;
-        delete masked_user_data;
+        delete user_data;
         return result;
     }
     
     return result;
 }
 
-struct Mediocre2DUserData {
-    std::vector<Mediocre2D> arrays;
+/*  Implement the asynchronous raw file input, which loads the same files
+ *  as the raw file input but reads them through a ReadPipeline.
+ */
+struct AsyncFileUserData {
+    mutable ReadPipeline pipeline;
+    StagedLoadFunction load;
 };
 
-static int mediocre_2D_loop_function(
+static int async_file_loop_function(
     MediocreInputControl* control,
     void const* user_data_pv,
     MediocreDimension maximum_request
 ) {
-    (void)maximum_request;
+    AsyncFileUserData const* user_data =
+        static_cast<AsyncFileUserData const*>(user_data_pv);
+    ReadPipeline& pipeline = user_data->pipeline;
     
-    std::vector<Mediocre2D> const& arrays =
-        static_cast<Mediocre2DUserData const*>(user_data_pv)->arrays;
+    int error = pipeline.start(maximum_request.width);
+    if (error != 0) {
+        fprintf(stderr, "mediocre_async_file_input: %s\n", strerror(error));
+        return error;
+    }
     
     MediocreInputCommand command;
     
     MEDIOCRE_INPUT_LOOP(command, control) {
-        assert(command.dimension.combine_count == arrays.size());
+        size_t slot;
+        error = pipeline.wait(command, &slot);
+        if (error != 0) {
+            fprintf(stderr, "mediocre_async_file_input: read failed: %s\n",
+                strerror(error));
+            return error;
+        }
         for (size_t i = 0; i < command.dimension.combine_count; ++i) {
-            Mediocre2D data = arrays[i];
-            
-            switch (data.type_code) {
-              default:
-                fprintf(stderr, "Mediocre2D input loop:\n"
-                    "Unknown data type_code %zi (array number [%zi]).\n",
-                    data.type_code, i
-                );
-                return EINVAL;
-              break; case 8:
-                load_data<int8_t>(command, data, i);
-              break; case 16:
-                load_data<int16_t>(command, data, i);
-              break; case 32:
-                load_data<int32_t>(command, data, i);
-              break; case 64:
-                load_data<int64_t>(command, data, i);
-              break; case 108:
-                load_data<uint8_t>(command, data, i);
-              break; case 116:
-                load_data<uint16_t>(command, data, i);
-              break; case 132:
-                load_data<uint32_t>(command, data, i);
-              break; case 164:
-                load_data<uint64_t>(command, data, i);
-              break; case 0xF:
-                load_data<float>(command, data, i);
-              break; case 0xD:
-                load_data<double>(command, data, i);
+            user_data->load(command, pipeline.data(slot, i), i);
+        }
+        pipeline.recycle(slot);
+    }
+    
+    return 0;
+}
+
+static void async_file_user_data_destructor(void* user_data_pv) {
+    delete static_cast<AsyncFileUserData*>(user_data_pv);
+}
+
+/*  User-visible function that returns a MediocreInput instance that loads
+ *  the  same  stack  of  raw  binary files as mediocre_raw_file_input, but
+ *  reads them with io_thread_count I/O threads (a few if  0),  optionally
+ *  with O_DIRECT, into staging buffers ahead of the combine.
+ */
+MediocreInput mediocre_async_file_input(
+    char const* const* paths,
+    size_t count,
+    uintptr_t type_code,
+    size_t const* header_offsets,
+    size_t rows,
+    size_t columns,
+    size_t io_thread_count,
+    int direct
+) {
+    MediocreInput result;
+    
+    result.loop_function = async_file_loop_function;
+    result.destructor = async_file_user_data_destructor;
+    result.user_data = nullptr; // Set later.
+    result.dimension.combine_count = count;
+    result.dimension.width = rows * columns;
+    result.nonzero_error = 0;
+    
+    AsyncFileUserData* user_data = nullptr;
+    const size_t item_size = type_code_sizeof(type_code);
+    
+    if (count == 0) {
+        fprintf(stderr, "mediocre_async_file_input:\n"
+            "count should not be zero (needs at least one input file).\n"
+        );
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    if (item_size == 0) {
+        fprintf(stderr, "mediocre_async_file_input: "
+            "Unknown type code %zi.\n", size_t(type_code));
+        result.nonzero_error = EINVAL;
+        return result;
+    }
+    
+    try {
+        user_data = new AsyncFileUserData;
+        user_data->load = choose_staged_loader(type_code);
+        
+        ReadPipeline& pipeline = user_data->pipeline;
+        pipeline.source.set_shape(item_size, rows * columns);
+        
+        for (size_t i = 0; i < count; ++i) {
+            const size_t header = header_offsets ? header_offsets[i] : 0;
+            int error = pipeline.source.add_file(
+                paths[i], header, direct != 0);
+            if (error == EINVAL) {
+                fprintf(stderr, "mediocre_async_file_input: %s: "
+                    "File too small for [%zi, %zi] array after %zi byte "
+                    "header.\n", paths[i], rows, columns, header);
+            } else if (error != 0) {
+                fprintf(stderr, "mediocre_async_file_input: %s: %s\n",
+                    paths[i], strerror(error));
+            }
+            if (error != 0) {
+                result.nonzero_error = error;
+                delete user_data;
+                return result;
             }
         }
+        
+        int error = pipeline.start_threads(
+            io_thread_count != 0 ? io_thread_count : 4);
+        if (error != 0) {
+            fprintf(stderr, "mediocre_async_file_input: "
+                "Could not start I/O threads: %s\n", strerror(error));
+            result.nonzero_error = error;
+            delete user_data;
+            return result;
+        }
+        // Don't write out user_data to the returned structure until
+        // we are sure it was successfully, fully constructed.
+        result.user_data = user_data;
+    } catch (std::bad_alloc&) {
+        fprintf(stderr,
+            "mediocre_async_file_input: Could not allocate memory.\n"
+        );
+        result.nonzero_error = ENOMEM;
+        delete user_data;
+        return result;
+    } catch (...) {
+        fprintf(stderr, "mediocre_async_file_input: Unknown error.\n");
+        result.nonzero_error = -1;
+        delete user_data;
+        return result;
+    }
+    
+    return result;
+}
+
+/*  Implement the FITS image stack input, which streams the images  out  of
+ *  the mapped files like the raw file input does.
+ */
+struct FitsUserData {
+    std::vector<MappedFile> files;
+    std::vector<FitsPlan> plans;
+    mutable Readahead readahead;
+};
+
+static int fits_loop_function(
+    MediocreInputControl* control,
+    void const* user_data_pv,
+    MediocreDimension maximum_request
+) {
+    (void)maximum_request;
+    
+    FitsUserData const* user_data =
+        static_cast<FitsUserData const*>(user_data_pv);
+    FitsPlan const* plans = user_data->plans.data();
+    Readahead& readahead = user_data->readahead;
+    
+    MediocreInputCommand command;
+    
+    MEDIOCRE_INPUT_LOOP(command, control) {
+        readahead.start_command(command);
+        for (size_t i = 0; i < command.dimension.combine_count; ++i) {
+            readahead.advise(
+                user_data->files[i], plans[i].data_offset, plans[i].item_size
+            );
+            plans[i].load(command, &plans[i],
+                plans[i].data + command.offset * plans[i].item_size, i);
+        }
+        readahead.finish_command();
     }
     
     return 0;
 }
 
-static void mediocre_2D_user_data_destructor(void* user_data_pv) {
-    delete static_cast<Mediocre2DUserData*>(user_data_pv);
+static void fits_user_data_destructor(void* user_data_pv) {
+    delete static_cast<FitsUserData*>(user_data_pv);
 }
 
-/*  User-visible function that returns a MediocreInput instance intended for
- *  loading  2D  data  arrays.  The  2D  arrays are not copied into internal
- *  storage  and  must  remain  valid  for  the  lifetime  of  the  returned
- *  MediocreInput  instance. However, the array of Mediocre2D objects itself
- *  will be copied into the MediocreInput's internal storage, so that  array
- *  can  be  safely  deleted after the function returns, as long as the data
- *  pointed to by those Mediocre2D objects remains valid.
+/*  User-visible function that finds the shape of the image in HDU number hdu
+ *  of the FITS file at path, which may be a tile-compressed image (see
+ *  mediocre.h). Returns 0 or an errno value.
  */
-MediocreInput mediocre_2D_input(Mediocre2D const* arrays, size_t count) {
+int mediocre_fits_image_shape(
+    char const* path,
+    size_t hdu,
+    size_t* rows,
+    size_t* columns
+) {
+    MappedFile file;
+    FitsHeader header;
+    
+    int error = file.open(path);
+    if (error != 0) {
+        fprintf(stderr, "mediocre_fits_image_shape: %s: %s\n",
+            path, strerror(error));
+        return error;
+    }
+    
+    FitsCards cards;
+    error = find_fits_hdu(file, path, hdu, &cards);
+    if (error != 0) return error;
+    if (hdu != 0 && cards.logical("ZIMAGE")) {
+        const std::vector<size_t> axes = cards.axes("ZNAXIS");
+        if (axes.empty()) {
+            fprintf(stderr, "%s: HDU %zi has no 1D or 2D image.\n",
+                path, hdu);
+            return EINVAL;
+        }
+        *rows = axes.size() >= 2 ? axes[1] : 1;
+        *columns = axes[0];
+        return 0;
+    }
+    
+    error = read_fits_header(file, path, hdu, &header);
+    if (error != 0) return error;
+    
+    *rows = header.rows;
+    *columns = header.columns;
+    return 0;
+}
+
+/*  User-visible function that returns a MediocreInput  instance  loading  the
+ *  images in HDU number hdu of [count] FITS files (see mediocre.h).
+ */
+MediocreInput mediocre_fits_input(
+    char const* const* paths,
+    size_t count,
+    size_t hdu
+) {
     MediocreInput result;
     
-    result.loop_function = mediocre_2D_loop_function;
-    result.destructor = mediocre_2D_user_data_destructor;
+    result.loop_function = fits_loop_function;
+    result.destructor = fits_user_data_destructor;
     result.user_data = nullptr; // Set later.
     result.dimension.combine_count = count;
     result.dimension.width = 0; // Set later.
     result.nonzero_error = 0;
     
-    Mediocre2DUserData* user_data = nullptr;
+    FitsUserData* user_data = nullptr;
     
     if (count == 0) {
-        fprintf(stderr, "mediocre_2D_input:\n"
-            "count should not be zero (needs at least one input array).\n"
+        fprintf(stderr, "mediocre_fits_input:\n"
+            "count should not be zero (needs at least one input file).\n"
         );
         result.nonzero_error = EINVAL;
         return result;
     }
     
-    size_t major_expected = arrays[0].major_width;
-    size_t minor_expected = arrays[0].minor_width;
-    result.dimension.width = major_expected * minor_expected;
+    try {
+        user_data = new FitsUserData;
+        user_data->files.reserve(count);
+        user_data->plans.reserve(count);
+        size_t rows_expected = 0;
+        size_t columns_expected = 0;
+        
+        for (size_t i = 0; i < count; ++i) {
+            FitsHeader header;
+            user_data->files.emplace_back();
+            MappedFile& file = user_data->files.back();
+            
+            int error = file.open(paths[i]);
+            if (error != 0) {
+                fprintf(stderr, "mediocre_fits_input: %s: %s\n",
+                    paths[i], strerror(error));
+            } else {
+                error = read_fits_header(file, paths[i], hdu, &header);
+            }
+            if (error == 0 && i == 0) {
+                rows_expected = header.rows;
+                columns_expected = header.columns;
+            } else if (error == 0 && (header.rows != rows_expected
+                || header.columns != columns_expected)
+            ) {
+                fprintf(stderr, "mediocre_fits_input: %s: "
+                    "Expected [%zi, %zi] image, found [%zi, %zi].\n",
+                    paths[i], rows_expected, columns_expected,
+                    header.rows, header.columns);
+                error = EINVAL;
+            }
+            if (error != 0) {
+                result.nonzero_error = error;
+                delete user_data;
+                return result;
+            }
+            user_data->plans.push_back(
+                make_fits_plan(header, file.bytes() + header.data_offset));
+        }
+        result.dimension.width = rows_expected * columns_expected;
+        // Don't write out user_data to the returned structure until
+        // we are sure it was successfully, fully constructed.
+        result.user_data = user_data;
+    } catch (std::bad_alloc&) {
+        fprintf(stderr, "mediocre_fits_input: Could not allocate memory.\n");
+        result.nonzero_error = ENOMEM;
+        delete user_data;
+        return result;
+    } catch (...) {
+        fprintf(stderr, "mediocre_fits_input: Unknown error.\n");
+        result.nonzero_error = -1;
+        delete user_data;
+        return result;
+    }
     
-    for (size_t i = 0; i < count; ++i) {
-        if (!array_is_okay(arrays[i], major_expected, minor_expected)) {
-            result.nonzero_error = EINVAL;
-            return result;
+    return result;
+}
+
+/*  Implement the Rice-compressed FITS input, which converts each command
+ *  from staging buffers that a DecodePipeline decodes the tiles into.
+ */
+struct RiceFitsUserData {
+    mutable DecodePipeline pipeline;
+    std::vector<FitsPlan> plans;
+};
+
+static int rice_fits_loop_function(
+    MediocreInputControl* control,
+    void const* user_data_pv,
+    MediocreDimension maximum_request
+) {
+    RiceFitsUserData const* user_data =
+        static_cast<RiceFitsUserData const*>(user_data_pv);
+    DecodePipeline& pipeline = user_data->pipeline;
+    FitsPlan const* plans = user_data->plans.data();
+    
+    int error = pipeline.start(maximum_request.width);
+    if (error != 0) {
+        fprintf(stderr, "mediocre_rice_fits_input: %s\n", strerror(error));
+        return error;
+    }
+    
+    MediocreInputCommand command;
+    
+    MEDIOCRE_INPUT_LOOP(command, control) {
+        size_t slot;
+        error = pipeline.wait(command, &slot);
+        if (error != 0) {
+            fprintf(stderr, "mediocre_rice_fits_input: decoding failed: %s\n",
+                strerror(error));
+            return error;
+        }
+        for (size_t i = 0; i < command.dimension.combine_count; ++i) {
+            plans[i].load(command, &plans[i],
+                static_cast<char const*>(pipeline.data(slot, i)), i);
         }
+        pipeline.recycle(slot);
+    }
+    
+    return 0;
+}
+
+static void rice_fits_user_data_destructor(void* user_data_pv) {
+    delete static_cast<RiceFitsUserData*>(user_data_pv);
+}
+
+/*  User-visible function that returns a MediocreInput instance loading the
+ *  Rice tile-compressed images in HDU number hdu of [count] FITS files,
+ *  decoded by decoder_thread_count threads (a few if 0) as the combine
+ *  goes (see mediocre.h).
+ */
+MediocreInput mediocre_rice_fits_input(
+    char const* const* paths,
+    size_t count,
+    size_t hdu,
+    size_t decoder_thread_count
+) {
+    MediocreInput result;
+    
+    result.loop_function = rice_fits_loop_function;
+    result.destructor = rice_fits_user_data_destructor;
+    result.user_data = nullptr; // Set later.
+    result.dimension.combine_count = count;
+    result.dimension.width = 0; // Set later.
+    result.nonzero_error = 0;
+    
+    RiceFitsUserData* user_data = nullptr;
+    
+    if (count == 0) {
+        fprintf(stderr, "mediocre_rice_fits_input:\n"
+            "count should not be zero (needs at least one input file).\n"
+        );
+        result.nonzero_error = EINVAL;
+        return result;
     }
     
     try {
-        user_data = new Mediocre2DUserData;
-        user_data->arrays.reserve(count);
+        user_data = new RiceFitsUserData;
+        RiceDecoder& decoder = user_data->pipeline.source;
+        user_data->plans.reserve(count);
         
         for (size_t i = 0; i < count; ++i) {
-            user_data->arrays.push_back(arrays[i]);
+            int error = decoder.add_image(paths[i], hdu);
+            if (error != 0) {
+                result.nonzero_error = error;
+                delete user_data;
+                return result;
+            }
+            user_data->plans.push_back(
+                make_fits_plan(decoder.image(i).header, nullptr));
+        }
+        
+        int error = user_data->pipeline.start_threads(
+            decoder_thread_count != 0 ? decoder_thread_count : 4);
+        if (error != 0) {
+            fprintf(stderr, "mediocre_rice_fits_input: "
+                "Could not start decoder threads: %s\n", strerror(error));
+            result.nonzero_error = error;
+            delete user_data;
+            return result;
         }
+        result.dimension.width = decoder.width();
         // Don't write out user_data to the returned structure until
         // we are sure it was successfully, fully constructed.
         result.user_data = user_data;
     } catch (std::bad_alloc&) {
         fprintf(stderr,
-            "mediocre_2D_input: Could not allocate memory.\n"
+            "mediocre_rice_fits_input: Could not allocate memory.\n"
         );
         result.nonzero_error = ENOMEM;
         delete user_data;
         return result;
     } catch (...) {
-        fprintf(stderr, "mediocre_2D_input: Unknown error.\n");
+        fprintf(stderr, "mediocre_rice_fits_input: Unknown error.\n");
         result.nonzero_error = -1;
         delete user_data;
         return result;
@@ -38,14 +38,16 @@ struct clipped_mean_result {
 
 /*  Calculate 8 clipped means of the 8 columns of [combine_count] numbers.
  *  The 8 columns are passed in chunk format. Return the 8 clipped means and
- *  the final 8 clipping bounds for those 8 means.
+ *  the final 8 clipping bounds for those 8 means. If skip_nan is true,  NaN
+ *  numbers are left out of the means (NaN if a column is all NaN).
  */
 static inline struct clipped_mean_result clipped_mean_m256(
     __m256 const* chunk,
     size_t combine_count,
     __m256d sigma_lower,
     __m256d sigma_upper,
-    size_t max_iter
+    size_t max_iter,
+    int skip_nan
 ) {
     // bounds is the current clipping bounds, which will be updated
     // per iteration. We start with the least restrictive bounds
@@ -90,7 +92,7 @@ static inline struct clipped_mean_result clipped_mean_m256(
             // count, respectively, only if the lane's number was in range.
             // (Add zero if it wasn't - this shouldn't have an effect).
             __m256 const vec = chunk[i];
-            __m256 const mask = sigma_mask(vec, bounds);
+            __m256 const mask = sigma_mask_nan(vec, bounds, skip_nan);
             
             sum = _mm256_add_ps(sum, _mm256_blendv_ps(vec, zero, mask));
             count = _mm256_add_ps(count, _mm256_blendv_ps(one, zero, mask));
@@ -119,7 +121,8 @@ static inline struct clipped_mean_result clipped_mean_m256(
             clipped_mean,           // center
             count,                  // clipped_count
             sigma_lower,            // sigma_lower (double vector)
-            sigma_upper             // sigma_upper (double vector)
+            sigma_upper,            // sigma_upper (double vector)
+            skip_nan                // skip_nan
         );
     }
     
@@ -136,14 +139,17 @@ static inline struct clipped_mean_result clipped_mean_m256(
  *  passed  within  one  array.  These  arrays are passed as subarrays[0 ...
  *  combine_count - 1] (chunks) within the in2D array. The clipped  mean  of
  *  each  lane  of  floats  is  written  to  the out array. Interpreting the
- *  pointers as pointer to float instead of to __m256,
+ *  in2D pointer as pointer to float instead of to __m256,
  *      out[8x + y]
  *  corresponds to the clipped mean of every 8th float in the range
  *      in2D[8*x*combine_count + y ... 8*(x+1)*combine_count + y - 8]
  *  (see example below)
  *  
  *    ** out
- *  array [0 ... chunk_count - 1] of __m256
+ *  array [0 ... width - 1] of float, not necessarily aligned.
+ *    ** width
+ *  number of floats to write to out (the last chunk  is  only  written  as
+ *  far as out[width - 1]; see mediocre_store_chunk).
  *    ** in2D
  *  array [0 ... chunk_count * combine_count - 1] of __m256
  *  (list of [chunk_count] chunks of [combine_count] __m256 vectors.
@@ -159,6 +165,8 @@ static inline struct clipped_mean_result clipped_mean_m256(
  *  vector of 4 identical positive doubles.
  *    ** max_iter
  *  maximum number of iterations of sigma clipping to be performed.
+ *    ** skip_nan
+ *  if true, leave NaN numbers (masked out or missing data) out of the mean.
  *  
  *  Example memory layout for combine_count = 4, chunk_count = 3 (3 * 8 = 24
  *  columns  of  4  floats  total).  Each  of  the  4 numbers stored in in2D
@@ -176,13 +184,15 @@ static inline struct clipped_mean_result clipped_mean_m256(
  *      +320:   G H I J K L M N  G H I J K L M N
  */ 
 static void clipped_mean_chunk_m256(
-    __m256* out,
+    float* out,
+    size_t width,
     __m256 const* in2D,
     size_t combine_count,
     size_t chunk_count,
     __m256d sigma_lower,
     __m256d sigma_upper,
-    size_t max_iter
+    size_t max_iter,
+    int skip_nan
 ) {
     assert(chunk_count >= 1);
     assert(combine_count >= 1);
@@ -192,15 +202,15 @@ static void clipped_mean_chunk_m256(
         __m256 const* const chunk = in2D + c * combine_count;
         
         struct clipped_mean_result result = clipped_mean_m256(
-            chunk, combine_count, sigma_lower, sigma_upper, max_iter
+            chunk, combine_count, sigma_lower, sigma_upper, max_iter, skip_nan
         );
         
-        out[c] = result.clipped_mean;
+        mediocre_store_chunk(out, width, c, result.clipped_mean);
     }
 }
 
 /*  Calculate the scaled mean (I'll explain later) of  data  passed  in  the
- *  same  format  as  for  clipped  mean.  The  first six arguments (out ...
+ *  same  format  as  for  clipped  mean.  The first seven arguments (out ...
  *  sigma_upper) have the same format as in the clipped mean function.
  *  
  *  The scaled mean was  designed  with  the  use  case  of  combining  many
@@ -215,7 +225,8 @@ static void clipped_mean_chunk_m256(
  *  times).
  *  
  *  Arguments:
- *    ** out, in2D, combine_count, chunk_count, sigma_lower, sigma_upper
+ *    ** out, width, in2D, combine_count, chunk_count, sigma_lower, sigma_upper
+ *    ** max_iter, skip_nan
  *  Same as in clipped_mean_chunk_m256
  *    ** scaled_scratch
  *  Array of [combine_count] __m256 vectors for temporary storage
@@ -231,13 +242,15 @@ static void clipped_mean_chunk_m256(
  *  division is just too darn slow.
  */
 static void scaled_mean_chunk_m256(
-    __m256* out,
+    float* out,
+    size_t width,
     __m256 const* in2D,
     size_t combine_count,
     size_t chunk_count,
     __m256d sigma_lower,
     __m256d sigma_upper,
     size_t max_iter,
+    int skip_nan,
     __m256* scaled_scratch,
     float const* scale_factors,
     float const* recip_factors
@@ -261,7 +274,8 @@ static void scaled_mean_chunk_m256(
         
         // Get the clipping bounds based on the scaled quantities.
         struct ClipBoundsM256 bounds = clipped_mean_m256(
-            scaled_scratch, combine_count, sigma_lower, sigma_upper, max_iter
+            scaled_scratch, combine_count,
+            sigma_lower, sigma_upper, max_iter, skip_nan
         ).bounds;
         
         // Now that we have the bounds for the scaled quantities, use them
@@ -281,7 +295,8 @@ static void scaled_mean_chunk_m256(
         //      WeightedMean = (x1+x2) / (w1+w2)
         __m256 qty_sum = zero, wt_sum = zero;
         for (size_t i = 0; i < combine_count; ++i) {
-            __m256 const mask = sigma_mask(scaled_scratch[i], bounds);
+            __m256 const mask = sigma_mask_nan(
+                scaled_scratch[i], bounds, skip_nan);
             __m256 const array_weight = _mm256_broadcast_ss(scale_factors + i);
             __m256 const masked_qty = _mm256_blendv_ps(chunk[i], zero, mask);
             __m256 const masked_wt = _mm256_blendv_ps(array_weight, zero, mask);
@@ -290,7 +305,7 @@ static void scaled_mean_chunk_m256(
             wt_sum = _mm256_add_ps(wt_sum, masked_wt);
         }
         
-        out[c] = _mm256_div_ps(qty_sum, wt_sum);
+        mediocre_store_chunk(out, width, c, _mm256_div_ps(qty_sum, wt_sum));
     }
 }
 
@@ -302,6 +317,7 @@ struct arguments {
     double sigma_lower;
     double sigma_upper;
     size_t max_iter;
+    int skip_nan;
 };
 
 static int clipped_loop_function(
@@ -315,20 +331,16 @@ static int clipped_loop_function(
     const __m256d sigma_lower = _mm256_set1_pd(arguments_ptr->sigma_lower);
     const __m256d sigma_upper = _mm256_set1_pd(arguments_ptr->sigma_upper);
     const size_t max_iter = arguments_ptr->max_iter;
+    const int skip_nan = arguments_ptr->skip_nan;
     
     MediocreFunctorCommand command;
     
-    MEDIOCRE_FUNCTOR_LOOP(command, control) {
+    // The (clipped) mean only reads its input, so it can use lent chunks.
+    MEDIOCRE_READ_ONLY_FUNCTOR_LOOP(command, control) {
         // Divide the requested width by 8 (rounded up) to get the chunk count.
         size_t chunk_count = (command.dimension.width + 7) / 8;
         
-        __m256* temp_output = mediocre_functor_aligned_temp(command, control);
-        
-        if (temp_output == NULL) {
-            perror("mediocre_clipped_mean_functor\n"
-                "could not allocated temp_output");
-            return errno == 0 ? -1 : errno;
-        } else if (command.dimension.combine_count > max_combine_count) {
+        if (command.dimension.combine_count > max_combine_count) {
             fprintf(stderr, "mediocre_clipped_mean_functor\n"
                 "too many arrays to be combined [%zi > %zi]\n",
                 command.dimension.combine_count, max_combine_count
@@ -336,15 +348,16 @@ static int clipped_loop_function(
             return E2BIG;
         } else {
             clipped_mean_chunk_m256(
-                temp_output,
+                command.output,
+                command.dimension.width,
                 command.input_chunks,
                 command.dimension.combine_count,
                 chunk_count,
                 sigma_lower,
                 sigma_upper,
-                max_iter
+                max_iter,
+                skip_nan
             );
-            mediocre_functor_write_temp(command, temp_output);
         }
     }
     
@@ -359,7 +372,7 @@ MediocreFunctor mediocre_mean_functor() {
     // The mean functor will just be the clipped mean functor set to run with
     // zero iterations of sigma clipping.
     static const struct arguments no_sigma_clipping = {
-        3.0, 3.0, 0
+        3.0, 3.0, 0, 0
     };
     
     MediocreFunctor result;
@@ -372,8 +385,23 @@ MediocreFunctor mediocre_mean_functor() {
     return result;
 }
 
-MediocreFunctor mediocre_clipped_mean_functor2(
-    double sigma_lower, double sigma_upper, size_t max_iter
+MediocreFunctor mediocre_nan_mean_functor() {
+    static const struct arguments no_sigma_clipping_skip_nan = {
+        3.0, 3.0, 0, 1
+    };
+    
+    MediocreFunctor result;
+    
+    result.loop_function = clipped_loop_function;
+    result.destructor = no_op;
+    result.user_data = &no_sigma_clipping_skip_nan;
+    result.nonzero_error = 0;
+    
+    return result;
+}
+
+static MediocreFunctor clipped_mean_functor(
+    double sigma_lower, double sigma_upper, size_t max_iter, int skip_nan
 ) {
     MediocreFunctor result;
     result.loop_function = clipped_loop_function;
@@ -402,6 +430,7 @@ MediocreFunctor mediocre_clipped_mean_functor2(
         args->sigma_lower = sigma_lower;
         args->sigma_upper = sigma_upper;
         args->max_iter = max_iter;
+        args->skip_nan = skip_nan;
         
         result.user_data = args;
         result.nonzero_error = 0;
@@ -410,6 +439,18 @@ MediocreFunctor mediocre_clipped_mean_functor2(
     }
 }
 
+MediocreFunctor mediocre_clipped_mean_functor2(
+    double sigma_lower, double sigma_upper, size_t max_iter
+) {
+    return clipped_mean_functor(sigma_lower, sigma_upper, max_iter, 0);
+}
+
+MediocreFunctor mediocre_nan_clipped_mean_functor2(
+    double sigma_lower, double sigma_upper, size_t max_iter
+) {
+    return clipped_mean_functor(sigma_lower, sigma_upper, max_iter, 1);
+}
+
 /*  Implement the scaled  mean  loop  function,  user  data  structure,  and
  *  MediocreFunctor factory.
  */
@@ -417,6 +458,7 @@ struct scaled_arguments {
     double sigma_lower;
     double sigma_upper;
     size_t max_iter;
+    int skip_nan;
     size_t combine_count;
     float const* scale_factors;
     float const* recip_factors;
@@ -436,22 +478,21 @@ static int scaled_loop_function(
         return EINVAL;
     }
     
-    void* scratch_pv = NULL;
-    errno = posix_memalign(
-        &scratch_pv,
-        sizeof(__m256),
-        maximum_request.combine_count * sizeof(__m256)
+    __m256* scratch = (__m256*)mediocre_functor_scratch(
+        control,
+        maximum_request.combine_count * sizeof(__m256),
+        sizeof(__m256)
     );
     
-    if (errno != 0) {
+    if (scratch == NULL) {
         perror("mediocre_clipped_mean_functor could not allocate memory");
         return (errno == 0 ? -1 : errno);
     }
     
-    __m256* scratch = (__m256*)scratch_pv;
     __m256d sigma_lower = _mm256_broadcast_sd(&args->sigma_lower);
     __m256d sigma_upper = _mm256_broadcast_sd(&args->sigma_upper);
     size_t const max_iter = args->max_iter;
+    int const skip_nan = args->skip_nan;
     float const* scale_factors = args->scale_factors;
     float const* recip_factors = args->recip_factors;
     
@@ -459,18 +500,12 @@ static int scaled_loop_function(
     
     int error_code = 0;
     
-    MEDIOCRE_FUNCTOR_LOOP(command, control) {
+    // Scaling goes into scratch, so the input is only read.
+    MEDIOCRE_READ_ONLY_FUNCTOR_LOOP(command, control) {
         // Divide the requested width by 8 (rounded up) to get the chunk count.
         size_t chunk_count = (command.dimension.width + 7) / 8;
         
-        __m256* temp_output = mediocre_functor_aligned_temp(command, control);
-        
-        if (temp_output == NULL) {
-            perror("mediocre_scaled_mean_functor\n"
-                "could not allocated temp_output");
-            error_code = errno;
-            break;
-        } else if (command.dimension.combine_count > max_combine_count) {
+        if (command.dimension.combine_count > max_combine_count) {
             fprintf(stderr, "mediocre_scaled_mean_functor\n"
                 "too many arrays to be combined [%zi > %zi]\n",
                 command.dimension.combine_count, max_combine_count
@@ -479,32 +514,32 @@ static int scaled_loop_function(
             break;
         } else {
             scaled_mean_chunk_m256(
-                temp_output,
+                command.output,
+                command.dimension.width,
                 command.input_chunks,
                 command.dimension.combine_count,
                 chunk_count,
                 sigma_lower,
                 sigma_upper,
                 max_iter,
+                skip_nan,
                 scratch,
                 scale_factors,
                 recip_factors
             );
-            
-            mediocre_functor_write_temp(command, temp_output);
         }
     }
     
-    free(scratch);
     return error_code;
 }
 
-MediocreFunctor mediocre_scaled_mean_functor2(
+static MediocreFunctor scaled_mean_functor(
     float const* scale_factors,
     size_t scale_count,
     double sigma_lower,
     double sigma_upper,
-    size_t max_iter
+    size_t max_iter,
+    int skip_nan
 ) {
     // Initialize the MediocreFunctor result (with NULL for user data for now)
     // and check the arguments for illegal values.
@@ -560,6 +595,7 @@ MediocreFunctor mediocre_scaled_mean_functor2(
     args->sigma_lower = sigma_lower;
     args->sigma_upper = sigma_upper;
     args->max_iter = max_iter;
+    args->skip_nan = skip_nan;
     args->combine_count = scale_count;
     args->scale_factors = scale;
     args->recip_factors = recip;
@@ -573,3 +609,26 @@ MediocreFunctor mediocre_scaled_mean_functor2(
     return result;
 }
 
+MediocreFunctor mediocre_scaled_mean_functor2(
+    float const* scale_factors,
+    size_t scale_count,
+    double sigma_lower,
+    double sigma_upper,
+    size_t max_iter
+) {
+    return scaled_mean_functor(
+        scale_factors, scale_count, sigma_lower, sigma_upper, max_iter, 0
+    );
+}
+
+MediocreFunctor mediocre_nan_scaled_mean_functor2(
+    float const* scale_factors,
+    size_t scale_count,
+    double sigma_lower,
+    double sigma_upper,
+    size_t max_iter
+) {
+    return scaled_mean_functor(
+        scale_factors, scale_count, sigma_lower, sigma_upper, max_iter, 1
+    );
+}
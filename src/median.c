@@ -55,6 +55,126 @@ static int is_sorted_m256(__m256 const* in, size_t vector_count) {
     return _mm256_movemask_ps(bits) == 0;
 }
 
+/*  Calculate the medians of the numbers within the clipping bounds in  the
+ *  8 lanes of the sorted chunk of combine_count vectors, and store the count
+ *  of those numbers in each lane in *clipped_count. The counting is done in
+ *  a single pass with the amazing, enigmatic, terrifying counter  variable.
+ *  If  skip_nan  is  true,  the  chunk  may  have  NaN at the top of each
+ *  lane (after the sorted numbers), which counts as being above the  upper
+ *  bound.
+ *  
+ *  Each lane of the counter variable indirectly encodes  information  about
+ *  where  the  median  of  the in-range numbers is within the corresponding
+ *  lane of the sorted list of all numbers. In the  second  loop,  where  we
+ *  iterate backwards through the chunk, the counter variable sort of stores
+ *  the remaining distance (plus half) to each median in each lane, assuming
+ *  that none of the numbers in the chunk are above the clipping range. Each
+ *  iteration the lanes of the counter are decremented  by  one  because  in
+ *  each  iteration  we  get one unit closer to the median. If a lane of the
+ *  counter is one-half, then we reached the correct median position for  an
+ *  odd-length  list,  and  we  store the number at that position as the new
+ *  median. If a lane of the counter is one or zero, then we are a half-unit
+ *  above  or  below  the  median's  position,  and  we  store  half of each
+ *  position's value such that  the  sum  of  those  values  is  the  median
+ *  (average of the numbers on the two sides of the median position).
+ *  
+ *  Of course, the assumption that all  of  the  numbers  we  visit  in  the
+ *  backwards  iteration  will  be  in  bounds is false (more precisely, the
+ *  assumption that none will be above the upper bound is false). So, if the
+ *  number  at  the  position  being  visited  in the backwards iteration is
+ *  out-of-range, we decrement the corresponding lane of the counter by only
+ *  a  half  instead  of  one,  since although we got one unit closer to the
+ *  median, we also discover that the  actual  position  of  the  median  is
+ *  one-half of a unit farther away than we assumed (because the size of the
+ *  list of in-bounds numbers shrank by one).
+ *  
+ *  To set up the counter, we assume that the median is at the exact halfway
+ *  point  of  the chunk , initializing the value of the counter to one plus
+ *  half of the length of the chunk using the initial_counter variable, then
+ *  iterate  forwards  from the beginning and decrement by half each time we
+ *  see a number that is below  the  clipping  range  (indicating  that  the
+ *  position  of the median is a half-unit closer to the end of the subarray
+ *  than we had assumed).
+ */
+static inline __m256 median_within_bounds(
+    __m256 const* chunk,
+    size_t combine_count,
+    struct ClipBoundsM256 bounds,
+    __m256* clipped_count_ptr,
+    int skip_nan
+) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 one  = _mm256_set1_ps(1.0f);
+    
+    __m256 counter = _mm256_set1_ps(combine_count * 0.5f + 1.0f);
+    __m256 clipped_count = _mm256_set1_ps((float)combine_count);
+    
+    size_t i = 0, not_finished = 1;
+    
+    // Forwards iteration loop. Exit once none of the numbers in any
+    // of the lanes are below the lower bound of the clipping range.
+    while (not_finished && i < combine_count) {
+        __m256 tmp = chunk[i++];
+        tmp = _mm256_cmp_ps(tmp, bounds.lower, _CMP_LT_OQ);
+        not_finished = _mm256_movemask_ps(tmp);
+        
+        clipped_count = _mm256_sub_ps(clipped_count,
+            _mm256_blendv_ps(zero, one, tmp)
+        );
+        tmp = _mm256_blendv_ps(zero, half, tmp);
+        counter = _mm256_sub_ps(counter, tmp);
+    }
+    
+    // Backwards iteration loop. Exit once all of the medians (or the
+    // 2 half-terms of a median of an even length list) are collected.
+    i = combine_count;
+    __m256 clipped_median = _mm256_setzero_ps();
+    do {
+        __m256 const data = chunk[--i];
+        __m256 const mask = skip_nan
+            ? _mm256_cmp_ps(data, bounds.upper, _CMP_NLE_UQ)
+            : _mm256_cmp_ps(data, bounds.upper, _CMP_GT_OQ);
+        
+        counter = _mm256_sub_ps(counter,
+            _mm256_blendv_ps(one, half, mask)
+        );
+        clipped_count = _mm256_sub_ps(clipped_count,
+            _mm256_blendv_ps(zero, one, mask)
+        );
+        
+        // If there is at least one non-negative number in counter,
+        // then there are still some medians that have not been found.
+        not_finished = _mm256_movemask_ps(counter) == 0xFF ? 0 : -1;
+        
+        __m256 multiplier = _mm256_blendv_ps(
+            zero, half, _mm256_cmp_ps(counter, one, _CMP_EQ_OQ)
+        );
+        multiplier = _mm256_or_ps(multiplier,
+            _mm256_blendv_ps(
+                zero, one, _mm256_cmp_ps(counter, half, _CMP_EQ_OQ)
+            )
+        );
+        multiplier = _mm256_or_ps(multiplier,
+            _mm256_blendv_ps(
+                zero, half, _mm256_cmp_ps(counter, zero, _CMP_EQ_OQ)
+            )
+        );
+        __m256 term = _mm256_mul_ps(multiplier, data);
+        if (skip_nan) {
+            // 0 * NaN is NaN, so drop the terms that aren't part of a median
+            // instead of counting on the multiplier.
+            term = _mm256_blendv_ps(
+                term, zero, _mm256_cmp_ps(multiplier, zero, _CMP_EQ_OQ)
+            );
+        }
+        clipped_median = _mm256_add_ps(clipped_median, term);
+    } while ((i & not_finished));
+    
+    *clipped_count_ptr = clipped_count;
+    return clipped_median;
+}
+
 /*  Calculate the sigma clipped median of groups of floating  point  numbers
  *  with  lower  and upper sigma bounds passed as specified below. Here, the
  *  sigma  clipped  median  of  a  group  of  numbers  is  defined  as  this
@@ -77,15 +197,18 @@ static int is_sorted_m256(__m256 const* in, size_t vector_count) {
  *  there  are chunk_count of them. The in2D array will be used as temporary
  *  storage within this function,  and  will  have  unspecified  value  upon
  *  return.  The clipped median of each lane of floats is written to the out
- *  array. Interpreting  the  pointers  as  pointers  to  float  instead  of
- *  to__m256,
+ *  array. Interpreting the in2D pointer as a pointer to float  instead  of
+ *  to __m256,
  *      out[8x + y]
  *  corresponds to the clipped median of every 8th float in the range
  *      in2D[8*x*combine_count + y ... 8*(x+1)*combine_count + y - 8]
  *  (see example below)
  *  
  *    ** out
- *  array [0 ... chunk_count - 1] of __m256
+ *  array [0 ... width - 1] of float, not necessarily aligned.
+ *    ** width
+ *  number of floats to write to out (the last chunk  is  only  written  as
+ *  far as out[width - 1]; see mediocre_store_chunk).
  *    ** in2D
  *  array [0 ... chunk_count * combine_count - 1] of __m256
  *  in2D's CONTENTS WILL HAVE UNSPECIFIED VALUE AFTER THE FUNCTION RETURNS.
@@ -101,6 +224,9 @@ static int is_sorted_m256(__m256 const* in, size_t vector_count) {
  *  vector of 4 identical positive doubles.
  *    ** max_iter
  *  maximum number of iterations of sigma clipping to be performed.
+ *    ** skip_nan
+ *  if true, leave NaN numbers (masked out or missing data) out of the
+ *  medians (NaN if a column is all NaN).
  *    ** scratch
  *  array [0 ... combine_count - 1] of  __m256  (for  temporary  storage  in
  *  sorting a chunk of 8 columns of numbers).
@@ -121,13 +247,15 @@ static int is_sorted_m256(__m256 const* in, size_t vector_count) {
  *      +320:   G H I J K L M N  G H I J K L M N 
  */
 static inline void clipped_median_chunk_m256(
-    __m256* out,
+    float* out,
+    size_t width,
     __m256* in2D,
     size_t combine_count,
     size_t chunk_count,
     __m256d sigma_lower,
     __m256d sigma_upper,
     size_t max_iter,
+    int skip_nan,
     __m256* scratch
 ) {
     assert(chunk_count >= 1);
@@ -137,72 +265,67 @@ static inline void clipped_median_chunk_m256(
     const __m256 zero = _mm256_setzero_ps();
     const __m256 half = _mm256_set1_ps(0.5f);
     const __m256 one  = _mm256_set1_ps(1.0f);
-    
-    // More about this later.
-    const __m256 initial_counter = _mm256_set1_ps(combine_count * 0.5f + 1.0f);
+    const __m256 infinity = _mm256_set1_ps(1.f/0.f);
+    const __m256 nan = _mm256_set1_ps(0.f/0.f);
     
     for (size_t g = 0; g < chunk_count; ++g) {
         __m256* chunk = in2D + g * combine_count;
         
+        // The count of numbers in each lane that are not NaN (all of them,
+        // unless we skip NaN). We sort NaN as +infinity, then put it back
+        // at the top of each lane, where the median search treats it as
+        // above the clipping range.
+        __m256 valid_count = _mm256_set1_ps((float)combine_count);
+        if (skip_nan) {
+            valid_count = zero;
+            for (size_t i = 0; i < combine_count; ++i) {
+                __m256 const is_nan = _mm256_cmp_ps(
+                    chunk[i], chunk[i], _CMP_UNORD_Q
+                );
+                valid_count = _mm256_add_ps(valid_count,
+                    _mm256_blendv_ps(one, zero, is_nan)
+                );
+                chunk[i] = _mm256_blendv_ps(chunk[i], infinity, is_nan);
+            }
+        }
+        
         // We will sort the chunk and work with only the sorted numbers.
         // Selection algorithm is neat but not easy to paralellize, so we sort.
         mergesort_m256(chunk, combine_count, scratch);
         assert(is_sorted_m256(chunk, combine_count));
         
-        // The count of numbers in each lane that are within the clipping range.
-        __m256 clipped_count = _mm256_set1_ps((float)combine_count);
+        struct ClipBoundsM256 bounds = {
+            _mm256_set1_ps(-1.f/0.f), _mm256_set1_ps(1.f/0.f)
+        };
+        
+        // The count of numbers in each lane that are within the clipping
+        // range, and the median of those numbers.
+        __m256 clipped_count;
+        __m256 clipped_median;
         
-        // That same quantity in the previous iteration. If the counts for the
+        if (skip_nan) {
+            for (size_t i = 0; i < combine_count; ++i) {
+                __m256 const past_valid = _mm256_cmp_ps(
+                    _mm256_set1_ps((float)i), valid_count, _CMP_GE_OQ
+                );
+                chunk[i] = _mm256_blendv_ps(chunk[i], nan, past_valid);
+            }
+            clipped_median = median_within_bounds(
+                chunk, combine_count, bounds, &clipped_count, 1
+            );
+        } else {
+            clipped_count = valid_count;
+            clipped_median = _mm256_add_ps(
+                _mm256_mul_ps(half, chunk[(combine_count-1)/2]),
+                _mm256_mul_ps(half, chunk[combine_count/2])
+            );
+        }
+        
+        // That same count in the previous iteration. If the counts for the
         // previous iteration of sigma clipping are the same as the counts for
         // this iteration, then we can finish iteration early.
         __m256 previous_count = clipped_count;
         
-        // Calculate the median of all of the numbers.
-        __m256 clipped_median = _mm256_add_ps(
-            _mm256_mul_ps(half, chunk[(combine_count-1)/2]),
-            _mm256_mul_ps(half, chunk[combine_count/2])
-        );
-        
-        struct ClipBoundsM256 bounds = {
-            _mm256_set1_ps(-1.f/0.f), _mm256_set1_ps(1.f/0.f)
-        };        
-/*  In each iteration, calculate  the  median  of  the  numbers  within  the
- *  recalculated clipping bounds. The amazing, enigmatic, terrifying counter
- *  variable has a lot to do with this recalculation.
- *  
- *  Each lane of the counter variable indirectly encodes  information  about
- *  where  the  median  of  the in-range numbers is within the corresponding
- *  lane of the sorted list of all numbers. In the  second  loop,  where  we
- *  iterate backwards through the chunk, the counter variable sort of stores
- *  the remaining distance (plus half) to each median in each lane, assuming
- *  that none of the numbers in the chunk are above the clipping range. Each
- *  iteration the lanes of the counter are decremented  by  one  because  in
- *  each  iteration  we  get one unit closer to the median. If a lane of the
- *  counter is one-half, then we reached the correct median position for  an
- *  odd-length  list,  and  we  store the number at that position as the new
- *  median. If a lane of the counter is one or zero, then we are a half-unit
- *  above  or  below  the  median's  position,  and  we  store  half of each
- *  position's value such that  the  sum  of  those  values  is  the  median
- *  (average of the numbers on the two sides of the median position).
- *  
- *  Of course, the assumption that all  of  the  numbers  we  visit  in  the
- *  backwards  iteration  will  be  in  bounds is false (more precisely, the
- *  assumption that none will be above the upper bound is false). So, if the
- *  number  at  the  position  being  visited  in the backwards iteration is
- *  out-of-range, we decrement the corresponding lane of the counter by only
- *  a  half  instead  of  one,  since although we got one unit closer to the
- *  median, we also discover that the  actual  position  of  the  median  is
- *  one-half of a unit farther away than we assumed (because the size of the
- *  list of in-bounds numbers shrank by one).
- *  
- *  To set up the counter, we assume that the median is at the exact halfway
- *  point  of  the chunk , initializing the value of the counter to one plus
- *  half of the length of the chunk using the initial_counter variable, then
- *  iterate  forwards  from the beginning and decrement by half each time we
- *  see a number that is below  the  clipping  range  (indicating  that  the
- *  position  of the median is a half-unit closer to the end of the subarray
- *  than we had assumed).
- */
         for (size_t iter = 0; iter != max_iter; ++iter) {
             bounds = get_new_clip_bounds(
                 chunk,                  // data
@@ -211,75 +334,22 @@ static inline void clipped_median_chunk_m256(
                 clipped_median,         // center
                 clipped_count,          // clipped_count
                 sigma_lower,            // sigma_lower
-                sigma_upper             // sigma_upper
+                sigma_upper,            // sigma_upper
+                skip_nan                // skip_nan
             );
             
-            __m256 counter = initial_counter;
-            clipped_count = _mm256_set1_ps((float)combine_count);
-            
-            size_t i = 0, not_finished = 1;
-            
-            // Forwards iteration loop. Exit once none of the numbers in any
-            // of the lanes are below the lower bound of the clipping range.
-            while (not_finished && i < combine_count) {
-                __m256 tmp = chunk[i++];
-                tmp = _mm256_cmp_ps(tmp, bounds.lower, _CMP_LT_OQ);
-                not_finished = _mm256_movemask_ps(tmp);
-                
-                clipped_count = _mm256_sub_ps(clipped_count,
-                    _mm256_blendv_ps(zero, one, tmp)
-                );
-                tmp = _mm256_blendv_ps(zero, half, tmp);
-                counter = _mm256_sub_ps(counter, tmp);
-            }
-            
-            // Backwards iteration loop. Exit once all of the medians (or the
-            // 2 half-terms of a median of an even length list) are collected.
-            i = combine_count;
-            clipped_median = _mm256_setzero_ps();
-            int clipped_count_changed;
-            do {
-                __m256 const data = chunk[--i];
-                __m256 mask = _mm256_cmp_ps(data, bounds.upper, _CMP_GT_OQ);
-                
-                counter = _mm256_sub_ps(counter,
-                    _mm256_blendv_ps(one, half, mask)
-                );
-                clipped_count = _mm256_sub_ps(clipped_count,
-                    _mm256_blendv_ps(zero, one, mask)
-                );
-                
-                clipped_count_changed = _mm256_movemask_ps(
-                    _mm256_cmp_ps(clipped_count, previous_count, _CMP_NEQ_OQ)
-                );
-                
-                // If there is at least one non-negative number in counter,
-                // then there are still some medians that have not been found.
-                not_finished = _mm256_movemask_ps(counter) == 0xFF ? 0 : -1;
-                
-                __m256 multiplier = _mm256_blendv_ps(
-                    zero, half, _mm256_cmp_ps(counter, one, _CMP_EQ_OQ)
-                );
-                multiplier = _mm256_or_ps(multiplier,
-                    _mm256_blendv_ps(
-                        zero, one, _mm256_cmp_ps(counter, half, _CMP_EQ_OQ)
-                    )
-                );
-                multiplier = _mm256_or_ps(multiplier,
-                    _mm256_blendv_ps(
-                        zero, half, _mm256_cmp_ps(counter, zero, _CMP_EQ_OQ)
-                    )
-                );
-                clipped_median = _mm256_add_ps(clipped_median,
-                    _mm256_mul_ps(multiplier, data)
-                );
-            } while ((i & not_finished));
+            clipped_median = median_within_bounds(
+                chunk, combine_count, bounds, &clipped_count, skip_nan
+            );
             
             // Do the comparisons and possible early exit for the clipped count.
+            int clipped_count_changed = _mm256_movemask_ps(
+                _mm256_cmp_ps(clipped_count, previous_count, _CMP_NEQ_OQ)
+            );
             if (!clipped_count_changed) break;
             previous_count = clipped_count;
         }
-        out[g] = clipped_median;
+        mediocre_store_chunk(out, width, g, clipped_median);
     }
 }
 
@@ -287,6 +357,7 @@ struct arguments {
     double sigma_lower;
     double sigma_upper;
     size_t max_iter;
+    int skip_nan;
 };
 
 static int loop_function(
@@ -299,20 +370,19 @@ static int loop_function(
     const __m256d sigma_lower = _mm256_set1_pd(arguments_ptr->sigma_lower);
     const __m256d sigma_upper = _mm256_set1_pd(arguments_ptr->sigma_upper);
     const size_t max_iter = arguments_ptr->max_iter;
+    const int skip_nan = arguments_ptr->skip_nan;
     
-    void* scratch_pv = NULL;
-    errno = posix_memalign(
-        &scratch_pv,
-        sizeof(__m256),
-        maximum_request.combine_count * sizeof(__m256)
+    __m256* scratch = (__m256*)mediocre_functor_scratch(
+        control,
+        maximum_request.combine_count * sizeof(__m256),
+        sizeof(__m256)
     );
     
-    if (errno != 0) {
+    if (scratch == NULL) {
         perror("mediocre_clipped_median_functor could not allocate memory");
         return (errno == 0 ? -1 : errno);
     }
     
-    __m256* scratch = (__m256*)scratch_pv;
     MediocreFunctorCommand command;
     
     int error_code = 0;
@@ -321,14 +391,7 @@ static int loop_function(
         // Divide the requested width by 8 (rounded up) to get the chunk count.
         size_t chunk_count = (command.dimension.width + 7) / 8;
         
-        __m256* temp_output = mediocre_functor_aligned_temp(command, control);
-        
-        if (temp_output == NULL) {
-            perror("mediocre_clipped_median_functor\n"
-                "could not allocated temp_output");
-            error_code = errno;
-            break;
-        } else if (command.dimension.combine_count > max_combine_count) {
+        if (command.dimension.combine_count > max_combine_count) {
             fprintf(stderr, "mediocre_clipped_mean_functor\n"
                 "too many arrays to be combined [%zi > %zi]\n",
                 command.dimension.combine_count, max_combine_count
@@ -337,21 +400,20 @@ static int loop_function(
             break;
         } else {
             clipped_median_chunk_m256(
-                temp_output,
+                command.output,
+                command.dimension.width,
                 command.input_chunks,
                 command.dimension.combine_count,
                 chunk_count,
                 sigma_lower,
                 sigma_upper,
                 max_iter,
+                skip_nan,
                 scratch
             );
-            
-            mediocre_functor_write_temp(command, temp_output);
         }
     }
     
-    free(scratch);
     return error_code;
 }
 
@@ -363,7 +425,7 @@ MediocreFunctor mediocre_median_functor() {
     // The median functor will just be the clipped median functor set to run
     // with zero iterations of sigma clipping.
     static const struct arguments no_sigma_clipping = {
-        3.0, 3.0, 0
+        3.0, 3.0, 0, 0
     };
     
     MediocreFunctor result;
@@ -376,8 +438,23 @@ MediocreFunctor mediocre_median_functor() {
     return result;
 }
 
-MediocreFunctor mediocre_clipped_median_functor2(
-    double sigma_lower, double sigma_upper, size_t max_iter
+MediocreFunctor mediocre_nan_median_functor() {
+    static const struct arguments no_sigma_clipping_skip_nan = {
+        3.0, 3.0, 0, 1
+    };
+    
+    MediocreFunctor result;
+    
+    result.loop_function = loop_function;
+    result.destructor = no_op;
+    result.user_data = &no_sigma_clipping_skip_nan;
+    result.nonzero_error = 0;
+    
+    return result;
+}
+
+static MediocreFunctor clipped_median_functor(
+    double sigma_lower, double sigma_upper, size_t max_iter, int skip_nan
 ) {
     MediocreFunctor result;
     result.loop_function = loop_function;
@@ -404,6 +481,7 @@ MediocreFunctor mediocre_clipped_median_functor2(
         args->sigma_lower = sigma_lower;
         args->sigma_upper = sigma_upper;
         args->max_iter = max_iter;
+        args->skip_nan = skip_nan;
         
         result.user_data = args;
         result.nonzero_error = 0;
@@ -412,6 +490,18 @@ MediocreFunctor mediocre_clipped_median_functor2(
     }
 }
 
+MediocreFunctor mediocre_clipped_median_functor2(
+    double sigma_lower, double sigma_upper, size_t max_iter
+) {
+    return clipped_median_functor(sigma_lower, sigma_upper, max_iter, 0);
+}
+
+MediocreFunctor mediocre_nan_clipped_median_functor2(
+    double sigma_lower, double sigma_upper, size_t max_iter
+) {
+    return clipped_median_functor(sigma_lower, sigma_upper, max_iter, 1);
+}
+
 /**************************************************************************
  *                                                                        *
  *                           THE END (really)                             *
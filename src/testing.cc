@@ -96,6 +96,27 @@ void sort_floats(float* array, size_t size) noexcept {
     std::sort(array, array + size);
 }
 
+// Replace entries of the arrays with missing at random (see testing.h).
+void punch_holes(
+    Random* r,
+    uint16_t* const* arrays,
+    size_t array_count,
+    size_t bin_count,
+    uint32_t rate,
+    uint16_t missing
+) noexcept {
+    for (size_t b = 0; b < bin_count; ++b) {
+        const uint32_t kind = random_dist_u32(r, 0, 15);
+        const size_t keep = random_dist_u32(r, 0, uint32_t(array_count - 1));
+        for (size_t a = 0; a < array_count; ++a) {
+            bool hole = random_dist_u32(r, 1, rate) == 1;
+            if (kind == 0) hole = true;
+            if (kind == 1) hole = a != keep;
+            if (hole) arrays[a][b] = missing;
+        }
+    }
+}
+
 /*  Initialize a canary page with space for data_size bytes of  data  and  a
  *  canary  of  canary_size bytes. The canary is optional and is useful only
  *  for substituting softer errors for segfaults. If the canary is set to  0
@@ -0,0 +1,213 @@
+/*  An aggresively average SIMD combine library
+ *  Copyright (C) 2017 David Akeley
+ *  
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mediocre.h"
+#include "testing.h"
+
+// Input that loads float arrays and can be told to fail partway through
+// the combine, which is how we pretend that the process was killed.
+// min_offset records the smallest offset that the input was asked to load,
+// so we can check that a resumed combine really skipped the finished part.
+struct FailingInput {
+    float const* const* arrays;
+    size_t commands_until_failure; // 0 means never fail.
+    size_t min_offset;
+};
+
+static int failing_input_loop(
+    MediocreInputControl* control,
+    void const* user_data,
+    MediocreDimension dimension
+) {
+    MediocreInputCommand command;
+    struct FailingInput* input = (struct FailingInput*)user_data;
+    size_t commands = 0;
+    
+    (void)dimension;
+    
+    MEDIOCRE_INPUT_LOOP(command, control) {
+        if (++commands == input->commands_until_failure) return EINTR;
+        
+        const size_t offset = command.offset;
+        const size_t array_count = command.dimension.combine_count;
+        if (offset < input->min_offset) input->min_offset = offset;
+        
+        for (size_t a = 0; a != array_count; ++a) {
+            for (size_t n = 0; n != command.dimension.width; ++n) {
+                *mediocre_chunk_ptr(command.output_chunks, array_count, a, n) =
+                    input->arrays[a][offset + n];
+            }
+        }
+    }
+    
+    return 0;
+}
+
+static void no_op(void* ignored) {
+    (void)ignored;
+}
+
+static MediocreInput failing_input(
+    struct FailingInput* user_data,
+    size_t combine_count,
+    size_t width
+) {
+    MediocreInput result;
+    
+    user_data->min_offset = SIZE_MAX;
+    result.loop_function = failing_input_loop;
+    result.destructor = no_op;
+    result.user_data = user_data;
+    result.dimension.combine_count = combine_count;
+    result.dimension.width = width;
+    result.nonzero_error = 0;
+    
+    return result;
+}
+
+static struct Random* generator;
+
+static void read_output(char const* path, float* out, size_t width) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL || fread(out, sizeof(float), width, file) != width) {
+        perror("could not read checkpointed output");
+        exit(1);
+    }
+    fclose(file);
+}
+
+static void test_checkpoint(
+    size_t array_count, size_t width, int thread_count
+) {
+    printf("Seed = %llu\n", (unsigned long long)get_seed(generator));
+    printf("\tCheckpointed mean of %zi arrays of %zi floats, %i threads.\n",
+        array_count, width, thread_count);
+    
+    float** arrays = (float**)malloc(array_count * sizeof(float*));
+    for (size_t a = 0; a < array_count; ++a) {
+        arrays[a] = (float*)malloc(width * sizeof(float) + 1);
+        for (size_t n = 0; n < width; ++n) {
+            arrays[a][n] = (float)random_dist_u32(generator, 0, 65535);
+        }
+    }
+    
+    char output_path[] = "/tmp/mediocre_checkpoint_output_XXXXXX";
+    char journal_path[] = "/tmp/mediocre_checkpoint_journal_XXXXXX";
+    close(mkstemp(output_path));
+    close(mkstemp(journal_path));
+    
+    float* expected = (float*)malloc(width * sizeof(float) + 1);
+    float* actual = (float*)malloc(width * sizeof(float) + 1);
+    struct FailingInput input;
+    int status;
+    
+    input.arrays = (float const* const*)arrays;
+    input.commands_until_failure = 0;
+    status = mediocre_combine(
+        expected,
+        failing_input(&input, array_count, width),
+        mediocre_mean_functor(),
+        thread_count
+    );
+    if (status != 0) {
+        perror("reference combine failed");
+        exit(1);
+    }
+    
+    // Kill the first attempt partway through, then resume it.
+    const size_t command_width = 160000 / array_count;
+    const size_t command_count = width / (command_width + 1) + 1;
+    input.commands_until_failure =
+        random_dist_u32(generator, 1, (uint32_t)command_count + 1);
+    status = mediocre_combine_checkpoint(
+        output_path,
+        journal_path,
+        failing_input(&input, array_count, width),
+        mediocre_mean_functor(),
+        thread_count
+    );
+    if (status != EINTR && status != 0) {
+        perror("interrupted checkpointed combine failed incorrectly");
+        exit(1);
+    }
+    
+    input.commands_until_failure = 0;
+    status = mediocre_combine_checkpoint(
+        output_path,
+        journal_path,
+        failing_input(&input, array_count, width),
+        mediocre_mean_functor(),
+        thread_count
+    );
+    if (status != 0) {
+        perror("resumed checkpointed combine failed");
+        exit(1);
+    }
+    printf("\tresumed at offset %zi.\n",
+        input.min_offset == SIZE_MAX ? width : input.min_offset);
+    
+    read_output(output_path, actual, width);
+    for (size_t i = 0; i < width; ++i) {
+        if (expected[i] != actual[i]) {
+            printf("[%zi] %f != %f\n", i, expected[i], actual[i]);
+            exit(1);
+        }
+    }
+    
+    // A finished combine should not ask the input for anything.
+    status = mediocre_combine_checkpoint(
+        output_path,
+        journal_path,
+        failing_input(&input, array_count, width),
+        mediocre_mean_functor(),
+        thread_count
+    );
+    if (status != 0 || input.min_offset != SIZE_MAX) {
+        printf("Finished checkpointed combine was run again.\n");
+        exit(1);
+    }
+    
+    unlink(output_path);
+    unlink(journal_path);
+    free(actual);
+    free(expected);
+    for (size_t a = 0; a < array_count; ++a) free(arrays[a]);
+    free(arrays);
+}
+
+int main() {
+    generator = new_random();
+    
+    // Journal every round of commands, so the interrupted combines get to
+    // record some progress before they fail.
+    mediocre_checkpoint_seconds = 0;
+    
+    for (size_t i = 0; i < 200; ++i) {
+        size_t array_count = random_dist_u32(generator, 1, 60);
+        size_t width = random_dist_u32(generator, 0, 400000);
+        int thread_count = (int)random_dist_u32(generator, 0, 8);
+        test_checkpoint(array_count, width, thread_count);
+    }
+}
@@ -0,0 +1,677 @@
+/*  An aggresively average SIMD combine library
+ *  Copyright (C) 2017 David Akeley
+ *  
+ *  Tests for the MediocreInput types that load straight from files. Each
+ *  test writes a stack of random arrays to temporary files (raw binary, or
+ *  FITS fixtures generated here, some Rice-compressed), combines them with
+ *  the mean functor, and compares with the mean calculated here.
+ *  
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timeb.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "mediocre.hpp"
+#include "testing.h"
+
+static const uint32_t max_axis_size = 700;
+static const uint32_t max_combine_count = 12;
+static const uint32_t max_header_size = 300;
+
+static struct Random* generator = new_random();
+const auto seed = get_seed(generator);
+MediocreFunctor mean_functor = mediocre_mean_functor();
+
+// Temporary file that deletes itself.
+struct TempFile {
+    std::string path;
+    
+    TempFile() {
+        char name[] = "/tmp/mediocre_file_input_XXXXXX";
+        int fd = mkstemp(name);
+        if (fd < 0) {
+            perror("mkstemp");
+            exit(1);
+        }
+        close(fd);
+        path = name;
+    }
+    
+    ~TempFile() {
+        unlink(path.c_str());
+    }
+    
+    void write(std::vector<char> const& bytes) const {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr
+            || fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()
+            || fclose(file) != 0
+        ) {
+            perror(path.c_str());
+            exit(1);
+        }
+    }
+};
+
+template <typename T>
+static T random_number() {
+    if (std::is_integral<T>::value) {
+        return T(137 * random_u32(generator));
+    } else {
+        return T(137.035999139 * random_u32(generator));
+    }
+}
+
+static void check_result(
+    std::vector<float> const& result, std::vector<float> const& expected
+) {
+    for (size_t x = 0; x < expected.size(); ++x) {
+        if (result[x] != expected[x]) {
+            printf("[%zi] %f != %f\n", x, result[x], expected[x]);
+            exit(1);
+        }
+    }
+}
+
+// Test the raw binary file input with random (unaligned) header sizes.
+template <typename T>
+static void test_raw_files(char const* type_label) {
+    const size_t combine_count =
+        random_dist_u32(generator, 1, max_combine_count);
+    const size_t rows = random_dist_u32(generator, 1, max_axis_size);
+    const size_t columns = random_dist_u32(generator, 1, max_axis_size);
+    const size_t width = rows * columns;
+    
+    std::vector<TempFile> files(combine_count);
+    std::vector<char const*> paths;
+    std::vector<size_t> header_offsets;
+    std::vector<float> expected(width, 0.0f);
+    
+    for (size_t i = 0; i < combine_count; ++i) {
+        const size_t header = random_dist_u32(generator, 0, max_header_size);
+        std::vector<char> bytes(header + width * sizeof(T));
+        for (size_t b = 0; b < header; ++b) bytes[b] = char(b);
+        
+        for (size_t x = 0; x < width; ++x) {
+            T t = random_number<T>();
+            memcpy(&bytes[header + x*sizeof(T)], &t, sizeof(T));
+            expected[x] += float(t);
+        }
+        files[i].write(bytes);
+        paths.push_back(files[i].path.c_str());
+        header_offsets.push_back(header);
+    }
+    for (float& f : expected) f /= float(combine_count);
+    
+    printf("\tSeed = %zi\n", size_t(seed));
+    printf("\tAveraging %zi raw %s files of [%zi, %zi]\n",
+        combine_count, type_label, rows, columns);
+    
+    MediocreInput input = mediocre_raw_file_input(
+        paths.data(), combine_count,
+        mediocre::type_code(static_cast<T const*>(nullptr)),
+        header_offsets.data(), rows, columns
+    );
+    struct timeb begin_time;
+    ftime(&begin_time);
+    std::vector<float> result = mediocre::combine(input, mean_functor, 2);
+    printf("\x1b[32m\x1b[1m%s raw file input: ", type_label);
+    print_timer_elapsed(begin_time, width * combine_count);
+    printf("\x1b[0m\n");
+    
+    check_result(result, expected);
+    
+    // Combining again with the same input has to give the same result.
+    check_result(mediocre::combine(input, mean_functor, 2), expected);
+    mediocre_input_destroy(input);
+    
+    // The asynchronous input reads the same files, with or without
+    // O_DIRECT (which falls back to plain reads where it isn't supported).
+    const size_t io_threads = random_dist_u32(generator, 0, 4);
+    const int direct = int(random_dist_u32(generator, 0, 1));
+    input = mediocre_async_file_input(
+        paths.data(), combine_count,
+        mediocre::type_code(static_cast<T const*>(nullptr)),
+        header_offsets.data(), rows, columns, io_threads, direct
+    );
+    ftime(&begin_time);
+    result = mediocre::combine(input, mean_functor, 2);
+    printf("\x1b[33m\x1b[1m%s async file input (%zi I/O threads%s): ",
+        type_label, io_threads, direct ? ", O_DIRECT" : "");
+    print_timer_elapsed(begin_time, width * combine_count);
+    printf("\x1b[0m\n");
+    
+    check_result(result, expected);
+    check_result(mediocre::combine(input, mean_functor, 2), expected);
+    mediocre_input_destroy(input);
+    
+    // A file that's too short should be an error.
+    header_offsets[combine_count - 1] += 1;
+    input = mediocre_raw_file_input(
+        paths.data(), combine_count,
+        mediocre::type_code(static_cast<T const*>(nullptr)),
+        header_offsets.data(), rows, columns
+    );
+    if (input.nonzero_error != EINVAL) {
+        printf("Expected EINVAL for short file, got %i\n",
+            input.nonzero_error);
+        exit(1);
+    }
+    mediocre_input_destroy(input);
+    
+    input = mediocre_async_file_input(
+        paths.data(), combine_count,
+        mediocre::type_code(static_cast<T const*>(nullptr)),
+        header_offsets.data(), rows, columns, 0, 0
+    );
+    if (input.nonzero_error != EINVAL) {
+        printf("Expected EINVAL for short file (async), got %i\n",
+            input.nonzero_error);
+        exit(1);
+    }
+    mediocre_input_destroy(input);
+}
+
+/*  Writing FITS fixtures: append one 80 character header card, or pad the
+ *  file out to a whole number of 2880 byte blocks.
+ */
+static void fits_card(
+    std::vector<char>* bytes, char const* key, std::string const& value
+) {
+    char card[81];
+    if (value.empty()) {
+        snprintf(card, sizeof card, "%-80s", key);
+    } else {
+        snprintf(card, sizeof card, "%-8s= %20s%50s", key, value.c_str(), "");
+    }
+    bytes->insert(bytes->end(), card, card + 80);
+}
+
+static void fits_pad(std::vector<char>* bytes, char fill) {
+    while (bytes->size() % 2880 != 0) bytes->push_back(fill);
+}
+
+static std::string fits_value(double number) {
+    char value[32];
+    snprintf(value, sizeof value, "%.17G", number);
+    return value;
+}
+
+// Write one image HDU holding big-endian numbers of type T, and return the
+// floats that mediocre_fits_input should turn them into.
+template <typename T>
+static std::vector<float> write_fits_image(
+    std::vector<char>* bytes,
+    bool primary,
+    long bitpix,
+    size_t rows,
+    size_t columns,
+    double bscale,
+    double bzero
+) {
+    if (primary) {
+        fits_card(bytes, "SIMPLE", "T");
+    } else {
+        fits_card(bytes, "XTENSION", "'IMAGE   '");
+    }
+    fits_card(bytes, "BITPIX", fits_value(double(bitpix)));
+    fits_card(bytes, "NAXIS", "2");
+    fits_card(bytes, "NAXIS1", fits_value(double(columns)));
+    fits_card(bytes, "NAXIS2", fits_value(double(rows)));
+    if (!primary) {
+        fits_card(bytes, "PCOUNT", "0");
+        fits_card(bytes, "GCOUNT", "1");
+    }
+    // Leave out the default scaling sometimes, to check the defaults.
+    if (bscale != 1.0 || bzero != 0.0 || random_u32(generator) % 2) {
+        fits_card(bytes, "BSCALE", fits_value(bscale));
+        fits_card(bytes, "BZERO", fits_value(bzero));
+    }
+    fits_card(bytes, "END", "");
+    fits_pad(bytes, ' ');
+    
+    std::vector<float> physical(rows * columns);
+    for (float& f : physical) {
+        const T stored = random_number<T>();
+        char big_endian[sizeof(T)];
+        memcpy(big_endian, &stored, sizeof(T));
+        std::reverse(big_endian, big_endian + sizeof(T));
+        bytes->insert(bytes->end(), big_endian, big_endian + sizeof(T));
+        f = float(double(stored) * bscale + bzero);
+    }
+    fits_pad(bytes, '\0');
+    return physical;
+}
+
+// Write a FITS file with a random image of type T in HDU number hdu (with
+// small images in the HDUs before it to skip over), and random scaling.
+template <typename T>
+static std::vector<float> write_fits_file(
+    TempFile const& file, long bitpix, size_t hdu, size_t rows, size_t columns
+) {
+    std::vector<char> bytes;
+    
+    if (hdu != 0) {
+        fits_card(&bytes, "SIMPLE", "T");
+        fits_card(&bytes, "BITPIX", "8");
+        fits_card(&bytes, "NAXIS", "0");
+        fits_card(&bytes, "EXTEND", "T");
+        fits_card(&bytes, "END", "");
+        fits_pad(&bytes, ' ');
+    }
+    for (size_t h = 1; h < hdu; ++h) {
+        write_fits_image<int16_t>(&bytes, false, 16, 3, 1000 + h, 1.0, 0.0);
+    }
+    
+    double bscale = 1.0;
+    double bzero = 0.0;
+    switch (random_u32(generator) % 3) {
+      case 1:
+        // The BZERO FITS uses for unsigned (or for BITPIX 8, signed) data.
+        if (bitpix == 8) bzero = -128.0;
+        if (bitpix == 16) bzero = 32768.0;
+        if (bitpix == 32) bzero = 2147483648.0;
+      break; case 2:
+        bscale = (1 + random_u32(generator) % 4000) / 1024.0;
+        bzero = int32_t(random_u32(generator)) / 4096.0;
+    }
+    std::vector<float> physical = write_fits_image<T>(
+        &bytes, hdu == 0, bitpix, rows, columns, bscale, bzero);
+    file.write(bytes);
+    return physical;
+}
+
+static void test_fits() {
+    const size_t combine_count =
+        random_dist_u32(generator, 1, max_combine_count);
+    const size_t rows = random_dist_u32(generator, 1, max_axis_size);
+    const size_t columns = random_dist_u32(generator, 1, max_axis_size);
+    const size_t width = rows * columns;
+    const size_t hdu = random_dist_u32(generator, 0, 2);
+    
+    std::vector<TempFile> files(combine_count);
+    std::vector<char const*> paths;
+    std::vector<float> expected(width, 0.0f);
+    
+    for (size_t i = 0; i < combine_count; ++i) {
+        std::vector<float> physical;
+        switch (random_u32(generator) % 5) {
+          case 0: physical =
+            write_fits_file<uint8_t>(files[i], 8, hdu, rows, columns);
+          break; case 1: physical =
+            write_fits_file<int16_t>(files[i], 16, hdu, rows, columns);
+          break; case 2: physical =
+            write_fits_file<int32_t>(files[i], 32, hdu, rows, columns);
+          break; case 3: physical =
+            write_fits_file<float>(files[i], -32, hdu, rows, columns);
+          break; case 4: physical =
+            write_fits_file<double>(files[i], -64, hdu, rows, columns);
+        }
+        for (size_t x = 0; x < width; ++x) expected[x] += physical[x];
+        paths.push_back(files[i].path.c_str());
+    }
+    for (float& f : expected) f /= float(combine_count);
+    
+    printf("\tSeed = %zi\n", size_t(seed));
+    printf("\tAveraging %zi FITS images of [%zi, %zi] in HDU %zi\n",
+        combine_count, rows, columns, hdu);
+    
+    size_t shape_rows = 0, shape_columns = 0;
+    if (mediocre_fits_image_shape(paths[0], hdu, &shape_rows, &shape_columns)
+        != 0 || shape_rows != rows || shape_columns != columns
+    ) {
+        printf("Wrong FITS image shape [%zi, %zi]\n",
+            shape_rows, shape_columns);
+        exit(1);
+    }
+    
+    MediocreInput input = mediocre_fits_input(
+        paths.data(), combine_count, hdu);
+    struct timeb begin_time;
+    ftime(&begin_time);
+    std::vector<float> result = mediocre::combine(input, mean_functor, 2);
+    printf("\x1b[32m\x1b[1mFITS input: ");
+    print_timer_elapsed(begin_time, width * combine_count);
+    printf("\x1b[0m\n");
+    mediocre_input_destroy(input);
+    
+    check_result(result, expected);
+    
+    // Asking for an HDU past the end should be an error.
+    input = mediocre_fits_input(paths.data(), combine_count, hdu + 1);
+    if (input.nonzero_error != EINVAL) {
+        printf("Expected EINVAL for missing HDU, got %i\n",
+            input.nonzero_error);
+        exit(1);
+    }
+    mediocre_input_destroy(input);
+}
+
+/*  Rice compression (RICE_1) as fpack / cfitsio do it, to make fixtures for
+ *  the Rice-compressed FITS input. values are bytepix byte numbers, and
+ *  differences wrap around at that many bytes. Bits are written most
+ *  significant first.
+ */
+struct BitWriter {
+    std::vector<char>* bytes;
+    uint32_t buffer = 0;
+    unsigned count = 0;
+    
+    explicit BitWriter(std::vector<char>* bytes_arg) : bytes(bytes_arg) { }
+    
+    void write(uint32_t value, unsigned n) {
+        for (unsigned b = n; b-- > 0; ) {
+            buffer = buffer << 1 | ((value >> b) & 1);
+            if (++count == 8) {
+                bytes->push_back(char(buffer));
+                buffer = 0;
+                count = 0;
+            }
+        }
+    }
+    
+    void flush() {
+        if (count != 0) write(0, 8 - count);
+    }
+};
+
+static std::vector<char> rice_encode(
+    std::vector<uint32_t> const& values, size_t bytepix, size_t block_size
+) {
+    const unsigned fs_bits = bytepix == 1 ? 3 : bytepix == 2 ? 4 : 5;
+    const unsigned fs_max = bytepix == 1 ? 6 : bytepix == 2 ? 14 : 25;
+    const unsigned bbits = unsigned(8 * bytepix);
+    const uint64_t mask = (uint64_t(1) << bbits) - 1;
+    
+    std::vector<char> bytes;
+    BitWriter bits(&bytes);
+    bits.write(values[0], bbits);
+    uint32_t last = values[0];
+    
+    for (size_t i = 0; i < values.size(); i += block_size) {
+        const size_t block = std::min(block_size, values.size() - i);
+        std::vector<uint32_t> diffs(block);
+        double sum = 0.0;
+        for (size_t j = 0; j < block; ++j) {
+            int64_t d = int64_t((values[i + j] - last) & mask);
+            if (uint64_t(d) > mask / 2) d -= int64_t(mask) + 1;
+            diffs[j] = uint32_t(d < 0 ? -2 * d - 1 : 2 * d);
+            sum += diffs[j];
+            last = values[i + j];
+        }
+        
+        double dpsum = (sum - double(block / 2) - 1) / double(block);
+        if (dpsum < 0) dpsum = 0;
+        unsigned fs = 0;
+        for (uint32_t psum = uint32_t(dpsum) >> 1; psum > 0; psum >>= 1) ++fs;
+        
+        if (fs >= fs_max) {
+            bits.write(fs_max + 1, fs_bits);
+            for (uint32_t diff : diffs) bits.write(diff, bbits);
+        } else if (fs == 0 && sum == 0) {
+            bits.write(0, fs_bits);
+        } else {
+            bits.write(fs + 1, fs_bits);
+            for (uint32_t diff : diffs) {
+                for (uint32_t top = diff >> fs; top > 0; --top) {
+                    bits.write(0, 1);
+                }
+                bits.write(1, 1);
+                if (fs != 0) bits.write(diff, fs);
+            }
+        }
+    }
+    bits.flush();
+    return bytes;
+}
+
+// Random numbers of type T with a mix of smooth stretches, constant
+// stretches (all zero differences) and noise, like a real image.
+template <typename T>
+static std::vector<T> random_image(size_t width) {
+    std::vector<T> numbers(width);
+    T walk = random_number<T>();
+    for (size_t x = 0; x < width; ) {
+        const size_t run = std::min<size_t>(
+            width - x, random_dist_u32(generator, 1, 300));
+        const uint32_t kind = random_u32(generator) % 3;
+        for (size_t end = x + run; x < end; ++x) {
+            if (kind == 0) walk = T(walk + T(random_dist_u32(generator, 0, 8)));
+            if (kind == 2) walk = random_number<T>();
+            numbers[x] = walk;
+        }
+    }
+    return numbers;
+}
+
+// Write a FITS file with an empty primary HDU and a random image of type T,
+// Rice-compressed in random tiles, in HDU 1. Returns the floats that
+// mediocre_rice_fits_input should turn it into.
+template <typename T>
+static std::vector<float> write_rice_fits_file(
+    TempFile const& file, long bitpix, size_t rows, size_t columns
+) {
+    const size_t tile_rows = random_u32(generator) % 2
+        ? 1 : random_dist_u32(generator, 1, uint32_t(rows));
+    const size_t tile_columns = random_u32(generator) % 2
+        ? columns : random_dist_u32(generator, 1, uint32_t(columns));
+    const size_t tiles_down = (rows + tile_rows - 1) / tile_rows;
+    const size_t tiles_across = (columns + tile_columns - 1) / tile_columns;
+    const size_t block_size = random_u32(generator) % 2 ? 32 : 16;
+    const size_t bytepix = random_u32(generator) % 2 ? sizeof(T) : 4;
+    
+    double bscale = 1.0;
+    double bzero = 0.0;
+    if (random_u32(generator) % 2) {
+        bscale = (1 + random_u32(generator) % 4000) / 1024.0;
+        bzero = int32_t(random_u32(generator)) / 4096.0;
+    }
+    
+    const std::vector<T> image = random_image<T>(rows * columns);
+    std::vector<float> physical(rows * columns);
+    for (size_t x = 0; x < rows * columns; ++x) {
+        physical[x] = float(double(image[x]) * bscale + bzero);
+    }
+    
+    // Compress the tiles, in C order, into the heap.
+    std::vector<char> heap;
+    std::vector<std::pair<size_t, size_t>> descriptors;
+    for (size_t down = 0; down < tiles_down; ++down) {
+        for (size_t across = 0; across < tiles_across; ++across) {
+            std::vector<uint32_t> values;
+            for (size_t r = down * tile_rows;
+                r < std::min(rows, (down + 1) * tile_rows); ++r
+            ) {
+                for (size_t c = across * tile_columns;
+                    c < std::min(columns, (across + 1) * tile_columns); ++c
+                ) {
+                    // Signed numbers are sign-extended to bytepix bytes.
+                    const int64_t n = int64_t(image[r * columns + c]);
+                    values.push_back(uint32_t(n) & uint32_t(
+                        (uint64_t(1) << (8 * bytepix)) - 1));
+                }
+            }
+            const std::vector<char> tile =
+                rice_encode(values, bytepix, block_size);
+            descriptors.emplace_back(tile.size(), heap.size());
+            heap.insert(heap.end(), tile.begin(), tile.end());
+        }
+    }
+    
+    // The table has a column before COMPRESSED_DATA sometimes, and 64-bit
+    // (Q) descriptors sometimes.
+    const bool extra_column = random_u32(generator) % 2;
+    const bool q_descriptors = random_u32(generator) % 2;
+    const size_t descriptor_size = q_descriptors ? 16 : 8;
+    const size_t row_size = descriptor_size + (extra_column ? 4 : 0);
+    
+    std::vector<char> bytes;
+    fits_card(&bytes, "SIMPLE", "T");
+    fits_card(&bytes, "BITPIX", "8");
+    fits_card(&bytes, "NAXIS", "0");
+    fits_card(&bytes, "EXTEND", "T");
+    fits_card(&bytes, "END", "");
+    fits_pad(&bytes, ' ');
+    
+    fits_card(&bytes, "XTENSION", "'BINTABLE'");
+    fits_card(&bytes, "BITPIX", "8");
+    fits_card(&bytes, "NAXIS", "2");
+    fits_card(&bytes, "NAXIS1", fits_value(double(row_size)));
+    fits_card(&bytes, "NAXIS2", fits_value(double(descriptors.size())));
+    fits_card(&bytes, "PCOUNT", fits_value(double(heap.size())));
+    fits_card(&bytes, "GCOUNT", "1");
+    fits_card(&bytes, "TFIELDS", extra_column ? "2" : "1");
+    if (extra_column) {
+        fits_card(&bytes, "TTYPE1", "'EXTRA'");
+        fits_card(&bytes, "TFORM1", "'1J'");
+    }
+    fits_card(&bytes, extra_column ? "TTYPE2" : "TTYPE1",
+        "'COMPRESSED_DATA'");
+    fits_card(&bytes, extra_column ? "TFORM2" : "TFORM1",
+        q_descriptors ? "'1QB'" : "'1PB'");
+    fits_card(&bytes, "ZIMAGE", "T");
+    fits_card(&bytes, "ZBITPIX", fits_value(double(bitpix)));
+    fits_card(&bytes, "ZNAXIS", "2");
+    fits_card(&bytes, "ZNAXIS1", fits_value(double(columns)));
+    fits_card(&bytes, "ZNAXIS2", fits_value(double(rows)));
+    if (tile_columns != columns || tile_rows != 1) {
+        fits_card(&bytes, "ZTILE1", fits_value(double(tile_columns)));
+        fits_card(&bytes, "ZTILE2", fits_value(double(tile_rows)));
+    }
+    fits_card(&bytes, "ZCMPTYPE", "'RICE_1'");
+    fits_card(&bytes, "ZNAME1", "'BLOCKSIZE'");
+    fits_card(&bytes, "ZVAL1", fits_value(double(block_size)));
+    fits_card(&bytes, "ZNAME2", "'BYTEPIX'");
+    fits_card(&bytes, "ZVAL2", fits_value(double(bytepix)));
+    if (bscale != 1.0 || bzero != 0.0) {
+        fits_card(&bytes, "BSCALE", fits_value(bscale));
+        fits_card(&bytes, "BZERO", fits_value(bzero));
+    }
+    fits_card(&bytes, "END", "");
+    fits_pad(&bytes, ' ');
+    
+    for (auto const& descriptor : descriptors) {
+        if (extra_column) bytes.insert(bytes.end(), 4, 'x');
+        for (uint64_t field : { descriptor.first, descriptor.second }) {
+            for (size_t b = descriptor_size / 2; b-- > 0; ) {
+                bytes.push_back(char(field >> (8 * b)));
+            }
+        }
+    }
+    bytes.insert(bytes.end(), heap.begin(), heap.end());
+    fits_pad(&bytes, '\0');
+    
+    file.write(bytes);
+    return physical;
+}
+
+static void test_rice_fits() {
+    const size_t combine_count =
+        random_dist_u32(generator, 1, max_combine_count);
+    const size_t rows = random_dist_u32(generator, 1, max_axis_size);
+    const size_t columns = random_dist_u32(generator, 1, max_axis_size);
+    const size_t width = rows * columns;
+    const size_t decoder_threads = random_dist_u32(generator, 0, 3);
+    
+    std::vector<TempFile> files(combine_count);
+    std::vector<char const*> paths;
+    std::vector<float> expected(width, 0.0f);
+    
+    for (size_t i = 0; i < combine_count; ++i) {
+        std::vector<float> physical;
+        switch (random_u32(generator) % 3) {
+          case 0: physical =
+            write_rice_fits_file<uint8_t>(files[i], 8, rows, columns);
+          break; case 1: physical =
+            write_rice_fits_file<int16_t>(files[i], 16, rows, columns);
+          break; case 2: physical =
+            write_rice_fits_file<int32_t>(files[i], 32, rows, columns);
+        }
+        for (size_t x = 0; x < width; ++x) expected[x] += physical[x];
+        paths.push_back(files[i].path.c_str());
+    }
+    for (float& f : expected) f /= float(combine_count);
+    
+    printf("\tSeed = %zi\n", size_t(seed));
+    printf("\tAveraging %zi Rice-compressed FITS images of [%zi, %zi]\n",
+        combine_count, rows, columns);
+    
+    size_t shape_rows = 0, shape_columns = 0;
+    if (mediocre_fits_image_shape(paths[0], 1, &shape_rows, &shape_columns)
+        != 0 || shape_rows != rows || shape_columns != columns
+    ) {
+        printf("Wrong compressed FITS image shape [%zi, %zi]\n",
+            shape_rows, shape_columns);
+        exit(1);
+    }
+    
+    MediocreInput input = mediocre_rice_fits_input(
+        paths.data(), combine_count, 1, decoder_threads);
+    struct timeb begin_time;
+    ftime(&begin_time);
+    std::vector<float> result = mediocre::combine(input, mean_functor, 2);
+    printf("\x1b[32m\x1b[1mRice FITS input (%zi decoder threads): ",
+        decoder_threads);
+    print_timer_elapsed(begin_time, width * combine_count);
+    printf("\x1b[0m\n");
+    
+    check_result(result, expected);
+    check_result(mediocre::combine(input, mean_functor, 2), expected);
+    mediocre_input_destroy(input);
+    
+    // The compressed HDU isn't an image to the uncompressed FITS input, and
+    // the primary HDU isn't compressed.
+    input = mediocre_fits_input(paths.data(), combine_count, 1);
+    if (input.nonzero_error != EINVAL) {
+        printf("Expected EINVAL for compressed HDU, got %i\n",
+            input.nonzero_error);
+        exit(1);
+    }
+    mediocre_input_destroy(input);
+    
+    input = mediocre_rice_fits_input(paths.data(), combine_count, 0, 0);
+    if (input.nonzero_error != EINVAL) {
+        printf("Expected EINVAL for uncompressed HDU, got %i\n",
+            input.nonzero_error);
+        exit(1);
+    }
+    mediocre_input_destroy(input);
+}
+
+int main() {
+    for (int i = 0; i < 20; ++i) {
+        test_raw_files<int8_t>("int8_t");
+        test_raw_files<int16_t>("int16_t");
+        test_raw_files<int32_t>("int32_t");
+        test_raw_files<int64_t>("int64_t");
+        test_raw_files<uint8_t>("uint8_t");
+        test_raw_files<uint16_t>("uint16_t");
+        test_raw_files<uint32_t>("uint32_t");
+        test_raw_files<uint64_t>("uint64_t");
+        test_raw_files<float>("float");
+        test_raw_files<double>("double");
+        for (int j = 0; j < 10; ++j) test_fits();
+        for (int j = 0; j < 5; ++j) test_rice_fits();
+    }
+}
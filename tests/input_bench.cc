@@ -0,0 +1,318 @@
+/*  An aggresively average SIMD combine library.
+ *  Copyright (C) 2017 David Akeley
+ *  
+ *  Benchmark for the MediocreInput loaders: times how fast each input type
+ *  can be loaded into chunk format, with a combine functor that does no
+ *  work, so that the time measured is (nearly) all spent loading. Then
+ *  compares  the  AVX2  gather  loader  against  the scalar loads for a few
+ *  strided 2D views of 32-bit arrays, and sweeps the prefetch distance  of
+ *  the 2D loaders over padded, strided, and masked 2D inputs. Last, times
+ *  staged against unstaged loads of deep stacks of Fortran-order arrays.
+ *  
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "mediocre.h"
+#include "mediocre.hpp"
+#include "testing.h"
+
+static const size_t combine_count = 16;
+static const size_t width = 1 << 21;
+static const int repetitions = 5;
+
+static struct Random* generator = new_random();
+
+// Functor that accepts commands and throws the data away.
+static int discard_loop_function(
+    MediocreFunctorControl* control,
+    void const* user_data,
+    MediocreDimension maximum_request
+) {
+    (void)user_data;
+    (void)maximum_request;
+    MediocreFunctorCommand command;
+    MEDIOCRE_FUNCTOR_LOOP(command, control) { }
+    return 0;
+}
+
+static void no_op(void*) {
+
+}
+
+static MediocreFunctor discard_functor() {
+    MediocreFunctor result;
+    result.loop_function = discard_loop_function;
+    result.destructor = no_op;
+    result.user_data = nullptr;
+    result.nonzero_error = 0;
+    return result;
+}
+
+template <typename T>
+static void bench(char const* type_name) {
+    std::vector<std::vector<T>> arrays(combine_count, std::vector<T>(width));
+    std::vector<T const*> pointers;
+    for (auto& array : arrays) {
+        for (T& t : array) t = T(random_dist_u32(generator, 0, 100));
+        pointers.push_back(array.data());
+    }
+    std::vector<float> output(width);
+    
+    struct timeb begin_time;
+    ftime(&begin_time);
+    
+    for (int r = 0; r < repetitions; ++r) {
+        MediocreInput input = mediocre::make_input(
+            pointers.data(), MediocreDimension { combine_count, width });
+        int status = mediocre_combine_destroy(
+            output.data(), input, discard_functor(), 1);
+        if (status != 0) {
+            fprintf(stderr, "%s: %s\n", type_name, strerror(status));
+            exit(1);
+        }
+    }
+    
+    const size_t item_count = repetitions * combine_count * width;
+    const long ms = ms_elapsed(begin_time);
+    printf("%-9s", type_name);
+    print_timer_elapsed(begin_time, item_count);
+    printf(" %.2f GB/s read.\n",
+        ms == 0 ? 0.0 : item_count * sizeof(T) / (ms * 1e6));
+}
+
+/*  Time loading 2D views of 32-bit arrays that take every step'th number of
+ *  each row of [rows] rows (step < 0 walks the rows backwards), once with the
+ *  AVX2 gather loader and once with the scalar loads, and check that the two
+ *  agree.
+ */
+static long bench_strided_once(
+    std::vector<Mediocre2D> const& views, std::vector<float>* output
+) {
+    struct timeb begin_time;
+    ftime(&begin_time);
+    
+    for (int r = 0; r < repetitions; ++r) {
+        MediocreInput input = mediocre_2D_input(views.data(), views.size());
+        int status = mediocre_combine_destroy(
+            output->data(), input, mediocre_mean_functor(), 1);
+        if (status != 0) {
+            fprintf(stderr, "strided: %s\n", strerror(status));
+            exit(1);
+        }
+    }
+    return ms_elapsed(begin_time);
+}
+
+template <typename T>
+static void bench_strided(char const* type_name, int step, size_t rows) {
+    const size_t abs_step = size_t(step < 0 ? -step : step);
+    const size_t columns = width / rows;
+    const size_t row_length = columns * abs_step;
+    std::vector<std::vector<T>> arrays(
+        combine_count, std::vector<T>(rows * row_length));
+    std::vector<Mediocre2D> views;
+    
+    for (auto& array : arrays) {
+        for (T& t : array) t = T(random_dist_u32(generator, 0, 100000));
+        // Walking backwards starts at the last number of the first row.
+        T const* first = step < 0 ? array.data() + row_length - 1
+                                  : array.data();
+        views.push_back(Mediocre2D {
+            first, uintptr_t(mediocre::type_code(first)),
+            rows, row_length * sizeof(T),
+            columns, uintptr_t(intptr_t(step) * intptr_t(sizeof(T)))
+        });
+    }
+    std::vector<float> gathered(width), scalar(width);
+    
+    mediocre_gather_enabled = 1;
+    const long gather_ms = bench_strided_once(views, &gathered);
+    mediocre_gather_enabled = 0;
+    const long scalar_ms = bench_strided_once(views, &scalar);
+    mediocre_gather_enabled = 1;
+    
+    for (size_t i = 0; i < rows * columns; ++i) {
+        if (gathered[i] != scalar[i]) {
+            printf("%s step %i: [%zi] %f != %f\n",
+                type_name, step, i, gathered[i], scalar[i]);
+            exit(1);
+        }
+    }
+    
+    const double items = double(repetitions) * combine_count * rows * columns;
+    printf("%-9s step %4i, %7zi rows: gather %.2f ns/item, "
+        "scalar %.2f ns/item.\n", type_name, step, rows,
+        gather_ms * 1e6 / items, scalar_ms * 1e6 / items);
+}
+
+template <typename T>
+static void bench_strides(char const* type_name) {
+    bench_strided<T>(type_name, 2, 1);
+    bench_strided<T>(type_name, 3, 64);
+    bench_strided<T>(type_name, -1, 64);
+    bench_strided<T>(type_name, -2, 1024);
+    bench_strided<T>(type_name, 7, 1 << 17); // Rows of 16: mostly fixups.
+}
+
+/*  Time mean-combining 2D float views of rows with [columns] columns, each
+ *  row  padded  to  a  major  stride  of [row_length] floats, taking every
+ *  step'th float, with each prefetch distance in turn. With masked, each
+ *  array also has a uint8 mask with one bad pixel in about 1000.
+ */
+static void bench_prefetch(
+    char const* label, size_t columns, size_t row_length, int step, bool masked
+) {
+    const size_t rows = width / columns;
+    std::vector<std::vector<float>> arrays(
+        combine_count, std::vector<float>(rows * row_length));
+    std::vector<std::vector<uint8_t>> masks(
+        combine_count, std::vector<uint8_t>(rows * columns));
+    std::vector<Mediocre2D> views;
+    std::vector<MediocreMasked2D> masked_views;
+    
+    for (size_t n = 0; n < combine_count; ++n) {
+        for (float& f : arrays[n]) f = float(random_dist_u32(generator, 0, 99));
+        for (uint8_t& m : masks[n]) m = random_dist_u32(generator, 0, 999) == 0;
+        views.push_back(Mediocre2D {
+            arrays[n].data(), mediocre_float_code,
+            rows, row_length * sizeof(float),
+            columns, uintptr_t(step) * sizeof(float)
+        });
+        masked_views.push_back(MediocreMasked2D {
+            views.back(),
+            Mediocre2D {
+                masks[n].data(), mediocre_u8_code, rows, columns, columns, 1
+            }
+        });
+    }
+    std::vector<float> output(width);
+    
+    printf("%-22s", label);
+    const int old_distance = mediocre_prefetch_distance;
+    for (int distance : { 0, 64, 256, 1024, 4096, 16384 }) {
+        mediocre_prefetch_distance = distance;
+        struct timeb begin_time;
+        ftime(&begin_time);
+        
+        for (int r = 0; r < repetitions; ++r) {
+            MediocreInput input = masked
+                ? mediocre_masked_2D_input(
+                    masked_views.data(), combine_count, 1)
+                : mediocre_2D_input(views.data(), combine_count);
+            int status = mediocre_combine_destroy(
+                output.data(), input, mediocre_mean_functor(), 1);
+            if (status != 0) {
+                fprintf(stderr, "%s: %s\n", label, strerror(status));
+                exit(1);
+            }
+        }
+        
+        const double items = double(repetitions) * combine_count * width;
+        printf(" %5i: %.2f", distance, ms_elapsed(begin_time) * 1e6 / items);
+    }
+    mediocre_prefetch_distance = old_distance;
+    printf(" ns/item.\n");
+}
+
+/*  Time mean-combining a deep stack of [frames] uint8 arrays of 64 rows  by
+ *  [columns] columns, stored in Fortran order, once staged (with the default
+ *  mediocre_stage_megabytes) and once with staging off, which walks  the
+ *  columns, and check that the two agree. At the default budget every frame
+ *  still gets a stage of at least 8 rows, so the staged time  should  be
+ *  well ahead.
+ */
+static long bench_fortran_once(
+    std::vector<Mediocre2D> const& views, std::vector<float>* output
+) {
+    struct timeb begin_time;
+    ftime(&begin_time);
+    
+    for (int r = 0; r < repetitions; ++r) {
+        MediocreInput input = mediocre_2D_input(views.data(), views.size());
+        int status = mediocre_combine_destroy(
+            output->data(), input, mediocre_mean_functor(), 1);
+        if (status != 0) {
+            fprintf(stderr, "Fortran order: %s\n", strerror(status));
+            exit(1);
+        }
+    }
+    return ms_elapsed(begin_time);
+}
+
+static void bench_fortran_stack(size_t frames, size_t columns) {
+    const size_t rows = 64;
+    std::vector<std::vector<uint8_t>> arrays(
+        frames, std::vector<uint8_t>(rows * columns));
+    std::vector<Mediocre2D> views;
+    
+    for (auto& array : arrays) {
+        for (uint8_t& u : array) u = random_dist_u32(generator, 0, 255);
+        views.push_back(Mediocre2D {
+            array.data(), mediocre_u8_code, rows, 1, columns, rows
+        });
+    }
+    std::vector<float> staged(rows * columns), strided(rows * columns);
+    
+    const long staged_ms = bench_fortran_once(views, &staged);
+    const int old_megabytes = mediocre_stage_megabytes;
+    mediocre_stage_megabytes = 0;
+    const long strided_ms = bench_fortran_once(views, &strided);
+    mediocre_stage_megabytes = old_megabytes;
+    
+    for (size_t i = 0; i < rows * columns; ++i) {
+        if (staged[i] != strided[i]) {
+            printf("Fortran order: [%zi] %f != %f\n", i, staged[i], strided[i]);
+            exit(1);
+        }
+    }
+    
+    const double items = double(repetitions) * frames * rows * columns;
+    printf("%4zi Fortran-order frames of %4zi columns: staged %.2f ns/item, "
+        "unstaged %.2f ns/item.\n", frames, columns,
+        staged_ms * 1e6 / items, strided_ms * 1e6 / items);
+}
+
+int main() {
+    bench<int8_t>("int8");
+    bench<int16_t>("int16");
+    bench<int32_t>("int32");
+    bench<int64_t>("int64");
+    bench<uint8_t>("uint8");
+    bench<uint16_t>("uint16");
+    bench<uint32_t>("uint32");
+    bench<uint64_t>("uint64");
+    bench<float>("float");
+    bench<double>("double");
+    
+    bench_strides<int32_t>("int32");
+    bench_strides<uint32_t>("uint32");
+    bench_strides<float>("float");
+    
+    bench_prefetch("padded rows of 2048", 2048, 2048 + 64, 1, false);
+    bench_prefetch("padded rows of 256", 256, 256 + 16, 1, false);
+    bench_prefetch("step 2, rows of 1024", 1024, 2048, 2, false);
+    bench_prefetch("masked rows of 2048", 2048, 2048 + 64, 1, true);
+    
+    bench_fortran_stack(128, 2048);
+    bench_fortran_stack(128, 4096);
+    bench_fortran_stack(512, 4096);
+}
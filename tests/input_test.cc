@@ -7,7 +7,8 @@
  *  functor as part of the test, so if something goes wrong it could also be
  *  its fault, but mean is the simplest functor so it's probably 100% correct.
  *  
- *  XXX masked input not checked. Try checking it in Python tests?
+ *  XXX masked input is only checked against itself (packed bit masks
+ *  against byte masks) and its median filter against a reference.
  *  
  *  This program is free software: you can redistribute it and/or modify
  *  it under the terms of the GNU General Public License as published by
@@ -24,11 +25,15 @@
  */
 
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/timeb.h>
+#include <algorithm>
 #include <memory>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <type_traits>
@@ -295,6 +300,276 @@ inline void test_contiguous(const char* type_label) noexcept {
     }
 }
 
+// Copy of t with its bytes reversed (native to big-endian).
+template <typename T>
+static T byte_swapped(T t) {
+    unsigned char bytes[sizeof(T)];
+    memcpy(bytes, &t, sizeof(T));
+    std::reverse(bytes, bytes + sizeof(T));
+    memcpy(&t, bytes, sizeof(T));
+    return t;
+}
+
+// The ways that test_big_endian, test_16_bit_float and test_scaled view a
+// buffer of 2 * rows * columns numbers as a [rows] x [columns] array.
+enum {
+    c_order_view, fortran_order_view, every_other_column_view,
+    reversed_rows_view, view_count
+};
+
+static char const* const view_names[view_count] = {
+    "C order", "Fortran order", "every other column", "reversed rows"
+};
+
+// Mediocre2D with the given type code for the view of the buffer at base.
+template <typename T>
+static Mediocre2D make_view(
+    T const* base, uintptr_t type_code, size_t rows, size_t columns, int view
+) {
+    const intptr_t size = sizeof(T);
+    Mediocre2D m;
+    m.data = base;
+    m.type_code = type_code;
+    m.major_width = rows;
+    m.major_stride = uintptr_t(size * columns);
+    m.minor_width = columns;
+    m.minor_stride = uintptr_t(size);
+    
+    if (view == fortran_order_view) {
+        m.major_stride = uintptr_t(size);
+        m.minor_stride = uintptr_t(size * rows);
+    } else if (view == every_other_column_view) {
+        m.major_stride = uintptr_t(2 * size * columns);
+        m.minor_stride = uintptr_t(2 * size);
+    } else if (view == reversed_rows_view) {
+        m.data = base + columns - 1;
+        m.minor_stride = uintptr_t(-size);
+    }
+    return m;
+}
+
+// Index into the buffer of the number at [r, c] of the view.
+static size_t view_index(
+    size_t r, size_t c, size_t rows, size_t columns, int view
+) {
+    switch (view) {
+      default:                      return r * columns + c;
+      case fortran_order_view:      return r + c * rows;
+      case every_other_column_view: return 2 * (r * columns + c);
+      case reversed_rows_view:      return r * columns + (columns - 1 - c);
+    }
+}
+
+// Test that arrays with a big-endian type code (big_code) give the same
+// results as the native arrays they were byte swapped from, when viewed in
+// C order, Fortran order, every other column and with reversed rows.
+template <typename T>
+static void test_big_endian(const char* type_label, int big_code) noexcept {
+    size_t const combine_count = random_dist_u32(
+        generator, min_combine_count, max_combine_count
+    );
+    size_t const rows = random_dist_u32(generator, 70, 200);
+    size_t const columns = random_dist_u32(generator, 70, 200);
+    
+    std::vector<std::vector<T>> native(combine_count);
+    std::vector<std::vector<T>> big(combine_count);
+    for (size_t i = 0; i < combine_count; ++i) {
+        for (size_t x = 0; x < 2 * rows * columns; ++x) {
+            const T t = std::is_integral<T>::value
+                ? T(137 * random_u32(generator))
+                : T(137.035999139 * random_u32(generator));
+            native[i].push_back(t);
+            big[i].push_back(byte_swapped(t));
+        }
+    }
+    
+    printf("\tBig-endian %s arrays\n", type_label);
+    
+    for (int view = 0; view < view_count; ++view) {
+        std::vector<Mediocre2D> native_views, big_views;
+        
+        for (size_t i = 0; i < combine_count; ++i) {
+            T const* base = native[i].data();
+            native_views.push_back(make_view(base,
+                uintptr_t(mediocre::type_code(base)), rows, columns, view));
+            big_views.push_back(make_view(big[i].data(),
+                uintptr_t(big_code), rows, columns, view));
+        }
+        
+        MediocreInput input =
+            mediocre_2D_input(native_views.data(), combine_count);
+        std::vector<float> expected = mean(input);
+        mediocre_input_destroy(input);
+        
+        input = mediocre_2D_input(big_views.data(), combine_count);
+        std::vector<float> result = mean(input);
+        mediocre_input_destroy(input);
+        
+        for (size_t x = 0; x < rows * columns; ++x) {
+            if (result[x] != expected[x]) {
+                printf("%s %s [%zi] %f != %f\n",
+                    type_label, view_names[view], x, result[x], expected[x]);
+                exit(1);
+            }
+        }
+    }
+}
+
+// Reference conversions for the 16-bit float types, written independently
+// of the library's bit tricks.
+static float half_reference(uint16_t bits) {
+    const int exponent = (bits >> 10) & 31;
+    const int mantissa = bits & 1023;
+    const float sign = (bits & 0x8000) ? -1.0f : 1.0f;
+    if (exponent == 0) return sign * ldexpf(float(mantissa), -24);
+    return sign * ldexpf(float(1024 + mantissa), exponent - 25);
+}
+
+static float bfloat16_reference(uint16_t bits) {
+    const int exponent = (bits >> 7) & 255;
+    const int mantissa = bits & 127;
+    const float sign = (bits & 0x8000) ? -1.0f : 1.0f;
+    if (exponent == 0) return sign * ldexpf(float(mantissa), -133);
+    return sign * ldexpf(float(128 + mantissa), exponent - 134);
+}
+
+// Test the 1D input factory and 2D input (each view, and big-endian in C
+// order) for a 16-bit float type, using random finite numbers (exponent
+// not all ones).
+static void test_16_bit_float(
+    const char* type_label,
+    float (*reference)(uint16_t),
+    uint16_t exponent_mask,
+    MediocreInput (*factory)(uint16_t const* const*, MediocreDimension),
+    int type_code,
+    int big_code
+) noexcept {
+    size_t const combine_count = random_dist_u32(
+        generator, min_combine_count, max_combine_count
+    );
+    size_t const rows = random_dist_u32(generator, 70, 200);
+    size_t const columns = random_dist_u32(generator, 70, 200);
+    
+    std::vector<std::vector<uint16_t>> arrays(combine_count);
+    std::vector<std::vector<uint16_t>> big(combine_count);
+    std::vector<uint16_t const*> pointers;
+    for (size_t i = 0; i < combine_count; ++i) {
+        for (size_t x = 0; x < 2 * rows * columns; ++x) {
+            uint16_t bits;
+            do {
+                bits = uint16_t(random_u32(generator));
+            } while ((bits & exponent_mask) == exponent_mask);
+            arrays[i].push_back(bits);
+            big[i].push_back(byte_swapped(bits));
+        }
+        pointers.push_back(arrays[i].data());
+    }
+    
+    printf("\t%s arrays\n", type_label);
+    
+    // The views, then the 1D input (view_count), then big-endian C order.
+    for (int view = 0; view < view_count + 2; ++view) {
+        const bool is_big = view == view_count + 1;
+        const int layout = view < view_count ? view : c_order_view;
+        std::vector<Mediocre2D> views;
+        for (size_t i = 0; i < combine_count; ++i) {
+            views.push_back(make_view((is_big ? big : arrays)[i].data(),
+                uintptr_t(is_big ? big_code : type_code),
+                rows, columns, layout));
+        }
+        
+        MediocreInput input = view == view_count
+            ? factory(pointers.data(), { combine_count, rows * columns })
+            : mediocre_2D_input(views.data(), combine_count);
+        std::vector<float> result = mean(input);
+        mediocre_input_destroy(input);
+        
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t c = 0; c < columns; ++c) {
+                const size_t index = view_index(r, c, rows, columns, layout);
+                
+                float total = 0.0f;
+                for (size_t i = 0; i < combine_count; ++i) {
+                    total += reference(arrays[i][index]);
+                }
+                const float expected = total / float(combine_count);
+                if (result[r * columns + c] != expected) {
+                    printf("%s view %i [%zi %zi] %f != %f\n", type_label,
+                        view, r, c, result[r * columns + c], expected);
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
+// Test that mediocre_scaled_1D_input and mediocre_scaled_2D_input (with
+// each view of the arrays) apply the scale and offset of each array. Some
+// arrays get the identity transform.
+template <typename T>
+static void test_scaled(const char* type_label) noexcept {
+    size_t const combine_count = random_dist_u32(
+        generator, min_combine_count, max_combine_count
+    );
+    size_t const rows = random_dist_u32(generator, 70, 200);
+    size_t const columns = random_dist_u32(generator, 70, 200);
+    
+    std::vector<std::unique_ptr<TestingArray<T>>> arrays(combine_count);
+    std::vector<void const*> pointers;
+    std::vector<float> scale, offset;
+    for (size_t i = 0; i < combine_count; ++i) {
+        arrays[i].reset(new TestingArray<T>(2 * rows * columns, generator));
+        pointers.push_back(arrays[i]->data());
+        const bool identity = random_dist_u32(generator, 0, 3) == 0;
+        scale.push_back(
+            identity ? 1.0f : random_dist_u32(generator, 1, 1000) / 256.0f);
+        offset.push_back(
+            identity ? 0.0f : float(random_dist_u32(generator, 0, 100)) - 50);
+    }
+    
+    printf("\tScaled %s arrays\n", type_label);
+    
+    // The views, then the 1D input (view_count).
+    for (int view = 0; view <= view_count; ++view) {
+        const int layout = view < view_count ? view : c_order_view;
+        std::vector<Mediocre2D> views;
+        for (size_t i = 0; i < combine_count; ++i) {
+            T const* base = arrays[i]->data();
+            views.push_back(make_view(base,
+                uintptr_t(mediocre::type_code(base)), rows, columns, layout));
+        }
+        
+        MediocreInput input = view == view_count
+            ? mediocre_scaled_1D_input(pointers.data(), views[0].type_code,
+                { combine_count, rows * columns }, scale.data(), offset.data())
+            : mediocre_scaled_2D_input(
+                views.data(), combine_count, scale.data(), offset.data());
+        std::vector<float> result = mean(input);
+        mediocre_input_destroy(input);
+        
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t c = 0; c < columns; ++c) {
+                const size_t index = view_index(r, c, rows, columns, layout);
+                
+                float total = 0.0f;
+                for (size_t i = 0; i < combine_count; ++i) {
+                    float x = arrays[i]->get(index);
+                    if (scale[i] != 1.0f || offset[i] != 0.0f) {
+                        x = x * scale[i] + offset[i];
+                    }
+                    total += x;
+                }
+                const float expected = total / float(combine_count);
+                if (result[r * columns + c] != expected) {
+                    printf("%s view %i [%zi %zi] %f != %f\n", type_label,
+                        view, r, c, result[r * columns + c], expected);
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
 // Test input of 2D arrays with different data types and unusual strides.
 static void test_2D() noexcept {
     size_t const combine_count = random_dist_u32(
@@ -428,6 +703,605 @@ static void test_2D() noexcept {
     }
 }
 
+// Compare masked input with packed bit masks against the same masks stored
+// one byte per entry. Rows of the bit masks have padding bytes, and junk in
+// the bits past the last column, that must be ignored. Then check that the
+// NaN masked input leaves the bad entries out of the NaN-aware mean.
+static void test_packed_mask() noexcept {
+    size_t const combine_count = random_dist_u32(
+        generator, min_combine_count, max_combine_count
+    );
+    size_t const rows = random_dist_u32(generator, 1, 300);
+    size_t const columns = random_dist_u32(generator, 1, 300);
+    size_t const row_bytes = (columns + 7) / 8;
+    size_t const row_stride = row_bytes + random_dist_u32(generator, 0, 9);
+    const bool nonzero_means_bad = random_dist_u32(generator, 0, 1) != 0;
+    // Per mille of entries that are bad, from almost none to most.
+    const uint32_t bad_rate = random_dist_u32(generator, 0, 3) == 0
+        ? random_dist_u32(generator, 0, 1000)
+        : random_dist_u32(generator, 0, 10);
+    
+    std::vector<std::vector<float>> data(combine_count);
+    std::vector<std::vector<uint8_t>> byte_masks(combine_count);
+    std::vector<std::vector<uint8_t>> bit_masks(combine_count);
+    std::vector<MediocreMasked2D> byte_inputs, bit_inputs;
+    for (size_t i = 0; i < combine_count; ++i) {
+        data[i].resize(rows * columns);
+        for (float& x : data[i]) {
+            x = float(random_dist_u32(generator, 0, 1000000)) - 500000.0f;
+        }
+        byte_masks[i].resize(rows * columns);
+        bit_masks[i].resize(rows * row_stride);
+        for (uint8_t& byte : bit_masks[i]) {
+            byte = uint8_t(random_dist_u32(generator, 0, 255));
+        }
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t c = 0; c < columns; ++c) {
+                const bool bad = random_dist_u32(generator, 0, 999) < bad_rate;
+                const bool bit = bad == nonzero_means_bad;
+                byte_masks[i][r*columns + c] = bit ? 1 : 0;
+                uint8_t& byte = bit_masks[i][r*row_stride + c/8];
+                const uint8_t mask_bit = uint8_t(0x80 >> c%8);
+                byte = bit ? byte | mask_bit : byte & ~mask_bit;
+            }
+        }
+        
+        MediocreMasked2D m;
+        m.data_2D.data = data[i].data();
+        m.data_2D.type_code = uintptr_t(mediocre::type_code(data[i].data()));
+        m.data_2D.major_width = rows;
+        m.data_2D.major_stride = columns * sizeof(float);
+        m.data_2D.minor_width = columns;
+        m.data_2D.minor_stride = sizeof(float);
+        m.mask_2D.data = byte_masks[i].data();
+        m.mask_2D.type_code = uintptr_t(mediocre_u8_code);
+        m.mask_2D.major_width = rows;
+        m.mask_2D.major_stride = columns;
+        m.mask_2D.minor_width = columns;
+        m.mask_2D.minor_stride = 1;
+        byte_inputs.push_back(m);
+        
+        m.mask_2D.data = bit_masks[i].data();
+        m.mask_2D.type_code = uintptr_t(mediocre_bit_code);
+        m.mask_2D.major_stride = row_stride;
+        m.mask_2D.minor_stride = 0;
+        bit_inputs.push_back(m);
+    }
+    
+    printf("\tPacked bit masks (%zi x %zi, %u per mille bad)\n",
+        rows, columns, unsigned(bad_rate));
+    
+    MediocreInput byte_input = mediocre_masked_2D_input(
+        byte_inputs.data(), combine_count, nonzero_means_bad);
+    MediocreInput bit_input = mediocre_masked_2D_input(
+        bit_inputs.data(), combine_count, nonzero_means_bad);
+    std::vector<float> expected_result = mean(byte_input);
+    std::vector<float> result = mean(bit_input);
+    mediocre_input_destroy(byte_input);
+    mediocre_input_destroy(bit_input);
+    
+    for (size_t n = 0; n < rows * columns; ++n) {
+        const float this_result = result[n];
+        const float this_expected = expected_result[n];
+        if (this_result != this_expected
+            && !(isnan(this_result) && isnan(this_expected))
+        ) {
+            printf("[%zi %zi] %f != %f\n",
+                n / columns, n % columns, this_result, this_expected);
+            exit(1);
+        }
+    }
+    
+    // Loaded as NaN instead, bad entries are left out of NaN-aware combines.
+    MediocreInput nan_input = mediocre_nan_masked_2D_input(
+        bit_inputs.data(), combine_count, nonzero_means_bad);
+    result = mediocre::combine(nan_input, mediocre_nan_mean_functor(), 2);
+    mediocre_input_destroy(nan_input);
+    
+    for (size_t n = 0; n < rows * columns; ++n) {
+        float total = 0.0f, count = 0.0f;
+        for (size_t i = 0; i < combine_count; ++i) {
+            if ((byte_masks[i][n] != 0) != nonzero_means_bad) {
+                total += data[i][n];
+                count += 1.0f;
+            }
+        }
+        const float this_expected = total / count;
+        if (result[n] != this_expected
+            && !(isnan(result[n]) && isnan(this_expected))
+        ) {
+            printf("NaN masked [%zi %zi] %f != %f\n",
+                n / columns, n % columns, result[n], this_expected);
+            exit(1);
+        }
+    }
+}
+
+/*  Reference 5 x 5 median filter of the pixel at [r, c]: the median of the
+ *  good pixels in the box around it (cut short at the edges), or NaN if
+ *  there are none.
+ */
+template <typename T>
+static float median_filter_reference(
+    std::vector<T> const& data,
+    std::vector<uint8_t> const& mask,
+    size_t rows,
+    size_t columns,
+    size_t r,
+    size_t c
+) {
+    float numbers[25];
+    size_t count = 0;
+    for (size_t y = r < 2 ? 0 : r - 2; y <= r + 2 && y < rows; ++y) {
+        for (size_t x = c < 2 ? 0 : c - 2; x <= c + 2 && x < columns; ++x) {
+            if (mask[y*columns + x] == 0) {
+                numbers[count++] = float(data[y*columns + x]);
+            }
+        }
+    }
+    if (count == 0) return 0.0f / 0.0f;
+    std::sort(numbers, numbers + count);
+    return 0.5f * (numbers[(count-1)/2] + numbers[count/2]);
+}
+
+/*  Check the median filtering of masked 2D input (which sorts the
+ *  neighborhoods of 8 bad pixels at a time) against the reference.
+ */
+template <typename T>
+static void test_median_filter(const char* type_label) noexcept {
+    size_t const combine_count = random_dist_u32(generator, 1, 4);
+    size_t const rows = random_dist_u32(generator, 1, 200);
+    size_t const columns = random_dist_u32(generator, 1, 200);
+    const uint32_t bad_rate = random_dist_u32(generator, 0, 1000);
+    
+    std::vector<std::vector<T>> data(combine_count);
+    std::vector<std::vector<uint8_t>> masks(combine_count);
+    std::vector<MediocreMasked2D> inputs;
+    for (size_t i = 0; i < combine_count; ++i) {
+        data[i].resize(rows * columns);
+        masks[i].resize(rows * columns);
+        for (size_t n = 0; n < rows * columns; ++n) {
+            data[i][n] = T(random_dist_u32(generator, 0, 100));
+            masks[i][n] = random_dist_u32(generator, 0, 999) < bad_rate;
+        }
+        
+        MediocreMasked2D m;
+        m.data_2D.data = data[i].data();
+        m.data_2D.type_code = uintptr_t(mediocre::type_code(data[i].data()));
+        m.data_2D.major_width = rows;
+        m.data_2D.major_stride = columns * sizeof(T);
+        m.data_2D.minor_width = columns;
+        m.data_2D.minor_stride = sizeof(T);
+        m.mask_2D.data = masks[i].data();
+        m.mask_2D.type_code = uintptr_t(mediocre_u8_code);
+        m.mask_2D.major_width = rows;
+        m.mask_2D.major_stride = columns;
+        m.mask_2D.minor_width = columns;
+        m.mask_2D.minor_stride = 1;
+        inputs.push_back(m);
+    }
+    
+    printf("\tMedian filter %s (%zi x %zi, %u per mille bad)\n",
+        type_label, rows, columns, unsigned(bad_rate));
+    
+    MediocreInput input = mediocre_masked_2D_input(
+        inputs.data(), combine_count, 1);
+    std::vector<float> result = mean(input);
+    mediocre_input_destroy(input);
+    
+    for (size_t n = 0; n < rows * columns; ++n) {
+        float total = 0.0f;
+        for (size_t i = 0; i < combine_count; ++i) {
+            total += masks[i][n] == 0 ? float(data[i][n])
+                : median_filter_reference(data[i], masks[i],
+                    rows, columns, n / columns, n % columns);
+        }
+        const float this_expected = total / float(combine_count);
+        if (result[n] != this_expected
+            && !(isnan(result[n]) && isnan(this_expected))
+        ) {
+            printf("[%zi %zi] %f != %f\n",
+                n / columns, n % columns, result[n], this_expected);
+            exit(1);
+        }
+    }
+}
+
+/*  Check the bad pixel list input against the masked input with the same bad
+ *  pixels as byte masks, shared by all arrays or one list per array. Shared
+ *  masks are also checked with the shared mask input.
+ */
+static void test_bad_pixel_list() noexcept {
+    size_t const combine_count = random_dist_u32(
+        generator, min_combine_count, max_combine_count
+    );
+    size_t const rows = random_dist_u32(generator, 1, 300);
+    size_t const columns = random_dist_u32(generator, 1, 300);
+    const bool shared = random_dist_u32(generator, 0, 1) != 0;
+    const uint32_t bad_rate = random_dist_u32(generator, 0, 3) == 0
+        ? random_dist_u32(generator, 0, 1000)
+        : random_dist_u32(generator, 0, 10);
+    const size_t list_count = shared ? 1 : combine_count;
+    
+    std::vector<std::vector<float>> data(combine_count);
+    std::vector<std::vector<uint8_t>> masks(list_count);
+    std::vector<std::vector<uintptr_t>> offsets(list_count);
+    std::vector<MediocreBadPixels> bad_pixels(list_count);
+    for (size_t b = 0; b < list_count; ++b) {
+        masks[b].resize(rows * columns);
+        for (size_t n = 0; n < rows * columns; ++n) {
+            masks[b][n] = random_dist_u32(generator, 0, 999) < bad_rate;
+            if (masks[b][n]) offsets[b].push_back(n);
+        }
+        bad_pixels[b].offsets = offsets[b].data();
+        bad_pixels[b].count = offsets[b].size();
+    }
+    
+    std::vector<Mediocre2D> arrays;
+    std::vector<MediocreMasked2D> masked_arrays;
+    for (size_t i = 0; i < combine_count; ++i) {
+        data[i].resize(rows * columns);
+        for (float& x : data[i]) {
+            x = float(random_dist_u32(generator, 0, 1000000)) - 500000.0f;
+        }
+        
+        MediocreMasked2D m;
+        m.data_2D.data = data[i].data();
+        m.data_2D.type_code = uintptr_t(mediocre::type_code(data[i].data()));
+        m.data_2D.major_width = rows;
+        m.data_2D.major_stride = columns * sizeof(float);
+        m.data_2D.minor_width = columns;
+        m.data_2D.minor_stride = sizeof(float);
+        m.mask_2D.data = masks[shared ? 0 : i].data();
+        m.mask_2D.type_code = uintptr_t(mediocre_u8_code);
+        m.mask_2D.major_width = rows;
+        m.mask_2D.major_stride = columns;
+        m.mask_2D.minor_width = columns;
+        m.mask_2D.minor_stride = 1;
+        arrays.push_back(m.data_2D);
+        masked_arrays.push_back(m);
+    }
+    
+    printf("\tBad pixel lists (%zi x %zi, %u per mille bad, %s)\n",
+        rows, columns, unsigned(bad_rate), shared ? "shared" : "per array");
+    
+    for (int nan = 0; nan < 2; ++nan) {
+        MediocreInput mask_input = (nan ? mediocre_nan_masked_2D_input
+            : mediocre_masked_2D_input)(masked_arrays.data(), combine_count, 1);
+        MediocreInput list_input = (nan ? mediocre_nan_bad_pixel_2D_input
+            : mediocre_bad_pixel_2D_input)(arrays.data(), combine_count,
+                bad_pixels.data(), list_count);
+        MediocreFunctor functor =
+            nan ? mediocre_nan_mean_functor() : mean_functor;
+        std::vector<float> expected_result =
+            mediocre::combine(mask_input, functor, 2);
+        std::vector<float> result = mediocre::combine(list_input, functor, 2);
+        std::vector<float> shared_result = result;
+        if (shared) {
+            MediocreInput shared_input = (nan
+                ? mediocre_nan_shared_mask_2D_input
+                : mediocre_shared_mask_2D_input)(arrays.data(), combine_count,
+                    masked_arrays[0].mask_2D, 1);
+            shared_result = mediocre::combine(shared_input, functor, 2);
+            mediocre_input_destroy(shared_input);
+        }
+        mediocre_input_destroy(mask_input);
+        mediocre_input_destroy(list_input);
+        
+        for (size_t n = 0; n < rows * columns; ++n) {
+            const float this_expected = expected_result[n];
+            for (float this_result : { result[n], shared_result[n] }) {
+                if (this_result != this_expected
+                    && !(isnan(this_result) && isnan(this_expected))
+                ) {
+                    printf("%s[%zi %zi] %f != %f\n", nan ? "NaN " : "",
+                        n / columns, n % columns, this_result, this_expected);
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
+/*  Check masks of type T, with contiguous or strided rows, against the same
+ *  mask as bytes. mask_code is T's type code (or a big-endian code of T's
+ *  size, which is the same mask with the same zeros). Floating point zeros
+ *  are sometimes -0.0.
+ */
+template <typename T>
+static void test_mask_type(const char* type_label, int mask_code) noexcept {
+    size_t const combine_count = random_dist_u32(generator, 1, 4);
+    size_t const rows = random_dist_u32(generator, 1, 200);
+    size_t const columns = random_dist_u32(generator, 1, 200);
+    size_t const spacing = random_dist_u32(generator, 0, 2) == 0 ? 2 : 1;
+    size_t const row_length =
+        columns * spacing + random_dist_u32(generator, 0, 5);
+    const bool nonzero_means_bad = random_dist_u32(generator, 0, 1) != 0;
+    const uint32_t bad_rate = random_dist_u32(generator, 0, 2) == 0
+        ? random_dist_u32(generator, 0, 1000)
+        : random_dist_u32(generator, 0, 20);
+    
+    std::vector<std::vector<float>> data(combine_count);
+    std::vector<std::vector<uint8_t>> byte_masks(combine_count);
+    std::vector<std::vector<T>> masks(combine_count);
+    std::vector<MediocreMasked2D> byte_inputs, inputs;
+    for (size_t i = 0; i < combine_count; ++i) {
+        data[i].resize(rows * columns);
+        byte_masks[i].resize(rows * columns);
+        masks[i].resize(rows * row_length);
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t c = 0; c < columns; ++c) {
+                const bool bad = random_dist_u32(generator, 0, 999) < bad_rate;
+                const bool nonzero = bad == nonzero_means_bad;
+                data[i][r*columns + c] =
+                    float(random_dist_u32(generator, 0, 1000));
+                byte_masks[i][r*columns + c] = nonzero ? 1 : 0;
+                T zero = T(0);
+                if (random_dist_u32(generator, 0, 1)) zero = -zero;
+                masks[i][r*row_length + c*spacing] = nonzero
+                    ? T(random_dist_u32(generator, 1, 100)) : zero;
+            }
+        }
+        
+        MediocreMasked2D m;
+        m.data_2D.data = data[i].data();
+        m.data_2D.type_code = uintptr_t(mediocre_float_code);
+        m.data_2D.major_width = rows;
+        m.data_2D.major_stride = columns * sizeof(float);
+        m.data_2D.minor_width = columns;
+        m.data_2D.minor_stride = sizeof(float);
+        m.mask_2D.data = byte_masks[i].data();
+        m.mask_2D.type_code = uintptr_t(mediocre_u8_code);
+        m.mask_2D.major_width = rows;
+        m.mask_2D.major_stride = columns;
+        m.mask_2D.minor_width = columns;
+        m.mask_2D.minor_stride = 1;
+        byte_inputs.push_back(m);
+        
+        m.mask_2D.data = masks[i].data();
+        m.mask_2D.type_code = uintptr_t(mask_code);
+        m.mask_2D.major_stride = row_length * sizeof(T);
+        m.mask_2D.minor_stride = spacing * sizeof(T);
+        inputs.push_back(m);
+    }
+    
+    printf("\t%s masks (%zi x %zi, spacing %zi, %u per mille bad)\n",
+        type_label, rows, columns, spacing, unsigned(bad_rate));
+    
+    MediocreInput byte_input = mediocre_masked_2D_input(
+        byte_inputs.data(), combine_count, nonzero_means_bad);
+    MediocreInput input = mediocre_masked_2D_input(
+        inputs.data(), combine_count, nonzero_means_bad);
+    std::vector<float> expected_result = mean(byte_input);
+    std::vector<float> result = mean(input);
+    mediocre_input_destroy(byte_input);
+    mediocre_input_destroy(input);
+    
+    for (size_t n = 0; n < rows * columns; ++n) {
+        if (result[n] != expected_result[n]
+            && !(isnan(result[n]) && isnan(expected_result[n]))
+        ) {
+            printf("[%zi %zi] %f != %f\n", n / columns, n % columns,
+                result[n], expected_result[n]);
+            exit(1);
+        }
+    }
+}
+
+// Store x, as a T, at p (byte swapped if big).
+template <typename T>
+static void store_as(char* p, int x, bool big) {
+    const T t = big ? byte_swapped(T(x)) : T(x);
+    memcpy(p, &t, sizeof t);
+}
+
+// Test mediocre_mixed_1D_input with a stack of arrays of assorted types.
+static void test_mixed_1D() noexcept {
+    size_t const combine_count = random_dist_u32(
+        generator, min_combine_count, max_combine_count
+    );
+    size_t const width = random_dist_u32(generator, 1, 5000);
+    
+    struct Kind { uintptr_t code; size_t size; };
+    static const Kind kinds[] = {
+        { mediocre_i8_code, 1 }, { mediocre_u16_code, 2 },
+        { mediocre_i32_code, 4 }, { mediocre_float_code, 4 },
+        { mediocre_double_code, 8 }, { mediocre_i32be_code, 4 },
+    };
+    
+    std::vector<std::vector<int>> values(combine_count);
+    std::vector<std::vector<char>> bytes(combine_count);
+    std::vector<void const*> pointers;
+    std::vector<uintptr_t> codes;
+    std::vector<float> scale, offset;
+    for (size_t i = 0; i < combine_count; ++i) {
+        const Kind kind = kinds[random_dist_u32(generator, 0, 5)];
+        bytes[i].resize(width * kind.size);
+        for (size_t x = 0; x < width; ++x) {
+            const int v = int(random_dist_u32(generator, 0, 100));
+            char* p = bytes[i].data() + x * kind.size;
+            values[i].push_back(v);
+            switch (kind.code) {
+              case mediocre_i8_code:     store_as<int8_t>(p, v, false); break;
+              case mediocre_u16_code:    store_as<uint16_t>(p, v, false); break;
+              case mediocre_i32_code:    store_as<int32_t>(p, v, false); break;
+              case mediocre_float_code:  store_as<float>(p, v, false); break;
+              case mediocre_double_code: store_as<double>(p, v, false); break;
+              case mediocre_i32be_code:  store_as<int32_t>(p, v, true); break;
+            }
+        }
+        pointers.push_back(bytes[i].data());
+        codes.push_back(kind.code);
+        scale.push_back(float(random_dist_u32(generator, 1, 4)));
+        offset.push_back(float(random_dist_u32(generator, 0, 8)) - 4);
+    }
+    
+    printf("\tMixed-type 1D arrays\n");
+    
+    for (int scaled = 0; scaled < 2; ++scaled) {
+        MediocreInput input = mediocre_mixed_1D_input(
+            pointers.data(), codes.data(), { combine_count, width },
+            scaled ? scale.data() : nullptr, scaled ? offset.data() : nullptr
+        );
+        std::vector<float> result = mean(input);
+        mediocre_input_destroy(input);
+        
+        for (size_t x = 0; x < width; ++x) {
+            float total = 0.0f;
+            for (size_t i = 0; i < combine_count; ++i) {
+                const float v = float(values[i][x]);
+                total += scaled ? v * scale[i] + offset[i] : v;
+            }
+            const float expected = total / float(combine_count);
+            if (result[x] != expected) {
+                printf("mixed scaled=%i [%zi] %f != %f\n",
+                    scaled, x, result[x], expected);
+                exit(1);
+            }
+        }
+    }
+    
+    // Unknown type codes are rejected (checked once, as it prints a message).
+    static bool checked_unknown_code = false;
+    if (!checked_unknown_code) {
+        uintptr_t bad_codes[] = { mediocre_i8_code, 12345 };
+        MediocreInput input = mediocre_mixed_1D_input(
+            pointers.data(), bad_codes, { 2, width }, nullptr, nullptr);
+        if (input.nonzero_error != EINVAL) {
+            printf("mixed: unknown type code accepted\n");
+            exit(1);
+        }
+        mediocre_input_destroy(input);
+        checked_unknown_code = true;
+    }
+}
+
+// Functor that sums its input in place, overwriting the first vector of each
+// chunk (as functors using MEDIOCRE_FUNCTOR_LOOP may).
+static int summing_loop_function(
+    MediocreFunctorControl* control,
+    void const* user_data,
+    MediocreDimension maximum_request
+) {
+    (void)user_data;
+    (void)maximum_request;
+    MediocreFunctorCommand command;
+    MEDIOCRE_FUNCTOR_LOOP(command, control) {
+        const size_t combine_count = command.dimension.combine_count;
+        for (size_t x = 0; x < command.dimension.width; ++x) {
+            float* sum = mediocre_chunk_ptr(
+                command.input_chunks, combine_count, 0, x);
+            for (size_t i = 1; i < combine_count; ++i) {
+                *sum += mediocre_chunk_data(
+                    command.input_chunks, combine_count, i, x);
+            }
+            command.output[x] = *sum;
+        }
+    }
+    return 0;
+}
+
+static void no_op(void*) {
+
+}
+
+// Test mediocre_chunk_input, with functors that do and don't write input.
+static void test_chunk_input() noexcept {
+    size_t const combine_count = random_dist_u32(
+        generator, min_combine_count, max_combine_count
+    );
+    size_t const width = random_dist_u32(generator, 1, 100000);
+    size_t const vector_count = (width + 7) / 8 * combine_count;
+    
+    __m256* chunks = static_cast<__m256*>(
+        _mm_malloc(vector_count * sizeof(__m256), sizeof(__m256)));
+    float* numbers = reinterpret_cast<float*>(chunks);
+    for (size_t n = 0; n < vector_count * 8; ++n) {
+        numbers[n] = float(random_dist_u32(generator, 0, 1000));
+    }
+    const std::vector<float> original(numbers, numbers + vector_count * 8);
+    
+    printf("\tChunk format input\n");
+    
+    MediocreFunctor summing_functor;
+    summing_functor.loop_function = summing_loop_function;
+    summing_functor.destructor = no_op;
+    summing_functor.user_data = nullptr;
+    summing_functor.nonzero_error = 0;
+    
+    const MediocreDimension dim { combine_count, width };
+    std::vector<float> means = mean(mediocre_chunk_input(chunks, dim));
+    std::vector<float> sums(width);
+    int status = mediocre_combine(
+        sums.data(), mediocre_chunk_input(chunks, dim), summing_functor, 3);
+    if (status != 0) {
+        printf("chunk input: %s\n", strerror(status));
+        exit(1);
+    }
+    
+    for (size_t x = 0; x < width; ++x) {
+        float total = 0.0f;
+        for (size_t i = 0; i < combine_count; ++i) {
+            total += mediocre_chunk_data(chunks, combine_count, i, x);
+        }
+        if (means[x] != total / float(combine_count) || sums[x] != total) {
+            printf("chunk input [%zi] %f, %f != %f\n",
+                x, means[x], sums[x], total);
+            exit(1);
+        }
+    }
+    if (!std::equal(original.begin(), original.end(), numbers)) {
+        printf("chunk input: lent chunks were written to\n");
+        exit(1);
+    }
+    
+    _mm_free(chunks);
+}
+
+// Test combining one masked input of Fortran-order arrays (which load
+// through staged rows) on two threads at once against combining it alone.
+static void test_concurrent_combines() noexcept {
+    size_t const combine_count = random_dist_u32(
+        generator, min_combine_count, max_combine_count
+    );
+    size_t const rows = random_dist_u32(generator, 8, 200);
+    size_t const columns = random_dist_u32(
+        generator, min_axis_size, max_axis_size
+    );
+    
+    printf("\tConcurrent combines of one input\n");
+    
+    std::vector<std::vector<uint8_t>> arrays(
+        combine_count, std::vector<uint8_t>(rows * columns));
+    std::vector<uint8_t> mask(rows * columns);
+    std::vector<Mediocre2D> views;
+    for (auto& array : arrays) {
+        for (uint8_t& u : array) u = random_dist_u32(generator, 0, 255);
+        views.push_back(mediocre::f2d_as_mediocre_2D(
+            array.data(), rows, columns));
+    }
+    for (uint8_t& m : mask) m = random_dist_u32(generator, 0, 99) == 0;
+    
+    MediocreInput input = mediocre_shared_mask_2D_input(
+        views.data(), combine_count,
+        mediocre::f2d_as_mediocre_2D(mask.data(), rows, columns), 1);
+    const std::vector<float> alone = mean(input);
+    
+    std::vector<float> first, second;
+    std::thread other([&] { first = mean(input); });
+    second = mean(input);
+    other.join();
+    
+    for (size_t x = 0; x < rows * columns; ++x) {
+        if (first[x] != alone[x] || second[x] != alone[x]) {
+            printf("concurrent combines [%zi] %f, %f != %f\n",
+                x, first[x], second[x], alone[x]);
+            exit(1);
+        }
+    }
+    mediocre_input_destroy(input);
+}
+
 int main() {
     for (int i = 0; i < 80; ++i) {
         for (int j = 0; j < 12; ++j) {
@@ -443,6 +1317,43 @@ int main() {
         test_contiguous<uint64_t>("uint64_t");
         test_contiguous<float>("float");
         test_contiguous<double>("double");
+        
+        test_big_endian<int16_t>("int16_t", mediocre_i16be_code);
+        test_big_endian<int32_t>("int32_t", mediocre_i32be_code);
+        test_big_endian<int64_t>("int64_t", mediocre_i64be_code);
+        test_big_endian<uint16_t>("uint16_t", mediocre_u16be_code);
+        test_big_endian<uint32_t>("uint32_t", mediocre_u32be_code);
+        test_big_endian<uint64_t>("uint64_t", mediocre_u64be_code);
+        test_big_endian<float>("float", mediocre_floatbe_code);
+        test_big_endian<double>("double", mediocre_doublebe_code);
+        
+        test_16_bit_float("float16", half_reference, 0x7C00,
+            mediocre_f16_input, mediocre_f16_code, mediocre_f16be_code);
+        test_16_bit_float("bfloat16", bfloat16_reference, 0x7F80,
+            mediocre_bf16_input, mediocre_bf16_code, mediocre_bf16be_code);
+        
+        test_scaled<int16_t>("int16_t");
+        test_scaled<uint32_t>("uint32_t");
+        test_scaled<float>("float");
+        test_scaled<double>("double");
+        test_mixed_1D();
+        test_chunk_input();
+        
+        test_packed_mask();
+        test_median_filter<uint8_t>("uint8_t");
+        test_median_filter<int16_t>("int16_t");
+        test_median_filter<float>("float");
+        test_median_filter<double>("double");
+        test_bad_pixel_list();
+        test_concurrent_combines();
+        
+        test_mask_type<int8_t>("int8_t", mediocre_i8_code);
+        test_mask_type<uint16_t>("uint16_t", mediocre_u16_code);
+        test_mask_type<int32_t>("int32_t", mediocre_i32_code);
+        test_mask_type<uint64_t>("uint64_t", mediocre_u64_code);
+        test_mask_type<float>("float", mediocre_float_code);
+        test_mask_type<double>("double", mediocre_double_code);
+        test_mask_type<uint32_t>("big-endian uint32_t", mediocre_u32be_code);
     }
 }
 
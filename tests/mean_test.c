@@ -26,6 +26,9 @@
 #include "mediocre.h"
 #include "testing.h"
 
+// Entries of the test arrays with this value are loaded as NaN (missing).
+static const uint16_t missing = 0xFFFF;
+
 static int u16_input_loop(
     MediocreInputControl* control,
     void const* user_data,
@@ -48,7 +51,8 @@ static int u16_input_loop(
             for (size_t n = 0; n != width; ++n) {
                 float* p = mediocre_chunk_ptr(chunks, array_count, array_i, n);
                 
-                *p = (float)offset_array[n];
+                *p = offset_array[n] == missing
+                   ? 0.0f / 0.0f : (float)offset_array[n];
             }
         }
     }
@@ -357,6 +361,133 @@ static void test_mean(
     free_canary_page(output_page);
 }
 
+// Test the NaN-aware clipped mean and scaled mean functors on arrays with
+// missing entries, which should be left out (NaN for bins with none left).
+static void test_nan_mean(
+    size_t array_count,
+    size_t bin_count,
+    double sigma_lower,
+    double sigma_upper,
+    size_t max_iter
+) {
+    bin_count = bin_count / 8 + 1;
+    const uint32_t rate = random_dist_u32(generator, 2, 12);
+    printf("\tNaN-aware means of %zi arrays of %zi integers, 1/%u missing.\n",
+        array_count, bin_count, (unsigned)rate);
+    
+    uint16_t* input_pointers[max_array_count];
+    const uint32_t* shuffled = get_shuffled_array_counts();
+    for (size_t i = 0; i < array_count; ++i) {
+        input_pointers[i] = input_data + (shuffled[i] * bin_count);
+    }
+    const uint32_t base = random_dist_u32(generator, 0, 3071);
+    for (size_t i = 0; i < array_count; ++i) {
+        random_fill(input_pointers[i], bin_count, base);
+    }
+    punch_holes(
+        generator, input_pointers, array_count, bin_count, rate, missing);
+    
+    static float output[max_bin_count];
+    static float scale_factors[max_array_count];
+    for (size_t a = 0; a < array_count; ++a) {
+        scale_factors[a] = 0.5 + 1e-3 * (random_u32(generator) % 1000);
+    }
+    const int thread_count = (int)random_dist_u32(
+        generator, 1, max_thread_count);
+    
+    for (int scaled = 0; scaled < 2; ++scaled) {
+        MediocreFunctor functor = scaled
+            ? mediocre_nan_scaled_mean_functor2(scale_factors, array_count,
+                sigma_lower, sigma_upper, max_iter)
+            : mediocre_nan_clipped_mean_functor2(
+                sigma_lower, sigma_upper, max_iter);
+        int status = mediocre_combine_destroy(
+            output,
+            u16_input(
+                (uint16_t const* const*)input_pointers,
+                array_count,
+                bin_count),
+            functor,
+            thread_count
+        );
+        if (status != 0) {
+            perror("NaN-aware mean failed");
+            exit(1);
+        }
+        
+        for (size_t i = 0; i < bin_count; ++i) {
+            static float scaled_data[max_array_count];
+            size_t valid_count = 0;
+            for (size_t a = 0; a < array_count; ++a) {
+                if (input_pointers[a][i] == missing) continue;
+                scaled_data[a] = scaled
+                    ? input_pointers[a][i] * (1.f/scale_factors[a])
+                    : (float)input_pointers[a][i];
+                ++valid_count;
+            }
+            
+            float lower_bound = -1.0f/0.0f, upper_bound = 1.0f/0.0f;
+            float clipped_mean = 0.0f / 0.0f;
+            for (size_t it = 0; it != max_iter + 1; ++it) {
+                float sum = 0.0f, count = 0.0f;
+                for (size_t a = 0; a < array_count; ++a) {
+                    float n = scaled_data[a];
+                    if (input_pointers[a][i] == missing) continue;
+                    if (n >= lower_bound && n <= upper_bound) {
+                        count += 1.0f;
+                        sum += n;
+                    }
+                }
+                clipped_mean = sum / count;
+                if (it == max_iter) break;
+                double ss = 0.0;
+                for (size_t a = 0; a < array_count; ++a) {
+                    float n = scaled_data[a];
+                    if (input_pointers[a][i] == missing) continue;
+                    if (n >= lower_bound && n <= upper_bound) {
+                        double dev = n - clipped_mean;
+                        ss += dev * dev;
+                    }
+                }
+                double sd = sqrt(ss / count);
+                float new_lb = (float)(clipped_mean - sigma_lower*sd);
+                float new_ub = (float)(clipped_mean + sigma_upper*sd);
+                
+                lower_bound = (new_lb < lower_bound) ? lower_bound : new_lb;
+                upper_bound = (new_ub > upper_bound) ? upper_bound : new_ub;
+            }
+            
+            float expected = clipped_mean;
+            bool okay = expected == output[i];
+            if (scaled) {
+                float sum = 0.0f, divisor = 0.0f;
+                for (size_t a = 0; a < array_count; ++a) {
+                    float n = scaled_data[a];
+                    if (input_pointers[a][i] == missing) continue;
+                    if (n >= lower_bound && n <= upper_bound) {
+                        sum += n * scale_factors[a];
+                        divisor += scale_factors[a];
+                    }
+                }
+                expected = sum / divisor;
+                float err = 1.0f - (expected / output[i]);
+                okay = err >= -.001 && err <= .001;
+            }
+            if (valid_count == 0) okay = isnan(output[i]);
+            
+            if (!okay) {
+                printf("%s[%zi] %f != %f\n[", scaled ? "scaled " : "",
+                    i, expected, output[i]);
+                for (size_t a = 0; a < array_count; ++a) {
+                    printf(" %u,", input_pointers[a][i]);
+                }
+                printf(" ]\n");
+                exit(1);
+            }
+        }
+    }
+}
+
 int main() {
     generator = new_random();
     
@@ -377,6 +508,9 @@ int main() {
             array_count, bin_count, offset0, offset1,
             sigma_lower, sigma_upper, max_iter
         );
+        test_nan_mean(
+            array_count, bin_count, sigma_lower, sigma_upper, max_iter
+        );
     }
 }
 
@@ -27,6 +27,9 @@
 #include "mediocre.h"
 #include "testing.h"
 
+// Entries of the test arrays with this value are loaded as NaN (missing).
+static const uint16_t missing = 0xFFFF;
+
 static int u16_input_loop(
     MediocreInputControl* control,
     void const* user_data,
@@ -49,7 +52,8 @@ static int u16_input_loop(
             for (size_t n = 0; n != width; ++n) {
                 float* p = mediocre_chunk_ptr(chunks, array_count, array_i, n);
                 
-                *p = (float)offset_array[n];
+                *p = offset_array[n] == missing
+                   ? 0.0f / 0.0f : (float)offset_array[n];
             }
         }
     }
@@ -272,6 +276,107 @@ static void test_median(
     free_canary_page(output_page);
 }
 
+// Test the NaN-aware clipped median functor on arrays with missing entries,
+// which should be left out (NaN for bins with none left). Some bins lose
+// all of their entries, or all but one; the others about one in rate.
+static void test_nan_median(
+    size_t array_count,
+    size_t bin_count,
+    double sigma_lower,
+    double sigma_upper,
+    size_t max_iter
+) {
+    bin_count = bin_count / 8 + 1;
+    const uint32_t rate = random_dist_u32(generator, 2, 12);
+    printf("\tNaN-aware median of %zi arrays of %zi integers, 1/%u missing.\n",
+        array_count, bin_count, (unsigned)rate);
+    
+    static uint16_t* input_pointers[max_array_count];
+    const uint32_t* shuffled = get_shuffled_array_counts();
+    for (size_t i = 0; i < array_count; ++i) {
+        input_pointers[i] = input_data + (shuffled[i] * bin_count);
+    }
+    const uint32_t base = random_dist_u32(generator, 0, 3071);
+    for (size_t i = 0; i < array_count; ++i) {
+        random_fill(input_pointers[i], bin_count, base);
+    }
+    punch_holes(
+        generator, input_pointers, array_count, bin_count, rate, missing);
+    
+    static float output[max_bin_count];
+    int status = mediocre_combine_destroy(
+        output,
+        u16_input(
+            (uint16_t const* const*)input_pointers, array_count, bin_count),
+        mediocre_nan_clipped_median_functor2(
+            sigma_lower, sigma_upper, max_iter),
+        (int)random_dist_u32(generator, 1, max_threads)
+    );
+    if (status != 0) {
+        perror("NaN-aware median failed");
+        exit(1);
+    }
+    
+    static float sorted[max_array_count];
+    
+    for (size_t b = 0; b < bin_count; ++b) {
+        size_t current_count = 0;
+        for (size_t a = 0; a < array_count; ++a) {
+            if (input_pointers[a][b] != missing) {
+                sorted[current_count++] = (float)input_pointers[a][b];
+            }
+        }
+        if (current_count == 0) {
+            if (!isnan(output[b])) {
+                printf("[%zi] %f should be NaN\n", b, output[b]);
+                exit(1);
+            }
+            continue;
+        }
+        sort_floats(sorted, current_count);
+        
+        float median = 0.5f * (
+            sorted[current_count / 2] + sorted[(current_count-1) / 2]
+        );
+        float lower_bound = -1.f/0.f, upper_bound = 1.f/0.f;
+        
+        for (size_t iter = 0; iter != max_iter; ++iter) {
+            double ss = 0.0;
+            for (size_t c = 0; c < current_count; ++c) {
+                double dev = sorted[c] - median;
+                ss += dev * dev;
+            }
+            double sd = sqrt(ss / current_count);
+            float new_lb = (float)(median - sigma_lower*sd);
+            float new_ub = (float)(median + sigma_upper*sd);
+            
+            lower_bound = (new_lb < lower_bound) ? lower_bound : new_lb;
+            upper_bound = (new_ub > upper_bound) ? upper_bound : new_ub;
+            
+            size_t new_count = 0;
+            for (size_t c = 0; c < current_count; ++c) {
+                float n = sorted[c];
+                if (n >= lower_bound && n <= upper_bound) {
+                    sorted[new_count++] = n;
+                }
+            }
+            current_count = new_count;
+            
+            median = 0.5f * (
+                sorted[current_count / 2] + sorted[(current_count-1) / 2]
+            );
+        }
+        if (median != output[b]) {
+            printf("[%zi] %f != %f\n[", b, median, output[b]);
+            for (size_t a = 0; a < array_count; ++a) {
+                printf("%u,", input_pointers[a][b]);
+            }
+            printf(" ]\n");
+            exit(1);
+        }
+    }
+}
+
 int main() {
     generator = new_random();
     
@@ -293,6 +398,9 @@ int main() {
             array_count, bin_count, offset0, offset1,
             sigma_lower, sigma_upper, max_iter
         );
+        test_nan_median(
+            array_count, bin_count, sigma_lower, sigma_upper, max_iter
+        );
     }
 }
 
@@ -49,6 +49,8 @@ try:
 except NameError: pass
 
 def almost_equal(a, b):
+    if a != a or b != b:    # NaN is only equal to NaN here.
+        return a != a and b != b
     if b != 0:
         return epsilon_recip < a/b < epsilon
     else:
@@ -231,7 +233,9 @@ def get_test_data(shape1D, shape2D, combine_count, dtype):
     arrays2D = [random_data(shape2D, dtype, contiguous)
         for i in range(combine_count)]
     
-    masks = [random_mask(shape2D, dtype, nonzero_means_bad)
+    # Boolean masks are packed to bit masks by the combine.
+    mask_dtype = rand.choice((dtype, np.bool_))
+    masks = [random_mask(shape2D, mask_dtype, nonzero_means_bad)
         for i in range(combine_count)]
     
     print("combine_count     %s" % combine_count)
@@ -240,6 +244,8 @@ def get_test_data(shape1D, shape2D, combine_count, dtype):
     print("shape1D           %s" % (shape1D, ))
     print("shape2D           %s" % (shape2D, ))
     print("dtype             %s" % (dtype().dtype.name if dtype else "multiple"))
+    print("mask dtype        %s" %
+        (mask_dtype().dtype.name if mask_dtype else "multiple"))
     
     return contiguous, nonzero_means_bad, arrays1D, arrays2D, masks
 
@@ -286,6 +292,13 @@ def test_mean(shape1D, shape2D, combine_count, dtype):
     expected = py_combine(np.mean, arrays1D)
     compare_1D(arrays1D, actual, expected)
     
+    print("\t1D arrays of mixed types")
+    mixed = [a.astype(np.float64) if i % 3 == 1
+        else a.astype(a.dtype.newbyteorder('>')) if i % 3 == 2
+        else a for i, a in enumerate(arrays1D)]
+    actual = MediocrePy.mean(mixed)
+    compare_1D(arrays1D, actual, expected)
+    
     print("\t2D arrays")
     actual = MediocrePy.mean(arrays2D)
     expected = py_combine(np.mean, arrays2D)
@@ -297,6 +310,20 @@ def test_mean(shape1D, shape2D, combine_count, dtype):
         for a, m in zip(arrays2D, masks)]
     expected = py_combine(np.mean, masked_arrays)
     compare_2D(arrays2D, actual, expected)
+    
+    print("\t2D arrays with bad pixel lists")
+    bad_pixels = [np.argwhere((m != 0) == nonzero_means_bad) for m in masks]
+    if rand.randrange(2):
+        bad_pixels = [np.ravel_multi_index(b.T, shape2D) for b in bad_pixels]
+    actual = MediocrePy.mean(arrays2D, bad_pixels=bad_pixels)
+    compare_2D(arrays2D, actual, expected)
+    
+    print("\t2D arrays with one shared mask")
+    actual = MediocrePy.mean(arrays2D, masks[0], nonzero_means_bad)
+    masked_arrays = [py_mask(a, masks[0], nonzero_means_bad)
+        for a in arrays2D]
+    expected = py_combine(np.mean, masked_arrays)
+    compare_2D(arrays2D, actual, expected)
 
 def test_median(shape1D, shape2D, combine_count, dtype):
     print("\n\x1b[1m\x1b[33mMedian test\x1b[0m")
@@ -321,6 +348,35 @@ def test_median(shape1D, shape2D, combine_count, dtype):
     expected = py_combine(np.median, masked_arrays)
     compare_2D(arrays2D, actual, expected)
 
+def test_nan_masked(shape1D, shape2D, combine_count, dtype):
+    print("\n\x1b[1m\x1b[33mNaN-aware masked test\x1b[0m")
+    contiguous, nonzero_means_bad, arrays1D, arrays2D, masks = get_test_data(
+        shape1D, shape2D, combine_count, dtype
+    )
+    # Masked out entries are left out of the combine entirely (columns with
+    # nothing left combine to NaN).
+    nan_arrays = []
+    for a, m in zip(arrays2D, masks):
+        nan_array = np.array(a, np.float64)
+        nan_array[(m != 0) == nonzero_means_bad] = np.nan
+        nan_arrays.append(nan_array)
+    
+    def nan_combine(combine_function):
+        def combine(data):
+            data = [n for n in data if n == n]
+            return combine_function(data) if data else np.nan
+        return combine
+    
+    print("\t2D masked arrays, mean")
+    actual = MediocrePy.nan_mean(arrays2D, masks, nonzero_means_bad)
+    expected = py_combine(nan_combine(np.mean), nan_arrays)
+    compare_2D(arrays2D, actual, expected)
+    
+    print("\t2D masked arrays, median")
+    actual = MediocrePy.nan_median(arrays2D, masks, nonzero_means_bad)
+    expected = py_combine(nan_combine(np.median), nan_arrays)
+    compare_2D(arrays2D, actual, expected)
+
 def test_clipped_mean(shape1D, shape2D, combine_count, dtype, sigma_data):
     print("\n\x1b[1m\x1b[33mClipped mean test [%f %f] %i\x1b[0m" % sigma_data)
     contiguous, nonzero_means_bad, arrays1D, arrays2D, masks = get_test_data(
@@ -478,6 +534,7 @@ Python results takes up almost all of the testing time.\n""")
             
         test_mean(shape1D, shape2D, combine_count, dtype)
         test_median(shape1D, shape2D, combine_count, dtype)
+        test_nan_masked(shape1D, shape2D, combine_count, dtype)
         
         shape1D = (rand.randrange(6000, 8000),)
         shape2D = (rand.randrange(70, 95), rand.randrange(70, 95))